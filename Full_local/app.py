@@ -5,7 +5,7 @@ Flask Backend Server - Local IoT System
 
 from flask import Flask, jsonify, request, send_from_directory
 from flask_cors import CORS
-from datetime import datetime
+from datetime import datetime, timedelta
 import logging
 import os
 import json
@@ -41,6 +41,7 @@ class SystemState:
         self.running = False
         self.selected_relays = []
         self.total_cycle = 120  # Mặc định 120 phút
+        self.sensor_cfg_version = 0  # Phiên bản cấu hình Sensor đã gửi (1..255, 0: chưa gửi)
         self.load_state()
     
     def load_state(self):
@@ -52,6 +53,7 @@ class SystemState:
                     self.running = data.get('running', False)
                     self.selected_relays = data.get('selected_relays', [])
                     self.total_cycle = data.get('total_cycle', 120)
+                    self.sensor_cfg_version = data.get('sensor_cfg_version', 0)
                     logger.info(f"Loaded state: running={self.running}, relays={self.selected_relays}, T={self.total_cycle}")
         except Exception as e:
             logger.error(f"Error loading state: {e}")
@@ -64,7 +66,8 @@ class SystemState:
                 json.dump({
                     'running': self.running,
                     'selected_relays': self.selected_relays,
-                    'total_cycle': self.total_cycle
+                    'total_cycle': self.total_cycle,
+                    'sensor_cfg_version': self.sensor_cfg_version
                 }, f, indent=2)
             logger.info(f"Saved state: running={self.running}, T={self.total_cycle}")
         except Exception as e:
@@ -84,6 +87,7 @@ class SystemState:
 
 system_state = SystemState()
 thresholds = DEFAULT_THRESHOLDS.copy()
+recent_alarms = []  # Cảnh báo vượt ngưỡng gần nhất (mới nhất ở cuối)
 
 
 # ==================== MQTT Callbacks ====================
@@ -109,6 +113,7 @@ def handle_advertise(payload: str):
 def handle_data(payload: str):
     """Xử lý tin nhắn từ topic Data
     Format: "Relay_ID1,ID1,temp1,humid1,soil1,Relay_ID2,ID2,temp2,humid2,soil2,..."
+    soil có hậu tố '*': Relay giữ lại giá trị cũ (Sensor không gửi do dead-band), không phải mẫu đo mới
     """
     try:
         # ==================== CHECK + SAVE MESSAGE (ATOMIC) ====================
@@ -136,21 +141,28 @@ def handle_data(payload: str):
             sensor_id = parts[idx + 1]
             temp = float(parts[idx + 2])
             humid = float(parts[idx + 3])
-            soil = float(parts[idx + 4])
+            carried = parts[idx + 4].endswith('*')
+            soil = float(parts[idx + 4].rstrip('*'))
             
             sensors_data.append({
                 'relay_id': relay_id,
                 'sensor_id': sensor_id,
                 'temp': temp,
                 'humid': humid,
-                'soil': soil
+                'soil': soil,
+                'carried': carried
             })
             
-            logger.info(f"  ✓ Sensor {sensor_id} (Relay {relay_id}): T={temp}°C, H={humid}%, S={soil}%")
+            logger.info(f"  ✓ Sensor {sensor_id} (Relay {relay_id}): T={temp}°C, H={humid}%, S={soil}%"
+                        f"{' (carried)' if carried else ''}")
+        
+        # Giá trị giữ lại: DATA.csv đã có giá trị (và timestamp) của lần đo thật, không ghi lại
+        measured = [d for d in sensors_data if not d['carried']]
         
         # LƯU TOÀN BỘ sensors MỘT LẦN (ĐỂ TRÁNH RACE CONDITION)
-        db.update_multiple_sensors(sensors_data)
-        logger.info(f"✅ Đã lưu {len(sensors_data)} sensors vào DATA.csv")
+        if measured:
+            db.update_multiple_sensors(measured)
+        logger.info(f"✅ Đã lưu {len(measured)} sensors vào DATA.csv")
         
         # Cập nhật ADV.csv cho các sensors không phải relay
         for data in sensors_data:
@@ -161,8 +173,8 @@ def handle_data(payload: str):
         # Lưu timestamp hiện tại
         current_timestamp = datetime.now().strftime('%Y-%m-%d %H:%M:%S')
         
-        # Lưu tất cả sensors vào OLD_DATA.csv
-        for data in sensors_data:
+        # Lưu các sensors có mẫu đo mới vào OLD_DATA.csv
+        for data in measured:
             db._append_to_old_data({
                 'relay_id': data['relay_id'],
                 'sensor_id': data['sensor_id'],
@@ -181,6 +193,110 @@ def handle_data(payload: str):
         logger.error(f"✗ Lỗi xử lý Data: {e}", exc_info=True)  # Thêm stack trace
 
 
+def handle_backlog(payload: str):
+    """Xử lý tin nhắn từ topic Backlog (aggregate Relay gửi bù khi GW lỡ bản tin Data)
+    Format: "CyclesAgo,Relay_ID1,ID1,temp1,humid1,soil1,Relay_ID2,ID2,temp2,humid2,soil2,..."
+    Chỉ ghi vào OLD_DATA.csv (lịch sử), không ghi đè giá trị mới nhất trong DATA.csv
+    """
+    try:
+        if not db.save_message_if_new('Backlog', payload):
+            logger.warning(f"⚠️ Message ĐÃ XỬ LÝ, BỎ QUA")
+            return
+        
+        parts = [p.strip() for p in payload.split(',')]
+        
+        # Phần tử đầu: số chu kỳ đã trôi qua, sau đó mỗi sensor có 5 phần
+        if len(parts) < 1 or (len(parts) - 1) % 5 != 0:
+            logger.warning(f"⚠ Dữ liệu Backlog không hợp lệ: {payload}")
+            return
+        
+        cycles_ago = int(parts[0])
+        
+        # total_cycle được Gateway dùng làm TOTAL_CYCLE_SEC (giây) cho Relay
+        sample_time = datetime.now() - timedelta(seconds=cycles_ago * system_state.total_cycle)
+        sample_timestamp = sample_time.strftime('%Y-%m-%d %H:%M:%S')
+        
+        num_sensors = (len(parts) - 1) // 5
+        rows = []
+        for i in range(num_sensors):
+            idx = 1 + i * 5
+            # Giá trị giữ lại (dead-band) không phải mẫu đo -> không ghi vào lịch sử
+            if parts[idx + 4].endswith('*'):
+                continue
+            rows.append({
+                'relay_id': parts[idx],
+                'sensor_id': parts[idx + 1],
+                'temp': str(float(parts[idx + 2])),
+                'humid': str(float(parts[idx + 3])),
+                'soil': str(float(parts[idx + 4])),
+                'timestamp': sample_timestamp
+            })
+        
+        # Aggregate đã tới qua Data (chỉ mất ACK) hoặc Backlog trước đó -> mẫu cùng chu kỳ đã có trong lịch sử
+        # Cùng chu kỳ: cùng relay_id, sensor_id và thời điểm lệch dưới nửa chu kỳ
+        saved = db.append_old_data_if_new(rows, system_state.total_cycle / 2)
+        
+        logger.info(f"✅ Đã lưu {saved}/{len(rows)} sensors gửi bù ({cycles_ago} chu kỳ trước, {sample_timestamp}) vào OLD_DATA.csv"
+                    f"{f' ({len(rows) - saved} đã có, bỏ qua)' if saved < len(rows) else ''}")
+            
+    except Exception as e:
+        logger.error(f"✗ Lỗi xử lý Backlog: {e}", exc_info=True)
+
+
+def handle_alarm(payload: str):
+    """Xử lý tin nhắn từ topic Alarm (Sensor vượt ngưỡng, gửi ngay qua slot cảnh báo)
+    Format: "Relay_ID,Sensor_ID,temp,humid,soil,Flags"
+    Chỉ cập nhật giá trị mới nhất trong DATA.csv, lịch sử OLD_DATA.csv do bản tin Data của chu kỳ ghi
+    """
+    try:
+        if not db.save_message_if_new('Alarm', payload):
+            logger.warning(f"⚠️ Message ĐÃ XỬ LÝ, BỎ QUA")
+            return
+        
+        parts = [p.strip() for p in payload.split(',')]
+        if len(parts) != 6:
+            logger.warning(f"⚠ Dữ liệu Alarm không hợp lệ: {payload}")
+            return
+        
+        alarm = {
+            'relay_id': parts[0],
+            'sensor_id': parts[1],
+            'temp': float(parts[2]),
+            'humid': float(parts[3]),
+            'soil': float(parts[4]),
+            'flags': int(parts[5], 16),
+            'timestamp': datetime.now().strftime('%Y-%m-%d %H:%M:%S')
+        }
+        db.update_multiple_sensors([alarm])
+        
+        recent_alarms.append(alarm)
+        del recent_alarms[:-ALARM_HISTORY]
+        
+        logger.warning(f"🚨 Cảnh báo Sensor {alarm['sensor_id']} (Relay {alarm['relay_id']}): "
+                       f"T={alarm['temp']}°C, H={alarm['humid']}%, S={alarm['soil']}%, Flags={parts[5]}")
+            
+    except Exception as e:
+        logger.error(f"✗ Lỗi xử lý Alarm: {e}", exc_info=True)
+
+
+def publish_sensor_config():
+    """Gửi ngưỡng + chu kỳ đo xuống Sensor (qua Gateway, Relay phát lại trong Beacon)
+    Format: "Ver,MeasureCycle,TMin,TMax,HMin,HMax,SMin,SMax" (nhiệt độ, độ ẩm x10)
+    Mỗi lần gửi tăng phiên bản (1..255) để Sensor chỉ áp dụng và xác nhận khi có thay đổi
+    """
+    system_state.sensor_cfg_version = system_state.sensor_cfg_version % 255 + 1
+    system_state.save_state()
+    
+    message = ','.join(str(v) for v in [
+        system_state.sensor_cfg_version,
+        int(thresholds['measure_cycle']),
+        round(thresholds['temp_min'] * 10), round(thresholds['temp_max'] * 10),
+        round(thresholds['humid_min'] * 10), round(thresholds['humid_max'] * 10),
+        round(thresholds['soil_min']), round(thresholds['soil_max'])
+    ])
+    mqtt.publish_sensor_config(message)
+
+
 # ==================== Flask Routes ====================
 
 @app.route('/')
@@ -376,6 +492,16 @@ def get_status():
     })
 
 
+@app.route('/api/alarms', methods=['GET'])
+def get_alarms():
+    """Lấy các cảnh báo vượt ngưỡng gần nhất (?since=timestamp: chỉ cảnh báo mới hơn)"""
+    since = request.args.get('since', '')
+    return jsonify({
+        'success': True,
+        'alarms': [a for a in recent_alarms if a['timestamp'] > since]
+    })
+
+
 @app.route('/api/thresholds', methods=['GET', 'POST'])
 def handle_thresholds():
     """Lấy/Cập nhật ngưỡng cảnh báo"""
@@ -391,6 +517,7 @@ def handle_thresholds():
             data = request.json
             thresholds.update(data)
             logger.info(f"⚙ Cập nhật ngưỡng cảnh báo: {thresholds}")
+            publish_sensor_config()
             return jsonify({
                 'success': True,
                 'message': 'Đã cập nhật ngưỡng cảnh báo',
@@ -409,6 +536,8 @@ def initialize_mqtt():
         mqtt.connect()
         mqtt.subscribe_advertise(handle_advertise)
         mqtt.subscribe_data(handle_data)
+        mqtt.subscribe_backlog(handle_backlog)
+        mqtt.subscribe_alarm(handle_alarm)
         logger.info("✓ MQTT đã sẵn sàng")
     except Exception as e:
         logger.error(f"✗ Không thể khởi động MQTT: {e}")
@@ -12,6 +12,9 @@ MQTT_KEEPALIVE = 60
 TOPIC_ADVERTISE = "Advertise"
 TOPIC_CYCLE = "Cycle"
 TOPIC_DATA = "Data"
+TOPIC_BACKLOG = "Backlog"
+TOPIC_ALARM = "Alarm"
+TOPIC_SENSOR_CONFIG = "SensorConfig"
 
 # Flask Server Configuration
 FLASK_HOST = "0.0.0.0"  # Cho phép truy cập từ các thiết bị trong mạng LAN
@@ -25,12 +28,17 @@ CSV_DATA = "Database/DATA.csv"
 CSV_OLD_DATA = "Database/OLD_DATA.csv"
 SYSTEM_STATE = "Database/system_state.json"
 
+# Số cảnh báo vượt ngưỡng gần nhất giữ lại cho Dashboard
+ALARM_HISTORY = 50
+
 # Sensor thresholds (Ngưỡng mặc định)
+# Sensor giữ bản sao ngưỡng này (SENSOR_ALARM_THRESHOLDS trong lora_app.h) để gửi cảnh báo nhanh
 DEFAULT_THRESHOLDS = {
     "temp_min": 15.0,
     "temp_max": 35.0,
     "humid_min": 40.0,
     "humid_max": 80.0,
     "soil_min": 30.0,
-    "soil_max": 70.0
+    "soil_max": 70.0,
+    "measure_cycle": 3  # Sensor đo mỗi N chu kỳ (SENSOR_MEASURE_CYCLE)
 }
@@ -480,6 +480,45 @@ class DatabaseManager:
             except Exception as e:
                 print(f"Error appending to OLD_DATA: {e}")
     
+    def append_old_data_if_new(self, rows: List[Dict], tolerance_s: float) -> int:
+        """Thêm mẫu gửi bù vào OLD_DATA.csv, bỏ mẫu đã có (cùng relay_id, sensor_id, lệch thời điểm <= tolerance_s)
+        GW giải mã RL_DATA nhưng Relay lỡ ACK -> Relay gửi lại cùng aggregate trong Backlog (có thể nhiều lần)
+        Trả về số mẫu đã ghi
+        """
+        def parse(ts):
+            try:
+                return datetime.strptime(ts, '%Y-%m-%d %H:%M:%S')
+            except (TypeError, ValueError):
+                return None
+        
+        keys = {(r['relay_id'], r['sensor_id']) for r in rows}
+        written = 0
+        with self._old_data_lock:
+            try:
+                existing = {}
+                if os.path.exists(self.old_data_file):
+                    with open(self.old_data_file, 'r', encoding='utf-8') as f:
+                        for row in csv.DictReader(f):
+                            key = (row.get('relay_id'), row.get('sensor_id'))
+                            t = parse(row.get('timestamp')) if key in keys else None
+                            if t:
+                                existing.setdefault(key, []).append(t)
+                
+                with open(self.old_data_file, 'a', newline='', encoding='utf-8') as f:
+                    writer = csv.DictWriter(f, fieldnames=['relay_id', 'sensor_id', 'temp', 'humid', 'soil', 'timestamp'])
+                    for r in rows:
+                        key = (r['relay_id'], r['sensor_id'])
+                        t = parse(r['timestamp'])
+                        if t and any(abs((t - e).total_seconds()) <= tolerance_s for e in existing.get(key, [])):
+                            continue
+                        writer.writerow(r)
+                        written += 1
+                        if t:
+                            existing.setdefault(key, []).append(t)
+            except Exception as e:
+                print(f"Error appending to OLD_DATA: {e}")
+        return written
+    
     def get_sensor_history(self, relay_id: str, sensor_id: str, time_range: str = 'default') -> List[Dict]:
         """Lấy lịch sử dữ liệu của một sensor từ OLD_DATA.csv
         time_range: 'default' (20 gần nhất), 'minute', 'hour', 'day', 'month'
@@ -534,6 +573,9 @@ class DatabaseManager:
                             data.append(row)
                             seen.add(key)
         
+        # Sắp xếp theo thời gian (dữ liệu gửi bù từ Backlog được append muộn hơn thời điểm đo)
+        data.sort(key=lambda row: row.get('timestamp') or '')
+        
         # Nếu mode 'default', chỉ lấy 20 data gần nhất
         if time_range == 'default' and len(data) > 20:
             data = data[-20:]  # Lấy 20 phần tử cuối (mới nhất)
@@ -23,6 +23,8 @@ class MQTTHandler:
         # Callbacks
         self.on_advertise_callback: Optional[Callable] = None
         self.on_data_callback: Optional[Callable] = None
+        self.on_backlog_callback: Optional[Callable] = None
+        self.on_alarm_callback: Optional[Callable] = None
         
         # Deduplication - Lưu message cuối để tránh duplicate
         self.last_message = {}  # {topic: (payload, timestamp)}
@@ -62,6 +64,10 @@ class MQTTHandler:
             self.on_advertise_callback(payload)
         elif topic == "Data" and self.on_data_callback:
             self.on_data_callback(payload)
+        elif topic == "Backlog" and self.on_backlog_callback:
+            self.on_backlog_callback(payload)
+        elif topic == "Alarm" and self.on_alarm_callback:
+            self.on_alarm_callback(payload)
     
     def connect(self):
         """Kết nối tới MQTT Broker"""
@@ -91,7 +97,24 @@ class MQTTHandler:
         self.client.subscribe("Data")
         logger.info("📥 Đã đăng ký topic 'Data'")
     
+    def subscribe_backlog(self, callback: Callable):
+        """Đăng ký nhận topic Backlog (dữ liệu Relay gửi bù)"""
+        self.on_backlog_callback = callback
+        self.client.subscribe("Backlog")
+        logger.info("📥 Đã đăng ký topic 'Backlog'")
+    
+    def subscribe_alarm(self, callback: Callable):
+        """Đăng ký nhận topic Alarm (cảnh báo vượt ngưỡng gửi ngay, ngoài chu kỳ)"""
+        self.on_alarm_callback = callback
+        self.client.subscribe("Alarm")
+        logger.info("📥 Đã đăng ký topic 'Alarm'")
+    
     def publish_cycle(self, message: str):
         """Gửi tin nhắn tới topic Cycle"""
         self.client.publish("Cycle", message)
         logger.info(f"📤 Đã gửi tin nhắn tới topic 'Cycle': {message}")
+    
+    def publish_sensor_config(self, message: str):
+        """Gửi cấu hình Sensor (ngưỡng, chu kỳ đo) tới topic SensorConfig"""
+        self.client.publish("SensorConfig", message)
+        logger.info(f"📤 Đã gửi tin nhắn tới topic 'SensorConfig': {message}")
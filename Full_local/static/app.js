@@ -7,6 +7,7 @@ let sensorData = [];
 let autoRefreshInterval = null;
 let systemRunning = false;
 let currentSensorDetail = null; // Lưu thông tin sensor đang xem
+let lastAlarmTime = '';         // Timestamp cảnh báo mới nhất đã hiển thị
 
 // ==================== Initialization ====================
 
@@ -123,9 +124,30 @@ function setupAutoRefresh() {
         if (!document.getElementById('general-dashboard').classList.contains('hidden')) {
             loadGeneralData();
         }
+        checkAlarms();
     }, 5000); // 5 seconds
 }
 
+// Cảnh báo vượt ngưỡng gửi ngay từ Sensor (không chờ hết chu kỳ)
+const ALARM_FLAG_NAMES = ['Nhiệt độ thấp', 'Nhiệt độ cao', 'Độ ẩm thấp', 'Độ ẩm cao', 'Độ ẩm đất thấp', 'Độ ẩm đất cao'];
+
+async function checkAlarms() {
+    try {
+        const response = await fetch(`${API_BASE}/api/alarms?since=${encodeURIComponent(lastAlarmTime)}`);
+        const data = await response.json();
+        
+        if (!data.success) return;
+        data.alarms.forEach(alarm => {
+            const names = ALARM_FLAG_NAMES.filter((_, bit) => alarm.flags & (1 << bit));
+            showAlert('error', `Cảnh báo Sensor ${alarm.sensor_id} (Relay ${alarm.relay_id}): ${names.join(', ')} - ` +
+                               `T=${alarm.temp}°C, H=${alarm.humid}%, S=${alarm.soil}%`);
+            lastAlarmTime = alarm.timestamp;
+        });
+    } catch (error) {
+        console.error('Lỗi tải cảnh báo:', error);
+    }
+}
+
 // ==================== Navigation ====================
 
 function showDashboard(view) {
@@ -415,6 +437,7 @@ async function loadThresholds() {
             document.getElementById('humid_max').value = thresholds.humid_max;
             document.getElementById('soil_min').value = thresholds.soil_min;
             document.getElementById('soil_max').value = thresholds.soil_max;
+            document.getElementById('measure_cycle').value = thresholds.measure_cycle;
         }
     } catch (error) {
         console.error('Lỗi tải ngưỡng:', error);
@@ -428,7 +451,8 @@ async function saveThresholds() {
         humid_min: parseFloat(document.getElementById('humid_min').value),
         humid_max: parseFloat(document.getElementById('humid_max').value),
         soil_min: parseFloat(document.getElementById('soil_min').value),
-        soil_max: parseFloat(document.getElementById('soil_max').value)
+        soil_max: parseFloat(document.getElementById('soil_max').value),
+        measure_cycle: parseInt(document.getElementById('measure_cycle').value)
     };
     
     try {
@@ -8,7 +8,11 @@
  * Chức năng:
  * 1. UART nhận "ADV,0x01,0x15,0x23,..." → MQTT publish topic "Advertise" với payload "0x01,0x15,0x23,..."
  * 2. UART nhận "DATA,0x01,0x01,28.5,65.2,45.3,..." → MQTT publish topic "Data" với payload "0x01,0x01,28.5,65.2,45.3,..."
- * 3. MQTT nhận topic "Cycle" với message "120,0x01,60,0x15,90,..." → UART gửi "120,0x01,60,0x15,90,..." (KHÔNG có prefix)
+ * 3. UART nhận "BACKLOG,2,0x01,0x01,28.5,65.2,45.3,..." → MQTT publish topic "Backlog" với payload "2,0x01,0x01,28.5,65.2,45.3,..." (dữ liệu gửi bù của 2 chu kỳ trước)
+ * 4. UART nhận "ALARM,0x01,0x01,38.5,65.2,45,0x02" → MQTT publish topic "Alarm" với payload "0x01,0x01,38.5,65.2,45,0x02" (cảnh báo vượt ngưỡng, cờ ở cuối)
+ * 5. UART nhận "LINK,0x01,0xFA,-92,7.25,18,20,1" → MQTT publish topic "LinkStats" với payload "0x01,0xFA,-92,7.25,18,20,1" (chất lượng liên kết Sensor-Relay)
+ * 6. MQTT nhận topic "Cycle" với message "120,0x01,60,0x15,90,..." → UART gửi "120,0x01,60,0x15,90,..." (KHÔNG có prefix)
+ * 7. MQTT nhận topic "SensorConfig" với message "3,3,150,350,400,800,30,70" → UART gửi "SCFG,3,3,150,350,400,800,30,70"
  * 
  * LƯU Ý: ESP32 chỉ FORWARD messages, KHÔNG convert ID format. IDs đã là hex strings từ relay nodes.
  */
@@ -29,7 +33,11 @@ const char* MQTT_CLIENT_ID = "ESP32_Gateway";
 // MQTT Topics
 const char* TOPIC_ADVERTISE = "Advertise";
 const char* TOPIC_DATA = "Data";
+const char* TOPIC_BACKLOG = "Backlog";
+const char* TOPIC_ALARM = "Alarm";
+const char* TOPIC_LINK = "LinkStats";
 const char* TOPIC_CYCLE = "Cycle";
+const char* TOPIC_SENSOR_CONFIG = "SensorConfig";
 
 // ==================== UART Configuration ====================
 #define UART_RX_PIN 16  // GPIO16 - RX2
@@ -155,6 +163,10 @@ void reconnectMQTT() {
     // Subscribe topic Cycle
     mqttClient.subscribe(TOPIC_CYCLE);
     Serial.printf("[MQTT] ✓ Subscribed to '%s'\n", TOPIC_CYCLE);
+    
+    // Subscribe topic SensorConfig
+    mqttClient.subscribe(TOPIC_SENSOR_CONFIG);
+    Serial.printf("[MQTT] ✓ Subscribed to '%s'\n", TOPIC_SENSOR_CONFIG);
   } else {
     Serial.print("✗ Failed, rc=");
     Serial.println(mqttClient.state());
@@ -179,6 +191,12 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
     Serial2.println(message);
     Serial.printf("[UART →] %s\n", message.c_str());
   }
+  // Xử lý topic "SensorConfig" → Forward xuống UART với prefix "SCFG,"
+  else if (strcmp(topic, TOPIC_SENSOR_CONFIG) == 0) {
+    // Format: "Ver,MeasureCycle,TMin,TMax,HMin,HMax,SMin,SMax" (nhiệt độ, độ ẩm x10)
+    Serial2.println("SCFG," + message);
+    Serial.printf("[UART →] SCFG,%s\n", message.c_str());
+  }
 }
 
 // ==================== Handle UART Message ====================
@@ -224,6 +242,18 @@ void forwardToMQTT(String command, String payload) {
   else if (command.equalsIgnoreCase("DATA")) {
     topic = TOPIC_DATA;
   }
+  // Command "BACKLOG" → Topic "Backlog", payload = "2,0x01,0x01,28.5,65.2,45.3,..." (số chu kỳ trễ ở đầu)
+  else if (command.equalsIgnoreCase("BACKLOG")) {
+    topic = TOPIC_BACKLOG;
+  }
+  // Command "ALARM" → Topic "Alarm", payload = "0x01,0x01,38.5,65.2,45,0x02" (cờ vượt ngưỡng ở cuối)
+  else if (command.equalsIgnoreCase("ALARM")) {
+    topic = TOPIC_ALARM;
+  }
+  // Command "LINK" → Topic "LinkStats", payload = "0x01,0xFA,-92,7.25,18,20,1" (RSSI, SNR, nghe được, kỳ vọng, trùng lặp)
+  else if (command.equalsIgnoreCase("LINK")) {
+    topic = TOPIC_LINK;
+  }
   else {
     Serial.printf("[MQTT] ✗ Unknown command: '%s'\n", command.c_str());
     return;
@@ -12,6 +12,7 @@
 #include "main.h"
 #include <stdio.h>
 #include "sx1278_lora.h"
+#include "lora_sec.h"
 
 #include "rtc.h"
 
@@ -36,14 +37,17 @@ extern UART_HandleTypeDef huart2;
     // --- CẤU HÌNH CHO SENSOR ---
     #define MY_SENSOR_ID        0xFE
     #define TARGET_RELAY_ID     0x01
+    // Relay ứng viên theo thứ tự ưu tiên (failover khi mất Relay hiện tại)
+    #define SENSOR_RELAY_CANDIDATES         {TARGET_RELAY_ID, 0x03}
+    #define SENSOR_RELAY_CANDIDATE_COUNT    2
 
 #elif (CURRENT_NODE_TYPE == NODE_TYPE_RELAY)
     // --- CẤU HÌNH CHO RELAY ---
     #define MY_RELAY_ID         0x01
-    // Danh sách sensor chịu quản lý
+    // Danh sách sensor chịu quản lý (slot cố định; Sensor khác được nhận lúc chạy vào slot dự phòng)
     #define MANAGED_SENSOR_LIST     {0xFE, 0xFD, 0xFC}
-    // Số lượng sensor chịu quản lý
-    #define MANAGED_SENSOR_COUNT    3
+    // Số slot dự phòng cho Sensor nhận lúc chạy (Sensor mới / failover từ Relay khác)
+    #define RELAY_SPARE_SLOTS       2
 #elif (CURRENT_NODE_TYPE == NODE_TYPE_GATEWAY)
     #define MY_GATEWAY_ID       0x00
 #endif
@@ -54,11 +58,63 @@ extern UART_HandleTypeDef huart2;
 
 #define FUNC_CODE_SS_DATA      		0x03 	// Report phase:		Gửi data từ Sensor -> Relay
 #define FUNC_CODE_RL_DATA			0x04	// Report phase:		Gửi data từ Relay -> Gateway
-#define FUNC_CODE_GW_ACK			0x05	// Report phase:		Xác nhận dữ liệu từ Gateway -> Relay
+#define FUNC_CODE_GW_ACK			0x05	// Report phase:		Xác nhận dữ liệu (gộp nhiều Relay) từ Gateway -> Relay
 
 #define FUNC_CODE_RL_REG_ADV    	0x06    // Registation phase:	Bản tin ADV từ Relay -> Gateway
 #define FUNC_CODE_GW_REG_ACK    	0x07    // Registation phase:	Xác nhận đăng ký ACK từ Gateway -> Relay
 
+#define FUNC_CODE_RL_BEACON		0x08	// Report phase:		Beacon đồng bộ đầu chu kỳ + bitmap ACK data từ Relay -> Sensor
+#define FUNC_CODE_RL_BACKLOG		0x09	// Report phase:		Gửi bù/chuyển tiếp các aggregate từ Relay -> Relay cha / Gateway
+#define FUNC_CODE_RL_PARENT_ACK		0x0A	// Registation phase:	Relay cha nhận Relay con (ngoài tầm GW), cấp slot trong chu kỳ của mình
+#define FUNC_CODE_SS_BATCH			0x0B	// Report phase:		Gửi gộp nhiều mẫu đo (có đánh dấu chu kỳ) từ Sensor -> Relay
+
+#define FUNC_CODE_SS_ALARM			0x0C	// Alarm (fast path):	Cảnh báo vượt ngưỡng từ Sensor -> Relay trong slot tranh chấp
+#define FUNC_CODE_RL_ALARM			0x0D	// Alarm (fast path):	Chuyển tiếp cảnh báo ngay từ Relay -> Relay cha / Gateway
+#define FUNC_CODE_ALARM_ACK			0x0E	// Alarm (fast path):	Xác nhận cảnh báo từ Relay -> Sensor
+
+#define FUNC_CODE_RL_DELTA			0x0F	// Report phase:		Gửi data từ Relay -> Gateway, mã hoá delta so với bản tin đã được ACK
+
+
+// --- RTC ---
+// LSE 32768 Hz / (PRL 31 + 1) = 1024 tick/s (~0.98 ms/tick), xem MX_RTC_Init()
+#define RTC_TICK_SHIFT				10
+#define RTC_TICK_HZ					(1UL << RTC_TICK_SHIFT)
+#define RTC_MS_TO_TICKS(ms)			((uint32_t)(((uint64_t)(ms) * RTC_TICK_HZ) / 1000))
+#define RTC_TICKS_TO_MS(ticks)		((uint32_t)(((uint64_t)(ticks) * 1000) / RTC_TICK_HZ))
+#define RTC_MIN_STOP_MS				5			// Khoảng ngủ ngắn hơn -> HAL_Delay (Alarm cần >= vài tick)
+
+// --- KÊNH TẦN SỐ (FREQUENCY PLAN) ---
+// Kênh 0: kênh GW (đăng ký Relay, đường lên Relay -> GW). Kênh 1 ... LORA_CH_COUNT-1: kênh con cho cluster
+// GW gán kênh con cho Relay trong GW_REG_ACK; Beacon, Sensor, ACK, slot cảnh báo của cluster chạy trên kênh con,
+// Relay chỉ chuyển về kênh GW trong cửa sổ đường lên -> GW xếp lịch chỉ theo cửa sổ đường lên, các cluster nghe song song
+// Relay con dùng chung kênh con với Relay cha. LORA_CH_COUNT = 1: mọi node 1 kênh như cũ
+#define LORA_CH_COUNT				4
+#define LORA_CH_GATEWAY_KHZ			433000		// Kênh 0 (trùng myLoRa.frequency trong main.c)
+#define LORA_CH_BASE_KHZ			433500		// Kênh con 1
+#define LORA_CH_SPACING_KHZ			500			// Khoảng cách kênh con (BW 125 kHz + dải bảo vệ)
+#define LORA_CH_GATEWAY				0
+
+#if (LORA_CH_COUNT < 1) || (LORA_CH_COUNT > 16)
+#error "LORA_CH_COUNT phải nằm trong 1 ... 16"
+#endif
+
+// --- BẢO MẬT ---
+// Mọi bản tin qua LoRaApp_Transmit / LoRaApp_Receive được niêm phong AES-128-CCM (lora_sec.h): thêm LORA_SEC_OVERHEAD byte
+#define LORA_AIR_LEN(n)				((n) + ((LORA_SEC_ENABLE) ? LORA_SEC_OVERHEAD : 0))	// Độ dài trên không trung của bản tin n byte
+#define LORA_MAX_PAYLOAD			((LORA_SEC_ENABLE) ? LORA_SEC_MAX_PAYLOAD : 255)	// Độ dài tối đa bản tin ứng dụng
+
+// --- AIRTIME (DUTY CYCLE) ---
+// Mọi bản tin phát qua LoRaApp_Transmit: cộng time-on-air vào cửa sổ trượt AIRTIME_WINDOW_S (AIRTIME_BUCKETS ô)
+// Bản tin làm vượt ngân sách của mức ưu tiên -> không phát (bên gọi giữ lại gửi sau hoặc bỏ)
+#define AIRTIME_WINDOW_S			3600		// Cửa sổ tính duty cycle (ERC 70-03: 1 giờ)
+#define AIRTIME_BUCKETS				60			// Số ô của cửa sổ trượt (mỗi ô 1 phút)
+#define AIRTIME_DUTY_PERMILLE		100			// Duty cycle tối đa (‰): 433.05-434.79 MHz: 10 %
+#define AIRTIME_NORMAL_PERCENT		90			// Bản tin thường được dùng tới N % ngân sách
+#define AIRTIME_LOW_PERCENT			70			// Bản tin ưu tiên thấp được dùng tới N % ngân sách
+#define AIR_PRIO_CRITICAL			0			// Beacon, ACK, cảnh báo: giữ đồng bộ / xác nhận cho cả cluster (tới 100 %)
+#define AIR_PRIO_NORMAL				1			// Data, đăng ký
+#define AIR_PRIO_LOW				2			// Bản sao dư thừa, gửi bù, broadcast lặp lại
+#define AIR_PRIO_COUNT				3
 
 // --- TIMING ---
 #define DEFAULT_TOTAL_CYCLE     	25
@@ -68,23 +124,176 @@ extern UART_HandleTypeDef huart2;
 
 //Cấu hình thời gian cho SENSOR
 #define REG_TIMEOUT_MS				2000    	// Thời gian chờ ACK của Sensor (Pha Đăng ký)
+// Backoff đăng ký (Sensor và Relay): lần thử thứ n ngủ STOP ngẫu nhiên trong [L/2, L), L = min(BASE << n, MAX)
+// Ngẫu nhiên theo UID của MCU + nhiễu máy thu: các node cấp nguồn cùng lúc không gửi lại cùng lúc
+#define REG_BACKOFF_BASE_MS			500
+#define REG_BACKOFF_MAX_MS			8000
 
-#define SENSOR_MEASURE_CYCLE    	3       	// Đo mỗi 7 chu kỳ
-#define SENSOR_TX_WINDOW_MS     	3000    	// Thời gian dành cho việc Gửi Data (bao gồm cả TDMA delay)
+#define SENSOR_MEASURE_CYCLE    	3       	// Đo mỗi 7 chu kỳ (mặc định, Server đổi được qua cấu hình Sensor)
 #define SENSOR_MEASURE_WINDOW_MS 	3000   		// Thời gian dành cho việc Đo đạc
 
-#define SENSOR_TDMA_BASE_MS     	1500    	// Thời gian chờ cơ sở (để Relay kịp dậy gửi ACK)
-#define SENSOR_TDMA_SLOT_MS     	100     	// Thời gian mỗi slot
+#define SENSOR_TDMA_GUARD_MS     	30	    	// Khoảng bảo vệ sau Beacon trước slot đầu tiên
+#define SENSOR_TDMA_SLOT_MS     	100     	// Độ rộng slot mặc định (trước khi nhận cấu hình từ Relay)
+#define SENSOR_COPY_GAP_MS			50			// Khoảng cách giữa các bản sao Data trong 1 slot
+
+#define SENSOR_SYNC_LEAD_MS			30			// Thức dậy sớm trước Beacon dự kiến
+#define SENSOR_SYNC_LEAD_STEP_MS	50			// Nới thêm lead cho mỗi Beacon bị lỡ liên tiếp
+#define SENSOR_SYNC_LEAD_MAX_MS		500			// Lead tối đa
+#define SENSOR_SYNC_MAX_DRIFT_MS	200			// Giới hạn bù trôi RTC mỗi chu kỳ
+#define SENSOR_BEACON_MARGIN_MS		50			// Thời gian chờ Beacon thêm (thời gian phát Beacon)
+
+// Đồng bộ lại nhanh: lỡ SENSOR_RESYNC_MISSES Beacon liên tiếp (hoặc vừa reset) -> nghe liên tục trọn 1 chu kỳ
+// tìm Beacon của Relay, giữ slot cũ. Chỉ đăng ký lại (ADV) sau SENSOR_RESYNC_ATTEMPTS lần nghe thất bại
+#define SENSOR_RESYNC_MISSES		3			// Số Beacon lỡ liên tiếp trước khi nghe lại trọn chu kỳ
+#define SENSOR_RESYNC_ATTEMPTS		2			// Số chu kỳ nghe lại tối đa trước khi đăng ký lại từ đầu
+#define SENSOR_RESYNC_MARGIN_MS		1000		// Nghe thêm sau 1 chu kỳ (Relay trôi / dời lịch)
+
+// Thanh ghi backup (giữ qua reset / brown-out khi còn nguồn VBAT): Relay, slot, chu kỳ, kênh đã đăng ký và mốc pha chu kỳ
+#define SENSOR_BKP_MAGIC			0xA5		// Byte cao của SENSOR_BKP_DR_ID: dữ liệu backup hợp lệ
+#define SENSOR_BKP_DR_ID			RTC_BKP_DR2	// [Magic | RelayID]
+#define SENSOR_BKP_DR_SLOT			RTC_BKP_DR3	// TDMA slot
+#define SENSOR_BKP_DR_CYCLE			RTC_BKP_DR4	// TOTAL_CYCLE_SEC (s)
+#define SENSOR_BKP_DR_SLOT_MS		RTC_BKP_DR5	// Độ rộng slot (ms)
+#define SENSOR_BKP_DR_ANCHOR_L		RTC_BKP_DR6	// Bộ đếm RTC tại Beacon gần nhất (16 bit thấp)
+#define SENSOR_BKP_DR_ANCHOR_H		RTC_BKP_DR7	// Bộ đếm RTC tại Beacon gần nhất (16 bit cao)
+#define SENSOR_BKP_DR_CHANNEL		RTC_BKP_DR8	// Kênh của cluster (LORA_CH_x)
+#define SENSOR_ANCHOR_MAX_AGE_S		1800		// Mốc cũ hơn -> nghe Beacon trọn chu kỳ (LSE ±20 ppm mỗi bên: lệch <= ~72 ms)
+
+// Failover: mất Relay (đồng bộ lại thất bại hoặc SENSOR_FAILOVER_NACKS lần gửi liên tiếp không được ACK)
+// -> đăng ký với Relay ứng viên kế tiếp: nghe Beacon của nó, gửi ADV trong slot cảnh báo (CAD + backoff)
+#define SENSOR_FAILOVER_NACKS		6			// Số lần gửi liên tiếp không được ACK (vẫn nghe được Beacon)
+#define SENSOR_FAILOVER_REG_CYCLES	2			// Số chu kỳ thử đăng ký với 1 Relay trước khi chuyển Relay kế tiếp
+#define SENSOR_SLOT_NONE			0xFF		// Chưa có slot ở Relay đang nghe (đang tìm Relay mới)
+
+#define SENSOR_MAX_REDUNDANCY		3			// Số bản sao tối đa của 1 bản tin Data
+
+// Điều khiển công suất phát: Relay khuyến nghị bước công suất (dB) theo độ dư liên kết trong Beacon,
+// Sensor tăng ngay khi được yêu cầu, chỉ giảm khi khuyến nghị giảm lặp lại (trễ). Mức: POWER_20db - suy giảm
+#define SENSOR_TXP_HYST_DB			2			// Khuyến nghị giảm nhỏ hơn -> giữ nguyên
+#define SENSOR_TXP_DOWN_BEACONS		2			// Số Beacon liên tiếp khuyến nghị giảm trước khi giảm
+#define SENSOR_TXP_STEP_DB			3			// Bước giảm tối đa mỗi lần / bước tăng khi Data không được ACK
+#define SENSOR_TXP_MAX_ATTEN		12			// Suy giảm tối đa so với POWER_20db (dB, <= 15)
+#define SENSOR_REDUNDANCY_DECAY		3			// Số chu kỳ được ACK liên tiếp trước khi giảm 1 bản sao
+
+// Gửi gộp: Sensor lưu mẫu đo cục bộ, chỉ thức radio mỗi SENSOR_UPLOAD_PERIOD chu kỳ (1: gửi SS_DATA mỗi chu kỳ như cũ)
+// Cấu hình chung toàn mạng: Relay tính độ rộng slot theo bản tin SS_BATCH lớn nhất
+#define SENSOR_UPLOAD_PERIOD		1			// Chu kỳ gửi dữ liệu (số chu kỳ, <= 255)
+#define SENSOR_BATCH_MAX_SAMPLES	8			// Số mẫu tối đa lưu tại Sensor / gửi trong 1 bản tin SS_BATCH
+#define SENSOR_SYNC_SKIP_STEP_MS	10			// Nới thêm lead cho mỗi chu kỳ ngủ qua Beacon (đã bù trôi)
+
+// Báo cáo theo ngoại lệ (dead-band): chỉ gửi khi 1 đại lượng thay đổi vượt ngưỡng so với lần gửi trước,
+// hoặc đã SENSOR_HEARTBEAT_CYCLES chu kỳ chưa gửi. Gửi gộp: chỉ lưu mẫu theo cùng quy tắc
+// Cấu hình chung toàn mạng: Relay giữ giá trị cuối (đánh dấu RL_RECORD_CARRIED) tối đa SENSOR_HEARTBEAT_CYCLES chu kỳ
+#define SENSOR_DEADBAND_ENABLE		0			// 1: bật dead-band, 0: gửi mỗi chu kỳ như cũ
+#define SENSOR_DEADBAND_TEMP		3			// Ngưỡng nhiệt độ (x10): 0.3 °C
+#define SENSOR_DEADBAND_HUM			20			// Ngưỡng độ ẩm không khí (x10): 2.0 %RH
+#define SENSOR_DEADBAND_SOIL		2			// Ngưỡng độ ẩm đất: 2 %
+#define SENSOR_HEARTBEAT_CYCLES		10			// Gửi tối thiểu 1 lần mỗi N chu kỳ (<= 255) dù giá trị không đổi
+
+// Cảnh báo nhanh: Sensor so mẫu đo với ngưỡng lưu cục bộ, vượt ngưỡng mới -> gửi ngay trong slot cảnh báo
+// Slot cảnh báo: mỗi RELAY_ALARM_PERIOD_MS tính từ Beacon, Relay thức nghe ngắn (ngoài phiên hoạt động chính)
+// Nhiều Sensor cùng slot: chọn khe backoff ngẫu nhiên, CAD trước khi gửi. Relay chuyển tiếp lên GW ngay
+#define ALARM_ENABLE				1			// 1: bật cảnh báo nhanh (cấu hình chung toàn mạng)
+#define RELAY_ALARM_PERIOD_MS		5000		// Khoảng cách các slot cảnh báo (độ trễ cảnh báo tối đa tại Relay)
+#define RELAY_ALARM_GUARD_MS		50			// Relay nghe sớm hơn / Sensor gửi muộn hơn mốc slot (sai lệch đồng bộ)
+#define ALARM_BACKOFF_SLOTS			4			// Số khe backoff trong 1 slot cảnh báo
+#define ALARM_RETRIES				3			// Số slot cảnh báo thử lại khi chưa được ACK
+#define RELAY_ALARM_QUEUE			4			// Số cảnh báo Relay giữ chờ chuyển tiếp
+// Ngưỡng mặc định (giống DEFAULT_THRESHOLDS của Server): { Temp min, max (x10) | Hum min, max (x10) | Soil min, max (%) }
+#define SENSOR_ALARM_THRESHOLDS		{ 150, 350, 400, 800, 30, 70 }
+
+#if (SENSOR_HEARTBEAT_CYCLES < 1) || (SENSOR_HEARTBEAT_CYCLES > 255)
+#error "SENSOR_HEARTBEAT_CYCLES phải nằm trong 1 ... 255"
+#endif
+#if (SENSOR_UPLOAD_PERIOD < 1) || (SENSOR_UPLOAD_PERIOD > 255)
+#error "SENSOR_UPLOAD_PERIOD phải nằm trong 1 ... 255"
+#endif
+#if (SENSOR_UPLOAD_PERIOD > SENSOR_MEASURE_CYCLE * SENSOR_BATCH_MAX_SAMPLES)
+#error "SENSOR_BATCH_MAX_SAMPLES không đủ chứa số mẫu đo giữa 2 lần gửi"
+#endif
 
 //Cấu hình thời gian cho RELAY
-#define RELAY_ACK_WINDOW_MS     	1000    	// Task 1: Gửi ACK đăng ký
-#define RELAY_RX_WINDOW_MS      	8000    	// Task 2: Lắng nghe Sensor
+#define RELAY_RX_WINDOW_MIN_MS     	2000    	// Task 1: Lắng nghe Sensor tối thiểu (để Sensor mới kịp gửi ADV)
+#define RELAY_SLOT_GUARD_MS			20			// Khoảng bảo vệ cuối mỗi slot (sai lệch đồng bộ)
+#define RELAY_RX_MARGIN_MS			100			// Thời gian nghe thêm sau slot cuối
+#define RELAY_ACK_WINDOW_MS     	1000    	// Task 2: Gửi ACK đăng ký
 #define RELAY_GW_WINDOW_MS      	1000    	// Task 3: Gửi Gateway & Chờ ACK
 #define MAX_PENDING_ACK     		10
+#define MANAGED_SENSOR_COUNT		((uint8_t)sizeof((const uint8_t[])MANAGED_SENSOR_LIST))	// Suy ra từ danh sách (không khai báo tay)
+#define RELAY_MAX_SENSORS			(MANAGED_SENSOR_COUNT + RELAY_SPARE_SLOTS)	// Sức chứa: Sensor quản lý + slot dự phòng
+#define RELAY_GUEST_TIMEOUT_CYCLES	30			// Giải phóng slot dự phòng sau N chu kỳ không có dữ liệu (> SENSOR_HEARTBEAT_CYCLES)
+#define RELAY_REG_HASH_SIZE			16			// Số ô bảng băm registry Sensor (lũy thừa của 2, >= 2 * RELAY_MAX_SENSORS)
+#define RELAY_REG_FLASH_ADDR		0x0800FC00	// Trang Flash lưu registry: trang 1 KB cuối của STM32F103C8 (đã bỏ khỏi FLASH trong linker script)
+#define RELAY_REG_FLASH_MAGIC		0x5248		// "RH": trang registry hợp lệ (bố cục có last-seen + liên kết)
+#define RELAY_REG_ENTRY_HW			5			// Mỗi Sensor: [Slot | ID] [Seen_H] [Seen_L] [RSSI EWMA] [SNR EWMA] (half-word)
+#define RELAY_REG_STATS_SAVE_S		21600		// Ghi lại last-seen / liên kết tối đa mỗi N giây khi registry không đổi (giới hạn số lần xóa trang)
+#define RELAY_LINK_REPORT_CYCLES	10			// Gửi khối chất lượng liên kết kèm RL_DATA mỗi N chu kỳ
+#define RELAY_LINK_EWMA_SHIFT		3			// EWMA RSSI/SNR: mẫu mới có trọng số 1/2^N
+#define RELAY_TXP_TARGET_MARGIN_DB	10			// Độ dư liên kết mục tiêu của Sensor (dB trên ngưỡng giải điều chế)
+#define RELAY_TXP_NOISE_FLOOR_DBM	(-117)		// Nền nhiễu máy thu: -174 + 10log(125 kHz) + NF 6 dB
+#define RELAY_DATA_ACK_BYTES		((RELAY_MAX_SENSORS + 7) / 8)	// Kích thước bitmap ACK data
+#define RELAY_BACKLOG_RAM_BYTES		4096		// RAM dành cho backlog aggregate chưa ACK (STM32F103C8: 20 KB)
+#define RELAY_BACKLOG_MAX_TOA_MS	500			// Giới hạn time-on-air bản tin gửi bù (để GW kịp ACK trong RELAY_GW_WINDOW_MS)
+
+//Cấu hình đa chặng (multi-hop) cho RELAY
+#define RELAY_MAX_HOPS				3			// Số chặng tối đa từ Relay tới GW (Relay nghe trực tiếp GW: hop 1)
+#define RELAY_MAX_CHILDREN			4			// Số Relay con tối đa của 1 Relay cha
+#define RELAY_HOP_LEAD_MS			5000		// Relay con bắt đầu chu kỳ sớm hơn slot của mình trong chu kỳ Relay cha
+#define RELAY_CHILD_TIMEOUT_CYCLES	5			// Giải phóng slot Relay con sau N chu kỳ không nhận được dữ liệu
+#define RELAY_PARENT_GATEWAY		0x00		// parent_id khi Relay nghe trực tiếp GW
+#define RELAY_MAX_PARENT_CANDIDATES	4			// Số Relay cha ứng viên ghi nhận trong pha đăng ký
+#define RELAY_UPLINK_MAX_FRAMES		3			// Số bản tin RL_BACKLOG tối đa gửi GW mỗi chu kỳ
+#define RELAY_UPLINK_WINDOW_MS		((1 + RELAY_UPLINK_MAX_FRAMES) * RELAY_GW_WINDOW_MS)	// Cửa sổ đường lên GW (RL_DATA + gửi bù)
+#define RELAY_SEC_EPOCH_MISSES		3			// Lỡ N ACK đường lên liên tiếp -> sang epoch bảo mật mới (GW / Relay cha có thể vừa reset, đang chặn epoch cũ)
+#define RELAY_AGG_MAX_RECORDS		8			// Số bản ghi tối đa trong 1 aggregate (>= RELAY_MAX_SENSORS của mọi Relay)
+#define RELAY_DELTA_ENABLE			1			// Gửi RL_DELTA thay cho RL_DATA khi đã có tham chiếu (bản tin trước được GW ACK)
+#define RELAY_DELTA_KEYFRAME_CYCLES	10			// Sau N bản tin RL_DELTA liên tiếp gửi 1 RL_DATA đầy đủ (keyframe)
+
+// MANAGED_SENSOR_COUNT suy ra bằng sizeof -> không dùng được trong #if, kiểm tra lúc biên dịch bằng _Static_assert
+#if (CURRENT_NODE_TYPE == NODE_TYPE_RELAY)
+_Static_assert(RELAY_MAX_SENSORS <= RELAY_AGG_MAX_RECORDS, "RELAY_AGG_MAX_RECORDS phải >= RELAY_MAX_SENSORS");
+_Static_assert(RELAY_REG_HASH_SIZE >= 2 * RELAY_MAX_SENSORS, "RELAY_REG_HASH_SIZE phải >= 2 * RELAY_MAX_SENSORS");
+#endif
+#if (RELAY_REG_HASH_SIZE & (RELAY_REG_HASH_SIZE - 1)) || (RELAY_REG_HASH_SIZE > 256)
+#error "RELAY_REG_HASH_SIZE phải là lũy thừa của 2 và <= 256"
+#endif
+
+// Độ trễ đầu-cuối (Sensor -> Dashboard) yêu cầu < 30 s: mỗi chặng tốn tối đa RELAY_HOP_LEAD_MS
+#define SYSTEM_LATENCY_BUDGET_MS	30000
+#if (RELAY_MAX_HOPS * RELAY_HOP_LEAD_MS + RELAY_UPLINK_MAX_FRAMES * RELAY_GW_WINDOW_MS) > SYSTEM_LATENCY_BUDGET_MS
+#error "RELAY_MAX_HOPS x RELAY_HOP_LEAD_MS vượt ngân sách độ trễ SYSTEM_LATENCY_BUDGET_MS"
+#endif
 
 //Cấu hình Relay Queue cho GW
 #define MAX_RELAY_QUEUE 20
 
+//Cấu hình lập lịch Δt tự động của GW (xếp cửa sổ các Relay liền nhau, không chồng lấn)
+#define GW_SCHED_AUTO				1			// 1: GW tự tính Δt (bỏ qua Δt từ Server), 0: dùng Δt từ Server
+#define GW_SCHED_UNIT_MS			10			// Đơn vị Δt trong GW_REG_ACK
+#define GW_SCHED_MAX_CYCLE_S		((0xFFFFUL * GW_SCHED_UNIT_MS) / 1000)	// Chu kỳ dài nhất Δt 16 bit biểu diễn được (655 s)
+#define GW_SCHED_GUARD_MS			500			// Khoảng bảo vệ giữa cửa sổ 2 Relay liền kề (trôi đồng hồ)
+#define GW_SCHED_DEFAULT_WINDOW_MS	8000		// Cửa sổ giả định cho Relay không báo độ dài (window = 0)
+#define GW_RELAY_TIMEOUT_CYCLES		5			// Relay im lặng quá N chu kỳ -> giải phóng cửa sổ
+#define RL_WINDOW_UNIT_MS			100			// Đơn vị độ dài cửa sổ Relay báo trong RL_REG_ADV
+
+#if (DEFAULT_TOTAL_CYCLE > GW_SCHED_MAX_CYCLE_S)
+#error "DEFAULT_TOTAL_CYCLE vượt GW_SCHED_MAX_CYCLE_S (Δt / stretch 16 bit đơn vị GW_SCHED_UNIT_MS)"
+#endif
+
+//Cấu hình ACK gộp của GW
+#define GW_ACK_HOLD_MS				150			// Giữ ACK chờ gộp với Relay có cửa sổ liền kề
+#define GW_ACK_MAX_BATCH			8			// Số Relay tối đa trong 1 bản tin ACK gộp
+
+//Cấu hình hàng chờ downlink của GW (gắn sau GW_ACK, lúc Relay đích đang nghe)
+#define GW_DL_QUEUE_SIZE			8			// Số bản tin downlink chờ gửi tối đa
+#define GW_DL_MAX_DATA				20			// Độ dài dữ liệu tối đa của 1 bản tin downlink
+#define GW_DL_REPEAT				2			// Số lần gửi 1 bản tin riêng (mỗi lần trong 1 GW_ACK)
+#define GW_DL_TTL_CYCLES			2			// Bản tin chưa gửi được sau N chu kỳ -> bỏ
+#define GW_DL_BROADCAST				0xFF		// Target: mọi Relay (gửi trong mọi GW_ACK tới khi hết hạn)
+#define DL_TYPE_SCHED				0x01		// Lịch mới: [Cycle_H | Cycle_L | Dt_H | Dt_L], Dt tính từ lúc nhận
+#define DL_TYPE_SENSOR_CFG			0x02		// Cấu hình Sensor: [Ver | TLV...], Relay phát lại trong Beacon
+#define RELAY_REALIGN_TOL_MS		200			// Lệch pha nhỏ hơn mức này -> không dời chu kỳ
+
 
 // --- FRAME STRUCTURE ---
 //Bản tin ADV pha Đăng ký (Sensor -> Relay)
@@ -101,18 +310,83 @@ typedef struct {
 	uint8_t target_sensor_id;
 	uint8_t time_slot;
 	uint16_t total_cycle;
-	uint8_t reserved;
+	uint16_t cycle_offset_ms;	// Thời gian (ms) tính từ Beacon đầu chu kỳ hiện tại của Relay
+	uint16_t slot_ms;			// Độ rộng slot TDMA (ms)
 //	uint16_t wake_interval;
-}msg_ss_reg_ack_t;
+} __attribute__((packed)) msg_ss_reg_ack_t;
 
-//Bản tin ADV pha Đăng ký (Relay -> Gateway)
+//Bản tin ADV pha Đăng ký (Relay -> Gateway / Relay cha)
 typedef struct {
     uint8_t func_code;      // 0x06
     uint8_t relay_id;
-    uint8_t reserved;
+    uint8_t window;         // Thời gian hoạt động tối đa mỗi chu kỳ (đơn vị RL_WINDOW_UNIT_MS, 0: không rõ)
+                            // Nhiều kênh: chỉ cửa sổ đường lên trên kênh GW
+    uint8_t lead;           // Nhiều kênh: phiên cluster trước cửa sổ đường lên (đơn vị RL_WINDOW_UNIT_MS), GW cũ bỏ qua
 } __attribute__((packed)) msg_rl_reg_adv_t;
 
-//Bản tin Dữ liệu pha Báo cáo (Sensor -> Relay) - 8 Bytes
+//Bản tin nhận Relay con pha Đăng ký (Relay cha -> Relay con) - 11 Bytes
+typedef struct {
+    uint8_t func_code;          // 0x0A
+    uint8_t parent_id;
+    uint8_t child_id;
+    uint8_t hop;                // Số chặng của Relay con tới GW
+    uint16_t total_cycle;       // Chu kỳ tổng (s)
+    uint16_t cycle_offset_ms;   // Thời gian (ms) tính từ Beacon đầu chu kỳ hiện tại của Relay cha
+    uint16_t child_offset_ms;   // Thời điểm slot của Relay con, tính từ Beacon của Relay cha
+    uint8_t child_slot;
+} __attribute__((packed)) msg_rl_parent_ack_t;
+
+//Bản tin Beacon đầu chu kỳ (Relay -> Sensor) - 15 Bytes + Bitmap + Công suất (+ Cấu hình Sensor)
+// Theo sau là bitmap_len byte: bit i = 1 nếu Relay đã nhận Data của slot i ở chu kỳ trước
+// Sau bitmap: RL_TXP_BYTES(bitmap_len) byte khuyến nghị công suất, 4 bit có dấu (dB) mỗi slot (slot chẵn ở 4 bit thấp)
+// Sau đó (tùy chọn): [Cfg_Ver | Cfg_Len | TLV...] khi còn Sensor chưa xác nhận phiên bản cấu hình
+#define RL_TXP_BYTES(bitmap_len)	((bitmap_len) * 4)
+#define RL_TXP_MIN_DB				(-8)
+#define RL_TXP_MAX_DB				7
+#define RL_BEACON_MAX_BITMAP		8			// Bitmap tối đa phía nhận (64 slot)
+#define RL_BEACON_MAX_LEN			(sizeof(msg_rl_beacon_t) + RL_BEACON_MAX_BITMAP + RL_TXP_BYTES(RL_BEACON_MAX_BITMAP) + 2 + SCFG_MAX_LEN)
+typedef struct {
+    uint8_t func_code;          // 0x08
+    uint8_t relay_id;
+    uint16_t cycle_count;       // Số thứ tự chu kỳ của Relay
+    uint32_t rtc_time;          // RTC counter (s) của Relay
+    uint16_t total_cycle;       // Chu kỳ tổng (s)
+    uint16_t slot_ms;           // Độ rộng slot TDMA (ms)
+    uint16_t stretch;           // Beacon kế tiếp trễ thêm (đơn vị GW_SCHED_UNIT_MS): Relay dời lịch
+    uint8_t bitmap_len;
+} __attribute__((packed)) msg_rl_beacon_t;
+
+//Bản tin ACK Data gộp pha Báo cáo (Gateway -> Relay) - độ dài thay đổi
+// [Func | Count | RelayID_1 | ... | RelayID_n | N_dl | DL_1 | ... | DL_n]
+// Phần downlink (N_dl, DL) chỉ có khi GW có bản tin cho các Relay trong ACK
+// DL = [Target | Type | Len | Data...], Target: RelayID hoặc GW_DL_BROADCAST
+#define GW_ACK_HEADER_LEN			2
+#define GW_DL_HEADER_LEN			3
+
+//Bản tin Dữ liệu pha Báo cáo (Relay -> Gateway) - độ dài thay đổi, mỗi bản ghi Sensor 6 Bytes
+// RL_DATA:    [Func | RelayID | Count | Record_1 | ... | Record_n]
+// RL_BACKLOG: [Func | RelayID | DestID | Cycle_H | Cycle_L | N_agg | Agg_1 | ... | Agg_n]
+//             DestID: Relay cha (hoặc RELAY_PARENT_GATEWAY), Cycle: chu kỳ hiện tại của Relay gửi
+//             Agg = [RelayID | Cycle_H | Cycle_L | Count | Record_1 | ... | Record_n] (RelayID/Cycle gốc của aggregate)
+// Record = [SensorID | Temp_H | Temp_L | Hum_H | Hum_L | Soil]
+// RL_DELTA:   [Func | RelayID | RefCheck | Bitmap | N_new | Delta_1 | ... | Delta_k | Record_1 | ... | Record_n]
+//             Tham chiếu: các bản ghi của RL_DATA / RL_DELTA gần nhất được GW ACK (thứ tự GW giải mã), RefCheck: CRC-8 của tham chiếu
+//             Bitmap ((số bản ghi tham chiếu + 7) / 8 byte): bit i = bản ghi thứ i của tham chiếu có mặt, Delta theo thứ tự bit
+//             Delta = [varint(zz(dSoil) << 1 | Carried) | varint(zz(dTemp)) | varint(zz(dHum))] (zigzag, 7 bit/byte, byte thấp trước)
+//             Record: Sensor không có trong tham chiếu, như RL_DATA. Tham chiếu mới = bản ghi có mặt (thứ tự tham chiếu) + Record
+// RL_DATA / RL_DELTA có thể kèm khối chất lượng liên kết sau Record cuối (mỗi RELAY_LINK_REPORT_CYCLES chu kỳ, GW cũ bỏ qua):
+//             [RL_LINK_MARK | N | Link_1 | ... | Link_n]
+//             Link = [SensorID | -RSSI (dBm) | SNR (0.25 dB, int8) | Heard | Expected | Dups] (đếm trong kỳ báo cáo)
+#define RL_RECORD_LEN				6
+#define RL_LINK_MARK				0x4C		// 'L'
+#define RL_LINK_LEN					6
+#define RL_RECORD_CARRIED			0x80		// Bit 7 của Soil: giá trị giữ lại từ lần gửi trước (Sensor im lặng do dead-band)
+#define RL_BACKLOG_HEADER_LEN		6
+#define RL_BACKLOG_AGG_HEADER_LEN	4
+#define ZIGZAG_ENC(x)				(((uint32_t)(x) << 1) ^ (uint32_t)((int32_t)(x) >> 31))
+#define ZIGZAG_DEC(u)				((int32_t)((u) >> 1) ^ -(int32_t)((u) & 1))
+
+//Bản tin Dữ liệu pha Báo cáo (Sensor -> Relay) - 9 Bytes
 typedef struct {
     uint8_t func_code;          // 0x03
     uint8_t sensor_id;
@@ -120,8 +394,48 @@ typedef struct {
     int16_t temp_val;           // Nhiệt độ * 10
     uint16_t hum_val;           // Độ ẩm * 10
     uint8_t soil_val;           // Độ ẩm đất %
+    uint8_t cfg_ver;            // Phiên bản cấu hình Sensor đang áp dụng (xác nhận với Relay)
 } __attribute__((packed)) msg_ss_data_t;
 
+//Bản tin Dữ liệu gộp pha Báo cáo (Sensor -> Relay) - độ dài thay đổi, mỗi mẫu 6 Bytes (cũ nhất trước)
+// [Func | SensorID | RelayID | Period | CfgVer | N | Sample_1 | ... | Sample_n]
+// Period: SENSOR_UPLOAD_PERIOD (Relay biết chu kỳ gửi kế tiếp để bỏ qua slot của Sensor ở các chu kỳ giữa)
+// CfgVer: phiên bản cấu hình Sensor đang áp dụng
+// Sample = [Age | Temp_H | Temp_L | Hum_H | Hum_L | Soil], Age: số chu kỳ tính từ lúc đo tới chu kỳ gửi
+#define SS_BATCH_HEADER_LEN			6
+#define SS_BATCH_SAMPLE_LEN			6
+#define SS_BATCH_MAX_LEN			(SS_BATCH_HEADER_LEN + SENSOR_BATCH_MAX_SAMPLES * SS_BATCH_SAMPLE_LEN)
+
+//Cấu hình Sensor từ Server (GW -> Relay qua downlink, Relay -> Sensor trong Beacon)
+// Block = [Ver | TLV_1 | ... | TLV_n], TLV = [Type | Len | Value...], Sensor bỏ qua Type không biết
+// Sensor chỉ áp dụng khi Ver khác phiên bản đang dùng, xác nhận bằng CfgVer trong bản tin Data
+#define SCFG_MAX_LEN				(GW_DL_MAX_DATA - 1)	// Độ dài TLV tối đa
+#define SCFG_TLV_HEADER_LEN			2
+#define SCFG_TLV_MEASURE_CYCLE		0x01	// [Cycles]: đo mỗi N chu kỳ
+#define SCFG_TLV_THRESHOLDS			0x02	// [TMin_H | TMin_L | TMax_H | TMax_L | HMin_H | HMin_L | HMax_H | HMax_L | SMin | SMax]
+#define SCFG_THRESHOLDS_LEN			10
+#define SCFG_BEACON_REPEAT			3		// Số Beacon kèm cấu hình sau khi đổi phiên bản (cho Relay con)
+
+//Bản tin Cảnh báo nhanh - độ dài cố định
+// SS_ALARM:  [Func | SensorID | RelayID | Flags | Temp_H | Temp_L | Hum_H | Hum_L | Soil]
+// ALARM_ACK: [Func | RelayID | SensorID]
+// RL_ALARM:  [Func | RelayID | DestID | OriginRelayID | SensorID | Flags | Temp_H | Temp_L | Hum_H | Hum_L | Soil]
+//            DestID: Relay cha (hoặc RELAY_PARENT_GATEWAY), Relay cha / GW xác nhận bằng GW_ACK
+// Flags: bit đại lượng vượt ngưỡng (ALARM_FLAG_x)
+#define SS_ALARM_LEN				9
+#define ALARM_ACK_LEN				3
+#define RL_ALARM_HEADER_LEN			3
+#define RL_ALARM_LEN				11
+#define ALARM_FLAG_TEMP_LOW			0x01
+#define ALARM_FLAG_TEMP_HIGH		0x02
+#define ALARM_FLAG_HUM_LOW			0x04
+#define ALARM_FLAG_HUM_HIGH			0x08
+#define ALARM_FLAG_SOIL_LOW			0x10
+#define ALARM_FLAG_SOIL_HIGH		0x20
+
+// Bản tin dữ liệu lớn nhất Sensor có thể gửi trong 1 slot (để Relay tính độ rộng slot)
+#define SENSOR_UPLINK_MAX_LEN		((SENSOR_UPLOAD_PERIOD > 1) ? SS_BATCH_MAX_LEN : sizeof(msg_ss_data_t))
+
 
 // --- RELAY MANAGEMENT STRUCT ---
 
@@ -138,12 +452,103 @@ typedef struct {
     uint16_t hum;
     uint8_t soil;
     uint8_t has_data; // Cờ báo đã nhận dữ liệu trong chu kỳ này chưa
+    uint8_t upload_period;  // Chu kỳ gửi của Sensor (0/1: gửi mỗi chu kỳ)
+    uint16_t next_cycle;    // Chu kỳ (của Relay) dự kiến Sensor gửi gộp lần tới
+    uint8_t carry_left;     // Số chu kỳ còn giữ giá trị cuối khi Sensor im lặng (dead-band)
+    uint8_t cfg_ver;        // Phiên bản cấu hình Sensor đã xác nhận (trong bản tin Data)
+    uint8_t silent;         // Số chu kỳ liên tiếp không có dữ liệu (slot dự phòng: giải phóng khi quá hạn)
+    uint32_t last_seen;     // Thời điểm nhận bản tin gần nhất (RTC_GetSeconds)
+    int16_t rssi_avg;       // RSSI trung bình trượt EWMA (1/16 dBm, 0: chưa có mẫu)
+    int16_t snr_avg;        // SNR trung bình trượt EWMA (1/16 dB)
+    uint8_t heard;          // Kỳ báo cáo liên kết: số chu kỳ nhận được Data
+    uint8_t expected;       // Số chu kỳ Sensor tới lượt gửi
+    uint8_t dups;           // Số bản sao Data bị bỏ (gửi dư thừa / gửi lại)
+    int8_t margin;          // Độ dư liên kết bản tin gần nhất (dB trên ngưỡng giải điều chế)
 } Relay_Sensor_Data_Slot_t;
 
+//[RELAY/GATEWAY]: 1 bản ghi Sensor (aggregate của Relay, tham chiếu RL_DELTA ở cả Relay và GW)
+typedef struct {
+    uint8_t sensor_id;
+    int16_t temp;
+    uint16_t hum;
+    uint8_t soil;
+} __attribute__((packed)) Relay_Record_t;
+
+#if (CURRENT_NODE_TYPE == NODE_TYPE_RELAY)
+//[RELAY]: Aggregate 1 chu kỳ (của Relay này hoặc Relay con) chờ gửi lên, lưu trong ring buffer
+typedef struct {
+    uint8_t relay_id;                               // Relay gom dữ liệu (bản thân hoặc Relay con)
+    uint16_t cycle;                                 // Số chu kỳ (theo Relay này) lúc gom
+    uint8_t count;                                  // Số bản ghi hợp lệ
+    Relay_Record_t records[RELAY_AGG_MAX_RECORDS];
+} Relay_Aggregate_t;
+
+#define RELAY_BACKLOG_DEPTH		(RELAY_BACKLOG_RAM_BYTES / sizeof(Relay_Aggregate_t))
+
+//[RELAY]: Relay cha ứng viên nghe được trong pha đăng ký (bảng parent/hop)
+typedef struct {
+    uint8_t relay_id;           // RELAY_PARENT_GATEWAY nếu nghe trực tiếp GW
+    uint8_t hop;                // Số chặng của Relay này nếu chọn ứng viên
+    int16_t rssi;
+    uint32_t beacon_tick;       // HAL tick ước lượng của Beacon Relay cha (chỉ với Relay cha)
+    uint16_t total_cycle;
+    uint16_t child_offset_ms;
+    uint8_t channel;            // Kênh nghe được ứng viên (kênh con của Relay cha / kênh GW)
+} Relay_Parent_t;
+
+//[RELAY]: Relay con đang chuyển tiếp qua Relay này
+typedef struct {
+    uint8_t relay_id;           // 0: slot trống
+    uint8_t has_data;           // Đã nhận dữ liệu trong chu kỳ này
+    uint8_t silent;             // Số chu kỳ liên tiếp không nhận được dữ liệu
+} Relay_Child_t;
+#endif
+
+//[SENSOR]: Trạng thái đồng bộ với Beacon của Relay
+typedef struct {
+    uint32_t ref_tick;      // HAL tick của Beacon gần nhất (hoặc mốc dự đoán nếu lỡ)
+    uint32_t wake_tick;     // HAL tick lúc thức dậy chu kỳ này
+    int32_t drift_ms;       // Bù trôi RTC ước lượng mỗi chu kỳ (ms)
+    uint16_t cycle;         // Số chu kỳ của Relay
+    uint32_t relay_rtc;     // RTC counter của Relay trong Beacon
+    uint8_t missed;         // Số Beacon bị lỡ liên tiếp
+    uint8_t skipped;        // Số chu kỳ chủ động ngủ qua Beacon (không phải chu kỳ gửi) kể từ Beacon gần nhất
+    uint8_t synced;         // Đã nhận ít nhất 1 Beacon kể từ khi đăng ký
+    uint16_t slot_ms;       // Độ rộng slot TDMA do Relay cấp
+    uint32_t stretch_ms;    // Beacon kế tiếp trễ thêm (Relay dời lịch), chỉ áp dụng 1 chu kỳ
+} Sensor_Sync_t;
+
+//[SENSOR]: Ngưỡng cảnh báo lưu cục bộ
+typedef struct {
+    int16_t temp_min;       // Nhiệt độ * 10
+    int16_t temp_max;
+    uint16_t hum_min;       // Độ ẩm * 10
+    uint16_t hum_max;
+    uint8_t soil_min;       // Độ ẩm đất %
+    uint8_t soil_max;
+} Sensor_Thresholds_t;
+
+//[SENSOR]: Mẫu đo lưu cục bộ chờ gửi gộp
+typedef struct {
+    uint16_t cycle;         // Chu kỳ (của Relay) lúc đo
+    int16_t temp;
+    uint16_t hum;
+    uint8_t soil;
+} Sensor_Sample_t;
+
 // --- GATEWAY MANAGEMENT STRUCT ---
 typedef struct {
     uint8_t relay_id;
     uint32_t last_seen;
+    uint16_t window_ms;     // Cửa sổ hoạt động mỗi chu kỳ (Relay báo trong RL_REG_ADV)
+    uint32_t offset_ms;     // Vị trí cửa sổ trong chu kỳ, tính từ mốc lịch của GW
+    uint8_t scheduled;      // Đã được xếp lịch
+    uint8_t dirty;          // Mục lịch mới/đổi, chưa broadcast
+    uint16_t lead_ms;       // Phiên cluster trước cửa sổ (trên kênh con, 0: 1 kênh / Relay cũ)
+    uint8_t channel;        // Kênh con gán cho cluster (gửi trong GW_REG_ACK)
+    uint8_t ref_valid;      // Có tham chiếu giải mã RL_DELTA
+    uint8_t ref_count;
+    Relay_Record_t ref[RELAY_AGG_MAX_RECORDS];  // Bản ghi bản tin dữ liệu gần nhất đã ACK (Soil bỏ bit RL_RECORD_CARRIED)
 } Relay_Info_t;
 
 typedef struct {
@@ -151,15 +556,90 @@ typedef struct {
     uint8_t count;
 } Gateway_Relay_List_t;
 
+//Thống kê thời gian phát (chẩn đoán), xem LoRaApp_Airtime_GetStats()
+typedef struct {
+    uint32_t total_ms;                  // Tổng time-on-air từ khi khởi động
+    uint32_t window_ms;                 // Time-on-air trong cửa sổ trượt hiện tại
+    uint32_t budget_ms;                 // Ngân sách của cửa sổ (100 %)
+    uint32_t sent[AIR_PRIO_COUNT];      // Số bản tin đã phát theo mức ưu tiên
+    uint32_t denied[AIR_PRIO_COUNT];    // Số bản tin bị hoãn / bỏ do hết ngân sách
+    uint32_t tx_fail;                   // Số bản tin radio không báo TxDone (không tính time-on-air)
+} LoRaApp_Airtime_t;
+
+//[GATEWAY]: Bản tin downlink chờ gửi kèm GW_ACK
+typedef struct {
+    uint8_t target;         // RelayID hoặc GW_DL_BROADCAST
+    uint8_t type;           // DL_TYPE_x
+    uint8_t len;
+    uint8_t tries;          // Số lần gửi còn lại (bản tin riêng)
+    uint32_t expire_tick;   // Hết hạn (HAL tick)
+    uint8_t data[GW_DL_MAX_DATA];
+} Gateway_Downlink_t;
+
 // --- HANDLE FUNCTION ---
 void RTC_SetAlarm_In_Seconds(uint32_t seconds);
 
+void RTC_SetAlarm_In_Ms(uint32_t ms);
+
+uint32_t RTC_GetSeconds(void);
+
 void Enter_Stop_Mode(void);
 
 void SystemClock_Config_FromStop(void);
 
 void Pad_Execution_Time(uint32_t start_tick, uint32_t target_duration_ms);
 
+uint32_t RTC_GetCounter(void);
+
+void Sleep_Precise_Ms(uint32_t ms);
+
+// Độ dài 1 khe backoff và cả slot cảnh báo (Sensor và Relay tính giống nhau theo cấu hình radio)
+uint32_t LoRaApp_Alarm_BackoffSlotMs(LoRa* _lora);
+
+uint32_t LoRaApp_Alarm_WindowMs(LoRa* _lora);
+
+// Chờ kênh rảnh trong slot cảnh báo (backoff ngẫu nhiên + CAD), trả về 1 nếu được phép gửi
+uint8_t LoRaApp_Alarm_WaitChannel(LoRa* _lora, uint8_t _seed);
+
+// Phát 1 bản tin trong ngân sách duty cycle (AIR_PRIO_x), trả về 0 nếu phát lỗi hoặc bị hoãn
+uint8_t LoRaApp_Transmit(LoRa* _lora, uint8_t* pData, uint8_t length, uint16_t timeout, uint8_t prio);
+
+// Đọc bản tin vừa nhận và mở niêm phong, trả về độ dài bản tin gốc (0 nếu sai tag / phát lại)
+uint8_t LoRaApp_Receive(LoRa* _lora, uint8_t* _buf, uint8_t _size);
+
+// In chi phí mã hoá từng loại bản tin (chu kỳ CPU, airtime tăng thêm)
+void LoRaApp_Security_Benchmark(LoRa* _lora);
+
+// Thống kê thời gian phát (bộ đếm chẩn đoán)
+void LoRaApp_Airtime_GetStats(LoRaApp_Airtime_t* _stats);
+
+void LoRaApp_Airtime_Print(void);
+
+// Khởi tạo bộ sinh số ngẫu nhiên từ UID của MCU và nhiễu máy thu SX1278 (gọi khi radio rảnh)
+void LoRaApp_Random_Seed(LoRa* _lora);
+
+uint32_t LoRaApp_Random(void);
+
+// Thời gian chờ ngẫu nhiên trước lần thử đăng ký thứ _attempt (0: lần thất bại đầu tiên)
+uint32_t LoRaApp_Backoff_Ms(uint8_t _attempt);
+
+// Tần số (kHz) của kênh _ch trong kế hoạch kênh
+uint32_t LoRaApp_Channel_KHz(uint8_t _ch);
+
+// Kênh con GW gán cho Relay (theo ID: Sensor suy ra được kênh của Relay ứng viên)
+uint8_t LoRaApp_Channel_ForRelay(uint8_t _relayID);
+
+// Chuyển radio sang kênh _ch (bỏ qua nếu đang ở kênh đó), gọi khi radio ở STANDBY
+void LoRaApp_Channel_Set(LoRa* _lora, uint8_t _ch);
+
+// RL_DELTA: ghi / đọc 1 varint (7 bit/byte), trả về số byte (đọc: 0 nếu thiếu dữ liệu)
+uint8_t LoRaApp_Varint_Put(uint8_t* _buf, uint32_t _v);
+
+uint8_t LoRaApp_Varint_Get(const uint8_t* _buf, uint8_t _len, uint32_t* _v);
+
+// RL_DELTA: CRC-8 của danh sách bản ghi tham chiếu (Relay và GW so khớp tham chiếu)
+uint8_t LoRaApp_Delta_RefCheck(const Relay_Record_t* _ref, uint8_t _count);
+
 // Test range TX
 void LoRaApp_TestRange_Tx(LoRa* _lora, uint8_t _myID);
 
@@ -171,21 +651,38 @@ void LoRaApp_TestRange_Rx(LoRa* _lora, uint8_t* _rxBuf, volatile uint8_t* _rxFla
 #include "sensor_handle.h"
 
 //[SENSOR]: Thực hiện pha Đăng ký (trả về time slot TDMA)
+// Còn slot trong thanh ghi backup -> nghe Beacon để đồng bộ lại trước, chỉ gửi ADV khi thất bại
+// Lần lượt thử các Relay trong SENSOR_RELAY_CANDIDATES (LoRaApp_Sensor_GetRelayID: Relay đã nhận)
 uint8_t LoRaApp_Sensor_RegistrationPhase(
     LoRa* _lora,                 // Con trỏ tới struct LoRa
     uint8_t* _rxBuf,             // Con trỏ tới buffer nhận
     uint16_t _rxBufSize,         // Kích thước buffer
     volatile uint8_t* _rxFlag,   // Con trỏ tới cờ ngắt (quan trọng!)
-    uint8_t _myID,               // ID của Sensor
-    uint8_t _targetRelayID       // ID của Relay đích
+    uint8_t _myID                // ID của Sensor
 );
 
-//[SENSOR]: Thực hiện gửi data (theo timeslot) pha Báo cáo (Timeout: SENSOR_TX_WINDOW_MS)
+//[SENSOR]: ID Relay hiện tại (Relay ứng viên đã nhận Sensor)
+uint8_t LoRaApp_Sensor_GetRelayID(void);
+
+//[SENSOR]: Mất Relay (đồng bộ lại thất bại / liên tiếp không được ACK) -> cần đăng ký lại (Relay kế tiếp)
+uint8_t LoRaApp_Sensor_IsLost(void);
+
+//[SENSOR]: Chờ Beacon, gửi data (theo timeslot tính từ Beacon) pha Báo cáo
+// Gửi gộp (SENSOR_UPLOAD_PERIOD > 1): chỉ chu kỳ gửi mới bật radio, các chu kỳ khác giữ radio tắt
 void LoRaApp_Sensor_Task_SendData(LoRa* _lora, uint8_t _myID, uint8_t _targetRelayID, uint8_t _mySlot);
 
+//[SENSOR]: Số chu kỳ giữa 2 lần đo (SENSOR_MEASURE_CYCLE hoặc theo cấu hình từ Server)
+uint8_t LoRaApp_Sensor_GetMeasureCycle(void);
+
 //[SENSOR]: Thực hiện đo cảm biến (Timeout: SENSOR_MEASURE_WINDOW_MS)
 void LoRaApp_Sensor_Task_Measure(Sensor_Config_t* _sensorCfg);
 
+//[SENSOR]: Gửi cảnh báo vượt ngưỡng (nếu có) trong slot cảnh báo kế tiếp của Relay, trước Beacon chu kỳ sau
+void LoRaApp_Sensor_Task_Alarm(LoRa* _lora, uint8_t _myID, uint8_t _targetRelayID);
+
+//[SENSOR]: Ngủ STOP tới ngay trước Beacon của chu kỳ sau (có bù trôi)
+void LoRaApp_Sensor_SleepUntilNextCycle(void);
+
 #endif
 
 #if (CURRENT_NODE_TYPE == NODE_TYPE_RELAY)
@@ -200,22 +697,42 @@ uint8_t LoRaApp_Relay_RegistrationWithGateway(
 void LoRaApp_Relay_RxProcessing(
     LoRa* _lora,
     uint8_t* _rxBuf,
+    uint8_t _len,
     uint8_t _myRelayID,
     Relay_Reg_Queue_t* _queue // Con trỏ tới hàng đợi ACK
 );
 
+// [RELAY]: Broadcast Beacon đầu chu kỳ (mốc TDMA + bitmap ACK data chu kỳ trước)
+void LoRaApp_Relay_Task_SendBeacon(LoRa* _lora, uint8_t _myRelayID);
+
 // [RELAY]: Gửi ACK pha Đăng ký cho sensor node (Timeout: RELAY_ACK_WINDOW_MS)
 void LoRaApp_Relay_Task_SendACKs(LoRa* _lora, uint8_t _myRelayID, Relay_Reg_Queue_t* _queue);
 
-//[RELAY]: Ghép bản tin từ dữ liệu Relay_Sensor_Data_Slot_t, gửi tới GW (Timeout: RELAY_GW_WINDOW_MS)
-void LoRaApp_Relay_Task_ForwardToGateway(LoRa* _lora, uint8_t _myRelayID);
+//[RELAY]: Ghép bản tin từ dữ liệu Relay_Sensor_Data_Slot_t, gửi tới GW (Timeout: RELAY_GW_WINDOW_MS), trả về 1 nếu GW đã ACK
+// Aggregate không được ACK -> lưu backlog, gửi bù gộp 1 bản tin ở lần GW ACK kế tiếp
+uint8_t LoRaApp_Relay_Task_ForwardToGateway(LoRa* _lora, uint8_t _myRelayID);
+
+//[RELAY]: Thức nghe các slot cảnh báo còn lại của chu kỳ, chuyển tiếp cảnh báo nhận được lên GW ngay
+void LoRaApp_Relay_Task_AlarmSlots(LoRa* _lora, uint8_t _myRelayID);
+
+//[RELAY]: Ngủ STOP tới Beacon chu kỳ sau
+void LoRaApp_Relay_SleepUntilNextCycle(void);
+
+//[RELAY]: Độ dài phiên lắng nghe chu kỳ này (tính theo số slot và time-on-air)
+uint32_t LoRaApp_Relay_GetRxWindowMs(void);
+
+//[RELAY]: Kết thúc sớm phiên lắng nghe khi mọi Sensor đã đăng ký đều đã gửi Data
+uint8_t LoRaApp_Relay_RxComplete(void);
 
-//[RELAY]: Kiểm tra id sensor có thuộc danh sách kiểm soát hay không?
+//[RELAY]: Kiểm tra id sensor có trong registry (Sensor quản lý hoặc đã nhận lúc chạy) hay không?
 uint8_t IsSensorManaged(uint8_t sensor_id);
 
-//[RELAY]: Cấp phát index cho Sensor node dựa theo số thứ tự trong danh sách
+//[RELAY]: Slot của Sensor trong registry (tra bảng băm, O(1))
 int GetSensorIndex(uint8_t sensor_id);
 
+//[RELAY]: Ghi registry Sensor nhận lúc chạy xuống Flash nếu có thay đổi (gọi trước khi ngủ)
+void LoRaApp_Relay_SaveRegistry(void);
+
 //[RELAY]: Reset struct quản lý dữ liệu sensor đầu chu kỳ
 void LoRaApp_Relay_Init(void);
 #endif
@@ -228,10 +745,19 @@ void LoRaApp_Gateway_Init(void);
 //[GATEWAY]: Xử lý bản tin nhận được tại Gateway
 void LoRaApp_Gateway_RxProcessing(LoRa* _lora, uint8_t* _rxBuf, uint8_t len);
 
+//[GATEWAY]: Gửi ACK gộp cho các Relay đã nhận Data (khi hết GW_ACK_HOLD_MS hoặc đầy)
+void LoRaApp_Gateway_Task_FlushACKs(LoRa* _lora);
+
 //[GATEWAY]: Tạo và gửi danh sách hàng chờ Relay đăng ký (định kỳ)
 void LoRaApp_Gateway_Send_RL_Queue(void);
 
-//[GATEWAY]: Parse lệnh UART và Broadcast cấu hình xuống Relay
+//[GATEWAY]: Đưa 1 bản tin vào hàng chờ downlink (gửi kèm GW_ACK tiếp theo của Relay đích)
+void LoRaApp_Gateway_QueueDownlink(uint8_t target, uint8_t type, const uint8_t* data, uint8_t len, uint32_t ttl_ms);
+
+//[GATEWAY]: Duy trì lịch Δt: xếp Relay mới vào khoảng trống, giải phóng Relay im lặng, broadcast mục thay đổi
+void LoRaApp_Gateway_Task_Schedule(LoRa* _lora);
+
+//[GATEWAY]: Parse lệnh UART và Broadcast cấu hình xuống Relay ("SCFG,...": cấu hình Sensor qua downlink)
 void LoRaApp_Gateway_ProcessConfigCommand(LoRa* _lora, char* cmd_str);
 
 #endif
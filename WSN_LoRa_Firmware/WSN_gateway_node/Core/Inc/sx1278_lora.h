@@ -18,6 +18,7 @@ https://semtech.my.salesforce.com/sfc/p/#E0000000JelG/a/2R0000001Rbr/6EfVZUorrpo
 #define TRANSMIT_MODE			3
 #define RXCONTIN_MODE			5
 #define RXSINGLE_MODE			6
+#define CAD_MODE				7
 
 
 //-------- BANDWIDTH ----------//
@@ -76,6 +77,7 @@ https://semtech.my.salesforce.com/sfc/p/#E0000000JelG/a/2R0000001Rbr/6EfVZUorrpo
 
 #define RegIrqFlags				0x12		//Interrupt flags
 #define RegRxNbBytes			0x13		//Number of payload bytes of latest packet received
+#define RegPktSnrValue			0x19		//SNR of the latest packet received (0.25 dB, signed)
 #define RegPktRssiValue			0x1A		//RSSI of the latest packet received (dBm)
 #define RegRssiValue			0x1A		//Current RSSI value (dBm)
 
@@ -89,6 +91,7 @@ https://semtech.my.salesforce.com/sfc/p/#E0000000JelG/a/2R0000001Rbr/6EfVZUorrpo
 
 #define RegFeiMsb				0x28		//Estimated frequency error MSB
 #define RegFeiLsb				0x2A		//Estimated frequency error LSB
+#define RegRssiWideband			0x2C		//Wideband RSSI (LSB used as random source)
 #define RegSyncWord				0x39
 #define RegDioMapping1			0x40
 #define RegDioMapping2			0x41
@@ -133,6 +136,7 @@ void LoRa_BurstWrite(LoRa* _LoRa, uint8_t address, uint8_t *pValue, uint8_t leng
 void LoRa_setMode(LoRa* _LoRa, int mode);
 void LoRa_reset(LoRa* _LoRa);
 void LoRa_setFrequency(LoRa* _LoRa, int freq);
+void LoRa_setFrequencyKHz(LoRa* _LoRa, uint32_t khz);
 void LoRa_setLowDaraRateOptimization(LoRa* _LoRa, uint8_t value);
 void LoRa_setAutoLDO(LoRa* _LoRa);
 void LoRa_setSpreadingFactor(LoRa* _LoRa, int SF);
@@ -141,8 +145,12 @@ void LoRa_setOCP(LoRa* _LoRa, uint8_t current);
 void LoRa_setTOMsb_setCRCon(LoRa* _LoRa);
 uint16_t LoRa_init(LoRa* _LoRa);
 int LoRa_getRSSI(LoRa* _LoRa);
+int LoRa_getSNR(LoRa* _LoRa);
+uint32_t LoRa_getRandom(LoRa* _LoRa);
+uint32_t LoRa_getTimeOnAir(LoRa* _LoRa, uint8_t length);
 uint8_t LoRa_transmit(LoRa* _LoRa, uint8_t* pData, uint8_t length, uint16_t timeout);
 uint8_t LoRa_receive(LoRa* _LoRa, uint8_t* data, uint8_t length);
+uint8_t LoRa_channelActivity(LoRa* _LoRa);
 
 
 #endif /* INC_SX1278_LORA_H_ */
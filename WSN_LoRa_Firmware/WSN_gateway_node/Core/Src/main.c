@@ -101,6 +101,14 @@ uint8_t initialize_lora() {
     if (init_result != LORA_OK) {
         return 0;
     }
+
+#if LORA_SEC_ENABLE
+    // --- Lớp bảo mật: khoá riêng của node, epoch bộ đếm (nhiễu máy thu làm epoch khi mất backup) ---
+    LoRaSec_Init(MY_GATEWAY_ID, LoRa_getRandom(&myLoRa));
+#if LORA_SEC_BENCHMARK
+    LoRaApp_Security_Benchmark(&myLoRa);
+#endif
+#endif
     printf("LoRa Init OK.");
     HAL_GPIO_WritePin(LED_PORT, LED_PIN, 1);
     return 1;
@@ -164,6 +172,7 @@ int main(void)
   printf("\r\n[GW] >>> INIT OK! START RECIEVING <<<\r\n");
 
   uint32_t last_queue_time = 0;
+  uint32_t last_air_time = 0;
 
   /* USER CODE END 2 */
 
@@ -176,13 +185,19 @@ int main(void)
 		loraRxDoneFlag = 0;
 		memset(rxBuffer, 0, sizeof(rxBuffer));
 
-		int len = LoRa_receive(&myLoRa, rxBuffer, sizeof(rxBuffer));
+		int len = LoRaApp_Receive(&myLoRa, rxBuffer, sizeof(rxBuffer));
 		if (len > 0) {
 			// Hàm xử lý bản tin GW nhận được (Đăng ký Relay hoặc Data Relay)
 			LoRaApp_Gateway_RxProcessing(&myLoRa, rxBuffer, len);
 		}
 	}
 
+	// GỬI ACK GỘP CHO RELAY (sau GW_ACK_HOLD_MS)
+	LoRaApp_Gateway_Task_FlushACKs(&myLoRa);
+
+	// LỊCH Δt: XẾP RELAY MỚI / GIẢI PHÓNG RELAY IM LẶNG
+	LoRaApp_Gateway_Task_Schedule(&myLoRa);
+
 	// XỬ LÝ LỆNH CẤU HÌNH TỪ UART (ESP32 GỬI XUỐNG)
 	if (cmdReadyFlag) {
 		cmdReadyFlag = 0; // Xóa cờ
@@ -198,6 +213,12 @@ int main(void)
 		last_queue_time = HAL_GetTick();
 	}
 
+	// THỐNG KÊ THỜI GIAN PHÁT (Mỗi 60s, chẩn đoán duty cycle)
+	if (HAL_GetTick() - last_air_time > 60000) {
+		LoRaApp_Airtime_Print();
+		last_air_time = HAL_GetTick();
+	}
+
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
@@ -0,0 +1,73 @@
+/*
+ * lora_sec.h
+ *
+ *  Mã hoá + xác thực bản tin (AES-128-CCM, tag rút gọn) cho mọi bản tin LoRa của ứng dụng
+ *  Bản tin sau khi niêm phong: [Func | Payload (mã hoá) | SrcID | Ctr (4B) | Tag (LORA_SEC_TAG_LEN)]
+ *  Func để nguyên (đưa vào nonce nên vẫn được xác thực), Ctr tăng dần theo từng node nguồn (chống phát lại)
+ */
+
+#ifndef INC_LORA_SEC_H_
+#define INC_LORA_SEC_H_
+
+#include "main.h"
+#include "sx1278_lora.h"
+
+#include "rtc.h"
+
+
+// --- CẤU HÌNH BẢO MẬT ---
+#define LORA_SEC_ENABLE				1			// 0: bản tin gửi/nhận nguyên văn (tương thích firmware cũ)
+#define LORA_SEC_TAG_LEN			4			// Tag CCM rút gọn (M = 4 byte: 2^-32 xác suất giả mạo mỗi lần thử)
+#define LORA_SEC_CTR_LEN			4			// Bộ đếm bản tin: [Epoch (16 bit) | Seq (16 bit)]
+#define LORA_SEC_BUMP_BITS			4			// Epoch = [Boot (12 bit) | Bump (4 bit)]: Bump tăng khi sang epoch mới không do khởi động
+#define LORA_SEC_OVERHEAD			(1 + LORA_SEC_CTR_LEN + LORA_SEC_TAG_LEN)	// Đuôi [SrcID | Ctr | Tag]
+#define LORA_SEC_MAX_PAYLOAD		(255 - LORA_SEC_OVERHEAD)	// Độ dài bản tin tối đa trước khi niêm phong
+
+// Khoá riêng mỗi node K_id = AES(Khoá chủ, [LORA_SEC_KDF_LABEL | id]), cấp qua lora_key.h (tools/lora_keygen.py, không commit):
+//  - LORA_SEC_MASTER_KEY: node giữ khoá chủ, dẫn xuất khoá của mọi node (Gateway; Relay cần nhận Sensor ngoài bảng)
+//  - LORA_SEC_KEY_TABLE: { {id, {16 byte}}, ... } khoá đã dẫn xuất, phần tử đầu là khoá của chính node,
+//    sau đó khoá các node cần mở bản tin. Sensor / Relay chỉ giữ bảng này -> lộ 1 node chỉ lộ các khoá trong bảng của nó
+// Không có lora_key.h: dùng lora_key.h.example (khoá phát triển công khai, chỉ để cây mã biên dịch được)
+#if __has_include("lora_key.h")
+#include "lora_key.h"
+#else
+#include "lora_key.h.example"
+#endif
+#if LORA_SEC_ENABLE && !defined(LORA_SEC_MASTER_KEY) && !defined(LORA_SEC_KEY_TABLE)
+#error "lora_key.h phải định nghĩa LORA_SEC_MASTER_KEY hoặc LORA_SEC_KEY_TABLE"
+#endif
+#define LORA_SEC_KDF_LABEL			0x574B		// 'WK'
+
+#define LORA_SEC_KEY_CACHE			4			// Số khoá node khác (đã mở rộng) giữ trong RAM
+#define LORA_SEC_BKP_DR_EPOCH		RTC_BKP_DR9	// Epoch bộ đếm, tăng mỗi lần khởi động
+#define LORA_SEC_LEASE_FLASH_ADDR	0x0800F800	// Trang Flash [Magic | Mốc epoch đã cấp | Epoch cuối đã nhận của ID 0..255] (trang 1 KB kề cuối, đã bỏ khỏi FLASH trong linker script)
+#define LORA_SEC_LEASE_MAGIC		0x4550		// "EP": trang mốc epoch hợp lệ
+#define LORA_SEC_LEASE_EPOCHS		256			// Mỗi lần ghi Flash cấp trước N epoch (mất backup -> tiếp tục từ mốc, bộ đếm không lùi)
+#define LORA_SEC_BENCHMARK			0			// In chi phí mã hoá (chu kỳ CPU, airtime) từng loại bản tin lúc khởi động
+
+// --- THỐNG KÊ ---
+typedef struct {
+	uint32_t sealed;					// Số bản tin đã niêm phong
+	uint32_t opened;					// Số bản tin mở thành công
+	uint32_t auth_fail;					// Sai tag (giả mạo / hỏng / khác khoá)
+	uint32_t no_key;					// Node nguồn không có trong bảng khoá (LORA_SEC_KEY_TABLE)
+	uint32_t replay;					// Đúng tag nhưng bộ đếm cũ (phát lại)
+	uint32_t lease_fail;				// Ghi trang Flash (mốc epoch / epoch đã nhận) lỗi
+	uint32_t new_epoch;					// Số lần sang epoch mới do node khác khởi động lại / LoRaSec_NewEpoch()
+	uint32_t seal_cycles;				// Chu kỳ CPU lần niêm phong gần nhất
+	uint32_t open_cycles;				// Chu kỳ CPU lần mở gần nhất
+	uint32_t seal_cycles_max;
+	uint32_t open_cycles_max;
+} LoRaSec_Stats_t;
+
+
+// --- HANDLE FUNCTION ---
+void LoRaSec_Init(uint8_t _myID, uint32_t _seed);
+uint8_t LoRaSec_Seal(uint8_t* _buf, uint8_t _len, uint8_t _size);
+uint8_t LoRaSec_Open(uint8_t* _buf, uint8_t _len);
+void LoRaSec_NewEpoch(void);
+void LoRaSec_GetStats(LoRaSec_Stats_t* _stats);
+void LoRaSec_Benchmark(LoRa* _lora, const char* _name, uint8_t _len);
+
+
+#endif /* INC_LORA_SEC_H_ */
@@ -0,0 +1,596 @@
+/*
+ * lora_sec.c
+ *
+ *  AES-128 phần mềm (bảng T 1 KB + xoay bit: phép xoay đi kèm lệnh EOR miễn phí trên Cortex-M3) + chế độ CCM
+ *  CCM chỉ dùng chiều mã hoá AES cho cả niêm phong lẫn mở -> không cần bảng giải mã
+ */
+
+#include <lora_sec.h>
+#include <stdio.h>
+#include <string.h>
+
+extern RTC_HandleTypeDef hrtc;
+
+#if LORA_SEC_ENABLE && defined(LORA_SEC_DEV_KEY)
+#warning "lora_sec: đang dùng khoá phát triển công khai (lora_key.h.example), sinh lora_key.h trước khi triển khai"
+#endif
+
+#define SEC_NONCE_LEN		13						// CCM: L = 2 byte độ dài -> nonce 13 byte
+#define SEC_FLAGS_B0		(((LORA_SEC_TAG_LEN - 2) / 2) << 3 | 1)	// Khối B0: không AAD, M, L - 1
+#define SEC_FLAGS_CTR		1						// Khối A_i: L - 1
+#ifdef LORA_SEC_MASTER_KEY
+#define SEC_KEY_MODE		"master key"			// Dẫn xuất khoá mọi node
+#else
+#define SEC_KEY_MODE		"key table"				// Chỉ các khoá trong LORA_SEC_KEY_TABLE
+#endif
+
+
+// =======================================
+// --- AES-128 (chỉ chiều mã hoá) ---
+// =======================================
+
+static const uint8_t aes_sbox[256] = {
+	0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+	0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+	0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+	0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+	0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+	0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+	0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+	0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+	0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+	0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+	0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+	0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+	0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+	0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+	0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+	0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+static const uint32_t aes_te0[256] = {
+	0xC66363A5UL, 0xF87C7C84UL, 0xEE777799UL, 0xF67B7B8DUL,
+	0xFFF2F20DUL, 0xD66B6BBDUL, 0xDE6F6FB1UL, 0x91C5C554UL,
+	0x60303050UL, 0x02010103UL, 0xCE6767A9UL, 0x562B2B7DUL,
+	0xE7FEFE19UL, 0xB5D7D762UL, 0x4DABABE6UL, 0xEC76769AUL,
+	0x8FCACA45UL, 0x1F82829DUL, 0x89C9C940UL, 0xFA7D7D87UL,
+	0xEFFAFA15UL, 0xB25959EBUL, 0x8E4747C9UL, 0xFBF0F00BUL,
+	0x41ADADECUL, 0xB3D4D467UL, 0x5FA2A2FDUL, 0x45AFAFEAUL,
+	0x239C9CBFUL, 0x53A4A4F7UL, 0xE4727296UL, 0x9BC0C05BUL,
+	0x75B7B7C2UL, 0xE1FDFD1CUL, 0x3D9393AEUL, 0x4C26266AUL,
+	0x6C36365AUL, 0x7E3F3F41UL, 0xF5F7F702UL, 0x83CCCC4FUL,
+	0x6834345CUL, 0x51A5A5F4UL, 0xD1E5E534UL, 0xF9F1F108UL,
+	0xE2717193UL, 0xABD8D873UL, 0x62313153UL, 0x2A15153FUL,
+	0x0804040CUL, 0x95C7C752UL, 0x46232365UL, 0x9DC3C35EUL,
+	0x30181828UL, 0x379696A1UL, 0x0A05050FUL, 0x2F9A9AB5UL,
+	0x0E070709UL, 0x24121236UL, 0x1B80809BUL, 0xDFE2E23DUL,
+	0xCDEBEB26UL, 0x4E272769UL, 0x7FB2B2CDUL, 0xEA75759FUL,
+	0x1209091BUL, 0x1D83839EUL, 0x582C2C74UL, 0x341A1A2EUL,
+	0x361B1B2DUL, 0xDC6E6EB2UL, 0xB45A5AEEUL, 0x5BA0A0FBUL,
+	0xA45252F6UL, 0x763B3B4DUL, 0xB7D6D661UL, 0x7DB3B3CEUL,
+	0x5229297BUL, 0xDDE3E33EUL, 0x5E2F2F71UL, 0x13848497UL,
+	0xA65353F5UL, 0xB9D1D168UL, 0x00000000UL, 0xC1EDED2CUL,
+	0x40202060UL, 0xE3FCFC1FUL, 0x79B1B1C8UL, 0xB65B5BEDUL,
+	0xD46A6ABEUL, 0x8DCBCB46UL, 0x67BEBED9UL, 0x7239394BUL,
+	0x944A4ADEUL, 0x984C4CD4UL, 0xB05858E8UL, 0x85CFCF4AUL,
+	0xBBD0D06BUL, 0xC5EFEF2AUL, 0x4FAAAAE5UL, 0xEDFBFB16UL,
+	0x864343C5UL, 0x9A4D4DD7UL, 0x66333355UL, 0x11858594UL,
+	0x8A4545CFUL, 0xE9F9F910UL, 0x04020206UL, 0xFE7F7F81UL,
+	0xA05050F0UL, 0x783C3C44UL, 0x259F9FBAUL, 0x4BA8A8E3UL,
+	0xA25151F3UL, 0x5DA3A3FEUL, 0x804040C0UL, 0x058F8F8AUL,
+	0x3F9292ADUL, 0x219D9DBCUL, 0x70383848UL, 0xF1F5F504UL,
+	0x63BCBCDFUL, 0x77B6B6C1UL, 0xAFDADA75UL, 0x42212163UL,
+	0x20101030UL, 0xE5FFFF1AUL, 0xFDF3F30EUL, 0xBFD2D26DUL,
+	0x81CDCD4CUL, 0x180C0C14UL, 0x26131335UL, 0xC3ECEC2FUL,
+	0xBE5F5FE1UL, 0x359797A2UL, 0x884444CCUL, 0x2E171739UL,
+	0x93C4C457UL, 0x55A7A7F2UL, 0xFC7E7E82UL, 0x7A3D3D47UL,
+	0xC86464ACUL, 0xBA5D5DE7UL, 0x3219192BUL, 0xE6737395UL,
+	0xC06060A0UL, 0x19818198UL, 0x9E4F4FD1UL, 0xA3DCDC7FUL,
+	0x44222266UL, 0x542A2A7EUL, 0x3B9090ABUL, 0x0B888883UL,
+	0x8C4646CAUL, 0xC7EEEE29UL, 0x6BB8B8D3UL, 0x2814143CUL,
+	0xA7DEDE79UL, 0xBC5E5EE2UL, 0x160B0B1DUL, 0xADDBDB76UL,
+	0xDBE0E03BUL, 0x64323256UL, 0x743A3A4EUL, 0x140A0A1EUL,
+	0x924949DBUL, 0x0C06060AUL, 0x4824246CUL, 0xB85C5CE4UL,
+	0x9FC2C25DUL, 0xBDD3D36EUL, 0x43ACACEFUL, 0xC46262A6UL,
+	0x399191A8UL, 0x319595A4UL, 0xD3E4E437UL, 0xF279798BUL,
+	0xD5E7E732UL, 0x8BC8C843UL, 0x6E373759UL, 0xDA6D6DB7UL,
+	0x018D8D8CUL, 0xB1D5D564UL, 0x9C4E4ED2UL, 0x49A9A9E0UL,
+	0xD86C6CB4UL, 0xAC5656FAUL, 0xF3F4F407UL, 0xCFEAEA25UL,
+	0xCA6565AFUL, 0xF47A7A8EUL, 0x47AEAEE9UL, 0x10080818UL,
+	0x6FBABAD5UL, 0xF0787888UL, 0x4A25256FUL, 0x5C2E2E72UL,
+	0x381C1C24UL, 0x57A6A6F1UL, 0x73B4B4C7UL, 0x97C6C651UL,
+	0xCBE8E823UL, 0xA1DDDD7CUL, 0xE874749CUL, 0x3E1F1F21UL,
+	0x964B4BDDUL, 0x61BDBDDCUL, 0x0D8B8B86UL, 0x0F8A8A85UL,
+	0xE0707090UL, 0x7C3E3E42UL, 0x71B5B5C4UL, 0xCC6666AAUL,
+	0x904848D8UL, 0x06030305UL, 0xF7F6F601UL, 0x1C0E0E12UL,
+	0xC26161A3UL, 0x6A35355FUL, 0xAE5757F9UL, 0x69B9B9D0UL,
+	0x17868691UL, 0x99C1C158UL, 0x3A1D1D27UL, 0x279E9EB9UL,
+	0xD9E1E138UL, 0xEBF8F813UL, 0x2B9898B3UL, 0x22111133UL,
+	0xD26969BBUL, 0xA9D9D970UL, 0x078E8E89UL, 0x339494A7UL,
+	0x2D9B9BB6UL, 0x3C1E1E22UL, 0x15878792UL, 0xC9E9E920UL,
+	0x87CECE49UL, 0xAA5555FFUL, 0x50282878UL, 0xA5DFDF7AUL,
+	0x038C8C8FUL, 0x59A1A1F8UL, 0x09898980UL, 0x1A0D0D17UL,
+	0x65BFBFDAUL, 0xD7E6E631UL, 0x844242C6UL, 0xD06868B8UL,
+	0x824141C3UL, 0x299999B0UL, 0x5A2D2D77UL, 0x1E0F0F11UL,
+	0x7BB0B0CBUL, 0xA85454FCUL, 0x6DBBBBD6UL, 0x2C16163AUL
+};
+
+#define AES_ROR(x, n)		(((x) >> (n)) | ((x) << (32 - (n))))
+#define AES_TE(a, b, c, d)	(aes_te0[(a) >> 24] ^ AES_ROR(aes_te0[((b) >> 16) & 0xFF], 8) \
+							^ AES_ROR(aes_te0[((c) >> 8) & 0xFF], 16) ^ AES_ROR(aes_te0[(d) & 0xFF], 24))
+#define AES_SB(a, b, c, d)	(((uint32_t)aes_sbox[(a) >> 24] << 24) | ((uint32_t)aes_sbox[((b) >> 16) & 0xFF] << 16) \
+							| ((uint32_t)aes_sbox[((c) >> 8) & 0xFF] << 8) | aes_sbox[(d) & 0xFF])
+
+static uint32_t Aes_Load(const uint8_t* _p) {
+	return ((uint32_t)_p[0] << 24) | ((uint32_t)_p[1] << 16) | ((uint32_t)_p[2] << 8) | _p[3];
+}
+
+static void Aes_Store(uint8_t* _p, uint32_t _v) {
+	_p[0] = _v >> 24;
+	_p[1] = _v >> 16;
+	_p[2] = _v >> 8;
+	_p[3] = _v;
+}
+
+
+/*
+ * @brief:  Mở rộng khoá AES-128 thành 11 khoá vòng (44 word)
+ * @param:
+ * 			_rk: Nơi ghi khoá vòng
+ * 			_key: Khoá 16 byte
+ */
+static void Aes_Expand(uint32_t* _rk, const uint8_t* _key) {
+	uint8_t rcon = 0x01;
+
+	for (uint8_t i = 0; i < 4; i++) _rk[i] = Aes_Load(&_key[4 * i]);
+	for (uint8_t i = 4; i < 44; i++) {
+		uint32_t t = _rk[i - 1];
+		if ((i & 3) == 0) {
+			t = ((uint32_t)aes_sbox[(t >> 16) & 0xFF] << 24) | ((uint32_t)aes_sbox[(t >> 8) & 0xFF] << 16)
+				| ((uint32_t)aes_sbox[t & 0xFF] << 8) | aes_sbox[t >> 24];
+			t ^= (uint32_t)rcon << 24;
+			rcon = (rcon << 1) ^ ((rcon & 0x80) ? 0x1B : 0x00);
+		}
+		_rk[i] = _rk[i - 4] ^ t;
+	}
+}
+
+
+/*
+ * @brief:  Mã hoá 1 khối AES-128 (_in và _out có thể trùng nhau)
+ * @param:
+ * 			_rk: Khoá vòng (Aes_Expand)
+ * 			_in: Khối rõ 16 byte
+ * 			_out: Khối mã 16 byte
+ */
+static void Aes_Encrypt(const uint32_t* _rk, const uint8_t* _in, uint8_t* _out) {
+	uint32_t s0 = Aes_Load(&_in[0]) ^ _rk[0];
+	uint32_t s1 = Aes_Load(&_in[4]) ^ _rk[1];
+	uint32_t s2 = Aes_Load(&_in[8]) ^ _rk[2];
+	uint32_t s3 = Aes_Load(&_in[12]) ^ _rk[3];
+	uint32_t t0, t1, t2, t3;
+
+	for (uint8_t r = 1; r < 10; r++) {
+		_rk += 4;
+		t0 = AES_TE(s0, s1, s2, s3) ^ _rk[0];
+		t1 = AES_TE(s1, s2, s3, s0) ^ _rk[1];
+		t2 = AES_TE(s2, s3, s0, s1) ^ _rk[2];
+		t3 = AES_TE(s3, s0, s1, s2) ^ _rk[3];
+		s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+	}
+	_rk += 4;
+
+	Aes_Store(&_out[0], AES_SB(s0, s1, s2, s3) ^ _rk[0]);
+	Aes_Store(&_out[4], AES_SB(s1, s2, s3, s0) ^ _rk[1]);
+	Aes_Store(&_out[8], AES_SB(s2, s3, s0, s1) ^ _rk[2]);
+	Aes_Store(&_out[12], AES_SB(s3, s0, s1, s2) ^ _rk[3]);
+}
+
+
+// =======================================
+// --- CCM ---
+// =======================================
+
+/*
+ * @brief:  AES-CCM không AAD (RFC 3610, L = 2): tính CBC-MAC trên bản rõ và mã hoá CTR tại chỗ
+ * @param:
+ * 			_rk: Khoá vòng
+ * 			_nonce: Nonce SEC_NONCE_LEN byte
+ * 			_data: Dữ liệu (mã hoá / giải mã tại chỗ)
+ * 			_len: Độ dài dữ liệu
+ * 			_tag: Nơi ghi tag LORA_SEC_TAG_LEN byte
+ * 			_encrypt: 1: _data là bản rõ, 0: _data là bản mã
+ */
+static void Sec_Ccm(const uint32_t* _rk, const uint8_t* _nonce, uint8_t* _data, uint8_t _len,
+					uint8_t* _tag, uint8_t _encrypt) {
+	uint8_t x[16], a[16], s[16];
+
+	x[0] = SEC_FLAGS_B0;
+	memcpy(&x[1], _nonce, SEC_NONCE_LEN);
+	x[14] = 0;
+	x[15] = _len;
+	Aes_Encrypt(_rk, x, x);
+
+	a[0] = SEC_FLAGS_CTR;
+	memcpy(&a[1], _nonce, SEC_NONCE_LEN);
+	a[14] = 0;
+	a[15] = 0;
+
+	for (uint16_t off = 0; off < _len; off += 16) {
+		uint8_t n = (_len - off < 16) ? (_len - off) : 16;
+		a[15]++;
+		Aes_Encrypt(_rk, a, s);
+		for (uint8_t j = 0; j < n; j++) {
+			if (_encrypt) {
+				x[j] ^= _data[off + j];
+				_data[off + j] ^= s[j];
+			} else {
+				_data[off + j] ^= s[j];
+				x[j] ^= _data[off + j];
+			}
+		}
+		Aes_Encrypt(_rk, x, x);
+	}
+
+	a[15] = 0;
+	Aes_Encrypt(_rk, a, s);
+	for (uint8_t j = 0; j < LORA_SEC_TAG_LEN; j++) _tag[j] = x[j] ^ s[j];
+}
+
+
+// =======================================
+// --- Khoá, bộ đếm & chống phát lại ---
+// =======================================
+
+typedef struct {
+	uint8_t used;
+	uint8_t id;
+	uint32_t rk[44];
+} Sec_Key_t;
+
+static uint8_t sec_my_id = 0;
+static uint32_t sec_ctr = 0;
+#ifdef LORA_SEC_MASTER_KEY
+static uint32_t sec_master_rk[44];
+#else
+typedef struct {
+	uint8_t id;
+	uint8_t key[16];
+} Sec_TableKey_t;
+
+static const Sec_TableKey_t sec_key_table[] = LORA_SEC_KEY_TABLE;
+#endif
+static uint32_t sec_own_rk[44];
+static uint8_t sec_own_valid = 0;		// Có khoá của chính node (bảng khoá có thể thiếu)
+static Sec_Key_t sec_keys[LORA_SEC_KEY_CACHE];
+static uint8_t sec_key_next = 0;
+static uint16_t sec_lease_end = 0;		// Epoch đầu tiên chưa được cấp trong Flash
+static uint8_t sec_new_epoch = 0;		// Bản tin kế tiếp sang epoch mới (bỏ phần Seq còn lại của epoch đang dùng)
+// Bộ đếm lớn nhất đã nhận của từng ID nguồn (đủ cả không gian ID 8 bit, 1 KB): không node nào bị quên / thay chỗ
+// 0: chưa nhận bản tin nào (bộ đếm hợp lệ luôn >= 1 << 16)
+// Phần epoch lưu trong trang Flash mỗi khi đổi: khởi động lại chỉ nhận epoch mới hơn epoch đã lưu
+static uint32_t sec_replay_last[256];
+static LoRaSec_Stats_t sec_stats;
+
+
+/*
+ * @brief:  Lấy khoá riêng của 1 node (dẫn xuất từ khoá chủ hoặc tra bảng khoá) và mở rộng thành khoá vòng
+ * @param:
+ * 			_id: ID node
+ * 			_rk: Nơi ghi khoá vòng
+ * @return: 1 nếu có khoá của node, 0 nếu node không có trong bảng khoá
+ */
+static uint8_t Sec_DeriveKey(uint8_t _id, uint32_t* _rk) {
+#ifdef LORA_SEC_MASTER_KEY
+	uint8_t blk[16] = { LORA_SEC_KDF_LABEL >> 8, LORA_SEC_KDF_LABEL & 0xFF };
+
+	blk[15] = _id;
+	Aes_Encrypt(sec_master_rk, blk, blk);
+	Aes_Expand(_rk, blk);
+	memset(blk, 0, sizeof(blk));
+	return 1;
+#else
+	for (uint8_t i = 0; i < sizeof(sec_key_table) / sizeof(sec_key_table[0]); i++) {
+		if (sec_key_table[i].id == _id) {
+			Aes_Expand(_rk, sec_key_table[i].key);
+			return 1;
+		}
+	}
+	return 0;
+#endif
+}
+
+
+/*
+ * @brief:  Lấy khoá vòng của node nguồn (cache, thay vòng tròn khi đầy)
+ * @param:	_id: ID node nguồn
+ * @return: Con trỏ khoá vòng, NULL nếu không có khoá của node
+ */
+static const uint32_t* Sec_KeyFor(uint8_t _id) {
+	if (_id == sec_my_id) return sec_own_valid ? sec_own_rk : NULL;
+
+	for (uint8_t i = 0; i < LORA_SEC_KEY_CACHE; i++) {
+		if (sec_keys[i].used && sec_keys[i].id == _id) return sec_keys[i].rk;
+	}
+
+	Sec_Key_t* k = &sec_keys[sec_key_next];
+	if (!Sec_DeriveKey(_id, k->rk)) return NULL;
+	sec_key_next = (sec_key_next + 1) % LORA_SEC_KEY_CACHE;
+	k->used = 1;
+	k->id = _id;
+	return k->rk;
+}
+
+
+static void Sec_Nonce(uint8_t* _nonce, uint8_t _src, uint32_t _ctr, uint8_t _func) {
+	memset(_nonce, 0, SEC_NONCE_LEN);
+	_nonce[0] = _src;
+	Aes_Store(&_nonce[1], _ctr);
+	_nonce[5] = _func;
+}
+
+
+static void Sec_CycleStart(void) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+
+/*
+ * @brief:  Ghi trang Flash: mốc epoch mới (mọi epoch < _end coi như đã dùng) và epoch cuối đã nhận của từng ID nguồn
+ * 			Magic ghi sau cùng: mất điện giữa chừng -> trang không hợp lệ, lần khởi động sau cấp lại từ seed
+ * @param:	_end: Epoch đầu tiên chưa được cấp
+ * @return: 1 nếu ghi thành công
+ */
+static uint8_t Sec_PageWrite(uint16_t _end) {
+	FLASH_EraseInitTypeDef erase;
+	uint32_t page_error = 0;
+	uint8_t ok = 0;
+
+	HAL_FLASH_Unlock();
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+	erase.Banks = FLASH_BANK_1;
+	erase.PageAddress = LORA_SEC_LEASE_FLASH_ADDR;
+	erase.NbPages = 1;
+	if (HAL_FLASHEx_Erase(&erase, &page_error) == HAL_OK
+			&& HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, LORA_SEC_LEASE_FLASH_ADDR + 2, _end) == HAL_OK) {
+		ok = 1;
+		// Ô đã xoá (0xFFFF) = chưa nhận từ ID này, chỉ ghi các ID đã nhận
+		for (uint16_t i = 0; i < 256 && ok; i++) {
+			uint16_t epoch = sec_replay_last[i] >> 16;
+			if (epoch != 0 && HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, LORA_SEC_LEASE_FLASH_ADDR + 4 + 2 * i, epoch) != HAL_OK) ok = 0;
+		}
+		if (ok && HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, LORA_SEC_LEASE_FLASH_ADDR, LORA_SEC_LEASE_MAGIC) != HAL_OK) ok = 0;
+	}
+	HAL_FLASH_Lock();
+
+	if (ok) {
+		sec_lease_end = _end;
+	} else {
+		sec_stats.lease_fail++;
+		printf("[SEC] Epoch page write failed (end %u)\r\n", _end);
+	}
+	return ok;
+}
+
+
+/*
+ * @brief:  Đảm bảo epoch đã nằm trong khoảng được cấp ở Flash, cấp thêm LORA_SEC_LEASE_EPOCHS nếu chưa
+ * @param:	_epoch: Epoch sắp dùng
+ */
+static void Sec_LeaseCover(uint16_t _epoch) {
+	if (_epoch < sec_lease_end) return;
+
+	uint32_t end = (uint32_t)_epoch + LORA_SEC_LEASE_EPOCHS;
+	Sec_PageWrite(end > 0xFFFF ? 0xFFFF : (uint16_t)end);
+}
+
+
+/*
+ * @brief:  Khởi tạo lớp bảo mật: khoá riêng, bộ đếm (epoch từ backup, sang Boot kế tiếp mỗi lần khởi động)
+ * 			Mất backup (VBAT) -> epoch tiếp tục từ mốc đã cấp trong Flash: bộ đếm không bao giờ lùi,
+ * 			bên nhận không cần cơ chế nhận lại node khởi động lại
+ * 			Chống phát lại qua reset: chỉ nhận từ mỗi node nguồn epoch mới hơn epoch đã lưu trong Flash.
+ * 			Node nguồn thấy Boot của node này tăng (hoặc lỡ ACK, LoRaSec_NewEpoch) -> sang epoch mới
+ * @param:
+ * 			_myID: ID node này
+ * 			_seed: Số ngẫu nhiên (epoch đầu khi trang mốc Flash còn trống, vd. sau khi xoá toàn bộ chip)
+ */
+void LoRaSec_Init(uint8_t _myID, uint32_t _seed) {
+#ifdef LORA_SEC_MASTER_KEY
+	static const uint8_t master[16] = LORA_SEC_MASTER_KEY;
+#endif
+	const volatile uint16_t* lease = (const volatile uint16_t*)LORA_SEC_LEASE_FLASH_ADDR;
+	uint16_t epoch = HAL_RTCEx_BKUPRead(&hrtc, LORA_SEC_BKP_DR_EPOCH);
+
+	sec_my_id = _myID;
+#ifdef LORA_SEC_MASTER_KEY
+	Aes_Expand(sec_master_rk, master);
+#endif
+	sec_own_valid = Sec_DeriveKey(_myID, sec_own_rk);
+	if (!sec_own_valid) printf("[SEC] No key for node 0x%02X in LORA_SEC_KEY_TABLE, TX disabled!\r\n", _myID);
+	memset(sec_keys, 0, sizeof(sec_keys));
+	memset(sec_replay_last, 0, sizeof(sec_replay_last));
+	memset(&sec_stats, 0, sizeof(sec_stats));
+	sec_new_epoch = 0;
+
+	sec_lease_end = (lease[0] == LORA_SEC_LEASE_MAGIC) ? lease[1] : 0;
+	if (sec_lease_end != 0) {
+		// Epoch cuối đã nhận trước reset: coi như đã dùng hết, bản tin cũ không phát lại được
+		for (uint16_t i = 0; i < 256; i++) {
+			uint16_t last = lease[2 + i];
+			if (last != 0 && last != 0xFFFF) sec_replay_last[i] = ((uint32_t)last << 16) | 0xFFFF;
+		}
+	}
+	if (epoch != 0) {
+		epoch = (epoch | ((1 << LORA_SEC_BUMP_BITS) - 1)) + 1;	// Backup còn: Boot kế tiếp, Bump = 0
+	} else if (sec_lease_end != 0) {
+		epoch = sec_lease_end;					// Mất backup: epoch đầu tiên chưa cấp
+	} else {
+		epoch = (uint16_t)((_seed & 0x7FFF) | (1 << LORA_SEC_BUMP_BITS));	// Trang mốc trống: chừa nửa trên cho các lần cấp sau
+	}
+	if (epoch == 0) epoch = 1 << LORA_SEC_BUMP_BITS;
+	Sec_LeaseCover(epoch);
+	HAL_RTCEx_BKUPWrite(&hrtc, LORA_SEC_BKP_DR_EPOCH, epoch);
+	sec_ctr = (uint32_t)epoch << 16;
+
+	Sec_CycleStart();
+	printf("[SEC] AES-128-CCM, tag %d B, overhead %d B/frame, epoch %u, %s\r\n", LORA_SEC_TAG_LEN, LORA_SEC_OVERHEAD, epoch, SEC_KEY_MODE);
+#ifdef LORA_SEC_DEV_KEY
+	printf("[SEC] WARNING: public development key (lora_key.h.example), do not deploy!\r\n");
+#endif
+}
+
+
+/*
+ * @brief:  Niêm phong bản tin tại chỗ: mã hoá phần sau Func, nối đuôi [SrcID | Ctr | Tag]
+ * @param:
+ * 			_buf: Bản tin (Func ở byte 0)
+ * 			_len: Độ dài bản tin
+ * 			_size: Kích thước buffer (>= _len + LORA_SEC_OVERHEAD)
+ * @return: Độ dài sau niêm phong, 0 nếu không đủ chỗ
+ */
+uint8_t LoRaSec_Seal(uint8_t* _buf, uint8_t _len, uint8_t _size) {
+	uint8_t nonce[SEC_NONCE_LEN];
+	uint32_t start = DWT->CYCCNT;
+
+	if (!sec_own_valid || _len == 0 || _len > LORA_SEC_MAX_PAYLOAD || _len + LORA_SEC_OVERHEAD > _size) return 0;
+
+	if (sec_new_epoch) {
+		sec_new_epoch = 0;
+		// Bên nhận có thể đã chặn cả epoch đang dùng -> bỏ phần Seq còn lại (epoch chưa dùng thì giữ)
+		if ((sec_ctr & 0xFFFF) != 0) {
+			sec_ctr |= 0xFFFF;
+			sec_stats.new_epoch++;
+		}
+	}
+	sec_ctr++;
+	if ((sec_ctr & 0xFFFF) == 0) {
+		// Hết Seq trong epoch: lưu epoch mới để lần khởi động sau không quay lại bộ đếm đã dùng
+		if ((sec_ctr >> 16) == 0) sec_ctr = 1UL << 16;
+		Sec_LeaseCover(sec_ctr >> 16);
+		HAL_RTCEx_BKUPWrite(&hrtc, LORA_SEC_BKP_DR_EPOCH, sec_ctr >> 16);
+		sec_ctr++;							// Seq 0 không phát: đánh dấu epoch chưa dùng
+	}
+
+	Sec_Nonce(nonce, sec_my_id, sec_ctr, _buf[0]);
+	_buf[_len] = sec_my_id;
+	Aes_Store(&_buf[_len + 1], sec_ctr);
+	Sec_Ccm(sec_own_rk, nonce, &_buf[1], _len - 1, &_buf[_len + 1 + LORA_SEC_CTR_LEN], 1);
+
+	sec_stats.sealed++;
+	sec_stats.seal_cycles = DWT->CYCCNT - start;
+	if (sec_stats.seal_cycles > sec_stats.seal_cycles_max) sec_stats.seal_cycles_max = sec_stats.seal_cycles;
+	return _len + LORA_SEC_OVERHEAD;
+}
+
+
+/*
+ * @brief:  Mở bản tin tại chỗ: kiểm tra tag, giải mã, kiểm tra bộ đếm của node nguồn
+ * @param:
+ * 			_buf: Bản tin nhận được
+ * 			_len: Độ dài bản tin
+ * 			_replay: 1: kiểm tra chống phát lại
+ * @return: Độ dài bản tin gốc, 0 nếu sai tag / phát lại / quá ngắn
+ */
+static uint8_t Sec_Open(uint8_t* _buf, uint8_t _len, uint8_t _replay) {
+	uint8_t nonce[SEC_NONCE_LEN];
+	uint8_t tag[LORA_SEC_TAG_LEN];
+	uint8_t diff = 0;
+	uint32_t start = DWT->CYCCNT;
+
+	if (_len < 1 + LORA_SEC_OVERHEAD) return 0;
+
+	uint8_t plain_len = _len - LORA_SEC_OVERHEAD;
+	uint8_t src = _buf[plain_len];
+	uint32_t ctr = Aes_Load(&_buf[plain_len + 1]);
+	const uint8_t* rx_tag = &_buf[plain_len + 1 + LORA_SEC_CTR_LEN];
+
+	const uint32_t* rk = Sec_KeyFor(src);
+	if (rk == NULL) {
+		sec_stats.no_key++;
+		return 0;
+	}
+
+	Sec_Nonce(nonce, src, ctr, _buf[0]);
+	Sec_Ccm(rk, nonce, &_buf[1], plain_len - 1, tag, 0);
+	for (uint8_t j = 0; j < LORA_SEC_TAG_LEN; j++) diff |= tag[j] ^ rx_tag[j];
+
+	sec_stats.open_cycles = DWT->CYCCNT - start;
+	if (sec_stats.open_cycles > sec_stats.open_cycles_max) sec_stats.open_cycles_max = sec_stats.open_cycles;
+
+	if (diff) {
+		sec_stats.auth_fail++;
+		return 0;
+	}
+
+	if (_replay) {
+		uint16_t last_epoch = sec_replay_last[src] >> 16;
+
+		if (ctr <= sec_replay_last[src]) {
+			sec_stats.replay++;
+			return 0;
+		}
+		sec_replay_last[src] = ctr;
+		if ((ctr >> 16) != last_epoch) {
+			// Node nguồn khởi động lại (Boot tăng): nó đã chặn epoch đang dùng của node này -> sang epoch mới
+			// Chỉ Bump tăng thì không, tránh 2 node đẩy epoch của nhau mãi
+			if (last_epoch != 0 && (ctr >> (16 + LORA_SEC_BUMP_BITS)) != (last_epoch >> LORA_SEC_BUMP_BITS)) sec_new_epoch = 1;
+			// Lưu epoch mới (hiếm: node nguồn khởi động lại / sang epoch mới) để reset không mở lại epoch cũ
+			Sec_PageWrite(sec_lease_end);
+		}
+	}
+
+	sec_stats.opened++;
+	return plain_len;
+}
+
+
+uint8_t LoRaSec_Open(uint8_t* _buf, uint8_t _len) {
+	return Sec_Open(_buf, _len, 1);
+}
+
+
+/*
+ * @brief:  Sang epoch mới ở bản tin kế tiếp
+ * 			Gọi khi bên nhận có thể vừa khởi động lại mà chưa phát gì (vd. Relay lỡ ACK của GW nhiều lần liên tiếp):
+ * 			bên nhận đã chặn epoch đang dùng, bản tin sau trong epoch này đều bị coi là phát lại
+ */
+void LoRaSec_NewEpoch(void) {
+	sec_new_epoch = 1;
+}
+
+
+/*
+ * @brief:  Đọc thống kê lớp bảo mật
+ * @param:	_stats: Nơi ghi thống kê
+ */
+void LoRaSec_GetStats(LoRaSec_Stats_t* _stats) {
+	*_stats = sec_stats;
+}
+
+
+/*
+ * @brief:  Đo chi phí 1 loại bản tin: chu kỳ CPU niêm phong / mở (khoá đã có trong cache) và airtime tăng thêm
+ * @param:
+ * 			_lora: Con trỏ struct LoRa (cấu hình SF/BW để tính time-on-air)
+ * 			_name: Tên loại bản tin
+ * 			_len: Độ dài bản tin gốc
+ */
+void LoRaSec_Benchmark(LoRa* _lora, const char* _name, uint8_t _len) {
+	uint8_t buf[255];
+	uint32_t mhz = SystemCoreClock / 1000000;
+
+	if (_len == 0 || _len > LORA_SEC_MAX_PAYLOAD) return;
+	for (uint8_t i = 0; i < _len; i++) buf[i] = i;
+
+	uint8_t len = LoRaSec_Seal(buf, _len, sizeof(buf));
+	uint32_t seal = sec_stats.seal_cycles;
+	uint8_t ok = (Sec_Open(buf, len, 0) == _len);
+	uint32_t open = sec_stats.open_cycles;
+	uint32_t toa = LoRa_getTimeOnAir(_lora, _len);
+	uint32_t toa_sec = LoRa_getTimeOnAir(_lora, len);
+
+	printf("[SEC] %-10s %3u B -> %3u B | seal %5lu cyc (%4lu us), open %5lu cyc (%4lu us)%s | ToA %lu -> %lu ms (+%lu)\r\n",
+			_name, _len, len, seal, seal / mhz, open, open / mhz, ok ? "" : " FAIL", toa, toa_sec, toa_sec - toa);
+}
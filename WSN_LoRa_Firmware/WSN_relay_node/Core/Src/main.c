@@ -54,7 +54,7 @@ extern uint16_t TOTAL_CYCLE_SEC;
 
 LoRa myLoRa;
 
-uint8_t rxBuffer[128];
+uint8_t rxBuffer[256];
 uint8_t txBuffer[128];
 
 volatile uint8_t loraRxDoneFlag = 0;
@@ -98,6 +98,14 @@ uint8_t initialize_lora() {
     if (init_result != LORA_OK) {
         return 0;
     }
+
+#if LORA_SEC_ENABLE
+    // --- Lớp bảo mật: khoá riêng của node, epoch bộ đếm (nhiễu máy thu làm epoch khi mất backup) ---
+    LoRaSec_Init(MY_RELAY_ID, LoRa_getRandom(&myLoRa));
+#if LORA_SEC_BENCHMARK
+    LoRaApp_Security_Benchmark(&myLoRa);
+#endif
+#endif
     printf("LoRa Init OK. Node ID: %s\r\n", MY_RELAY_ID);
     HAL_GPIO_WritePin(LED_PORT, LED_PIN, 1);
     return 1;
@@ -167,37 +175,45 @@ int main(void)
 	  //Reset struct quản lý dữ liệu
 	  LoRaApp_Relay_Init();
 
-	  //TASK 1: GỬI ACK tới Sensor node đăng ký pha trước (Timeout: RELAY_ACK_WINDOW_MS)
-	  printf("[RELAY] Sending ACK (%d ms)...\r\n", RELAY_ACK_WINDOW_MS);
-	  LoRaApp_Relay_Task_SendACKs(&myLoRa, MY_RELAY_ID, &ackQueue);
+	  //Beacon đầu chu kỳ: mốc TDMA cho Sensor + bitmap ACK data chu kỳ trước
+	  LoRaApp_Relay_Task_SendBeacon(&myLoRa, MY_RELAY_ID);
 
 
-	  //TASK 2: Lắng nghe gói tin tới (Timeout: RELAY_RX_WINDOW_MS)
+	  //TASK 1: Lắng nghe gói tin tới ngay sau Beacon (Timeout: theo số slot TDMA)
 	  uint32_t start_rx = HAL_GetTick();
-	  printf("[RELAY] Listening TX (%d ms)...\r\n", RELAY_RX_WINDOW_MS);
-	  while (HAL_GetTick() - start_rx < RELAY_RX_WINDOW_MS) {
+	  uint32_t rx_window = LoRaApp_Relay_GetRxWindowMs();
+	  printf("[RELAY] Listening TX (%lu ms)...\r\n", rx_window);
+	  while (HAL_GetTick() - start_rx < rx_window && !LoRaApp_Relay_RxComplete()) {
 	            if (loraRxDoneFlag) {
 	                loraRxDoneFlag = 0;
 	                memset(rxBuffer, 0, sizeof(rxBuffer));
-	                int len = LoRa_receive(&myLoRa, rxBuffer, sizeof(rxBuffer)-1);
+	                int len = LoRaApp_Receive(&myLoRa, rxBuffer, sizeof(rxBuffer)-1);
 	                if (len > 0) {
-	                    LoRaApp_Relay_RxProcessing(&myLoRa, rxBuffer, MY_RELAY_ID, &ackQueue);
+	                    LoRaApp_Relay_RxProcessing(&myLoRa, rxBuffer, (uint8_t)len, MY_RELAY_ID, &ackQueue);
 	                }
 	            }
 	        }
+	  printf("[RELAY] Listen closed after %lu ms.\r\n", HAL_GetTick() - start_rx);
+
+	  //TASK 2: GỬI ACK tới Sensor node vừa đăng ký trong phiên lắng nghe (Timeout: RELAY_ACK_WINDOW_MS)
+	  printf("[RELAY] Sending ACK (%d ms)...\r\n", RELAY_ACK_WINDOW_MS);
+	  LoRaApp_Relay_Task_SendACKs(&myLoRa, MY_RELAY_ID, &ackQueue);
 
 	  //TASK 3: Tổng hợp, tạo và Forward bản tin dữ liệu tới Gateway (Timeout: RELAY_GW_WINDOW_MS)
 	  LoRaApp_Relay_Task_ForwardToGateway(&myLoRa, MY_RELAY_ID);
 
+	  //TASK 4: Slot cảnh báo tới hết chu kỳ (thức nghe ngắn mỗi RELAY_ALARM_PERIOD_MS, chuyển tiếp cảnh báo ngay)
+	  LoRaApp_Relay_Task_AlarmSlots(&myLoRa, MY_RELAY_ID);
 
+	  //Thống kê thời gian phát trong cửa sổ duty cycle (chẩn đoán)
+	  LoRaApp_Airtime_Print();
 
-	  //--- CÀI ĐẶT RTC + VÀO CHẾ ĐỘ STOP MODE ---
-	  uint32_t sleep_sec = TOTAL_CYCLE_SEC - (RELAY_ACK_WINDOW_MS + RELAY_RX_WINDOW_MS + RELAY_GW_WINDOW_MS)/1000;
 
-	  printf("[RELAY] Sleep time: %lu s.\r\n", sleep_sec);
+	  //Lưu registry Sensor xuống Flash nếu có Sensor khách mới / bị giải phóng (ngoài các cửa sổ TDMA)
+	  LoRaApp_Relay_SaveRegistry();
 
-	  RTC_SetAlarm_In_Seconds(sleep_sec);
-	  Enter_Stop_Mode();
+	  //--- CÀI ĐẶT RTC + VÀO CHẾ ĐỘ STOP MODE (tới Beacon chu kỳ sau) ---
+	  LoRaApp_Relay_SleepUntilNextCycle();
 
 	  //--- STOP MODE tại đây đến khi có ngắt RTC ---
 
@@ -21,20 +21,61 @@ uint16_t TOTAL_CYCLE_SEC = DEFAULT_TOTAL_CYCLE;
 // --- Hàm xử lý RTC & chuyển chế độ ---
 // =======================================
 
+// Số lần bộ đếm RTC tràn (mở rộng wall-clock 32-bit theo giây)
+static uint16_t rtc_overflow_count = 0;
+
+
 /*
- * @brief:  Cài đặt LSE RTC Alarm
+ * @brief:  Đọc bộ đếm RTC (tick = 1/RTC_TICK_HZ s), đọc lại CNTH để tránh sai khi CNTL tràn giữa 2 lần đọc
+ * 			Đồng thời ghi nhận cờ tràn (OWF) để RTC_GetSeconds() không bị nhảy về 0
+ * @return:
+ * 			Giá trị CNT hiện tại
+ */
+uint32_t RTC_GetCounter(void) {
+	uint16_t high = hrtc.Instance->CNTH;
+	uint16_t low = hrtc.Instance->CNTL;
+
+	if (high != hrtc.Instance->CNTH) {
+		high = hrtc.Instance->CNTH;
+		low = hrtc.Instance->CNTL;
+	}
+
+	// Bộ đếm vừa tràn (~48 ngày ở 1024 Hz): tăng epoch, đọc lại giá trị sau tràn
+	if (__HAL_RTC_OVERFLOW_GET_FLAG(&hrtc, RTC_FLAG_OW)) {
+		__HAL_RTC_OVERFLOW_CLEAR_FLAG(&hrtc, RTC_FLAG_OW);
+		rtc_overflow_count++;
+		high = hrtc.Instance->CNTH;
+		low = hrtc.Instance->CNTL;
+	}
+	return ((uint32_t)high << 16) | low;
+}
+
+
+/*
+ * @brief:  Wall-clock RTC theo giây (32-bit), ghép epoch tràn với phần giây của bộ đếm
+ * @return:
+ * 			Số giây kể từ khi RTC được khởi tạo
+ */
+uint32_t RTC_GetSeconds(void) {
+	uint32_t counter = RTC_GetCounter();
+	return ((uint32_t)rtc_overflow_count << (32 - RTC_TICK_SHIFT)) | (counter >> RTC_TICK_SHIFT);
+}
+
+
+/*
+ * @brief:  Cài đặt LSE RTC Alarm theo tick RTC
  * @param:
- * 			seconds: Thời gian (giây) báo thức
+ * 			ticks: Số tick (1/RTC_TICK_HZ s) tính từ hiện tại
  */
-void RTC_SetAlarm_In_Seconds(uint32_t seconds) {
+static void RTC_SetAlarm_In_Ticks(uint32_t ticks) {
 	// Đợi đồng bộ hóa RTC
 	HAL_RTC_WaitForSynchro(&hrtc);
 
 	while (!(hrtc.Instance->CRL & RTC_CRL_RTOFF));
 
 	// Đọc giá trị bộ đếm hiện tại:
-	uint32_t current_counter = (hrtc.Instance->CNTH << 16) | hrtc.Instance->CNTL;
-	uint32_t alarm_value = current_counter + seconds;
+	uint32_t current_counter = RTC_GetCounter();
+	uint32_t alarm_value = current_counter + ticks;
 
 	//Bật chế độ config flag
 	__HAL_RTC_WRITEPROTECTION_DISABLE(&hrtc);
@@ -70,11 +111,32 @@ void RTC_SetAlarm_In_Seconds(uint32_t seconds) {
 }
 
 
+/*
+ * @brief:  Cài đặt LSE RTC Alarm
+ * @param:
+ * 			seconds: Thời gian (giây) báo thức
+ */
+void RTC_SetAlarm_In_Seconds(uint32_t seconds) {
+	RTC_SetAlarm_In_Ticks(seconds * RTC_TICK_HZ);
+}
+
+
+/*
+ * @brief:  Cài đặt LSE RTC Alarm với độ phân giải ~1 ms (1 tick = 1/RTC_TICK_HZ s)
+ * @param:
+ * 			ms: Thời gian (ms) báo thức
+ */
+void RTC_SetAlarm_In_Ms(uint32_t ms) {
+	RTC_SetAlarm_In_Ticks(RTC_MS_TO_TICKS(ms));
+}
+
+
 /*
  * @brief:  Vào STOP mode, khôi phục khi có ngắt
- *
+ * 			SysTick bị dừng trong STOP -> bù uwTick theo số tick RTC đã trôi qua
  */
 void Enter_Stop_Mode(void) {
+	uint32_t rtc_before = RTC_GetCounter();
 
     // Tắt SysTick để tránh ngắt SysTick đánh thức chip ngay lập tức
     HAL_SuspendTick();
@@ -84,12 +146,15 @@ void Enter_Stop_Mode(void) {
 
     // ---> STOP <---
 
-    // Bật lại SysTick
-    HAL_ResumeTick();
-
     // Khôi phục lại Clock
     SystemClock_Config_FromStop();
 
+    // Bù thời gian ngủ cho HAL_GetTick()
+    HAL_RTC_WaitForSynchro(&hrtc);
+    uwTick += RTC_TICKS_TO_MS(RTC_GetCounter() - rtc_before);
+
+    // Bật lại SysTick
+    HAL_ResumeTick();
 }
 
 
@@ -98,8 +163,31 @@ void SystemClock_Config_FromStop(void) {
     SystemClock_Config();
 }
 
+
+/*
+ * @brief:  Ngủ với độ phân giải ms: STOP mode tới khi còn dưới RTC_MIN_STOP_MS, phần lẻ dùng HAL_Delay
+ * 			Bị đánh thức sớm (ngắt DIO0, UART...) sẽ vào lại STOP cho phần còn lại
+ * @param:
+ * 			ms: Thời gian ngủ (ms)
+ */
+void Sleep_Precise_Ms(uint32_t ms) {
+	uint32_t start = HAL_GetTick();
+	uint32_t elapsed;
+
+	while ((elapsed = HAL_GetTick() - start) + RTC_MIN_STOP_MS < ms) {
+		RTC_SetAlarm_In_Ms(ms - elapsed);
+		Enter_Stop_Mode();
+	}
+
+	elapsed = HAL_GetTick() - start;
+	if (ms > elapsed) {
+		HAL_Delay(ms - elapsed);
+	}
+}
+
+
 /*
- * @brief:  Thực hiện bù thời gian tới khi hết timeout một task
+ * @brief:  Thực hiện bù thời gian tới khi hết timeout một task (ngủ STOP phần còn lại)
  * @param:
  * 			start_tick: Systick khi bắt đầu thực hiện task
  * 			target_duration_ms: Timeout mong muốn (ms)
@@ -108,589 +196,3901 @@ void SystemClock_Config_FromStop(void) {
 void Pad_Execution_Time(uint32_t start_tick, uint32_t target_duration_ms) {
     uint32_t elapsed = HAL_GetTick() - start_tick;
     if (target_duration_ms > elapsed) {
-        HAL_Delay(target_duration_ms - elapsed);
+        Sleep_Precise_Ms(target_duration_ms - elapsed);
     }
 }
 
-#if (CURRENT_NODE_TYPE == NODE_TYPE_SENSOR)
-// ==============================
-// --- HÀM PHÍA SENSOR NODE ---
-// ==============================
 
 /*
- * @brief:  Thực hiện pha đăng ký với Relay.
- * @param:
- * 			_lora: Con trỏ struct LoRa quản lý
- * 			_rxBuf: Con trỏ buffer nhận
- * 			_rxBufSize: Kích thước buffer nhận
- * 			_rxFlag: Cờ nhận (recieve flag)
- * 			_myID: ID sensor node
- * 			_targetRelayID: ID relay node mục tiêu
- * @return:
- * 			Cycle tổng (total_cycle) và Time Slot (ID khe thời gian) được Relay cấp phát.
+ * @brief:  Độ dài 1 khe backoff trong slot cảnh báo: đủ 1 bản tin cảnh báo + ACK
+ * @param:	_lora: Con trỏ struct LoRa quản lý
  */
+uint32_t LoRaApp_Alarm_BackoffSlotMs(LoRa* _lora) {
+	return LoRa_getTimeOnAir(_lora, LORA_AIR_LEN(RL_ALARM_LEN)) + LoRa_getTimeOnAir(_lora, LORA_AIR_LEN(GW_ACK_HEADER_LEN + 1))
+			+ 2 * RELAY_SLOT_GUARD_MS;
+}
 
-uint8_t LoRaApp_Sensor_RegistrationPhase(
-		LoRa* _lora, uint8_t* _rxBuf, uint16_t _rxBufSize,
-		volatile uint8_t* _rxFlag, uint8_t _myID, uint8_t _targetRelayID) {
 
-	msg_ss_reg_adv_t adv_msg;
-	msg_ss_reg_ack_t* ack_msg;
-    uint8_t tx_buffer[10];
+/*
+ * @brief:  Thời gian Relay nghe trong 1 slot cảnh báo (tính từ mốc slot - RELAY_ALARM_GUARD_MS)
+ * @param:	_lora: Con trỏ struct LoRa quản lý
+ */
+uint32_t LoRaApp_Alarm_WindowMs(LoRa* _lora) {
+	return 2 * RELAY_ALARM_GUARD_MS + ALARM_BACKOFF_SLOTS * LoRaApp_Alarm_BackoffSlotMs(_lora);
+}
 
-    printf("\r\n[SENSOR] >>> START REGISTRATION PHASE <<<\r\n");
 
-    // 1. Cấu hình bản tin quảng bá ADV
-    adv_msg.func_code = FUNC_CODE_REG_ADV;
-    adv_msg.sensor_id = _myID;
-    adv_msg.target_relay_id = _targetRelayID;
+/*
+ * @brief:  Chờ kênh rảnh trong slot cảnh báo: chọn khe bắt đầu ngẫu nhiên, CAD đầu mỗi khe,
+ * 			kênh bận -> lùi sang khe sau. Gọi ngay tại mốc gửi của slot (radio Standby)
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_seed: ID node (các node cùng slot chọn khe khác nhau)
+ * @return: 1 nếu kênh rảnh (gửi ngay), 0 nếu bận tới hết slot
+ */
+uint8_t LoRaApp_Alarm_WaitChannel(LoRa* _lora, uint8_t _seed) {
+	uint32_t start = HAL_GetTick();
+	uint32_t bslot = LoRaApp_Alarm_BackoffSlotMs(_lora);
+	uint32_t slot = (LoRaApp_Random() ^ _seed) % ALARM_BACKOFF_SLOTS;
+
+	for (; slot < ALARM_BACKOFF_SLOTS; slot++) {
+		uint32_t elapsed = HAL_GetTick() - start;
+		if (slot * bslot > elapsed) HAL_Delay(slot * bslot - elapsed);
+		if (!LoRa_channelActivity(_lora)) return 1;
+	}
+	return 0;
+}
 
-    // Đóng gói vào buffer
-    tx_buffer[0] = adv_msg.func_code;
-    tx_buffer[1] = adv_msg.sensor_id;
-    tx_buffer[2] = adv_msg.target_relay_id;
 
-	// Vòng lặp gửi và chờ
-	while (1) {
+// =======================================
+// --- Ngân sách thời gian phát (duty cycle) ---
+// =======================================
 
-//		printf("\r\n[SENSOR] Sending ADV Request to Relay 0x%02X...\r\n", _targetRelayID);
+#define AIRTIME_BUCKET_MS			((uint32_t)AIRTIME_WINDOW_S * 1000 / AIRTIME_BUCKETS)
 
-		// Gửi bản tin ADV
-		LoRa_setMode(_lora, STNBY_MODE);
-		uint8_t tx_result = LoRa_transmit(_lora, tx_buffer, sizeof(msg_ss_reg_adv_t), TRANSMIT_TIMEOUT);
+// Cửa sổ trượt: time-on-air theo từng ô AIRTIME_BUCKET_MS (HAL tick liên tục qua STOP)
+static uint32_t air_bucket_ms[AIRTIME_BUCKETS];
+static uint32_t air_bucket_now = 0;		// Số thứ tự ô hiện tại (HAL_GetTick() / AIRTIME_BUCKET_MS)
+static LoRaApp_Airtime_t air_stats = { .budget_ms = (uint32_t)AIRTIME_WINDOW_S * AIRTIME_DUTY_PERMILLE };
 
-		if (tx_result) {
-			printf("[SENSOR] Sending ADV Request to Relay 0x%02X... -> OK \r\n", _targetRelayID);
-		} else {
-			printf("[SENSOR] ADV transmission FAILED! Check connection.\r\n");
-		}
 
-		// Chuyển sang chế độ nhận liên tục để chờ ACK
-		LoRa_setMode(_lora, RXCONTIN_MODE);
+/*
+ * @brief:  Trượt cửa sổ tới thời điểm hiện tại: xóa các ô đã ra khỏi cửa sổ
+ */
+static void Airtime_Advance(void) {
+	uint32_t now = HAL_GetTick() / AIRTIME_BUCKET_MS;
+	uint32_t steps = now - air_bucket_now;
+
+	if (steps > AIRTIME_BUCKETS) steps = AIRTIME_BUCKETS;
+	while (steps--) {
+		air_bucket_now++;
+		air_stats.window_ms -= air_bucket_ms[air_bucket_now % AIRTIME_BUCKETS];
+		air_bucket_ms[air_bucket_now % AIRTIME_BUCKETS] = 0;
+	}
+	air_bucket_now = now;
+}
 
-		uint32_t start_wait = HAL_GetTick();
-//		uint8_t received_ack = 0;
 
-		// Chờ trong khoảng thời gian REG_TIMEOUT_MS
-		while (HAL_GetTick() - start_wait < REG_TIMEOUT_MS) {
+#if LORA_SEC_ENABLE
+// Bản tin đã niêm phong (phát) / chưa mở (nhận)
+static uint8_t sec_frame[255];
+#endif
 
-			// Kiểm tra cờ ngắt
-			if (*_rxFlag) {
-				*_rxFlag = 0; // Xóa cờ ngắt
-				memset(_rxBuf, 0, _rxBufSize);
 
-				int len = LoRa_receive(_lora, _rxBuf, _rxBufSize);
-				if (len > 0) {
-					// Kiểm tra Function Code
-					if (_rxBuf[0] == FUNC_CODE_REG_ACK) {
+/*
+ * @brief:  Phát 1 bản tin nếu còn ngân sách duty cycle cho mức ưu tiên của nó, cộng time-on-air vào cửa sổ sau khi phát xong
+ * 			Bản tin thường / ưu tiên thấp chừa lại phần ngân sách cho Beacon, ACK và cảnh báo
+ * 			Bản tin được niêm phong (mã hoá + tag) ngay trước khi phát, bên gọi chỉ làm việc với bản rõ
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			pData: Bản tin
+ * 			length: Độ dài bản tin
+ * 			timeout: Thời gian chờ phát xong (ms)
+ * 			prio: AIR_PRIO_x
+ * @return: Kết quả LoRa_transmit, 0 nếu độ dài sai / bị hoãn do hết ngân sách
+ */
+uint8_t LoRaApp_Transmit(LoRa* _lora, uint8_t* pData, uint8_t length, uint16_t timeout, uint8_t prio) {
+	static const uint8_t share[AIR_PRIO_COUNT] = { 100, AIRTIME_NORMAL_PERCENT, AIRTIME_LOW_PERCENT };
+	uint8_t* frame = pData;
+	uint8_t result;
+
+	if (length == 0 || length > LORA_MAX_PAYLOAD) {
+		printf("[AIR] Frame length %d B invalid (max %d B), dropped.\r\n", length, LORA_MAX_PAYLOAD);
+		return 0;
+	}
 
-						// Ép kiểu sang msg_ss_reg_ack_t
-						ack_msg = (msg_ss_reg_ack_t*)_rxBuf;
+	uint32_t toa = LoRa_getTimeOnAir(_lora, LORA_AIR_LEN(length));
 
-						// Kiểm tra ID: Đúng Relay mình gọi và đúng Sensor ID của mình
-						if (ack_msg->target_sensor_id == _myID && ack_msg->relay_id == _targetRelayID) {
+	if (prio >= AIR_PRIO_COUNT) prio = AIR_PRIO_LOW;
+	Airtime_Advance();
 
-							// Lấy total_cycle và time slot được cấp phát
-							uint8_t assigned_slot = ack_msg->time_slot;
-							TOTAL_CYCLE_SEC = ack_msg->total_cycle;
+	if (air_stats.window_ms + toa > air_stats.budget_ms / 100 * share[prio]) {
+		air_stats.denied[prio]++;
+		printf("[AIR] Duty cycle budget: frame 0x%02X (%lu ms, prio %d) deferred.\r\n", pData[0], toa, prio);
+		return 0;
+	}
 
-							printf("\r\n[SENSOR] !!! ACK RECEIVED FROM RELAY 0x%02X!!!\r\n", ack_msg->relay_id);
-							printf("[SENSOR] Assigned TDMA Slot: %d\r\n", assigned_slot);
+#if LORA_SEC_ENABLE
+	memcpy(sec_frame, pData, length);
+	length = LoRaSec_Seal(sec_frame, length, sizeof(sec_frame));
+	if (length == 0) return 0;
+	frame = sec_frame;
+#endif
 
-							printf("[SENSOR] Syncing Cycle: Sleeping %d seconds to match Relay Start...\r\n", TOTAL_CYCLE_SEC);
-							HAL_Delay(10);
+	result = LoRa_transmit(_lora, frame, length, timeout);
 
-							// Cài đặt RTC và ngủ đúng 1 chu kỳ để dậy vào đầu chu kỳ sau
-							RTC_SetAlarm_In_Seconds(TOTAL_CYCLE_SEC);
-							Enter_Stop_Mode();
+	// Chỉ tính time-on-air khi radio báo phát xong (TxDone)
+	if (result) {
+		Airtime_Advance();
+		air_bucket_ms[air_bucket_now % AIRTIME_BUCKETS] += toa;
+		air_stats.window_ms += toa;
+		air_stats.total_ms += toa;
+		air_stats.sent[prio]++;
+	} else {
+		air_stats.tx_fail++;
+	}
+	return result;
+}
 
-							// Khi thức dậy, thoát khỏi hàm và trả về Slot ID
-							printf("[SENSOR] Woke up! Registration Complete. Entering Main Loop.\r\n");
 
-							return assigned_slot;
-						}
-					}
-				}
-			}
-		}
-		// Random delay để tránh xung đột
-		HAL_Delay(200 + (HAL_GetTick() % 1000));
+/*
+ * @brief:  Đọc bản tin vừa nhận (sau RxDone) và mở niêm phong: sai tag hoặc bộ đếm cũ -> bỏ
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_buf: Nơi ghi bản tin gốc
+ * 			_size: Kích thước _buf (bản tin dài hơn bị cắt như LoRa_receive)
+ * @return: Độ dài bản tin gốc, 0 nếu không có / bị loại
+ */
+uint8_t LoRaApp_Receive(LoRa* _lora, uint8_t* _buf, uint8_t _size) {
+#if LORA_SEC_ENABLE
+	uint8_t len = LoRa_receive(_lora, sec_frame, sizeof(sec_frame));
+	if (len == 0) return 0;
+
+	uint8_t plain = LoRaSec_Open(sec_frame, len);
+	if (plain == 0) {
+		printf("[SEC] Frame 0x%02X (%d B) rejected: bad tag or replay.\r\n", sec_frame[0], len);
+		return 0;
 	}
+
+	if (plain > _size) plain = _size;
+	memcpy(_buf, sec_frame, plain);
+	return plain;
+#else
+	return LoRa_receive(_lora, _buf, _size);
+#endif
 }
 
 
-static msg_ss_data_t sensor_latest_data = {0};
-//static uint32_t sensor_cycle_count;
+/*
+ * @brief:  In chi phí mã hoá từng loại bản tin (độ dài điển hình / lớn nhất): chu kỳ CPU niêm phong / mở
+ * 			đo bằng DWT->CYCCNT và time-on-air trước / sau niêm phong theo cấu hình radio hiện tại
+ * @param:	_lora: Con trỏ struct LoRa quản lý (cấu hình SF/BW/CR)
+ */
+void LoRaApp_Security_Benchmark(LoRa* _lora) {
+#if LORA_SEC_ENABLE
+	LoRaSec_Benchmark(_lora, "REG_ADV", sizeof(msg_ss_reg_adv_t));
+	LoRaSec_Benchmark(_lora, "REG_ACK", sizeof(msg_ss_reg_ack_t));
+	LoRaSec_Benchmark(_lora, "SS_DATA", sizeof(msg_ss_data_t));
+	LoRaSec_Benchmark(_lora, "SS_BATCH", SS_BATCH_MAX_LEN);
+	LoRaSec_Benchmark(_lora, "SS_ALARM", SS_ALARM_LEN);
+	LoRaSec_Benchmark(_lora, "ALARM_ACK", ALARM_ACK_LEN);
+	LoRaSec_Benchmark(_lora, "RL_BEACON", sizeof(msg_rl_beacon_t) + 1);
+	LoRaSec_Benchmark(_lora, "RL_DATA", 3 + RELAY_AGG_MAX_RECORDS * RL_RECORD_LEN);
+	LoRaSec_Benchmark(_lora, "RL_ALARM", RL_ALARM_LEN);
+	LoRaSec_Benchmark(_lora, "RL_REG_ADV", sizeof(msg_rl_reg_adv_t));
+	LoRaSec_Benchmark(_lora, "GW_ACK", GW_ACK_HEADER_LEN + 1);
+	LoRaSec_Benchmark(_lora, "RL_BACKLOG", LORA_MAX_PAYLOAD);
+#endif
+}
 
 
 /*
- * @brief:  TASK 1: Thực hiện gửi dữ liệu từ Sensor -> Relay (Timeout: SENSOR_TX_WINDOW_MS)
- * @param:
- * 			_lora: Con trỏ struct LoRa quản lý
- * 			_myID: ID sensor node
- * 			_targetRelayID: ID relay node mục tiêu
- * 			_mySlot: TDMA time slot được cấp phát
- *
+ * @brief:  Đọc thống kê thời gian phát (cửa sổ đã trượt tới hiện tại)
+ * @param:	_stats: Nơi ghi thống kê
  */
-void LoRaApp_Sensor_Task_SendData(LoRa* _lora, uint8_t _myID, uint8_t _targetRelayID, uint8_t _mySlot) {
-    uint32_t start_task = HAL_GetTick();
+void LoRaApp_Airtime_GetStats(LoRaApp_Airtime_t* _stats) {
+	Airtime_Advance();
+	*_stats = air_stats;
+}
 
-    // 1. TDMA Delay
-    uint32_t tdma_wait = SENSOR_TDMA_BASE_MS + (_mySlot * SENSOR_TDMA_SLOT_MS);
 
-    // Kiểm tra an toàn: TDMA wait không được vượt quá window
-    if (tdma_wait > SENSOR_TX_WINDOW_MS - 500) tdma_wait = SENSOR_TX_WINDOW_MS - 500;
+/*
+ * @brief:  In thống kê thời gian phát (chẩn đoán)
+ */
+void LoRaApp_Airtime_Print(void) {
+	LoRaApp_Airtime_t s;
+
+	LoRaApp_Airtime_GetStats(&s);
+	printf("[AIR] Window %lu/%lu ms (%lu.%lu %% of budget), total %lu ms, sent %lu/%lu/%lu, deferred %lu/%lu/%lu, TX fail %lu\r\n",
+			s.window_ms, s.budget_ms, s.window_ms * 100 / s.budget_ms, (s.window_ms * 1000 / s.budget_ms) % 10,
+			s.total_ms, s.sent[AIR_PRIO_CRITICAL], s.sent[AIR_PRIO_NORMAL], s.sent[AIR_PRIO_LOW],
+			s.denied[AIR_PRIO_CRITICAL], s.denied[AIR_PRIO_NORMAL], s.denied[AIR_PRIO_LOW], s.tx_fail);
+}
 
 
-    printf("[SENSOR] Wait for TDMA slot to sent DATA: %lu ms\r\n", tdma_wait);
-    HAL_Delay(tdma_wait);
+// =======================================
+// --- Số ngẫu nhiên & backoff ---
+// =======================================
 
-    // 2. Đóng gói Data (Latest)
-    sensor_latest_data.func_code = FUNC_CODE_SS_DATA;
-    sensor_latest_data.sensor_id = _myID;
-    sensor_latest_data.target_relay_id = _targetRelayID;
+static uint32_t rng_state = 0;		// xorshift32 (0: chưa khởi tạo)
 
-    LoRa_setMode(_lora, STNBY_MODE);
 
-    //Gửi 2 lần
-    int result;
-    for (int i = 0; i < 2; i++){
-    	result = LoRa_transmit(_lora, (uint8_t*)&sensor_latest_data, sizeof(msg_ss_data_t), 300);
-    	HAL_Delay(50);
-    }
+/*
+ * @brief:  Trộn UID 96 bit của MCU và 32 bit nhiễu máy thu vào trạng thái bộ sinh số ngẫu nhiên
+ * 			HAL_GetTick() ngay sau khi cấp nguồn gần như giống nhau ở mọi node -> không dùng làm seed
+ * @param:	_lora: Con trỏ struct LoRa quản lý (radio về Standby)
+ */
+void LoRaApp_Random_Seed(LoRa* _lora) {
+	rng_state ^= HAL_GetUIDw0() ^ (HAL_GetUIDw1() * 0x9E3779B1u) ^ (HAL_GetUIDw2() * 0x85EBCA6Bu);
+	rng_state ^= LoRa_getRandom(_lora);
+	if (rng_state == 0) rng_state = 0x2545F491u;
+}
 
-	if (result) {
-		printf("[SENSOR] Data Sent: T=%d, H=%d\r\n", sensor_latest_data.temp_val, sensor_latest_data.hum_val);
-	} else {
-		printf("[SENSOR] Send Data -> FAILED!\r\n");
-	}
 
-    //Padding thời gian cho đủ SENSOR_TX_WINDOW_MS
-    Pad_Execution_Time(start_task, SENSOR_TX_WINDOW_MS);
+/*
+ * @brief:  Số ngẫu nhiên 32 bit (xorshift32). Chưa seed -> khởi tạo chỉ từ UID
+ */
+uint32_t LoRaApp_Random(void) {
+	if (rng_state == 0) rng_state = HAL_GetUIDw0() ^ HAL_GetUIDw1() ^ HAL_GetUIDw2() ^ 0x2545F491u;
+
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
 }
 
+
 /*
- * @brief:  TASK 2: Sensor thực hiện đo dữ liệu cảm biến (Timeout: SENSOR_MEASURE_WINDOW_MS)
- * @param:
- * 			_sensorCfg: Con trỏ tới struct quản lý dữ liệu cảm biến
- *
- *
+ * @brief:  Backoff mũ ngẫu nhiên: L = min(REG_BACKOFF_BASE_MS << _attempt, REG_BACKOFF_MAX_MS), chờ trong [L/2, L)
+ * @param:	_attempt: Số lần thử thất bại liên tiếp trước đó (bên gọi đặt về 0 khi thành công)
+ * @return: Thời gian chờ (ms)
  */
+uint32_t LoRaApp_Backoff_Ms(uint8_t _attempt) {
+	uint32_t limit = REG_BACKOFF_MAX_MS;
 
-void LoRaApp_Sensor_Task_Measure(Sensor_Config_t* _sensorCfg) {
-    uint32_t start_task = HAL_GetTick();
-    printf("[SENSOR] Measuring sensor data ... (Timeout: %lu ms)\r\n", SENSOR_MEASURE_WINDOW_MS);
+	if (_attempt < 16 && ((uint32_t)REG_BACKOFF_BASE_MS << _attempt) < limit) {
+		limit = (uint32_t)REG_BACKOFF_BASE_MS << _attempt;
+	}
+	return limit / 2 + LoRaApp_Random() % (limit - limit / 2);
+}
 
-    //Thực hiện chu trình đo
-    Sensor_Data_t myData;
-    Sensor_ReadAll(_sensorCfg, &myData);
 
-//    //Test với không có cảm biến
-//    Sensor_ReadAll_Test(_sensorCfg, &myData);
+// =======================================
+// --- Kênh tần số ---
+// =======================================
 
-    //Lưu dữ liệu struct quản lý
-    if(myData.status == 0) {
-    	sensor_latest_data.temp_val = (int16_t)(myData.temp_c * 10);
-    	sensor_latest_data.hum_val  = (uint16_t)(myData.hum_rh * 10);
-    	sensor_latest_data.soil_val = myData.soil_percent;
-        printf("[SENSOR] Measured: %.1f C, %.1f %%\r\n", myData.temp_c, myData.hum_rh);
-    } else {
-        printf("[SENSOR] Measure Failed. Keep Old Data.\r\n");
-    }
+static uint8_t lora_channel = LORA_CH_GATEWAY;	// Kênh radio đang dùng (LoRa_init: myLoRa.frequency = kênh GW)
 
-    // Padding thời gian cho đủ SENSOR_MEASURE_WINDOW_MS
-    Pad_Execution_Time(start_task, SENSOR_MEASURE_WINDOW_MS);
-}
 
-#endif
+/*
+ * @brief:  Tần số của 1 kênh trong kế hoạch kênh
+ * @param:	_ch: Kênh (LORA_CH_GATEWAY hoặc kênh con 1 ... LORA_CH_COUNT-1)
+ * @return: Tần số (kHz)
+ */
+uint32_t LoRaApp_Channel_KHz(uint8_t _ch) {
+	if (_ch == LORA_CH_GATEWAY || _ch >= LORA_CH_COUNT) return LORA_CH_GATEWAY_KHZ;
+	return LORA_CH_BASE_KHZ + (uint32_t)(_ch - 1) * LORA_CH_SPACING_KHZ;
+}
 
-#if (CURRENT_NODE_TYPE == NODE_TYPE_RELAY)
-// ==============================
-// --- HÀM PHÍA RELAY NODE ---
-// ==============================
 
-//Danh sách sensor node chịu quản lý
-static const uint8_t managed_sensors[MANAGED_SENSOR_COUNT] = MANAGED_SENSOR_LIST;
-//Struct kiểm soát dữ liệu các sensor chịu quản lý
-static Relay_Sensor_Data_Slot_t relay_data_store[MANAGED_SENSOR_COUNT];
+/*
+ * @brief:  Kênh con gán cho cluster của Relay (chia vòng theo ID Relay)
+ * @param:	_relayID: ID Relay
+ * @return: Kênh con (LORA_CH_GATEWAY khi chỉ có 1 kênh)
+ */
+uint8_t LoRaApp_Channel_ForRelay(uint8_t _relayID) {
+	if (LORA_CH_COUNT <= 1) return LORA_CH_GATEWAY;
+	return (uint8_t)(1 + (uint8_t)(_relayID - 1) % (LORA_CH_COUNT - 1));
+}
 
 
 /*
- * @brief: 	Kiểm tra xem Sensor ID có nằm trong danh sách quản lý không
- * @param:	sensor_id: ID sensor cần kiểm tra
- * @return: 1 nếu CÓ, 0 nếu KHÔNG
+ * @brief:  Chuyển radio sang kênh khác (chỉ ghi thanh ghi tần số khi đổi kênh)
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý (đang ở STANDBY)
+ * 			_ch: Kênh cần chuyển tới
  */
+void LoRaApp_Channel_Set(LoRa* _lora, uint8_t _ch) {
+	if (_ch >= LORA_CH_COUNT || _ch == lora_channel) return;
 
-uint8_t IsSensorManaged(uint8_t sensor_id) {
-    for (int i = 0; i < MANAGED_SENSOR_COUNT; i++) {
-        if (managed_sensors[i] == sensor_id) {
-            return 1; // Tìm thấy trong danh sách
-        }
-    }
-    return 0; // Không tìm thấy
+	LoRa_setMode(_lora, STNBY_MODE);
+	LoRa_setFrequencyKHz(_lora, LoRaApp_Channel_KHz(_ch));
+	lora_channel = _ch;
 }
 
+
+// =======================================
+// --- Mã hoá delta (RL_DELTA) ---
+// =======================================
+
 /*
- * @brief: Cấp phát index slot cho Sensor node dựa theo số thứ tự trong danh sách
- * @param:	sensor_id: ID sensor cần kiểm tra
- * @return: Sensor node index
+ * @brief:  Ghi 1 số không dấu dạng varint: 7 bit/byte, byte thấp trước, bit 7 = còn byte tiếp
+ * @param:
+ * 			_buf: Vị trí ghi
+ * 			_v: Giá trị (số có dấu: ZIGZAG_ENC trước)
+ * @return: Số byte đã ghi
  */
-int GetSensorIndex(uint8_t sensor_id) {
-    for (int i = 0; i < MANAGED_SENSOR_COUNT; i++) {
-        if (relay_data_store[i].sensor_id == sensor_id) return i;
-    }
-    return -1;
+uint8_t LoRaApp_Varint_Put(uint8_t* _buf, uint32_t _v) {
+	uint8_t n = 0;
+
+	while (_v >= 0x80) {
+		_buf[n++] = (_v & 0x7F) | 0x80;
+		_v >>= 7;
+	}
+	_buf[n++] = _v;
+	return n;
 }
 
 
 /*
- * @brief: Init/Reset dữ liệu Sensor do Relay quản lý
+ * @brief:  Đọc 1 varint
+ * @param:
+ * 			_buf: Vị trí đọc
+ * 			_len: Số byte còn lại trong bản tin
+ * 			_v: Nơi ghi giá trị
+ * @return: Số byte đã đọc, 0 nếu bản tin hết giữa chừng
  */
-void LoRaApp_Relay_Init(void) {
-    for(int i=0; i<MANAGED_SENSOR_COUNT; i++) {
-        // Gán cứng ID từ danh sách quản lý vào Slot để GetSensorIndex tìm thấy
-        relay_data_store[i].sensor_id = managed_sensors[i];
-
-        // Reset trạng thái data cũ
-        relay_data_store[i].has_data = 0;
-        relay_data_store[i].temp = 0;
-        relay_data_store[i].hum = 0;
-        relay_data_store[i].soil = 0;
-    }
+uint8_t LoRaApp_Varint_Get(const uint8_t* _buf, uint8_t _len, uint32_t* _v) {
+	uint32_t v = 0;
+
+	for (uint8_t n = 0; n < _len && n < 5; n++) {
+		v |= (uint32_t)(_buf[n] & 0x7F) << (7 * n);
+		if (!(_buf[n] & 0x80)) {
+			*_v = v;
+			return n + 1;
+		}
+	}
+	return 0;
 }
 
 
 /*
- * @brief: 	Relay đăng ký với Gateway và chờ cấu hình thời gian
- * 			Hàm này sẽ chặn (Blocking) cho đến khi nhận được Config từ GW
+ * @brief:  CRC-8 (đa thức 0x07) của danh sách bản ghi tham chiếu: Relay gửi trong RL_DELTA, GW chỉ giải mã khi khớp
  * @param:
- * 			_lora: Con trỏ struct LoRa quản lý
- * 			_rxBuf: Con trỏ buffer nhận
- * 			_rxBufSize: Kích thước buffer nhận
- * 			_rxFlag: Cờ nhận (recieve flag)
- * 			_myRelayID: ID Relay node
+ * 			_ref: Bản ghi tham chiếu
+ * 			_count: Số bản ghi
+ * @return: CRC-8
  */
-uint8_t LoRaApp_Relay_RegistrationWithGateway(
-		LoRa* _lora, uint8_t* _rxBuf, uint16_t _rxBufSize,
-		volatile uint8_t* _rxFlag, uint8_t _myRelayID)
-{
-    msg_rl_reg_adv_t adv_msg;
-    uint16_t my_wakeup_offset = 0;
-    uint8_t configured = 0;
+uint8_t LoRaApp_Delta_RefCheck(const Relay_Record_t* _ref, uint8_t _count) {
+	uint8_t crc = _count;
+
+	for (uint8_t i = 0; i < _count; i++) {
+		uint8_t b[RL_RECORD_LEN] = { _ref[i].sensor_id, (uint16_t)_ref[i].temp >> 8, _ref[i].temp & 0xFF,
+									 _ref[i].hum >> 8, _ref[i].hum & 0xFF, _ref[i].soil };
+		for (uint8_t j = 0; j < RL_RECORD_LEN; j++) {
+			crc ^= b[j];
+			for (uint8_t k = 0; k < 8; k++) crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+		}
+	}
+	return crc;
+}
 
-    printf("\r\n[RELAY] >>> START RELAY REGISTRATION <<<\r\n");
+#if (CURRENT_NODE_TYPE == NODE_TYPE_SENSOR)
+// ==============================
+// --- HÀM PHÍA SENSOR NODE ---
+// ==============================
 
-    adv_msg.func_code = FUNC_CODE_RL_REG_ADV;
-    adv_msg.relay_id = _myRelayID;
-    adv_msg.reserved = 0;
+static msg_ss_data_t sensor_latest_data = {0};
+//static uint32_t sensor_cycle_count;
 
-    while(!configured) {
-        // Gửi ADV định kỳ
-        LoRa_setMode(_lora, STNBY_MODE);
-        int result = LoRa_transmit(_lora, (uint8_t*)&adv_msg, sizeof(msg_rl_reg_adv_t), 1000);
-        if (result){
-        	printf("[RELAY] Sending ADV Request to Gateway...\r\n");
-        } else {
-        	printf("[RELAY] Sending ADV Request to Gateway -> FAILED...\r\n");
-        }
-        LoRa_setMode(_lora, RXCONTIN_MODE);
+// Điều khiển số bản sao Data theo chất lượng link (học từ bitmap ACK của Relay)
+static uint8_t sensor_tx_copies = SENSOR_MAX_REDUNDANCY - 1;	// Số bản sao hiện tại (khởi đầu như gửi 2 lần)
+static uint8_t sensor_ack_streak = 0;							// Số chu kỳ liên tiếp được ACK
+static uint8_t sensor_wait_ack = 0;								// Cờ: chu kỳ trước đã gửi Data, chờ bitmap ACK
 
+// Điều khiển công suất phát theo khuyến nghị của Relay (trong Beacon)
+static uint8_t sensor_txp_atten = 0;							// Suy giảm so với POWER_20db (dB)
+static uint8_t sensor_txp_down = 0;								// Số Beacon liên tiếp khuyến nghị giảm
 
-        // Chờ phản hồi Broadcast (Timeout REG_TIMEOUT_MS gửi lại)
-        uint32_t start_wait = HAL_GetTick();
-        while(HAL_GetTick() - start_wait < REG_TIMEOUT_MS) {
-            if(*_rxFlag) {
-                *_rxFlag = 0;
-                int len = LoRa_receive(_lora, _rxBuf, _rxBufSize);
-                if(len > 0 && _rxBuf[0] == FUNC_CODE_GW_REG_ACK) {
+// Trạng thái đồng bộ thời gian với Relay (theo Beacon)
+static Sensor_Sync_t sensor_sync = {0};
 
-                    //Format: [0x07 | Cycle_H | Cycle_L | Count | ... ]
-                	uint16_t total_cycle = (_rxBuf[1] << 8) | _rxBuf[2];
-                    uint8_t count = _rxBuf[3];
-                    uint8_t ptr = 4;	//Data bắt đầu từ byte thứ 4
+// Gửi gộp: ring buffer mẫu đo chờ gửi (cũ nhất ở head)
+static Sensor_Sample_t sensor_batch[SENSOR_BATCH_MAX_SAMPLES];
+static uint8_t sensor_batch_head = 0;
+static uint8_t sensor_batch_len = 0;
+static uint8_t sensor_batch_sent = 0;		// Số mẫu cũ nhất đã gửi ở lần gửi trước, xóa khi được ACK
+static uint8_t sensor_upload_wait = 0;		// Số chu kỳ còn lại tới lần gửi kế tiếp (0: gửi chu kỳ này)
+
+// Dead-band: giá trị (và chu kỳ) của lần báo cáo gần nhất
+static Sensor_Sample_t sensor_reported = {0};
+static uint8_t sensor_reported_valid = 0;
+static uint8_t sensor_report_unacked = 0;	// Lần gửi trước chưa được ACK -> gửi lại dù trong dead-band
+
+// Cảnh báo nhanh: ngưỡng cục bộ, các đại lượng đang vượt ngưỡng, cảnh báo chờ gửi
+static Sensor_Thresholds_t sensor_thresholds = SENSOR_ALARM_THRESHOLDS;
+static uint8_t sensor_alarm_flags = 0;
+static uint8_t sensor_alarm_pending = 0;
+static uint8_t sensor_alarm_tries = 0;
+
+// Cấu hình từ Server (qua Beacon): phiên bản đang áp dụng (0: mặc định lúc biên dịch)
+static uint8_t sensor_cfg_ver = 0;
+static uint8_t sensor_measure_cycle = SENSOR_MEASURE_CYCLE;
+
+// Đồng bộ lại nhanh: số lần nghe trọn chu kỳ liên tiếp không thấy Beacon
+static uint8_t sensor_resync_fail = 0;
+
+// Chuyển Relay dự phòng: danh sách Relay ứng viên, Relay đang dùng, số lần liên tiếp Data không được ACK
+static const uint8_t sensor_relays[SENSOR_RELAY_CANDIDATE_COUNT] = SENSOR_RELAY_CANDIDATES;
+static uint8_t sensor_relay_idx = 0;
+static uint8_t sensor_nack_streak = 0;
+
+// Kênh con của cluster đang tham gia; số vòng ứng viên thất bại liên tiếp (dò kênh lệch khỏi kênh dự kiến)
+static uint8_t sensor_channel = LORA_CH_GATEWAY;
+static uint8_t sensor_ch_scan = 0;
+
+
+/*
+ * @brief:  Thời gian thức dậy sớm trước Beacon (ms)
+ * 			Nới rộng theo số Beacon bị lỡ liên tiếp để bù trôi đồng hồ chưa được hiệu chỉnh
+ */
+static uint32_t Sensor_SyncLead(void) {
+	uint32_t lead = SENSOR_SYNC_LEAD_MS + (uint32_t)sensor_sync.missed * SENSOR_SYNC_LEAD_STEP_MS
+					+ (uint32_t)sensor_sync.skipped * SENSOR_SYNC_SKIP_STEP_MS;
+	return (lead > SENSOR_SYNC_LEAD_MAX_MS) ? SENSOR_SYNC_LEAD_MAX_MS : lead;
+}
+
+
+/*
+ * @brief:  Cập nhật số bản sao Data dựa trên bitmap ACK của chu kỳ trước
+ * @param:
+ * 			acked: 1 nếu Relay đã nhận được Data, 0 nếu bị mất
+ */
+static void Sensor_UpdateRedundancy(uint8_t acked) {
+	if (acked) {
+		// Link tốt: sau SENSOR_REDUNDANCY_DECAY chu kỳ liên tiếp -> giảm 1 bản sao
+		if (++sensor_ack_streak >= SENSOR_REDUNDANCY_DECAY) {
+			sensor_ack_streak = 0;
+			if (sensor_tx_copies > 1) sensor_tx_copies--;
+		}
+	} else {
+		// Mất gói: tăng ngay 1 bản sao
+		sensor_ack_streak = 0;
+		if (sensor_tx_copies < SENSOR_MAX_REDUNDANCY) sensor_tx_copies++;
+	}
+}
+
+
+/*
+ * @brief:  Cập nhật mức suy giảm công suất phát theo Beacon của chu kỳ trước
+ * 			Tăng: ngay khi Relay yêu cầu hoặc Data bị mất. Giảm: tối đa SENSOR_TXP_STEP_DB,
+ * 			chỉ khi SENSOR_TXP_DOWN_BEACONS Beacon liên tiếp khuyến nghị giảm >= SENSOR_TXP_HYST_DB
+ * @param:
+ * 			acked: 1 nếu Relay đã nhận được Data
+ * 			step: Bước khuyến nghị của Relay (dB, > 0: tăng)
+ */
+static void Sensor_UpdateTxPower(uint8_t acked, int8_t step) {
+	if (!acked) step = SENSOR_TXP_STEP_DB;
+
+	if (step > 0) {
+		sensor_txp_down = 0;
+		sensor_txp_atten = (step >= sensor_txp_atten) ? 0 : sensor_txp_atten - step;
+	} else if (step <= -SENSOR_TXP_HYST_DB) {
+		if (++sensor_txp_down < SENSOR_TXP_DOWN_BEACONS) return;
+		sensor_txp_down = 0;
+		uint8_t down = (-step > SENSOR_TXP_STEP_DB) ? SENSOR_TXP_STEP_DB : (uint8_t)-step;
+		sensor_txp_atten = (sensor_txp_atten + down > SENSOR_TXP_MAX_ATTEN) ? SENSOR_TXP_MAX_ATTEN : sensor_txp_atten + down;
+	} else {
+		sensor_txp_down = 0;
+	}
+}
+
+
+/*
+ * @brief:  Ghi mức công suất hiện tại vào SX1278 nếu khác (radio ở Standby)
+ * @param:	_lora: Con trỏ struct LoRa quản lý
+ */
+static void Sensor_ApplyTxPower(LoRa* _lora) {
+	uint8_t power = POWER_20db - sensor_txp_atten;
+
+	if (_lora->power == power) return;
+	_lora->power = power;
+	LoRa_setPower(_lora, power);
+	printf("[SENSOR] TX power: -%d dB (RegPaConfig 0x%02X)\r\n", sensor_txp_atten, power);
+}
+
+
+/*
+ * @brief:  Áp dụng block cấu hình gắn sau bitmap của Beacon (chỉ khi phiên bản khác phiên bản đang dùng)
+ * 			Xác nhận: CfgVer trong bản tin Data kế tiếp (gửi cả khi đang trong dead-band)
+ * @param:
+ * 			_ver: Phiên bản cấu hình
+ * 			_tlv: Con trỏ TLV đầu tiên
+ * 			_len: Tổng độ dài các TLV
+ */
+static void Sensor_ApplyConfig(uint8_t _ver, const uint8_t* _tlv, int _len) {
+	if (_ver == sensor_cfg_ver) return;
+
+	for (int ptr = 0; ptr + SCFG_TLV_HEADER_LEN <= _len; ) {
+		uint8_t type = _tlv[ptr];
+		uint8_t t_len = _tlv[ptr+1];
+		const uint8_t* v = &_tlv[ptr + SCFG_TLV_HEADER_LEN];
+
+		ptr += SCFG_TLV_HEADER_LEN + t_len;
+		if (ptr > _len) break;
+
+		if (type == SCFG_TLV_MEASURE_CYCLE && t_len >= 1 && v[0] > 0) {
+			sensor_measure_cycle = v[0];
+		} else if (type == SCFG_TLV_THRESHOLDS && t_len >= SCFG_THRESHOLDS_LEN) {
+			sensor_thresholds.temp_min = (int16_t)((v[0] << 8) | v[1]);
+			sensor_thresholds.temp_max = (int16_t)((v[2] << 8) | v[3]);
+			sensor_thresholds.hum_min  = (uint16_t)((v[4] << 8) | v[5]);
+			sensor_thresholds.hum_max  = (uint16_t)((v[6] << 8) | v[7]);
+			sensor_thresholds.soil_min = v[8];
+			sensor_thresholds.soil_max = v[9];
+		}
+	}
+
+	sensor_cfg_ver = _ver;
+	sensor_report_unacked = 1;
+	printf("[SENSOR] Config v%u applied: measure every %u cycle(s).\r\n", sensor_cfg_ver, sensor_measure_cycle);
+}
+
+
+/*
+ * @brief:  Lưu Relay, slot, thông số chu kỳ và mốc pha vào thanh ghi backup (giữ qua reset khi còn VBAT)
+ * 			Mốc pha = bộ đếm RTC tại Beacon gần nhất (cộng stretch khi Relay dời lịch); bộ đếm RTC chạy tiếp qua reset
+ * @param:
+ * 			_relayID: ID Relay đã đăng ký
+ * 			_mySlot: TDMA time slot được cấp phát
+ */
+static void Sensor_SaveBackup(uint8_t _relayID, uint8_t _mySlot) {
+	int32_t age_ms = (int32_t)(HAL_GetTick() - sensor_sync.ref_tick) - (int32_t)sensor_sync.stretch_ms;
+	uint32_t anchor = RTC_GetCounter();
+
+	if (age_ms >= 0) anchor -= RTC_MS_TO_TICKS(age_ms);
+	else anchor += RTC_MS_TO_TICKS(-age_ms);
+
+	HAL_RTCEx_BKUPWrite(&hrtc, SENSOR_BKP_DR_ID, ((uint32_t)SENSOR_BKP_MAGIC << 8) | _relayID);
+	HAL_RTCEx_BKUPWrite(&hrtc, SENSOR_BKP_DR_SLOT, _mySlot);
+	HAL_RTCEx_BKUPWrite(&hrtc, SENSOR_BKP_DR_CYCLE, TOTAL_CYCLE_SEC);
+	HAL_RTCEx_BKUPWrite(&hrtc, SENSOR_BKP_DR_SLOT_MS, sensor_sync.slot_ms);
+	HAL_RTCEx_BKUPWrite(&hrtc, SENSOR_BKP_DR_ANCHOR_L, anchor & 0xFFFF);
+	HAL_RTCEx_BKUPWrite(&hrtc, SENSOR_BKP_DR_ANCHOR_H, anchor >> 16);
+	HAL_RTCEx_BKUPWrite(&hrtc, SENSOR_BKP_DR_CHANNEL, sensor_channel);
+}
+
+
+/*
+ * @brief:  Kênh thử đăng ký với Relay ứng viên: kênh trong backup (nếu là Relay đã đăng ký) hoặc kênh GW gán theo ID,
+ * 			lệch thêm sensor_ch_scan kênh con sau mỗi vòng ứng viên thất bại
+ * @param:	_relayID: ID Relay ứng viên
+ * @return: Kênh (LORA_CH_x)
+ */
+static uint8_t Sensor_ChannelFor(uint8_t _relayID) {
+	uint8_t ch = LoRaApp_Channel_ForRelay(_relayID);
+	uint32_t bkp_ch = HAL_RTCEx_BKUPRead(&hrtc, SENSOR_BKP_DR_CHANNEL);
+
+	if (HAL_RTCEx_BKUPRead(&hrtc, SENSOR_BKP_DR_ID) == (((uint32_t)SENSOR_BKP_MAGIC << 8) | _relayID)
+			&& bkp_ch != LORA_CH_GATEWAY && bkp_ch < LORA_CH_COUNT) {
+		ch = (uint8_t)bkp_ch;
+	}
+	if (LORA_CH_COUNT > 2 && sensor_ch_scan > 0) {
+		ch = (uint8_t)(1 + (ch + LORA_CH_COUNT - 2 + sensor_ch_scan) % (LORA_CH_COUNT - 1));
+	}
+	return ch;
+}
+
+
+/*
+ * @brief:  Vào lại lịch từ mốc pha trong backup, không bật radio: Beacon kế tiếp = mốc + k * chu kỳ
+ * 			Beacon kế tiếp (Sensor_WaitBeacon) xác nhận lại; lỡ -> đồng bộ lại nhanh như thường
+ * @return: 1 nếu mốc dùng được, 0 nếu mốc quá cũ (hoặc bộ đếm RTC đã bị đặt lại)
+ */
+static uint8_t Sensor_ResumeFromAnchor(void) {
+	uint32_t anchor = (HAL_RTCEx_BKUPRead(&hrtc, SENSOR_BKP_DR_ANCHOR_H) << 16)
+					| (HAL_RTCEx_BKUPRead(&hrtc, SENSOR_BKP_DR_ANCHOR_L) & 0xFFFF);
+	uint32_t age = RTC_GetCounter() - anchor;
+	uint32_t cycle = RTC_MS_TO_TICKS((uint32_t)TOTAL_CYCLE_SEC * 1000);
+
+	if (age > (uint32_t)SENSOR_ANCHOR_MAX_AGE_S * RTC_TICK_HZ || cycle == 0) return 0;
+
+	// Beacon gần nhất theo lưới chu kỳ của Relay; coi như vừa lỡ 1 Beacon để nới lead cho lần nghe đầu
+	sensor_sync.ref_tick = HAL_GetTick() - RTC_TICKS_TO_MS(age % cycle);
+	sensor_sync.synced = 0;
+	sensor_sync.missed = 1;
+	sensor_sync.skipped = 0;
+	sensor_sync.stretch_ms = 0;
+	sensor_wait_ack = 0;
+	sensor_upload_wait = 0;
+
+	printf("[SENSOR] Phase anchor %lu s old -> resume schedule, next Beacon verifies.\r\n", age >> RTC_TICK_SHIFT);
+	return 1;
+}
+
+
+/*
+ * @brief:  Đọc Relay và slot đã đăng ký từ thanh ghi backup, khôi phục chu kỳ, độ rộng slot và kênh của cluster
+ * @param:
+ * 			_mySlot: Nơi ghi slot đọc được
+ * @return: 1 nếu backup hợp lệ (Relay nằm trong SENSOR_RELAY_CANDIDATES), 0 nếu không (lần cấp nguồn đầu / mất VBAT)
+ */
+static uint8_t Sensor_LoadBackup(uint8_t* _mySlot) {
+	uint32_t id = HAL_RTCEx_BKUPRead(&hrtc, SENSOR_BKP_DR_ID);
+	uint32_t cycle = HAL_RTCEx_BKUPRead(&hrtc, SENSOR_BKP_DR_CYCLE);
+	uint8_t i;
+
+	if ((id >> 8) != SENSOR_BKP_MAGIC || cycle == 0) return 0;
+	for (i = 0; i < SENSOR_RELAY_CANDIDATE_COUNT; i++) {
+		if (sensor_relays[i] == (uint8_t)id) break;
+	}
+	if (i == SENSOR_RELAY_CANDIDATE_COUNT) return 0;
+
+	sensor_relay_idx = i;
+	// Kênh GW không dùng cho cluster (backup của bản 1 kênh) -> kênh GW gán theo ID Relay
+	uint32_t ch = HAL_RTCEx_BKUPRead(&hrtc, SENSOR_BKP_DR_CHANNEL);
+	sensor_channel = (ch != LORA_CH_GATEWAY && ch < LORA_CH_COUNT) ? (uint8_t)ch : LoRaApp_Channel_ForRelay((uint8_t)id);
+
+	*_mySlot = (uint8_t)HAL_RTCEx_BKUPRead(&hrtc, SENSOR_BKP_DR_SLOT);
+	TOTAL_CYCLE_SEC = (uint16_t)cycle;
+	sensor_sync.slot_ms = (uint16_t)HAL_RTCEx_BKUPRead(&hrtc, SENSOR_BKP_DR_SLOT_MS);
+	if (sensor_sync.slot_ms == 0) sensor_sync.slot_ms = SENSOR_TDMA_SLOT_MS;
+	return 1;
+}
+
+
+/*
+ * @brief:  Xử lý Beacon đầu chu kỳ của Relay: đồng bộ mốc thời gian, ước lượng trôi, đọc bitmap ACK
+ * @param:
+ * 			_rxBuf: Con trỏ buffer chứa Beacon
+ * 			len: Độ dài bản tin
+ * 			_mySlot: TDMA time slot được cấp phát
+ * 			rx_tick: HAL tick lúc nhận xong Beacon
+ */
+static void Sensor_HandleBeacon(uint8_t* _rxBuf, int len, uint8_t _mySlot, uint32_t rx_tick) {
+	msg_rl_beacon_t* beacon = (msg_rl_beacon_t*)_rxBuf;
+
+	// Sai lệch so với dự đoán: > 0 là dậy quá sớm (RTC chạy nhanh), < 0 là dậy muộn
+	int32_t error_ms = (int32_t)(rx_tick - sensor_sync.wake_tick) - (int32_t)Sensor_SyncLead();
+
+	// Chỉ ước lượng trôi khi chu kỳ trước đã đồng bộ (tránh học sai sau khi lỡ Beacon)
+	// Ngủ qua nhiều chu kỳ (gửi gộp) -> sai lệch tích lũy chia đều cho từng chu kỳ
+	if (sensor_sync.synced && sensor_sync.missed == 0) {
+		sensor_sync.drift_ms += error_ms / (2 * ((int32_t)sensor_sync.skipped + 1));
+		if (sensor_sync.drift_ms > SENSOR_SYNC_MAX_DRIFT_MS) sensor_sync.drift_ms = SENSOR_SYNC_MAX_DRIFT_MS;
+		if (sensor_sync.drift_ms < -SENSOR_SYNC_MAX_DRIFT_MS) sensor_sync.drift_ms = -SENSOR_SYNC_MAX_DRIFT_MS;
+	}
+
+	sensor_sync.ref_tick = rx_tick;
+	sensor_sync.cycle = beacon->cycle_count;
+	sensor_sync.relay_rtc = beacon->rtc_time;
+	sensor_sync.missed = 0;
+	sensor_sync.skipped = 0;
+	sensor_sync.synced = 1;
+	TOTAL_CYCLE_SEC = beacon->total_cycle;
+	if (beacon->slot_ms > 0) sensor_sync.slot_ms = beacon->slot_ms;
+	sensor_sync.stretch_ms = (uint32_t)beacon->stretch * GW_SCHED_UNIT_MS;	// Relay dời lịch: Beacon sau trễ thêm
+	sensor_resync_fail = 0;
+	if (_mySlot != SENSOR_SLOT_NONE) {
+		Sensor_SaveBackup(beacon->relay_id, _mySlot);	// Chu kỳ / slot_ms có thể đã đổi
+	}
+
+	printf("[SENSOR] Beacon #%u: Error %ld ms, Drift %ld ms/cycle\r\n",
+			sensor_sync.cycle, error_ms, sensor_sync.drift_ms);
+
+	// Bitmap ACK data của chu kỳ trước (chỉ đánh giá khi chu kỳ trước có gửi Data)
+	if (sensor_wait_ack && beacon->bitmap_len > 0) {
+		uint8_t byte_idx = _mySlot / 8;
+		uint8_t acked = 0;
+		if (byte_idx < beacon->bitmap_len && (int)(sizeof(msg_rl_beacon_t) + byte_idx) < len) {
+			acked = (_rxBuf[sizeof(msg_rl_beacon_t) + byte_idx] >> (_mySlot % 8)) & 0x01;
+		}
+		Sensor_UpdateRedundancy(acked);
+		printf("[SENSOR] Data ACK from Relay: %s -> Copies: %d\r\n", acked ? "OK" : "MISSED", sensor_tx_copies);
+
+		// Khuyến nghị công suất của slot: 4 bit có dấu sau bitmap
+		int txp = sizeof(msg_rl_beacon_t) + beacon->bitmap_len + _mySlot / 2;
+		int8_t step = 0;
+		if (_mySlot / 2 < RL_TXP_BYTES(beacon->bitmap_len) && txp < len) {
+			step = (int8_t)(_rxBuf[txp] << (4 - (_mySlot % 2) * 4)) >> 4;
+		}
+		Sensor_UpdateTxPower(acked, step);
+
+		// Gửi gộp: Relay đã nhận -> xóa các mẫu vừa gửi, mất -> giữ lại gửi kèm lần sau
+		if (acked) {
+			sensor_nack_streak = 0;
+			sensor_batch_head = (sensor_batch_head + sensor_batch_sent) % SENSOR_BATCH_MAX_SAMPLES;
+			sensor_batch_len -= sensor_batch_sent;
+			sensor_report_unacked = 0;
+		} else if (sensor_nack_streak < 0xFF) {
+			sensor_nack_streak++;	// Relay vẫn phát Beacon nhưng không nhận Data (hết slot / đã khởi động lại)
+		}
+	}
+	sensor_batch_sent = 0;
+	sensor_wait_ack = 0;
+
+	// Cấu hình Sensor gắn sau khuyến nghị công suất: [Cfg_Ver | Cfg_Len | TLV...]
+	int cfg = sizeof(msg_rl_beacon_t) + beacon->bitmap_len + RL_TXP_BYTES(beacon->bitmap_len);
+	if (cfg + 2 <= len && cfg + 2 + _rxBuf[cfg+1] <= len) {
+		Sensor_ApplyConfig(_rxBuf[cfg], &_rxBuf[cfg+2], _rxBuf[cfg+1]);
+	}
+}
+
+
+/*
+ * @brief:  Chu kỳ không gửi (gửi gộp): không bật radio, giữ mốc chu kỳ theo dự đoán (wake + lead)
+ */
+static void Sensor_SkipCycle(void) {
+	sensor_sync.wake_tick = HAL_GetTick();
+	sensor_sync.ref_tick = sensor_sync.wake_tick + Sensor_SyncLead();
+	sensor_sync.cycle++;
+	sensor_sync.stretch_ms = 0;
+	if (sensor_sync.skipped < 0xFF) sensor_sync.skipped++;
+
+	printf("[SENSOR] Upload in %d cycle(s). Radio off.\r\n", sensor_upload_wait + 1);
+}
+
+
+/*
+ * @brief:  Kiểm tra mẫu đo có cần báo cáo không (dead-band so với lần báo cáo gần nhất)
+ * @param:	_sample: Mẫu đo (cycle = chu kỳ hiện tại)
+ * @return: 1 nếu 1 đại lượng vượt ngưỡng, hết SENSOR_HEARTBEAT_CYCLES, hoặc dead-band đang tắt
+ */
+static uint8_t Sensor_OutsideDeadband(const Sensor_Sample_t* _sample) {
+	if (!SENSOR_DEADBAND_ENABLE || !sensor_reported_valid) return 1;
+	if ((uint16_t)(_sample->cycle - sensor_reported.cycle) >= SENSOR_HEARTBEAT_CYCLES) return 1;
+
+	int32_t d_temp = (int32_t)_sample->temp - sensor_reported.temp;
+	int32_t d_hum  = (int32_t)_sample->hum - sensor_reported.hum;
+	int32_t d_soil = (int32_t)_sample->soil - sensor_reported.soil;
+
+	return (d_temp > SENSOR_DEADBAND_TEMP || d_temp < -SENSOR_DEADBAND_TEMP ||
+			d_hum > SENSOR_DEADBAND_HUM || d_hum < -SENSOR_DEADBAND_HUM ||
+			d_soil > SENSOR_DEADBAND_SOIL || d_soil < -SENSOR_DEADBAND_SOIL);
+}
+
+
+/*
+ * @brief:  Chu kỳ này có cần phát không
+ * 			Gửi gộp: còn mẫu chưa được ACK. Gửi mỗi chu kỳ: giá trị vượt dead-band, tới heartbeat,
+ * 			hoặc lần gửi trước chưa được ACK (lỡ Beacon / Relay không nhận)
+ * @return: 1 nếu cần phát
+ */
+static uint8_t Sensor_HasUplink(void) {
+	if (SENSOR_UPLOAD_PERIOD > 1) {
+		if (sensor_batch_len == 0) {
+			printf("[SENSOR] No samples to upload.\r\n");
+			return 0;
+		}
+		return 1;
+	}
+
+	Sensor_Sample_t now = {
+		.cycle = sensor_sync.cycle,
+		.temp = sensor_latest_data.temp_val,
+		.hum = sensor_latest_data.hum_val,
+		.soil = sensor_latest_data.soil_val,
+	};
+	if (!sensor_report_unacked && !Sensor_OutsideDeadband(&now)) {
+		printf("[SENSOR] Within dead-band (%u cycles since report). Skip uplink.\r\n",
+				(uint16_t)(now.cycle - sensor_reported.cycle));
+		return 0;
+	}
+
+	sensor_reported = now;
+	sensor_reported_valid = 1;
+	sensor_report_unacked = 1;		// Xóa khi bitmap ACK của Beacon sau xác nhận
+	return 1;
+}
+
+
+/*
+ * @brief:  Lưu 1 mẫu đo vào ring buffer chờ gửi gộp (đầy -> bỏ mẫu cũ nhất)
+ * @param:	_sample: Mẫu đo
+ */
+static void Sensor_BatchPush(const Sensor_Sample_t* _sample) {
+	if (sensor_batch_len == SENSOR_BATCH_MAX_SAMPLES) {
+		sensor_batch_head = (sensor_batch_head + 1) % SENSOR_BATCH_MAX_SAMPLES;
+		sensor_batch_len--;
+		if (sensor_batch_sent > 0) sensor_batch_sent--;
+		printf("[SENSOR] Batch full. Oldest sample dropped.\r\n");
+	}
+	sensor_batch[(sensor_batch_head + sensor_batch_len) % SENSOR_BATCH_MAX_SAMPLES] = *_sample;
+	sensor_batch_len++;
+}
+
+
+/*
+ * @brief:  Đóng gói bản tin SS_BATCH từ toàn bộ mẫu đang lưu (cũ nhất trước)
+ * 			[Func | SensorID | RelayID | Period | CfgVer | N | Age | Temp_H | Temp_L | Hum_H | Hum_L | Soil | ...]
+ * @param:
+ * 			_buf: Buffer gửi (>= SS_BATCH_MAX_LEN)
+ * 			_myID: ID sensor node
+ * 			_targetRelayID: ID relay node mục tiêu
+ * @return: Độ dài bản tin
+ */
+static uint8_t Sensor_PackBatch(uint8_t* _buf, uint8_t _myID, uint8_t _targetRelayID) {
+	uint8_t idx = 0;
+
+	_buf[idx++] = FUNC_CODE_SS_BATCH;
+	_buf[idx++] = _myID;
+	_buf[idx++] = _targetRelayID;
+	_buf[idx++] = SENSOR_UPLOAD_PERIOD;
+	_buf[idx++] = sensor_cfg_ver;
+	_buf[idx++] = sensor_batch_len;
+
+	for (int i = 0; i < sensor_batch_len; i++) {
+		const Sensor_Sample_t* s = &sensor_batch[(sensor_batch_head + i) % SENSOR_BATCH_MAX_SAMPLES];
+		uint16_t age = (uint16_t)(sensor_sync.cycle - s->cycle);
+
+		_buf[idx++] = (age > 0xFF) ? 0xFF : (uint8_t)age;
+		_buf[idx++] = (s->temp >> 8) & 0xFF;
+		_buf[idx++] = (s->temp) & 0xFF;
+		_buf[idx++] = (s->hum >> 8) & 0xFF;
+		_buf[idx++] = (s->hum) & 0xFF;
+		_buf[idx++] = s->soil;
+	}
+	sensor_batch_sent = sensor_batch_len;
+	return idx;
+}
+
+
+/*
+ * @brief:  Chờ Beacon đầu chu kỳ từ Relay (Timeout: 2 x lead + SENSOR_BEACON_MARGIN_MS)
+ * 			Lỡ Beacon -> chạy tự do theo mốc dự đoán (wake + lead)
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_targetRelayID: ID relay node mục tiêu
+ * 			_mySlot: TDMA time slot được cấp phát
+ * @return:
+ * 			1 nếu nhận được Beacon, 0 nếu timeout
+ */
+static uint8_t Sensor_WaitBeacon(LoRa* _lora, uint8_t _targetRelayID, uint8_t _mySlot) {
+	extern volatile uint8_t loraRxDoneFlag;
+	uint8_t rx_buf[RL_BEACON_MAX_LEN];
+	uint32_t lead = Sensor_SyncLead();
+	uint32_t timeout = 2 * lead + SENSOR_BEACON_MARGIN_MS;
+
+	LoRa_setMode(_lora, RXCONTIN_MODE);
+
+	while (HAL_GetTick() - sensor_sync.wake_tick < timeout) {
+		if (loraRxDoneFlag) {
+			loraRxDoneFlag = 0;
+			uint32_t rx_tick = HAL_GetTick();
+
+			int len = LoRaApp_Receive(_lora, rx_buf, sizeof(rx_buf));
+			if (len >= (int)sizeof(msg_rl_beacon_t) && rx_buf[0] == FUNC_CODE_RL_BEACON && rx_buf[1] == _targetRelayID) {
+				Sensor_HandleBeacon(rx_buf, len, _mySlot, rx_tick);
+				LoRa_setMode(_lora, STNBY_MODE);
+				return 1;
+			}
+		}
+	}
+
+	// Không có Beacon: mốc chu kỳ = thời điểm dự đoán, giữ nguyên mức dư thừa
+	sensor_sync.ref_tick = sensor_sync.wake_tick + lead;
+	sensor_sync.cycle++;
+	sensor_sync.stretch_ms = 0;
+	if (sensor_sync.missed < 0xFF) sensor_sync.missed++;
+	sensor_wait_ack = 0;
+
+	printf("[SENSOR] Beacon missed (%d) -> Free-running.\r\n", sensor_sync.missed);
+	LoRa_setMode(_lora, STNBY_MODE);
+	return 0;
+}
+
+
+/*
+ * @brief:  Đồng bộ lại nhanh: nghe liên tục trọn 1 chu kỳ (+ SENSOR_RESYNC_MARGIN_MS) tới khi có Beacon của Relay
+ * 			Beacon ở vị trí bất kỳ trong chu kỳ đều bắt được; giữ slot cũ, không cần ADV / ACK
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_targetRelayID: ID relay node mục tiêu
+ * 			_mySlot: TDMA time slot đã được cấp phát (SENSOR_SLOT_NONE: chưa đăng ký, chỉ lấy mốc chu kỳ)
+ * @return:
+ * 			1 nếu nhận được Beacon (mốc chu kỳ = Beacon vừa nhận), 0 nếu timeout
+ */
+static uint8_t Sensor_ListenBeacon(LoRa* _lora, uint8_t _targetRelayID, uint8_t _mySlot) {
+	extern volatile uint8_t loraRxDoneFlag;
+	uint8_t rx_buf[RL_BEACON_MAX_LEN];
+	uint32_t start = HAL_GetTick();
+	uint32_t timeout = (uint32_t)TOTAL_CYCLE_SEC * 1000 + SENSOR_RESYNC_MARGIN_MS;
+
+	printf("[SENSOR] Resync: listening for Relay 0x%02X Beacon (%lu ms)...\r\n", _targetRelayID, timeout);
+	LoRa_setMode(_lora, RXCONTIN_MODE);
+
+	while (HAL_GetTick() - start < timeout) {
+		if (loraRxDoneFlag) {
+			loraRxDoneFlag = 0;
+			uint32_t rx_tick = HAL_GetTick();
+
+			int len = LoRaApp_Receive(_lora, rx_buf, sizeof(rx_buf));
+			if (len >= (int)sizeof(msg_rl_beacon_t) && rx_buf[0] == FUNC_CODE_RL_BEACON && rx_buf[1] == _targetRelayID) {
+				// Không ước lượng trôi / đánh giá ACK từ lần nghe này (mốc cũ không còn đúng)
+				sensor_sync.synced = 0;
+				sensor_wait_ack = 0;
+				sensor_upload_wait = 0;
+				Sensor_HandleBeacon(rx_buf, len, _mySlot, rx_tick);
+				LoRa_setMode(_lora, STNBY_MODE);
+				printf("[SENSOR] Relay 0x%02X Beacon heard after %lu ms.\r\n", _targetRelayID, rx_tick - start);
+				return 1;
+			}
+		}
+	}
+
+	// Không thấy Beacon: lấy mốc hiện tại, chu kỳ sau thử lại (tới SENSOR_RESYNC_ATTEMPTS lần)
+	sensor_sync.ref_tick = HAL_GetTick();
+	sensor_sync.stretch_ms = 0;
+	if (sensor_resync_fail < 0xFF) sensor_resync_fail++;
+
+	printf("[SENSOR] Resync failed (%d/%d).\r\n", sensor_resync_fail, SENSOR_RESYNC_ATTEMPTS);
+	LoRa_setMode(_lora, STNBY_MODE);
+	return 0;
+}
+
+
+/*
+ * @brief:  So mẫu đo mới nhất với ngưỡng cục bộ
+ * @return: Các bit ALARM_FLAG_x của đại lượng đang vượt ngưỡng
+ */
+static uint8_t Sensor_CheckThresholds(void) {
+	uint8_t flags = 0;
+
+	if (sensor_latest_data.temp_val < sensor_thresholds.temp_min) flags |= ALARM_FLAG_TEMP_LOW;
+	if (sensor_latest_data.temp_val > sensor_thresholds.temp_max) flags |= ALARM_FLAG_TEMP_HIGH;
+	if (sensor_latest_data.hum_val < sensor_thresholds.hum_min) flags |= ALARM_FLAG_HUM_LOW;
+	if (sensor_latest_data.hum_val > sensor_thresholds.hum_max) flags |= ALARM_FLAG_HUM_HIGH;
+	if (sensor_latest_data.soil_val < sensor_thresholds.soil_min) flags |= ALARM_FLAG_SOIL_LOW;
+	if (sensor_latest_data.soil_val > sensor_thresholds.soil_max) flags |= ALARM_FLAG_SOIL_HIGH;
+	return flags;
+}
+
+
+/*
+ * @brief:  Áp dụng REG_ACK của Relay: slot, chu kỳ và mốc đầu chu kỳ của Relay, lưu vào thanh ghi backup
+ * @param:
+ * 			_ack: Bản tin ACK (đã kiểm tra ID)
+ * 			_rx_tick: HAL tick lúc nhận xong ACK
+ * @return: TDMA slot được cấp phát
+ */
+static uint8_t Sensor_ApplyRegAck(const msg_ss_reg_ack_t* _ack, uint32_t _rx_tick) {
+	// Lấy total_cycle và time slot được cấp phát
+	uint8_t assigned_slot = _ack->time_slot;
+	TOTAL_CYCLE_SEC = _ack->total_cycle;
+
+	// Mốc đầu chu kỳ của Relay = thời điểm nhận ACK - offset trong chu kỳ
+	sensor_sync.ref_tick = _rx_tick - _ack->cycle_offset_ms;
+	sensor_sync.missed = 0;
+	sensor_sync.skipped = 0;
+	sensor_sync.synced = 0;
+	sensor_upload_wait = 0;
+	sensor_sync.drift_ms = 0;
+	sensor_sync.stretch_ms = 0;
+	sensor_sync.slot_ms = _ack->slot_ms ? _ack->slot_ms : SENSOR_TDMA_SLOT_MS;
+	sensor_resync_fail = 0;
+	sensor_nack_streak = 0;
+	sensor_ch_scan = 0;
+	Sensor_SaveBackup(_ack->relay_id, assigned_slot);
+
+	printf("\r\n[SENSOR] !!! ACK RECEIVED FROM RELAY 0x%02X!!!\r\n", _ack->relay_id);
+	printf("[SENSOR] Assigned TDMA Slot: %d (%d ms)\r\n", assigned_slot, sensor_sync.slot_ms);
+	printf("[SENSOR] Syncing Cycle: Relay is %d ms into a %d s cycle...\r\n", _ack->cycle_offset_ms, TOTAL_CYCLE_SEC);
+	return assigned_slot;
+}
+
+
+/*
+ * @brief:  Gửi ADV trong các slot cảnh báo của Relay (đã đồng bộ theo Beacon của Relay đó), CAD + backoff như cảnh báo
+ * 			Relay ACK ngay trong slot -> cả cụm Sensor cùng chuyển sang 1 Relay không tạo bão ADV
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myID: ID sensor node
+ * 			_relayID: ID Relay ứng viên
+ * @return: TDMA slot được cấp, SENSOR_SLOT_NONE nếu hết slot cảnh báo của chu kỳ mà chưa được ACK
+ */
+static uint8_t Sensor_AdvInAlarmSlots(LoRa* _lora, uint8_t _myID, uint8_t _relayID) {
+	extern volatile uint8_t loraRxDoneFlag;
+	uint8_t tx_buf[sizeof(msg_ss_reg_adv_t)] = { FUNC_CODE_REG_ADV, _myID, _relayID };
+	uint8_t rx_buf[16];
+	uint32_t window = LoRaApp_Alarm_WindowMs(_lora);
+	uint32_t cycle_end = sensor_sync.ref_tick + (uint32_t)TOTAL_CYCLE_SEC * 1000 + sensor_sync.stretch_ms;
+
+	for (;;) {
+		// Slot cảnh báo kế tiếp của Relay (mốc tính như Relay: từ Beacon)
+		uint32_t k = (HAL_GetTick() - sensor_sync.ref_tick) / RELAY_ALARM_PERIOD_MS + 1;
+		uint32_t slot_tick = sensor_sync.ref_tick + k * RELAY_ALARM_PERIOD_MS;
+		if ((int32_t)(cycle_end - (slot_tick + window)) < 0) return SENSOR_SLOT_NONE;
+
+		int32_t wait = (int32_t)(slot_tick + RELAY_ALARM_GUARD_MS - HAL_GetTick());
+		if (wait > 0) Sleep_Precise_Ms((uint32_t)wait);
+
+		LoRa_setMode(_lora, STNBY_MODE);
+		if (!LoRaApp_Alarm_WaitChannel(_lora, _myID)) continue;
+		LoRaApp_Transmit(_lora, tx_buf, sizeof(tx_buf), 200, AIR_PRIO_NORMAL);
+		printf("[SENSOR] ADV to Relay 0x%02X in alarm slot %lu.\r\n", _relayID, k);
+
+		// Chờ REG_ACK tới hết slot
+		LoRa_setMode(_lora, RXCONTIN_MODE);
+		while ((int32_t)(slot_tick + window - HAL_GetTick()) > 0) {
+			if (loraRxDoneFlag) {
+				loraRxDoneFlag = 0;
+				uint32_t rx_tick = HAL_GetTick();
+				int len = LoRaApp_Receive(_lora, rx_buf, sizeof(rx_buf));
+				msg_ss_reg_ack_t* ack = (msg_ss_reg_ack_t*)rx_buf;
+				if (len >= (int)sizeof(msg_ss_reg_ack_t) && ack->func_code == FUNC_CODE_REG_ACK
+						&& ack->relay_id == _relayID && ack->target_sensor_id == _myID) {
+					LoRa_setMode(_lora, STNBY_MODE);
+					return Sensor_ApplyRegAck(ack, rx_tick);
+				}
+			}
+		}
+		LoRa_setMode(_lora, STNBY_MODE);
+	}
+}
+
+
+/*
+ * @brief:  Thực hiện pha đăng ký với Relay.
+ * 			Còn slot trong backup (reset / brown-out): nghe Beacon, giữ slot cũ
+ * 			Không thì thử lần lượt các Relay trong SENSOR_RELAY_CANDIDATES, mỗi Relay tối đa SENSOR_FAILOVER_REG_CYCLES chu kỳ:
+ * 			nghe Beacon rồi gửi ADV trong slot cảnh báo, không có Beacon -> gửi ADV định kỳ như cũ
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_rxBuf: Con trỏ buffer nhận
+ * 			_rxBufSize: Kích thước buffer nhận
+ * 			_rxFlag: Cờ nhận (recieve flag)
+ * 			_myID: ID sensor node
+ * @return:
+ * 			Time Slot (ID khe thời gian) được Relay cấp phát (Relay: LoRaApp_Sensor_GetRelayID()).
+ */
+
+uint8_t LoRaApp_Sensor_RegistrationPhase(
+		LoRa* _lora, uint8_t* _rxBuf, uint16_t _rxBufSize,
+		volatile uint8_t* _rxFlag, uint8_t _myID) {
+
+	msg_ss_reg_ack_t* ack_msg;
+    uint8_t tx_buffer[10];
+    uint8_t slot;
+    uint8_t reg_attempt = 0;
+
+    printf("\r\n[SENSOR] >>> START REGISTRATION PHASE <<<\r\n");
+    LoRaApp_Random_Seed(_lora);
+
+    // Relay mới / liên kết chưa rõ: phát công suất tối đa tới khi Relay khuyến nghị lại
+    sensor_txp_atten = 0;
+    sensor_txp_down = 0;
+    Sensor_ApplyTxPower(_lora);
+
+    // 0. Còn slot trong backup (reset / brown-out): vào lại lịch theo mốc pha; mốc quá cũ -> nghe Beacon tối đa SENSOR_RESYNC_ATTEMPTS chu kỳ
+    // Relay cấp slot theo vị trí Sensor trong danh sách quản lý -> slot cũ vẫn đúng, không cần ADV
+    // (Relay liên tục không ACK Data -> slot cũ không còn giá trị, bỏ qua backup)
+    if (sensor_resync_fail < SENSOR_RESYNC_ATTEMPTS && sensor_nack_streak < SENSOR_FAILOVER_NACKS
+    		&& Sensor_LoadBackup(&slot)) {
+    	LoRaApp_Channel_Set(_lora, sensor_channel);
+    	// Mốc pha còn mới: vào lịch ngay, không nghe Beacon trước
+    	if (Sensor_ResumeFromAnchor()) {
+    		LoRaApp_Sensor_SleepUntilNextCycle();
+    		printf("[SENSOR] Woke up! Resumed from backup. Entering Main Loop.\r\n");
+    		return slot;
+    	}
+    	while (sensor_resync_fail < SENSOR_RESYNC_ATTEMPTS) {
+    		if (Sensor_ListenBeacon(_lora, LoRaApp_Sensor_GetRelayID(), slot)) {
+    			LoRaApp_Sensor_SleepUntilNextCycle();
+    			printf("[SENSOR] Woke up! Resync Complete. Entering Main Loop.\r\n");
+    			return slot;
+    		}
+    	}
+    }
+
+    // Mất Beacon của Relay hiện tại -> thử Relay ứng viên kế tiếp trước
+    // (Relay vẫn phát Beacon nhưng không ACK Data: có thể vừa khởi động lại -> thử lại chính nó trước)
+    if (sensor_resync_fail >= SENSOR_RESYNC_ATTEMPTS) {
+    	sensor_relay_idx = (sensor_relay_idx + 1) % SENSOR_RELAY_CANDIDATE_COUNT;
+    }
+    sensor_nack_streak = 0;
+
+	while (1) {
+		uint8_t relay_id = sensor_relays[sensor_relay_idx];
+		sensor_channel = Sensor_ChannelFor(relay_id);
+		LoRaApp_Channel_Set(_lora, sensor_channel);
+		printf("[SENSOR] Registering with Relay 0x%02X (candidate %d/%d, channel %d)...\r\n",
+				relay_id, sensor_relay_idx + 1, SENSOR_RELAY_CANDIDATE_COUNT, sensor_channel);
+
+		// 1. Nghe được Beacon -> ADV trong slot cảnh báo, Relay ACK ngay trong slot
+		if (ALARM_ENABLE && Sensor_ListenBeacon(_lora, relay_id, SENSOR_SLOT_NONE)) {
+			slot = Sensor_AdvInAlarmSlots(_lora, _myID, relay_id);
+			if (slot != SENSOR_SLOT_NONE) {
+				LoRaApp_Sensor_SleepUntilNextCycle();
+				printf("[SENSOR] Woke up! Registration Complete. Entering Main Loop.\r\n");
+				return slot;
+			}
+		}
+
+		// 2. Cấu hình bản tin quảng bá ADV, Relay ACK ở cửa sổ ACK sau phiên nghe
+		tx_buffer[0] = FUNC_CODE_REG_ADV;
+		tx_buffer[1] = _myID;
+		tx_buffer[2] = relay_id;
+
+		// Vòng lặp gửi và chờ (tối đa SENSOR_FAILOVER_REG_CYCLES chu kỳ cho mỗi Relay)
+		uint32_t start_relay = HAL_GetTick();
+		uint32_t relay_ms = (uint32_t)SENSOR_FAILOVER_REG_CYCLES * TOTAL_CYCLE_SEC * 1000;
+
+		while (HAL_GetTick() - start_relay < relay_ms) {
+
+			// Gửi bản tin ADV
+			LoRa_setMode(_lora, STNBY_MODE);
+			uint8_t tx_result = LoRaApp_Transmit(_lora, tx_buffer, sizeof(msg_ss_reg_adv_t), TRANSMIT_TIMEOUT, AIR_PRIO_NORMAL);
+
+			if (tx_result) {
+				printf("[SENSOR] Sending ADV Request to Relay 0x%02X... -> OK \r\n", relay_id);
+			} else {
+				printf("[SENSOR] ADV transmission FAILED! Check connection.\r\n");
+			}
+
+			// Chuyển sang chế độ nhận liên tục để chờ ACK
+			LoRa_setMode(_lora, RXCONTIN_MODE);
+
+			uint32_t start_wait = HAL_GetTick();
+
+			// Chờ trong khoảng thời gian REG_TIMEOUT_MS
+			while (HAL_GetTick() - start_wait < REG_TIMEOUT_MS) {
+
+				// Kiểm tra cờ ngắt
+				if (*_rxFlag) {
+					*_rxFlag = 0; // Xóa cờ ngắt
+					uint32_t rx_tick = HAL_GetTick();
+					memset(_rxBuf, 0, _rxBufSize);
+
+					int len = LoRaApp_Receive(_lora, _rxBuf, _rxBufSize);
+
+					// Kiểm tra Function Code và ID: Đúng Relay mình gọi và đúng Sensor ID của mình
+					ack_msg = (msg_ss_reg_ack_t*)_rxBuf;
+					if (len > 0 && _rxBuf[0] == FUNC_CODE_REG_ACK
+							&& ack_msg->target_sensor_id == _myID && ack_msg->relay_id == relay_id) {
+
+						slot = Sensor_ApplyRegAck(ack_msg, rx_tick);
+						HAL_Delay(10);
+
+						// Ngủ tới ngay trước Beacon của chu kỳ sau
+						LoRa_setMode(_lora, STNBY_MODE);
+						LoRaApp_Sensor_SleepUntilNextCycle();
+
+						// Khi thức dậy, thoát khỏi hàm và trả về Slot ID
+						printf("[SENSOR] Woke up! Registration Complete. Entering Main Loop.\r\n");
+
+						return slot;
+					}
+				}
+			}
+			// Backoff mũ ngẫu nhiên (theo UID + nhiễu máy thu) để tránh xung đột, ngủ STOP thay vì HAL_Delay
+			uint32_t backoff = LoRaApp_Backoff_Ms(reg_attempt);
+			if (reg_attempt < 0xFF) reg_attempt++;
+			printf("[SENSOR] No REG_ACK -> retry in %lu ms (attempt %d).\r\n", backoff, reg_attempt);
+			LoRa_setMode(_lora, STNBY_MODE);
+			Sleep_Precise_Ms(backoff);
+		}
+
+		// Relay không trả lời (hỏng / hết slot dự phòng) -> Relay ứng viên kế tiếp
+		printf("[SENSOR] Relay 0x%02X not answering -> next candidate.\r\n", relay_id);
+		sensor_relay_idx = (sensor_relay_idx + 1) % SENSOR_RELAY_CANDIDATE_COUNT;
+
+		// Hết 1 vòng ứng viên -> vòng sau dò kênh con kế tiếp (Relay con dùng kênh của Relay cha)
+		if (sensor_relay_idx == 0 && LORA_CH_COUNT > 2) {
+			sensor_ch_scan = (sensor_ch_scan + 1) % (LORA_CH_COUNT - 1);
+		}
+	}
+}
+
+
+/*
+ * @brief:  TASK 1: Thực hiện gửi dữ liệu từ Sensor -> Relay
+ * 			Chờ Beacon đầu chu kỳ, sau đó gửi tại mốc Beacon + SENSOR_TDMA_GUARD_MS + slot x slot_ms (Relay cấp)
+ * 			Số bản sao gửi đi do bitmap ACK của Relay quyết định (1 ... SENSOR_MAX_REDUNDANCY)
+ * 			Gửi gộp (SENSOR_UPLOAD_PERIOD > 1): chỉ thức radio mỗi SENSOR_UPLOAD_PERIOD chu kỳ, gửi 1 bản tin
+ * 			SS_BATCH chứa mọi mẫu chưa được ACK; các chu kỳ khác bỏ qua Beacon (Relay cũng bỏ qua slot này)
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myID: ID sensor node
+ * 			_targetRelayID: ID relay node mục tiêu
+ * 			_mySlot: TDMA time slot được cấp phát
+ *
+ */
+void LoRaApp_Sensor_Task_SendData(LoRa* _lora, uint8_t _myID, uint8_t _targetRelayID, uint8_t _mySlot) {
+    // Gửi gộp: chưa tới chu kỳ gửi -> không bật radio
+    if (sensor_upload_wait > 0) {
+        sensor_upload_wait--;
+        Sensor_SkipCycle();
+        return;
+    }
+    sensor_upload_wait = SENSOR_UPLOAD_PERIOD - 1;
+
+    // Hàm này chạy ngay khi thức dậy: lấy mốc thức dậy
+    sensor_sync.wake_tick = HAL_GetTick();
+
+    // 1. Đồng bộ theo Beacon (hoặc chạy tự do nếu lỡ)
+    // Lỡ SENSOR_RESYNC_MISSES Beacon liên tiếp -> nghe lại trọn chu kỳ, không thấy thì không phát
+    if (!Sensor_WaitBeacon(_lora, _targetRelayID, _mySlot) && sensor_sync.missed >= SENSOR_RESYNC_MISSES) {
+        if (!Sensor_ListenBeacon(_lora, _targetRelayID, _mySlot)) return;
+    }
+
+    // Không có gì cần gửi (chưa có mẫu / trong dead-band) -> không phát, Beacon vẫn giữ đồng bộ
+    if (!Sensor_HasUplink()) return;
+
+    // 2. TDMA Delay tính từ mốc Beacon
+    uint32_t tdma_offset = SENSOR_TDMA_GUARD_MS + ((uint32_t)_mySlot * sensor_sync.slot_ms);
+    uint32_t elapsed = HAL_GetTick() - sensor_sync.ref_tick;
+
+    printf("[SENSOR] Wait for TDMA slot to sent DATA: %lu ms\r\n", tdma_offset);
+    if (tdma_offset > elapsed) {
+        Sleep_Precise_Ms(tdma_offset - elapsed);	// Radio đang Standby -> ngủ STOP chờ slot
+    }
+
+    // 3. Đóng gói Data (Latest) hoặc toàn bộ mẫu đang lưu (gửi gộp)
+    uint8_t tx_buf[SS_BATCH_MAX_LEN];
+    uint8_t tx_len;
+
+    if (SENSOR_UPLOAD_PERIOD > 1) {
+        tx_len = Sensor_PackBatch(tx_buf, _myID, _targetRelayID);
+    } else {
+        sensor_latest_data.func_code = FUNC_CODE_SS_DATA;
+        sensor_latest_data.sensor_id = _myID;
+        sensor_latest_data.target_relay_id = _targetRelayID;
+        sensor_latest_data.cfg_ver = sensor_cfg_ver;
+        memcpy(tx_buf, &sensor_latest_data, sizeof(msg_ss_data_t));
+        tx_len = sizeof(msg_ss_data_t);
+    }
+
+    LoRa_setMode(_lora, STNBY_MODE);
+    Sensor_ApplyTxPower(_lora);
+
+    //Gửi sensor_tx_copies lần
+    int result = 0;
+    for (int i = 0; i < sensor_tx_copies; i++){
+    	result |= LoRaApp_Transmit(_lora, tx_buf, tx_len, 300, i == 0 ? AIR_PRIO_NORMAL : AIR_PRIO_LOW);
+    	if (i < sensor_tx_copies - 1) HAL_Delay(SENSOR_COPY_GAP_MS);
+    }
+
+	if (result) {
+		sensor_wait_ack = 1;
+		printf("[SENSOR] Data Sent (x%d, %d bytes): T=%d, H=%d\r\n", sensor_tx_copies, tx_len, sensor_latest_data.temp_val, sensor_latest_data.hum_val);
+	} else {
+		printf("[SENSOR] Send Data -> FAILED!\r\n");
+	}
+}
+
+/*
+ * @brief:  Kiểm tra Sensor đã mất Relay: đồng bộ lại nhanh thất bại SENSOR_RESYNC_ATTEMPTS lần liên tiếp
+ * 			hoặc SENSOR_FAILOVER_NACKS lần gửi Data liên tiếp không được ACK
+ * @return: 1 nếu cần đăng ký lại (LoRaApp_Sensor_RegistrationPhase chuyển Relay nếu cần), 0 nếu không
+ */
+uint8_t LoRaApp_Sensor_IsLost(void) {
+	return sensor_resync_fail >= SENSOR_RESYNC_ATTEMPTS || sensor_nack_streak >= SENSOR_FAILOVER_NACKS;
+}
+
+
+/*
+ * @brief:  ID Relay Sensor đang đăng ký (phần tử hiện tại của SENSOR_RELAY_CANDIDATES)
+ * @return: ID Relay
+ */
+uint8_t LoRaApp_Sensor_GetRelayID(void) {
+	return sensor_relays[sensor_relay_idx];
+}
+
+
+/*
+ * @brief:  Số chu kỳ giữa 2 lần đo (main.c đo khi số chu kỳ chia hết)
+ * @return: SENSOR_MEASURE_CYCLE hoặc giá trị Server gửi xuống (SCFG_TLV_MEASURE_CYCLE)
+ */
+uint8_t LoRaApp_Sensor_GetMeasureCycle(void) {
+	return sensor_measure_cycle;
+}
+
+
+/*
+ * @brief:  TASK 2: Sensor thực hiện đo dữ liệu cảm biến (Timeout: SENSOR_MEASURE_WINDOW_MS)
+ * @param:
+ * 			_sensorCfg: Con trỏ tới struct quản lý dữ liệu cảm biến
+ *
+ *
+ */
+
+void LoRaApp_Sensor_Task_Measure(Sensor_Config_t* _sensorCfg) {
+    uint32_t start_task = HAL_GetTick();
+    printf("[SENSOR] Measuring sensor data ... (Timeout: %lu ms)\r\n", SENSOR_MEASURE_WINDOW_MS);
+
+    //Thực hiện chu trình đo
+    Sensor_Data_t myData;
+    Sensor_ReadAll(_sensorCfg, &myData);
+
+//    //Test với không có cảm biến
+//    Sensor_ReadAll_Test(_sensorCfg, &myData);
+
+    //Lưu dữ liệu struct quản lý
+    if(myData.status == 0) {
+    	sensor_latest_data.temp_val = (int16_t)(myData.temp_c * 10);
+    	sensor_latest_data.hum_val  = (uint16_t)(myData.hum_rh * 10);
+    	sensor_latest_data.soil_val = myData.soil_percent;
+        printf("[SENSOR] Measured: %.1f C, %.1f %%\r\n", myData.temp_c, myData.hum_rh);
+
+        // Cảnh báo nhanh: chỉ khi có đại lượng mới vượt ngưỡng (không lặp lại mỗi chu kỳ khi vẫn vượt)
+        uint8_t flags = Sensor_CheckThresholds();
+        if (ALARM_ENABLE && (flags & ~sensor_alarm_flags)) {
+            sensor_alarm_pending = 1;
+            sensor_alarm_tries = ALARM_RETRIES;
+            printf("[SENSOR] Threshold crossed (flags 0x%02X) -> Alarm pending.\r\n", flags);
+        }
+        sensor_alarm_flags = flags;
+
+        // Gửi gộp: lưu mẫu kèm chu kỳ đo (Relay quy đổi lại thời điểm đo), bỏ mẫu nằm trong dead-band
+        if (SENSOR_UPLOAD_PERIOD > 1) {
+            Sensor_Sample_t sample = {
+                .cycle = sensor_sync.cycle,
+                .temp = sensor_latest_data.temp_val,
+                .hum = sensor_latest_data.hum_val,
+                .soil = sensor_latest_data.soil_val,
+            };
+            if (Sensor_OutsideDeadband(&sample)) {
+                Sensor_BatchPush(&sample);
+                sensor_reported = sample;
+                sensor_reported_valid = 1;
+            } else {
+                printf("[SENSOR] Sample within dead-band. Not stored.\r\n");
+            }
+        }
+    } else {
+        printf("[SENSOR] Measure Failed. Keep Old Data.\r\n");
+    }
+
+    // Padding thời gian cho đủ SENSOR_MEASURE_WINDOW_MS
+    Pad_Execution_Time(start_task, SENSOR_MEASURE_WINDOW_MS);
+}
+
+
+/*
+ * @brief:  Gửi cảnh báo vượt ngưỡng trong slot cảnh báo của Relay (mỗi RELAY_ALARM_PERIOD_MS tính từ Beacon)
+ * 			[Func | SensorID | RelayID | Flags | Temp_H | Temp_L | Hum_H | Hum_L | Soil]
+ * 			Ngủ STOP tới slot, backoff + CAD, gửi và chờ ALARM_ACK tới hết slot
+ * 			Không được ACK -> thử ở slot sau (tối đa ALARM_RETRIES), hết slot trước Beacon -> chờ chu kỳ sau
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myID: ID sensor node
+ * 			_targetRelayID: ID relay node mục tiêu
+ */
+void LoRaApp_Sensor_Task_Alarm(LoRa* _lora, uint8_t _myID, uint8_t _targetRelayID) {
+    extern volatile uint8_t loraRxDoneFlag;
+    uint8_t tx_buf[SS_ALARM_LEN];
+    uint8_t rx_buf[16];
+
+    if (!ALARM_ENABLE || !sensor_alarm_pending || !sensor_sync.synced) return;
+
+    uint32_t window = LoRaApp_Alarm_WindowMs(_lora);
+    uint32_t next_beacon = sensor_sync.ref_tick + (uint32_t)TOTAL_CYCLE_SEC * 1000 + sensor_sync.stretch_ms
+                           - Sensor_SyncLead();
+
+    tx_buf[0] = FUNC_CODE_SS_ALARM;
+    tx_buf[1] = _myID;
+    tx_buf[2] = _targetRelayID;
+    tx_buf[3] = sensor_alarm_flags;
+    tx_buf[4] = (sensor_latest_data.temp_val >> 8) & 0xFF;
+    tx_buf[5] = (sensor_latest_data.temp_val) & 0xFF;
+    tx_buf[6] = (sensor_latest_data.hum_val >> 8) & 0xFF;
+    tx_buf[7] = (sensor_latest_data.hum_val) & 0xFF;
+    tx_buf[8] = sensor_latest_data.soil_val;
+
+    while (sensor_alarm_tries > 0) {
+        // Slot cảnh báo kế tiếp của Relay (mốc tính như Relay: từ Beacon)
+        uint32_t k = (HAL_GetTick() - sensor_sync.ref_tick) / RELAY_ALARM_PERIOD_MS + 1;
+        uint32_t slot_tick = sensor_sync.ref_tick + k * RELAY_ALARM_PERIOD_MS;
+        if ((int32_t)(next_beacon - (slot_tick + window)) < 0) {
+            printf("[SENSOR] No alarm slot left this cycle.\r\n");
+            return;
+        }
+
+        int32_t wait = (int32_t)(slot_tick + RELAY_ALARM_GUARD_MS - HAL_GetTick());
+        if (wait > 0) Sleep_Precise_Ms((uint32_t)wait);
+        sensor_alarm_tries--;
+
+        LoRa_setMode(_lora, STNBY_MODE);
+        if (!LoRaApp_Alarm_WaitChannel(_lora, _myID)) {
+            printf("[SENSOR] Alarm slot busy.\r\n");
+            continue;
+        }
+        LoRaApp_Transmit(_lora, tx_buf, SS_ALARM_LEN, 200, AIR_PRIO_CRITICAL);
+
+        // Chờ ALARM_ACK tới hết slot
+        LoRa_setMode(_lora, RXCONTIN_MODE);
+        while ((int32_t)(slot_tick + window - HAL_GetTick()) > 0) {
+            if (loraRxDoneFlag) {
+                loraRxDoneFlag = 0;
+                int len = LoRaApp_Receive(_lora, rx_buf, sizeof(rx_buf));
+                if (len >= ALARM_ACK_LEN && rx_buf[0] == FUNC_CODE_ALARM_ACK
+                        && rx_buf[1] == _targetRelayID && rx_buf[2] == _myID) {
+                    sensor_alarm_pending = 0;
+                    LoRa_setMode(_lora, STNBY_MODE);
+                    printf("[SENSOR] Alarm 0x%02X ACK OK.\r\n", sensor_alarm_flags);
+                    return;
+                }
+            }
+        }
+        LoRa_setMode(_lora, STNBY_MODE);
+        printf("[SENSOR] Alarm ACK timeout (%d tries left).\r\n", sensor_alarm_tries);
+    }
+
+    // Hết lượt: bỏ cảnh báo, giá trị vẫn lên Server qua bản tin Data thường
+    sensor_alarm_pending = 0;
+}
+
+
+/*
+ * @brief:  Ngủ STOP tới ngay trước Beacon của chu kỳ kế tiếp
+ * 			Mốc = Beacon gần nhất + TOTAL_CYCLE_SEC (+ stretch khi Relay dời lịch), trừ lead, cộng bù trôi đồng hồ đã ước lượng
+ */
+void LoRaApp_Sensor_SleepUntilNextCycle(void) {
+	int32_t elapsed = (int32_t)(HAL_GetTick() - sensor_sync.ref_tick);
+	int32_t sleep_ms = (int32_t)TOTAL_CYCLE_SEC * 1000 + (int32_t)sensor_sync.stretch_ms + sensor_sync.drift_ms
+						- (int32_t)Sensor_SyncLead() - elapsed;
+
+	if (sleep_ms < 0) sleep_ms = 0;
+
+	printf("[SENSOR] Active: %ld ms. Enter STOP mode: %ld ms.\r\n", elapsed, sleep_ms);
+
+	Sleep_Precise_Ms((uint32_t)sleep_ms);
+}
+
+#endif
+
+#if (CURRENT_NODE_TYPE == NODE_TYPE_RELAY)
+// ==============================
+// --- HÀM PHÍA RELAY NODE ---
+// ==============================
+
+//Danh sách sensor node chịu quản lý
+static const uint8_t managed_sensors[MANAGED_SENSOR_COUNT] = MANAGED_SENSOR_LIST;
+//Struct kiểm soát dữ liệu các sensor chịu quản lý (slot 0..MANAGED_SENSOR_COUNT-1) và Sensor khách (slot dự phòng)
+static Relay_Sensor_Data_Slot_t relay_data_store[RELAY_MAX_SENSORS];
+//Registry: bảng băm địa chỉ mở (dò tuyến tính) sensor_id -> slot + 1 (0: ô trống)
+static uint8_t relay_reg_hash[RELAY_REG_HASH_SIZE];
+static uint8_t relay_reg_loaded = 0;	// Đã nạp danh sách quản lý + Sensor khách lưu trong Flash
+static uint8_t relay_reg_dirty = 0;		// Sensor khách thay đổi, chưa ghi xuống Flash
+static uint32_t relay_reg_saved_s = 0;		// RTC_GetSeconds lúc ghi Flash thành công gần nhất
+static uint16_t relay_reg_save_fail = 0;	// Số lần xóa / ghi trang registry lỗi
+static uint8_t relay_link_due = 0;		// Tới kỳ gửi khối chất lượng liên kết kèm RL_DATA
+//Bitmap ACK data của chu kỳ trước (bit i <-> slot i)
+static uint8_t relay_data_ack_bitmap[RELAY_DATA_ACK_BYTES];
+static uint8_t relay_data_ack_valid = 0;	// Chỉ có nghĩa khi đã qua ít nhất 1 phiên lắng nghe
+
+static uint32_t relay_cycle_start_tick = 0;	// HAL tick lúc phát xong Beacon (mốc chu kỳ)
+static uint32_t relay_cycle_wake_tick = 0;	// HAL tick lúc bắt đầu chu kỳ (mốc ngủ: khoảng cách 2 chu kỳ đúng TOTAL_CYCLE_SEC)
+static uint16_t relay_cycle_count = 0;
+
+// Lịch mới nhận qua downlink của GW (DL_TYPE_SCHED), áp dụng ở Beacon kế tiếp
+static uint8_t relay_realign_pending = 0;
+static uint16_t relay_realign_cycle = 0;
+static uint32_t relay_realign_tick = 0;		// 1 mốc bắt đầu chu kỳ theo lịch mới (HAL tick)
+static uint32_t relay_stretch_ms = 0;		// Chu kỳ này kéo dài thêm để vào lịch mới (đã báo trong Beacon)
+
+// Lịch TDMA tính theo số Sensor đã đăng ký và time-on-air của cấu hình radio hiện tại
+static uint8_t relay_slot_count = 0;			// Số slot đang dùng (slot lớn nhất đã cấp + 1)
+static uint16_t relay_slot_ms = SENSOR_TDMA_SLOT_MS;
+static uint32_t relay_rx_window_ms = RELAY_RX_WINDOW_MIN_MS;
+static uint8_t relay_slot_registered[RELAY_DATA_ACK_BYTES];	// Bit i = 1: slot i đã có Sensor đăng ký
+static uint8_t relay_registered_count = 0;		// Số Sensor quản lý (không tính Sensor khách) đã đăng ký
+
+// Ring buffer các aggregate chờ gửi lên: chưa được ACK hoặc nhận từ Relay con (cũ nhất ở head)
+static Relay_Aggregate_t relay_backlog[RELAY_BACKLOG_DEPTH];
+static uint16_t relay_backlog_head = 0;
+static uint16_t relay_backlog_len = 0;
+
+// Mã hoá delta: tham chiếu = bản ghi của bản tin dữ liệu gần nhất GW đã ACK (thứ tự GW giải mã, Soil bỏ bit carried)
+static Relay_Record_t relay_delta_ref[RELAY_AGG_MAX_RECORDS];
+static uint8_t relay_delta_ref_count = 0;
+static uint8_t relay_delta_ref_valid = 0;		// 0: bản tin kế tiếp là keyframe (RL_DATA)
+static Relay_Record_t relay_delta_next[RELAY_AGG_MAX_RECORDS];	// Tham chiếu mới nếu bản tin đang gửi được ACK
+static uint8_t relay_delta_next_count = 0;
+static uint8_t relay_delta_run = 0;				// Số RL_DELTA liên tiếp từ keyframe gần nhất
+static uint8_t relay_ack_misses = 0;			// Số lần chờ ACK đường lên liên tiếp không có kết quả
+
+// Đa chặng: vị trí của Relay này trong cây (chọn ở pha đăng ký)
+static uint8_t relay_hop = 1;
+static uint8_t relay_parent_id = RELAY_PARENT_GATEWAY;
+static uint16_t relay_child_offset_ms = 0;		// Slot của Relay này, tính từ Beacon Relay cha
+static uint32_t relay_parent_beacon_tick = 0;	// Beacon Relay cha chu kỳ này (nghe được hoặc dự đoán)
+static uint8_t relay_parent_heard = 0;
+static uint32_t relay_parent_stretch_ms = 0;	// Relay cha dời lịch: Beacon sau của Relay cha trễ thêm
+
+// Kênh: cluster chạy trên kênh con (GW gán / theo Relay cha), hop 1 chỉ lên kênh GW trong cửa sổ đường lên
+static uint8_t relay_channel = LORA_CH_GATEWAY;
+static uint32_t relay_uplink_lead_ms = 0;		// Cửa sổ đường lên bắt đầu sau mốc chu kỳ (0: 1 kênh, lên GW ngay sau ACK)
+
+// Cấu hình Sensor từ Server, phát lại trong Beacon tới khi mọi Sensor xác nhận
+static uint8_t relay_scfg_ver = 0;			// 0: chưa có cấu hình
+static uint8_t relay_scfg[SCFG_MAX_LEN];
+static uint8_t relay_scfg_len = 0;
+static uint8_t relay_scfg_repeat = 0;		// Số Beacon còn kèm cấu hình dù Sensor đã xác nhận (cho Relay con)
+
+// Đa chặng: các Relay con chuyển tiếp qua Relay này (slot sau các slot Sensor)
+static Relay_Child_t relay_children[RELAY_MAX_CHILDREN];
+static Relay_Reg_Queue_t relay_child_queue;		// Relay con chờ ACK nhận làm con
+static uint16_t relay_child_slot_ms = 0;
+
+// Cảnh báo nhanh chờ chuyển tiếp: [OriginRelayID | SensorID | Flags | Temp_H | Temp_L | Hum_H | Hum_L | Soil]
+static uint8_t relay_alarm_queue[RELAY_ALARM_QUEUE][RL_ALARM_LEN - RL_ALARM_HEADER_LEN];
+static uint8_t relay_alarm_tries[RELAY_ALARM_QUEUE];
+static uint8_t relay_alarm_count = 0;
+
+
+/*
+ * @brief:  Ghi nhận 1 slot đang được dùng (khi cấp ACK hoặc nhận Data từ Sensor đã đăng ký trước đó)
+ * @param:	slot: Slot index
+ */
+static void Relay_MarkSlotUsed(int slot) {
+    if (slot < 0) return;
+
+    if (slot + 1 > relay_slot_count) {
+        relay_slot_count = (uint8_t)(slot + 1);
+    }
+    if (!(relay_slot_registered[slot / 8] & (1 << (slot % 8)))) {
+        relay_slot_registered[slot / 8] |= (1 << (slot % 8));
+        if (slot < MANAGED_SENSOR_COUNT) relay_registered_count++;
+    }
+}
+
+
+/*
+ * @brief:  Số slot Relay con đang dùng (slot lớn nhất còn giữ + 1)
+ */
+static uint8_t Relay_ChildSlotCount(void) {
+    for (int i = RELAY_MAX_CHILDREN - 1; i >= 0; i--) {
+        if (relay_children[i].relay_id != 0) return (uint8_t)(i + 1);
+    }
+    return 0;
+}
+
+
+/*
+ * @brief:  Thời điểm slot của Relay con, tính từ Beacon (sau toàn bộ slot Sensor có thể cấp)
+ * 			Cố định theo RELAY_MAX_SENSORS để Sensor đăng ký thêm (kể cả Sensor khách) không làm lệch slot Relay con
+ * @param:	slot: Slot index Relay con
+ */
+static uint32_t Relay_ChildOffsetMs(int slot) {
+    return SENSOR_TDMA_GUARD_MS + (uint32_t)RELAY_MAX_SENSORS * relay_slot_ms + (uint32_t)slot * relay_child_slot_ms;
+}
+
+
+/*
+ * @brief:  Tính lại độ rộng slot và phiên lắng nghe
+ * 			slot = SENSOR_MAX_REDUNDANCY x ToA(Data hoặc SS_BATCH lớn nhất) + khoảng cách giữa bản sao + RELAY_SLOT_GUARD_MS
+ * 			window = SENSOR_TDMA_GUARD_MS + số slot x slot + RELAY_RX_MARGIN_MS
+ * 			Còn Sensor quản lý chưa đăng ký -> giữ tối thiểu RELAY_RX_WINDOW_MIN_MS để nghe ADV
+ * 			Có Relay con -> kéo dài tới hết slot Relay con cuối
+ * 			Là Relay con -> phiên nghe + ACK phải xong trước slot của mình ở Relay cha
+ * @param:	_lora: Con trỏ struct LoRa quản lý (cấu hình SF/BW/CR)
+ */
+static void Relay_UpdateSchedule(LoRa* _lora) {
+    uint32_t toa = LoRa_getTimeOnAir(_lora, LORA_AIR_LEN(SENSOR_UPLINK_MAX_LEN));
+    uint32_t slot = SENSOR_MAX_REDUNDANCY * toa + (SENSOR_MAX_REDUNDANCY - 1) * SENSOR_COPY_GAP_MS + RELAY_SLOT_GUARD_MS;
+    uint32_t window = SENSOR_TDMA_GUARD_MS + (uint32_t)relay_slot_count * slot + RELAY_RX_MARGIN_MS;
+    uint8_t children = Relay_ChildSlotCount();
+
+    relay_slot_ms = (uint16_t)slot;
+    relay_child_slot_ms = (uint16_t)(RELAY_BACKLOG_MAX_TOA_MS + LoRa_getTimeOnAir(_lora, LORA_AIR_LEN(GW_ACK_HEADER_LEN + 1))
+                                     + 2 * RELAY_SLOT_GUARD_MS);
+
+    if (relay_registered_count < MANAGED_SENSOR_COUNT && window < RELAY_RX_WINDOW_MIN_MS) {
+        window = RELAY_RX_WINDOW_MIN_MS;
+    }
+    if (children > 0 && window < Relay_ChildOffsetMs(children) + RELAY_RX_MARGIN_MS) {
+        window = Relay_ChildOffsetMs(children) + RELAY_RX_MARGIN_MS;
+    }
+    if (relay_hop > 1 && window > RELAY_HOP_LEAD_MS - RELAY_ACK_WINDOW_MS - RELAY_RX_MARGIN_MS) {
+        window = RELAY_HOP_LEAD_MS - RELAY_ACK_WINDOW_MS - RELAY_RX_MARGIN_MS;
+    }
+    relay_rx_window_ms = window;
+}
+
+
+/*
+ * @brief:  Phiên cluster tối đa trước cửa sổ đường lên: Beacon + phiên nghe với đủ RELAY_MAX_SENSORS Sensor
+ * 			và RELAY_MAX_CHILDREN Relay con + cửa sổ ACK
+ * @param:	_lora: Con trỏ struct LoRa quản lý (cấu hình SF/BW/CR)
+ * @return: Độ dài (ms)
+ */
+static uint32_t Relay_ClusterLeadMs(LoRa* _lora) {
+    Relay_UpdateSchedule(_lora);
+
+    uint32_t rx = Relay_ChildOffsetMs(RELAY_MAX_CHILDREN) + RELAY_RX_MARGIN_MS;
+    if (rx < RELAY_RX_WINDOW_MIN_MS) rx = RELAY_RX_WINDOW_MIN_MS;
+
+    return LoRa_getTimeOnAir(_lora, LORA_AIR_LEN(sizeof(msg_rl_beacon_t) + RELAY_DATA_ACK_BYTES + RL_TXP_BYTES(RELAY_DATA_ACK_BYTES) + 2 + SCFG_MAX_LEN)) + rx
+           + RELAY_ACK_WINDOW_MS;
+}
+
+
+/*
+ * @brief:  Thời gian hoạt động tối đa mỗi chu kỳ (báo cho GW xếp lịch Δt)
+ * 			Phiên cluster + RL_DATA và tối đa RELAY_UPLINK_MAX_FRAMES bản tin gửi bù
+ * @param:	_lora: Con trỏ struct LoRa quản lý (cấu hình SF/BW/CR)
+ * @return: Độ dài cửa sổ (ms)
+ */
+static uint32_t Relay_ActiveWindowMs(LoRa* _lora) {
+    return Relay_ClusterLeadMs(_lora) + RELAY_UPLINK_WINDOW_MS;
+}
+
+
+/*
+ * @brief:  Độ dài phiên lắng nghe chu kỳ này (ms)
+ */
+uint32_t LoRaApp_Relay_GetRxWindowMs(void) {
+    return relay_rx_window_ms;
+}
+
+
+/*
+ * @brief:  Sensor có gửi dữ liệu ở chu kỳ này không (Sensor gửi gộp im lặng giữa 2 lần gửi)
+ * @param:
+ * 			idx: Index Sensor trong relay_data_store
+ * 			cycle: Chu kỳ (của Relay) cần kiểm tra
+ * @return: 1 nếu Sensor gửi ở chu kỳ này (hoặc gửi mỗi chu kỳ)
+ */
+static uint8_t Relay_SensorDue(int idx, uint16_t cycle) {
+    if (relay_data_store[idx].upload_period <= 1) return 1;
+    return (int16_t)(cycle - relay_data_store[idx].next_cycle) >= 0;
+}
+
+
+/*
+ * @brief:  Kiểm tra phiên lắng nghe đã có thể kết thúc sớm chưa
+ * 			Kết thúc khi mọi Sensor đã đăng ký (và tới chu kỳ gửi) đều đã gửi Data trong chu kỳ này
+ * 			và không còn Sensor quản lý nào chưa đăng ký (cần nghe ADV)
+ * @return: 1 nếu có thể đóng phiên nghe, 0 nếu tiếp tục nghe
+ */
+uint8_t LoRaApp_Relay_RxComplete(void) {
+    if (relay_registered_count < MANAGED_SENSOR_COUNT) return 0;
+
+    for (int i = 0; i < RELAY_MAX_SENSORS; i++) {
+        if ((relay_slot_registered[i / 8] & (1 << (i % 8))) && !relay_data_store[i].has_data
+            && Relay_SensorDue(i, relay_cycle_count)) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < RELAY_MAX_CHILDREN; i++) {
+        if (relay_children[i].relay_id != 0 && !relay_children[i].has_data) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * @brief: 	Kiểm tra xem Sensor ID có trong registry không (danh sách quản lý hoặc đang giữ slot dự phòng)
+ * @param:	sensor_id: ID sensor cần kiểm tra
+ * @return: 1 nếu CÓ, 0 nếu KHÔNG
+ */
+
+uint8_t IsSensorManaged(uint8_t sensor_id) {
+    return GetSensorIndex(sensor_id) >= 0;
+}
+
+
+/*
+ * @brief:  Ô bắt đầu dò của Sensor ID trong bảng băm (trộn 2 nửa byte: ID thường chỉ khác nhau ở nửa thấp)
+ */
+static uint8_t Relay_RegHash(uint8_t sensor_id) {
+    return (uint8_t)((sensor_id ^ (sensor_id >> 4)) & (RELAY_REG_HASH_SIZE - 1));
+}
+
+
+/*
+ * @brief: Tìm slot của Sensor trong registry (bảng băm, không phụ thuộc số Sensor)
+ * 			Sensor quản lý: thứ tự trong danh sách, Sensor khách: slot dự phòng đã cấp khi nhận ADV
+ * @param:	sensor_id: ID sensor cần kiểm tra
+ * @return: Sensor node index, -1 nếu không có
+ */
+int GetSensorIndex(uint8_t sensor_id) {
+    if (sensor_id == 0) return -1;	// 0: slot dự phòng còn trống
+
+    uint8_t h = Relay_RegHash(sensor_id);
+    for (int n = 0; n < RELAY_REG_HASH_SIZE; n++) {
+        uint8_t e = relay_reg_hash[h];
+        if (e == 0) return -1;		// Gặp ô trống: không có trong registry
+        if (relay_data_store[e - 1].sensor_id == sensor_id) return e - 1;
+        h = (h + 1) & (RELAY_REG_HASH_SIZE - 1);
+    }
+    return -1;
+}
+
+
+/*
+ * @brief:  Đưa slot vào bảng băm theo sensor_id của slot
+ * 			Dò tối đa RELAY_REG_HASH_SIZE ô: luôn còn ô trống (RELAY_REG_HASH_SIZE >= 2 * RELAY_MAX_SENSORS),
+ * 			giới hạn vòng dò chỉ để bảng đầy do lỗi không treo Relay
+ * @param:	slot: Slot index (relay_data_store[slot].sensor_id đã gán)
+ */
+static void Relay_RegInsert(int slot) {
+    uint8_t h = Relay_RegHash(relay_data_store[slot].sensor_id);
+
+    for (int n = 0; n < RELAY_REG_HASH_SIZE; n++) {
+        if (relay_reg_hash[h] == 0) {
+            relay_reg_hash[h] = (uint8_t)(slot + 1);
+            return;
+        }
+        h = (h + 1) & (RELAY_REG_HASH_SIZE - 1);
+    }
+    printf("[RELAY] Registry hash full, Sensor 0x%02X not indexed!\r\n", relay_data_store[slot].sensor_id);
+}
+
+
+/*
+ * @brief:  Dựng lại bảng băm từ relay_data_store (sau khi xóa 1 Sensor: dò tuyến tính không xóa tại chỗ được)
+ */
+static void Relay_RegRebuild(void) {
+    memset(relay_reg_hash, 0, sizeof(relay_reg_hash));
+    for (int i = 0; i < RELAY_MAX_SENSORS; i++) {
+        if (relay_data_store[i].sensor_id != 0) Relay_RegInsert(i);
+    }
+}
+
+
+/*
+ * @brief:  Nạp registry lúc khởi động: Sensor quản lý vào slot cố định, Sensor khách đọc từ trang Flash
+ * 			Trang Flash: [MAGIC | count | Entry x count] (half-word), Entry = RELAY_REG_ENTRY_HW half-word:
+ * 			[Slot << 8 | SensorID | Seen_H | Seen_L | RSSI EWMA | SNR EWMA] cho mọi Sensor đã có trong registry
+ * 			Sensor khách giữ đúng slot cũ -> đồng bộ lại từ backup ở Sensor vẫn đúng sau khi Relay khởi động lại
+ * 			Last-seen (RTC giữ bộ đếm qua reset nhờ cờ DR1 trong rtc.c) và EWMA liên kết được nạp lại cho cả Sensor quản lý
+ * 			Sensor khách im lặng quá hạn (RELAY_GUEST_TIMEOUT_CYCLES chu kỳ, cộng độ trễ ghi RELAY_REG_STATS_SAVE_S) -> không nạp lại
+ */
+static void Relay_RegLoad(void) {
+    const volatile uint16_t* page = (const volatile uint16_t*)RELAY_REG_FLASH_ADDR;
+    uint32_t now = RTC_GetSeconds();
+    uint32_t guest_max_s = (uint32_t)RELAY_GUEST_TIMEOUT_CYCLES * TOTAL_CYCLE_SEC + RELAY_REG_STATS_SAVE_S;
+
+    for (int i = 0; i < MANAGED_SENSOR_COUNT; i++) {
+        relay_data_store[i].sensor_id = managed_sensors[i];
+    }
+    Relay_RegRebuild();
+
+    if (page[0] == RELAY_REG_FLASH_MAGIC && page[1] <= RELAY_MAX_SENSORS) {
+        for (int k = 0; k < page[1]; k++) {
+            const volatile uint16_t* e = &page[2 + k * RELAY_REG_ENTRY_HW];
+            uint8_t id = (uint8_t)(e[0] & 0xFF);
+            uint8_t slot = (uint8_t)(e[0] >> 8);
+            uint32_t seen = ((uint32_t)e[1] << 16) | e[2];
+
+            if (id == 0 || slot >= RELAY_MAX_SENSORS) continue;
+            // Mốc sau hiện tại: RTC đã khởi tạo lại (mất VBAT) -> last-seen cũ vô nghĩa, tính từ bây giờ
+            if (seen > now) seen = now;
+            if (slot >= MANAGED_SENSOR_COUNT) {
+                if (relay_data_store[slot].sensor_id != 0 || GetSensorIndex(id) >= 0) continue;
+                if (now - seen > guest_max_s) {
+                    printf("[RELAY] Guest Sensor 0x%02X silent for %lu s. Not restored.\r\n", id, now - seen);
+                    relay_reg_dirty = 1;
+                    continue;
+                }
+                relay_data_store[slot].sensor_id = id;
+                Relay_RegInsert(slot);
+                printf("[RELAY] Guest Sensor 0x%02X restored from Flash -> slot %d.\r\n", id, slot);
+            } else if (relay_data_store[slot].sensor_id != id) {
+                continue;	// Danh sách quản lý đã đổi (nạp firmware mới)
+            }
+            relay_data_store[slot].last_seen = seen;
+            relay_data_store[slot].rssi_avg = (int16_t)e[3];
+            relay_data_store[slot].snr_avg = (int16_t)e[4];
+        }
+    }
+    relay_reg_saved_s = now;
+    relay_reg_loaded = 1;
+}
+
+
+/*
+ * @brief:  Ghi registry xuống trang Flash (gọi trước khi ngủ, ngoài các cửa sổ TDMA)
+ * 			Ghi khi Sensor khách thay đổi, hoặc mỗi RELAY_REG_STATS_SAVE_S giây để cập nhật last-seen / liên kết
+ * 			Chỉ xóa / ghi khi nội dung khác Flash (giới hạn số lần ghi/xóa); MAGIC ghi sau cùng -> mất nguồn giữa chừng
+ * 			để lại trang không hợp lệ, không phải trang sai. Lỗi xóa / ghi: giữ cờ dirty, thử lại lần gọi sau
+ */
+void LoRaApp_Relay_SaveRegistry(void) {
+    FLASH_EraseInitTypeDef erase;
+    uint32_t page_error;
+    uint16_t image[2 + RELAY_MAX_SENSORS * RELAY_REG_ENTRY_HW];
+    uint16_t len = 2;
+    uint8_t n = 0;
+    uint8_t guests = 0;
+    HAL_StatusTypeDef status;
+
+    if (!relay_reg_loaded) return;
+    if (!relay_reg_dirty && RTC_GetSeconds() - relay_reg_saved_s < RELAY_REG_STATS_SAVE_S) return;
+
+    for (int i = 0; i < RELAY_MAX_SENSORS; i++) {
+        const Relay_Sensor_Data_Slot_t* s = &relay_data_store[i];
+        if (s->sensor_id == 0) continue;
+
+        image[len++] = (uint16_t)((i << 8) | s->sensor_id);
+        image[len++] = (uint16_t)(s->last_seen >> 16);
+        image[len++] = (uint16_t)(s->last_seen & 0xFFFF);
+        image[len++] = (uint16_t)s->rssi_avg;
+        image[len++] = (uint16_t)s->snr_avg;
+        n++;
+        if (i >= MANAGED_SENSOR_COUNT) guests++;
+    }
+    image[0] = RELAY_REG_FLASH_MAGIC;
+    image[1] = n;
+
+    if (memcmp((const void*)RELAY_REG_FLASH_ADDR, image, len * sizeof(uint16_t)) == 0) {
+        relay_reg_dirty = 0;
+        relay_reg_saved_s = RTC_GetSeconds();
+        return;
+    }
+
+    HAL_FLASH_Unlock();
+    erase.TypeErase = FLASH_TYPEERASE_PAGES;
+    erase.Banks = FLASH_BANK_1;
+    erase.PageAddress = RELAY_REG_FLASH_ADDR;
+    erase.NbPages = 1;
+    status = HAL_FLASHEx_Erase(&erase, &page_error);
+    for (int k = 1; k < len && status == HAL_OK; k++) {
+        status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, RELAY_REG_FLASH_ADDR + 2 * k, image[k]);
+    }
+    if (status == HAL_OK) {
+        status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, RELAY_REG_FLASH_ADDR, image[0]);
+    }
+    HAL_FLASH_Lock();
+
+    if (status != HAL_OK) {
+        relay_reg_save_fail++;
+        printf("[RELAY] Registry save FAILED (status %d, %u failures). Retry before next sleep.\r\n", status, relay_reg_save_fail);
+        return;
+    }
+
+    relay_reg_dirty = 0;
+    relay_reg_saved_s = RTC_GetSeconds();
+    printf("[RELAY] Registry saved to Flash (%d Sensors, %d guests).\r\n", n, guests);
+}
+
+
+/*
+ * @brief:  Độ dư liên kết của bản tin vừa nhận so với ngưỡng giải điều chế của SF hiện tại
+ * 			SNR >= 0: SNR bão hòa, dùng RSSI so với độ nhạy. SNR < 0: RSSI là nhiễu, dùng SNR
+ * @param:
+ * 			_lora: Con trỏ struct LoRa (cấu hình SF)
+ * 			_rssi: RSSI bản tin (dBm)
+ * 			_snr: SNR bản tin (0.25 dB)
+ * @return: Độ dư (dB)
+ */
+static int Relay_LinkMargin(LoRa* _lora, int _rssi, int _snr) {
+    int snr_floor = -((int)_lora->spredingFactor - 4) * 10;		// 0.25 dB: SF7 -7.5 dB ... SF12 -20 dB
+
+    if (_snr >= 0) return _rssi - RELAY_TXP_NOISE_FLOOR_DBM - snr_floor / 4;
+    return (_snr - snr_floor) / 4;
+}
+
+
+/*
+ * @brief:  Cập nhật thời điểm nhận gần nhất, độ dư liên kết và RSSI/SNR trung bình trượt (EWMA) của Sensor trong registry
+ * @param:
+ * 			idx: Slot index
+ * 			_lora: Con trỏ struct LoRa (đọc RSSI/SNR bản tin vừa nhận)
+ */
+static void Relay_RegTouch(int idx, LoRa* _lora) {
+    Relay_Sensor_Data_Slot_t* s = &relay_data_store[idx];
+    int rssi_dbm = LoRa_getRSSI(_lora);
+    int snr_q = LoRa_getSNR(_lora);
+    int16_t rssi = (int16_t)(rssi_dbm * 16);
+    int16_t snr = (int16_t)(snr_q * 4);		// 0.25 dB -> 1/16 dB
+    int margin = Relay_LinkMargin(_lora, rssi_dbm, snr_q);
+
+    s->last_seen = RTC_GetSeconds();
+    s->margin = (int8_t)(margin > 127 ? 127 : (margin < -128 ? -128 : margin));
+    if (s->rssi_avg == 0) {
+        s->rssi_avg = rssi;
+        s->snr_avg = snr;
+    } else {
+        s->rssi_avg += (rssi - s->rssi_avg) / (1 << RELAY_LINK_EWMA_SHIFT);
+        s->snr_avg += (snr - s->snr_avg) / (1 << RELAY_LINK_EWMA_SHIFT);
+    }
+}
+
+
+/*
+ * @brief:  Đóng gói khuyến nghị công suất các slot (ghép sau bitmap ACK của Beacon), 4 bit có dấu mỗi slot
+ * 			Chỉ slot có Data được ACK (độ dư còn mới), các slot khác: 0 (giữ nguyên)
+ * @param:	_buf: Buffer ghi (RL_TXP_BYTES(RELAY_DATA_ACK_BYTES) byte)
+ */
+static void Relay_PackTxPower(uint8_t* _buf) {
+    memset(_buf, 0, RL_TXP_BYTES(RELAY_DATA_ACK_BYTES));
+
+    for (int i = 0; i < RELAY_MAX_SENSORS; i++) {
+        if (!(relay_data_ack_bitmap[i / 8] & (1 << (i % 8)))) continue;
+
+        int step = RELAY_TXP_TARGET_MARGIN_DB - relay_data_store[i].margin;
+        if (step > RL_TXP_MAX_DB) step = RL_TXP_MAX_DB;
+        if (step < RL_TXP_MIN_DB) step = RL_TXP_MIN_DB;
+        _buf[i / 2] |= (uint8_t)((step & 0x0F) << ((i % 2) * 4));
+    }
+}
+
+
+/*
+ * @brief:  Tăng bộ đếm 8 bit, dừng ở 255
+ */
+static void Relay_SatInc(uint8_t* _cnt) {
+    if (*_cnt < 0xFF) (*_cnt)++;
+}
+
+
+/*
+ * @brief:  Đóng gói khối chất lượng liên kết các Sensor trong registry (ghép sau Record cuối của RL_DATA)
+ * 			[RL_LINK_MARK | N | (SensorID | -RSSI | SNR | Heard | Expected | Dups) x N]
+ * @param:	_buf: Buffer ghi
+ * @return: Số byte đã ghi
+ */
+static uint8_t Relay_PackLinkStats(uint8_t* _buf) {
+    uint8_t ptr = 2;
+    uint8_t n = 0;
+
+    for (int i = 0; i < RELAY_MAX_SENSORS; i++) {
+        Relay_Sensor_Data_Slot_t* s = &relay_data_store[i];
+        if (s->sensor_id == 0 || (s->expected == 0 && s->heard == 0 && s->dups == 0)) continue;
+
+        int16_t rssi = -(s->rssi_avg / 16);
+        int16_t snr = s->snr_avg / 4;
+        if (snr > 127) snr = 127;
+        if (snr < -128) snr = -128;
+
+        _buf[ptr++] = s->sensor_id;
+        _buf[ptr++] = (uint8_t)(rssi > 0xFF ? 0xFF : rssi);
+        _buf[ptr++] = (uint8_t)(int8_t)snr;
+        _buf[ptr++] = s->heard;
+        _buf[ptr++] = s->expected;
+        _buf[ptr++] = s->dups;
+        n++;
+    }
+    _buf[0] = RL_LINK_MARK;
+    _buf[1] = n;
+    return ptr;
+}
+
+
+/*
+ * @brief:  Nhận Sensor gửi ADV: Sensor quản lý giữ slot cố định, Sensor lạ (Sensor mới / failover từ Relay khác)
+ * 			được cấp slot dự phòng còn trống (tối đa RELAY_SPARE_SLOTS), lưu Flash ở cuối chu kỳ
+ * @param:	sensor_id: ID sensor gửi ADV
+ * @return: Slot index, -1 nếu đã hết sức chứa
+ */
+static int Relay_AcceptSensor(uint8_t sensor_id) {
+    int idx = GetSensorIndex(sensor_id);
+    if (idx >= 0) return idx;
+
+    for (int i = MANAGED_SENSOR_COUNT; i < RELAY_MAX_SENSORS; i++) {
+        if (relay_data_store[i].sensor_id == 0) {
+            memset(&relay_data_store[i], 0, sizeof(Relay_Sensor_Data_Slot_t));
+            relay_data_store[i].sensor_id = sensor_id;
+            Relay_RegInsert(i);
+            relay_reg_dirty = 1;
+            printf("[RELAY] Guest Sensor 0x%02X -> spare slot %d.\r\n", sensor_id, i);
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * @brief: Tìm slot của Relay con
+ * @param:	relay_id: ID Relay con
+ * @return: Slot index, -1 nếu không phải Relay con
+ */
+static int Relay_FindChild(uint8_t relay_id) {
+    for (int i = 0; i < RELAY_MAX_CHILDREN; i++) {
+        if (relay_children[i].relay_id == relay_id) return i;
+    }
+    return -1;
+}
+
+
+/*
+ * @brief:  Lưu aggregate vào backlog chờ gửi lên (đầy -> bỏ aggregate cũ nhất)
+ * @param:	_agg: Aggregate cần lưu
+ */
+static void Relay_BacklogPush(const Relay_Aggregate_t* _agg) {
+    if (relay_backlog_len == RELAY_BACKLOG_DEPTH) {
+        printf("[RELAY] Backlog full. Drop cycle #%u of 0x%02X\r\n",
+               relay_backlog[relay_backlog_head].cycle, relay_backlog[relay_backlog_head].relay_id);
+        relay_backlog_head = (relay_backlog_head + 1) % RELAY_BACKLOG_DEPTH;
+        relay_backlog_len--;
+    }
+
+    relay_backlog[(relay_backlog_head + relay_backlog_len) % RELAY_BACKLOG_DEPTH] = *_agg;
+    relay_backlog_len++;
+    printf("[RELAY] Cycle #%u of 0x%02X queued (%u pending).\r\n", _agg->cycle, _agg->relay_id, relay_backlog_len);
+}
+
+
+/*
+ * @brief:  Thêm 1 bản ghi cũ (mẫu gửi gộp của Sensor) vào backlog
+ * 			Gộp vào aggregate cùng Relay/chu kỳ đã có trong backlog, nếu không tạo aggregate mới
+ * @param:
+ * 			_relayID: Relay gom dữ liệu
+ * 			_cycle: Chu kỳ (của Relay này) lúc đo
+ * 			_rec: Bản ghi
+ */
+static void Relay_BacklogAddRecord(uint8_t _relayID, uint16_t _cycle, const Relay_Record_t* _rec) {
+    for (int i = relay_backlog_len - 1; i >= 0; i--) {
+        Relay_Aggregate_t* agg = &relay_backlog[(relay_backlog_head + i) % RELAY_BACKLOG_DEPTH];
+        if (agg->relay_id == _relayID && agg->cycle == _cycle && agg->count < RELAY_AGG_MAX_RECORDS) {
+            agg->records[agg->count++] = *_rec;
+            return;
+        }
+    }
+
+    Relay_Aggregate_t agg;
+    agg.relay_id = _relayID;
+    agg.cycle = _cycle;
+    agg.count = 1;
+    agg.records[0] = *_rec;
+    Relay_BacklogPush(&agg);
+}
+
+
+/*
+ * @brief:  Tách các aggregate trong RL_BACKLOG của Relay con vào backlog của Relay này
+ * 			Số chu kỳ được quy đổi sang chu kỳ của Relay này (giữ nguyên "số chu kỳ trước")
+ * @param:
+ * 			_rxBuf: Bản tin RL_BACKLOG
+ * 			_len: Độ dài bản tin
+ */
+static void Relay_StoreChildUplink(uint8_t* _rxBuf, uint8_t _len) {
+    uint16_t child_cycle = (_rxBuf[3] << 8) | _rxBuf[4];
+    uint8_t n_agg = _rxBuf[5];
+    uint8_t ptr = RL_BACKLOG_HEADER_LEN;
+    Relay_Aggregate_t agg;
+
+    for (int i = 0; i < n_agg; i++) {
+        if (ptr + RL_BACKLOG_AGG_HEADER_LEN > _len) break;
+
+        uint16_t cycle = (_rxBuf[ptr+1] << 8) | _rxBuf[ptr+2];
+        uint8_t count = _rxBuf[ptr+3];
+
+        agg.relay_id = _rxBuf[ptr];
+        agg.cycle = relay_cycle_count - (uint16_t)(child_cycle - cycle);
+        agg.count = 0;
+        ptr += RL_BACKLOG_AGG_HEADER_LEN;
+
+        for (int k = 0; k < count && ptr + RL_RECORD_LEN <= _len; k++) {
+            if (agg.count < RELAY_AGG_MAX_RECORDS) {
+                Relay_Record_t* rec = &agg.records[agg.count++];
+                rec->sensor_id = _rxBuf[ptr];
+                rec->temp = (int16_t)((_rxBuf[ptr+1] << 8) | _rxBuf[ptr+2]);
+                rec->hum  = (uint16_t)((_rxBuf[ptr+3] << 8) | _rxBuf[ptr+4]);
+                rec->soil = _rxBuf[ptr+5];
+            }
+            ptr += RL_RECORD_LEN;
+        }
+        Relay_BacklogPush(&agg);
+    }
+}
+
+
+/*
+ * @brief:  Lưu cấu hình Sensor mới (từ downlink của GW hoặc Beacon Relay cha)
+ * @param:
+ * 			_ver: Phiên bản cấu hình
+ * 			_tlv: Con trỏ TLV đầu tiên
+ * 			_len: Tổng độ dài các TLV
+ */
+static void Relay_SetSensorConfig(uint8_t _ver, const uint8_t* _tlv, uint8_t _len) {
+    if (_ver == relay_scfg_ver || _len > SCFG_MAX_LEN) return;
+
+    relay_scfg_ver = _ver;
+    relay_scfg_len = _len;
+    memcpy(relay_scfg, _tlv, _len);
+    relay_scfg_repeat = SCFG_BEACON_REPEAT;
+    printf("[RELAY] Sensor config v%u received (%u bytes).\r\n", _ver, _len);
+}
+
+
+/*
+ * @brief:  Relay con nghe được Beacon Relay cha: neo lại slot, theo chu kỳ (và lịch dời) của Relay cha
+ * 			Beacon kèm cấu hình Sensor -> nhận về để phát lại cho Sensor của mình
+ * @param:
+ * 			_buf: Beacon của Relay cha
+ * 			_len: Độ dài bản tin
+ */
+static void Relay_HandleParentBeacon(const uint8_t* _buf, int _len) {
+    const msg_rl_beacon_t* beacon = (const msg_rl_beacon_t*)_buf;
+    int cfg = sizeof(msg_rl_beacon_t) + beacon->bitmap_len + RL_TXP_BYTES(beacon->bitmap_len);
+
+    relay_parent_beacon_tick = HAL_GetTick();
+    relay_parent_heard = 1;
+    relay_parent_stretch_ms = (uint32_t)beacon->stretch * GW_SCHED_UNIT_MS;
+    if (beacon->total_cycle > 0) TOTAL_CYCLE_SEC = beacon->total_cycle;
+
+    if (cfg + 2 <= _len && cfg + 2 + _buf[cfg+1] <= _len) {
+        Relay_SetSensorConfig(_buf[cfg], &_buf[cfg+2], _buf[cfg+1]);
+    }
+}
+
+
+/*
+ * @brief:  Áp dụng lịch mới nhận qua downlink (gọi đầu chu kỳ, trước Beacon)
+ * 			Chu kỳ này giữ nguyên vị trí (Sensor đang chờ Beacon), chu kỳ sau dời tới mốc lịch mới:
+ * 			kéo dài chu kỳ này thêm stretch (báo trong Beacon để Sensor ngủ theo)
+ */
+static void Relay_ApplyRealign(void) {
+    uint32_t cycle_ms = (uint32_t)relay_realign_cycle * 1000;
+
+    relay_realign_pending = 0;
+    if (cycle_ms == 0) return;
+    TOTAL_CYCLE_SEC = relay_realign_cycle;
+
+    // Thời gian từ đầu chu kỳ này tới mốc lịch mới kế tiếp (mod chu kỳ)
+    int32_t diff = (int32_t)(relay_realign_tick - relay_cycle_wake_tick) % (int32_t)cycle_ms;
+    uint32_t phase = (uint32_t)(diff + (int32_t)cycle_ms) % cycle_ms;
+
+    // Lệch nhỏ (bản tin lặp lại hoặc trôi đồng hồ) -> giữ nguyên
+    if (phase < RELAY_REALIGN_TOL_MS || phase > cycle_ms - RELAY_REALIGN_TOL_MS) {
+        printf("[RELAY] Schedule: cycle %u s, already aligned.\r\n", TOTAL_CYCLE_SEC);
+        return;
+    }
+    relay_stretch_ms = phase - phase % GW_SCHED_UNIT_MS;
+    printf("[RELAY] Schedule: cycle %u s, next cycle shifted by %lu ms.\r\n", TOTAL_CYCLE_SEC, relay_stretch_ms);
+}
+
+
+/*
+ * @brief:  Xử lý phần downlink gắn sau ACK gộp của GW (các bản tin cho Relay này hoặc broadcast)
+ * 			[N_dl | Target | Type | Len | Data... | ...]
+ * @param:
+ * 			_buf: Con trỏ byte N_dl
+ * 			_len: Số byte còn lại của bản tin
+ * 			_myRelayID: ID Relay node
+ * 			_rx_tick: HAL tick lúc nhận ACK (mốc của Dt trong DL_TYPE_SCHED)
+ */
+static void Relay_HandleDownlink(const uint8_t* _buf, int _len, uint8_t _myRelayID, uint32_t _rx_tick) {
+    if (_len < 1) return;
+
+    uint8_t n_dl = _buf[0];
+    int ptr = 1;
+
+    for (int i = 0; i < n_dl && ptr + GW_DL_HEADER_LEN <= _len; i++) {
+        uint8_t target = _buf[ptr];
+        uint8_t type = _buf[ptr+1];
+        uint8_t dl_len = _buf[ptr+2];
+        const uint8_t* data = &_buf[ptr + GW_DL_HEADER_LEN];
+
+        ptr += GW_DL_HEADER_LEN + dl_len;
+        if (ptr > _len) break;
+        if (target != _myRelayID && target != GW_DL_BROADCAST) continue;
+
+        switch (type) {
+        case DL_TYPE_SCHED:
+            if (dl_len < 4) break;
+            relay_realign_cycle = (data[0] << 8) | data[1];
+            // Dt: đầu cửa sổ đường lên -> chu kỳ bắt đầu sớm hơn relay_uplink_lead_ms
+            relay_realign_tick = _rx_tick + (uint32_t)((data[2] << 8) | data[3]) * GW_SCHED_UNIT_MS - relay_uplink_lead_ms;
+            relay_realign_pending = 1;
+            printf("[RELAY] Downlink: new schedule (cycle %u s).\r\n", relay_realign_cycle);
+            break;
+        case DL_TYPE_SENSOR_CFG:
+            if (dl_len < 1) break;
+            Relay_SetSensorConfig(data[0], &data[1], dl_len - 1);
+            break;
+        default:
+            printf("[RELAY] Downlink: unknown type 0x%02X.\r\n", type);
+            break;
+        }
+    }
+}
+
+
+/*
+ * @brief:  Đưa cảnh báo vào hàng chờ chuyển tiếp (thay bản cũ của cùng Sensor, đầy -> bỏ bản cũ nhất)
+ * @param:	_alarm: [OriginRelayID | SensorID | Flags | Temp_H | Temp_L | Hum_H | Hum_L | Soil]
+ */
+static void Relay_AlarmPush(const uint8_t* _alarm) {
+    int i;
+
+    for (i = 0; i < relay_alarm_count; i++) {
+        if (relay_alarm_queue[i][0] == _alarm[0] && relay_alarm_queue[i][1] == _alarm[1]) break;
+    }
+    if (i == RELAY_ALARM_QUEUE) {
+        memmove(relay_alarm_queue[0], relay_alarm_queue[1], (RELAY_ALARM_QUEUE - 1) * sizeof(relay_alarm_queue[0]));
+        memmove(&relay_alarm_tries[0], &relay_alarm_tries[1], RELAY_ALARM_QUEUE - 1);
+        i = RELAY_ALARM_QUEUE - 1;
+    } else if (i == relay_alarm_count) {
+        relay_alarm_count++;
+    }
+    memcpy(relay_alarm_queue[i], _alarm, sizeof(relay_alarm_queue[0]));
+    relay_alarm_tries[i] = ALARM_RETRIES;
+}
+
+
+/*
+ * @brief:  Xử lý cảnh báo nhận được (trong phiên hoạt động chính hoặc slot cảnh báo)
+ * 			SS_ALARM từ Sensor quản lý -> ALARM_ACK, RL_ALARM từ Relay con -> ACK cùng định dạng ACK của GW
+ * 			Cả hai vào hàng chờ chuyển tiếp lên GW
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_rxBuf: Con trỏ buffer nhận
+ * 			_len: Độ dài bản tin
+ * 			_myRelayID: ID Relay node
+ */
+static void Relay_HandleAlarm(LoRa* _lora, uint8_t* _rxBuf, uint8_t _len, uint8_t _myRelayID) {
+    uint8_t alarm[RL_ALARM_LEN - RL_ALARM_HEADER_LEN];
+
+    if (_rxBuf[0] == FUNC_CODE_SS_ALARM) {
+        int idx = GetSensorIndex(_rxBuf[1]);
+        if (_len < SS_ALARM_LEN || _rxBuf[2] != _myRelayID || idx < 0) return;
+        Relay_RegTouch(idx, _lora);
+
+        uint8_t ack[ALARM_ACK_LEN] = { FUNC_CODE_ALARM_ACK, _myRelayID, _rxBuf[1] };
+        LoRa_setMode(_lora, STNBY_MODE);
+        LoRaApp_Transmit(_lora, ack, sizeof(ack), 200, AIR_PRIO_CRITICAL);
+        LoRa_setMode(_lora, RXCONTIN_MODE);
+
+        alarm[0] = _myRelayID;
+        alarm[1] = _rxBuf[1];
+        memcpy(&alarm[2], &_rxBuf[3], SS_ALARM_LEN - 3);
+    } else {
+        if (_len < RL_ALARM_LEN || _rxBuf[2] != _myRelayID || Relay_FindChild(_rxBuf[1]) < 0) return;
+
+        uint8_t ack[GW_ACK_HEADER_LEN + 1] = { FUNC_CODE_GW_ACK, 1, _rxBuf[1] };
+        LoRa_setMode(_lora, STNBY_MODE);
+        LoRaApp_Transmit(_lora, ack, sizeof(ack), 200, AIR_PRIO_CRITICAL);
+        LoRa_setMode(_lora, RXCONTIN_MODE);
+
+        memcpy(alarm, &_rxBuf[RL_ALARM_HEADER_LEN], sizeof(alarm));
+    }
+
+    printf("[RELAY] Alarm from Sensor 0x%02X (Relay 0x%02X): flags 0x%02X\r\n", alarm[1], alarm[0], alarm[2]);
+    Relay_AlarmPush(alarm);
+}
+
+
+/*
+ * @brief: Init/Reset dữ liệu Sensor do Relay quản lý
+ * 			Trước khi reset, chốt bitmap ACK data của chu kỳ vừa qua để gửi ở pha ACK
+ * 			Sensor gửi gộp chưa tới chu kỳ gửi -> giữ nguyên bit (Sensor đọc ACK ở Beacon của lần gửi sau)
+ */
+void LoRaApp_Relay_Init(void) {
+    uint8_t bitmap[RELAY_DATA_ACK_BYTES] = {0};
+
+    for(int i=0; i<RELAY_MAX_SENSORS; i++) {
+        // Chất lượng liên kết: chu kỳ Sensor đã đăng ký tới lượt gửi / đã nhận được Data
+        if ((relay_slot_registered[i / 8] & (1 << (i % 8)))
+            && (relay_data_store[i].has_data || Relay_SensorDue(i, relay_cycle_count))) {
+            Relay_SatInc(&relay_data_store[i].expected);
+            if (relay_data_store[i].has_data) Relay_SatInc(&relay_data_store[i].heard);
+        }
+
+        if (relay_data_store[i].has_data) {
+            bitmap[i / 8] |= (1 << (i % 8));
+        } else if (!Relay_SensorDue(i, relay_cycle_count)) {
+            bitmap[i / 8] |= relay_data_ack_bitmap[i / 8] & (1 << (i % 8));
+        } else if (relay_data_store[i].upload_period > 1) {
+            // Lỡ bản tin gửi gộp: Sensor vẫn gửi lại sau đúng 1 chu kỳ gửi
+            relay_data_store[i].next_cycle += relay_data_store[i].upload_period;
+        }
+    }
+    memcpy(relay_data_ack_bitmap, bitmap, sizeof(relay_data_ack_bitmap));
+    if (relay_cycle_count % RELAY_LINK_REPORT_CYCLES == 0) relay_link_due = 1;
+
+    // Lần đầu: nạp registry (danh sách quản lý + Sensor khách trong Flash)
+    if (!relay_reg_loaded) Relay_RegLoad();
+
+    for(int i=0; i<RELAY_MAX_SENSORS; i++) {
+        // Sensor khách im lặng quá RELAY_GUEST_TIMEOUT_CYCLES chu kỳ (đã về Relay cũ / hỏng) -> giải phóng slot
+        // (Sensor quản lý giữ slot cố định)
+        if (i >= MANAGED_SENSOR_COUNT && relay_data_store[i].sensor_id != 0) {
+            if (relay_data_store[i].has_data) {
+                relay_data_store[i].silent = 0;
+            } else if (++relay_data_store[i].silent >= RELAY_GUEST_TIMEOUT_CYCLES) {
+                printf("[RELAY] Guest Sensor 0x%02X silent. Spare slot %d released.\r\n", relay_data_store[i].sensor_id, i);
+                memset(&relay_data_store[i], 0, sizeof(Relay_Sensor_Data_Slot_t));
+                relay_slot_registered[i / 8] &= ~(1 << (i % 8));
+                Relay_RegRebuild();
+                relay_reg_dirty = 1;
+                continue;
+            }
+        }
+
+        // Dead-band: Sensor im lặng vẫn được coi là giá trị cũ tối đa SENSOR_HEARTBEAT_CYCLES chu kỳ
+        if (relay_data_store[i].has_data) {
+            relay_data_store[i].carry_left = SENSOR_HEARTBEAT_CYCLES;
+        } else if (relay_data_store[i].carry_left > 0) {
+            relay_data_store[i].carry_left--;
+        }
+
+        // Reset trạng thái data cũ (giữ giá trị cuối cho dead-band)
+        relay_data_store[i].has_data = 0;
+    }
+
+    // Relay con im lặng quá RELAY_CHILD_TIMEOUT_CYCLES chu kỳ -> giải phóng slot
+    for (int i = 0; i < RELAY_MAX_CHILDREN; i++) {
+        if (relay_children[i].relay_id == 0) continue;
+
+        if (relay_children[i].has_data) {
+            relay_children[i].silent = 0;
+        } else if (++relay_children[i].silent >= RELAY_CHILD_TIMEOUT_CYCLES) {
+            printf("[RELAY] Child Relay 0x%02X silent. Slot %d released.\r\n", relay_children[i].relay_id, i);
+            relay_children[i].relay_id = 0;
+        }
+        relay_children[i].has_data = 0;
+    }
+}
+
+
+/*
+ * @brief: 	Ghi nhận 1 Relay cha ứng viên vào bảng parent/hop (cập nhật nếu đã có, thay ứng viên kém nhất nếu đầy)
+ * @param:
+ * 			_table: Bảng ứng viên
+ * 			_count: Số ứng viên hiện có
+ * 			_cand: Ứng viên mới
+ */
+static void Relay_AddParentCandidate(Relay_Parent_t* _table, uint8_t* _count, const Relay_Parent_t* _cand) {
+    int worst = 0;
+
+    for (int i = 0; i < *_count; i++) {
+        if (_table[i].relay_id == _cand->relay_id) {
+            _table[i] = *_cand;
+            return;
+        }
+        if (_table[i].hop > _table[worst].hop ||
+            (_table[i].hop == _table[worst].hop && _table[i].rssi < _table[worst].rssi)) {
+            worst = i;
+        }
+    }
+
+    if (*_count < RELAY_MAX_PARENT_CANDIDATES) {
+        _table[(*_count)++] = *_cand;
+    } else if (_cand->hop < _table[worst].hop ||
+               (_cand->hop == _table[worst].hop && _cand->rssi > _table[worst].rssi)) {
+        _table[worst] = *_cand;
+    }
+}
+
+
+/*
+ * @brief: 	Relay đăng ký với Gateway và chờ cấu hình thời gian
+ * 			Hàm này sẽ chặn (Blocking) cho đến khi nhận được Config từ GW hoặc được 1 Relay cha nhận làm con
+ * 			Nghe trực tiếp GW -> hop 1. Ngoài tầm GW -> chọn Relay cha ít chặng nhất (RSSI mạnh nhất)
+ * 			trong bảng ứng viên, hop = hop cha + 1, chu kỳ lồng vào chu kỳ Relay cha
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_rxBuf: Con trỏ buffer nhận
+ * 			_rxBufSize: Kích thước buffer nhận
+ * 			_rxFlag: Cờ nhận (recieve flag)
+ * 			_myRelayID: ID Relay node
+ */
+uint8_t LoRaApp_Relay_RegistrationWithGateway(
+		LoRa* _lora, uint8_t* _rxBuf, uint16_t _rxBufSize,
+		volatile uint8_t* _rxFlag, uint8_t _myRelayID)
+{
+    msg_rl_reg_adv_t adv_msg;
+    uint16_t my_wakeup_offset = 0;
+    uint8_t configured = 0;
+    Relay_Parent_t parents[RELAY_MAX_PARENT_CANDIDATES];
+    uint8_t parent_count = 0;
+    uint8_t reg_attempt = 0;
+
+    printf("\r\n[RELAY] >>> START RELAY REGISTRATION <<<\r\n");
+    LoRaApp_Random_Seed(_lora);
+
+    // Báo cửa sổ hoạt động để GW xếp lịch không chồng lấn (làm tròn lên theo RL_WINDOW_UNIT_MS)
+    // Nhiều kênh: GW chỉ xếp cửa sổ đường lên trên kênh GW, phiên cluster (lead) chạy song song trên kênh con
+    uint32_t lead = (LORA_CH_COUNT > 1) ? (Relay_ClusterLeadMs(_lora) + RL_WINDOW_UNIT_MS - 1) / RL_WINDOW_UNIT_MS : 0;
+    uint32_t window = (((LORA_CH_COUNT > 1) ? RELAY_UPLINK_WINDOW_MS : Relay_ActiveWindowMs(_lora))
+                       + RL_WINDOW_UNIT_MS - 1) / RL_WINDOW_UNIT_MS;
+
+    adv_msg.func_code = FUNC_CODE_RL_REG_ADV;
+    adv_msg.relay_id = _myRelayID;
+    adv_msg.window = (window > 0xFF) ? 0xFF : (uint8_t)window;
+    adv_msg.lead = (lead > 0xFF) ? 0xFF : (uint8_t)lead;
+
+    while(!configured) {
+        // Gửi ADV định kỳ, xoay vòng kênh: kênh GW và kênh con của các Relay cha có thể nhận làm con
+        uint8_t adv_ch = reg_attempt % LORA_CH_COUNT;
+        LoRa_setMode(_lora, STNBY_MODE);
+        LoRaApp_Channel_Set(_lora, adv_ch);
+        int result = LoRaApp_Transmit(_lora, (uint8_t*)&adv_msg, sizeof(msg_rl_reg_adv_t), 1000, AIR_PRIO_NORMAL);
+        if (result){
+        	printf("[RELAY] Sending ADV Request to Gateway (channel %d)...\r\n", adv_ch);
+        } else {
+        	printf("[RELAY] Sending ADV Request to Gateway -> FAILED...\r\n");
+        }
+        LoRa_setMode(_lora, RXCONTIN_MODE);
+
+
+        // Chờ phản hồi Broadcast (Timeout REG_TIMEOUT_MS + 1 s, nghe liên tục:
+        // ACK của Relay cha chỉ tới sau phiên lắng nghe của nó)
+        uint32_t start_wait = HAL_GetTick();
+        uint32_t wait_ms = REG_TIMEOUT_MS + 1000;
+        while(HAL_GetTick() - start_wait < wait_ms) {
+            if(*_rxFlag) {
+                *_rxFlag = 0;
+                int len = LoRaApp_Receive(_lora, _rxBuf, _rxBufSize);
+                if(len > 0 && _rxBuf[0] == FUNC_CODE_GW_REG_ACK) {
+
+                    //Format: [0x07 | Cycle_H | Cycle_L | Count | (ID | Dt_H | Dt_L) x Count | Ch x Count]
+                	uint16_t total_cycle = (_rxBuf[1] << 8) | _rxBuf[2];
+                    uint8_t count = _rxBuf[3];
+                    uint8_t ptr = 4;	//Data bắt đầu từ byte thứ 4
 
                     printf("\r\n[RELAY] !!! ACK RECEIVED FROM GATEWAY !!!\r\n");
 
-                    printf("[RELAY] Scanning for My ID and configuration...\r\n");
+                    printf("[RELAY] Scanning for My ID and configuration...\r\n");
+
+                    // Quét danh sách để tìm ID của mình
+                    for(int i=0; i<count; i++) {
+                        uint8_t id = _rxBuf[ptr];
+                        uint16_t delta = (_rxBuf[ptr+1] << 8) | _rxBuf[ptr+2];
+
+                        //Nếu có chứa ID bản thân
+                        if(id == _myRelayID) {
+
+                            TOTAL_CYCLE_SEC = total_cycle;
+                            my_wakeup_offset = delta; // Đơn vị GW_SCHED_UNIT_MS, tính từ lúc nhận
+                            relay_hop = 1;
+                            relay_parent_id = RELAY_PARENT_GATEWAY;
+                            relay_uplink_lead_ms = lead * RL_WINDOW_UNIT_MS;
+                            configured = 1;
+
+                            // Kênh con của cluster: khối kênh sau các cặp (GW cũ không gửi -> kênh theo ID)
+                            int ch_idx = 4 + 3 * count + i;
+                            relay_channel = (ch_idx < len && _rxBuf[ch_idx] < LORA_CH_COUNT)
+                                            ? _rxBuf[ch_idx] : LoRaApp_Channel_ForRelay(_myRelayID);
+
+                            printf("[RELAY] System configuration set! Cycle: %ds, Wakeup Offset: %lu ms, Channel: %d\r\n",
+                                   total_cycle, (uint32_t)my_wakeup_offset * GW_SCHED_UNIT_MS, relay_channel);
+                            break;
+                        }
+                        ptr += 3; // Nhảy sang cặp tiếp theo
+                    }
+                    if(configured) break;
+                }
+                else if (len >= (int)sizeof(msg_rl_parent_ack_t) && _rxBuf[0] == FUNC_CODE_RL_PARENT_ACK) {
+                    msg_rl_parent_ack_t* pack = (msg_rl_parent_ack_t*)_rxBuf;
+                    if (pack->child_id != _myRelayID || pack->hop > RELAY_MAX_HOPS) continue;
+
+                    Relay_Parent_t cand;
+                    cand.relay_id = pack->parent_id;
+                    cand.hop = pack->hop;
+                    cand.rssi = (int16_t)LoRa_getRSSI(_lora);
+                    cand.beacon_tick = HAL_GetTick() - pack->cycle_offset_ms;
+                    cand.total_cycle = pack->total_cycle;
+                    cand.child_offset_ms = pack->child_offset_ms;
+                    cand.channel = adv_ch;
+                    Relay_AddParentCandidate(parents, &parent_count, &cand);
+
+                    printf("[RELAY] Parent candidate 0x%02X (hop %d, RSSI %d dBm)\r\n", cand.relay_id, cand.hop, cand.rssi);
+                }
+            }
+        }
+
+        // Không nghe được GW: chọn Relay cha tốt nhất trong bảng ứng viên
+        if(!configured && parent_count > 0) {
+            Relay_Parent_t* best = &parents[0];
+            for (int i = 1; i < parent_count; i++) {
+                if (parents[i].hop < best->hop ||
+                    (parents[i].hop == best->hop && parents[i].rssi > best->rssi)) {
+                    best = &parents[i];
+                }
+            }
+
+            TOTAL_CYCLE_SEC = best->total_cycle;
+            relay_hop = best->hop;
+            relay_parent_id = best->relay_id;
+            relay_child_offset_ms = best->child_offset_ms;
+            relay_parent_beacon_tick = best->beacon_tick;
+            relay_channel = best->channel;
+            relay_uplink_lead_ms = 0;
+            configured = 1;
+
+            printf("[RELAY] Joined Parent Relay 0x%02X! Hop: %d, Cycle: %ds, Slot offset: %d ms, Channel: %d\r\n",
+                   relay_parent_id, relay_hop, TOTAL_CYCLE_SEC, relay_child_offset_ms, relay_channel);
+        }
+
+        // Không có phản hồi: backoff mũ ngẫu nhiên, ngủ STOP tới lần ADV sau
+        if (!configured) {
+            uint32_t backoff = LoRaApp_Backoff_Ms(reg_attempt);
+            if (reg_attempt < 0xFF) reg_attempt++;
+
+            printf("[RELAY] No answer -> retry in %lu ms (attempt %d).\r\n", backoff, reg_attempt);
+            LoRa_setMode(_lora, STNBY_MODE);
+            Sleep_Precise_Ms(backoff);
+        }
+    }
+
+    if (relay_hop > 1) {
+        // Bắt đầu chu kỳ RELAY_HOP_LEAD_MS trước slot của mình trong chu kỳ Relay cha
+        uint32_t cycle_ms = (uint32_t)TOTAL_CYCLE_SEC * 1000;
+        uint32_t start = relay_parent_beacon_tick + relay_child_offset_ms - RELAY_HOP_LEAD_MS;
+        while ((int32_t)(start - HAL_GetTick()) < 0) start += cycle_ms;
+
+        uint32_t wait = start - HAL_GetTick();
+
+        printf("[RELAY] Waiting %lu ms to nest into parent cycle...\r\n", wait);
+        Sleep_Precise_Ms(wait);
+    }
+    // Ngủ chờ đến thời điểm Δt (Wakeup Offset) để bắt đầu chu kỳ
+    // Nhiều kênh: Δt là đầu cửa sổ đường lên -> bắt đầu chu kỳ sớm hơn relay_uplink_lead_ms
+    else if(my_wakeup_offset > 0 || relay_uplink_lead_ms > 0) {
+        uint32_t wait = (uint32_t)my_wakeup_offset * GW_SCHED_UNIT_MS;
+        if (wait < relay_uplink_lead_ms) wait += (uint32_t)TOTAL_CYCLE_SEC * 1000;
+        wait -= relay_uplink_lead_ms;
+
+        printf("[RELAY] Waiting %lu ms to sync start time...\r\n", wait);
+
+        // STOP mode cho toàn bộ khoảng chờ (độ phân giải ms)
+        Sleep_Precise_Ms(wait);
+    }
+
+    LoRa_setMode(_lora, STNBY_MODE);
+    LoRaApp_Channel_Set(_lora, relay_channel);
+    printf("[RELAY] Synced! Entering Main Loop.\r\n");
+    return 1;
+}
+
+
+/*
+ * @brief:  Xử lý dữ liệu nhận được khi Relay đang ở Pha Lắng nghe
+ * 			Hàm sẽ phân loại và xử lý bản tin nhận được theo function code
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_rxBuf: Con trỏ buffer nhận
+ * 			_len: Độ dài bản tin nhận
+ * 			_myRelayID: ID Relay node
+ * 			_queue: Hàng chờ yêu cầu Đăng ký của Sensor node (xử lý gửi ACK đầu chu kỳ sau)
+ *
+ */
+void LoRaApp_Relay_RxProcessing(
+		LoRa* _lora, uint8_t* _rxBuf, uint8_t _len, uint8_t _myRelayID, Relay_Reg_Queue_t* _queue) {
+
+    uint8_t func_code = _rxBuf[0];
+
+    // --- CASE 1: PHA ĐĂNG KÝ (ADV) ---
+    if (func_code == FUNC_CODE_REG_ADV) {
+        msg_ss_reg_adv_t* adv_msg = (msg_ss_reg_adv_t*)_rxBuf;
+
+//        printf("[RELAY] Received ADV from Sensor 0x%02X for Relay 0x%02X\r\n",
+//                           adv_msg->sensor_id, adv_msg->target_relay_id);
+
+        // Kiểm tra Target Relay ID
+        if (adv_msg->target_relay_id != _myRelayID) {
+            return;
+        }
+
+        // Kiểm tra xem thuộc danh sách quản lý không? (Sensor lạ: nhận vào slot dự phòng nếu còn)
+        int idx = Relay_AcceptSensor(adv_msg->sensor_id);
+        if (idx >= 0) {
+            Relay_RegTouch(idx, _lora);
+
+            printf("[RELAY] Received ADV form Sensor: 0x%02X --> ACCEPTED\r\n", adv_msg->sensor_id);
+
+            // Logic thêm vào hàng đợi (Queue logic)
+            if (_queue->count < MAX_PENDING_ACK) {
+                uint8_t exists = 0;
+                for(int i=0; i < _queue->count; i++) {
+                    if(_queue->pending_sensors[i] == adv_msg->sensor_id) {
+                        exists = 1; break;
+                    }
+                }
+
+                if (!exists) {
+                    _queue->pending_sensors[_queue->count] = adv_msg->sensor_id;
+                    _queue->count++;
+                    printf("[RELAY] Added Sensor 0x%02X to ACK Queue. Count: %d\r\n", adv_msg->sensor_id, _queue->count);
+                }
+            }
+        }
+    }
+
+    // --- CASE 2: PHA BÁO CÁO (HANDLE LƯU DATA) ---
+    else if (func_code == FUNC_CODE_SS_DATA) {
+        msg_ss_data_t* data_msg = (msg_ss_data_t*)_rxBuf;
+
+        // Kiểm tra Target Relay ID
+        if (data_msg->target_relay_id != _myRelayID) {
+            return;
+        }
+
+        // Kiểm tra xem có trong registry? (1 lần tra bảng băm)
+        int idx = GetSensorIndex(data_msg->sensor_id);
+        if (idx >= 0) {
+        	printf("[RELAY] Received DATA from 0x%02X: T=%d, H=%d, S=%d\r\n",
+        	                   data_msg->sensor_id, data_msg->temp_val, data_msg->hum_val, data_msg->soil_val);
+
+        	if (idx < RELAY_MAX_SENSORS) {
+				Relay_RegTouch(idx, _lora);
+
+				// Trả về nếu đã có dữ liệu ở chu kỳ này rồi (bản sao)
+				if (relay_data_store[idx].has_data == 1) {
+					Relay_SatInc(&relay_data_store[idx].dups);
+					return;
+				}
+
+				Relay_MarkSlotUsed(idx);	// Sensor đã đăng ký từ trước khi Relay khởi động lại
+				relay_data_store[idx].temp = data_msg->temp_val;
+				relay_data_store[idx].hum  = data_msg->hum_val;
+				relay_data_store[idx].soil = data_msg->soil_val;
+				relay_data_store[idx].has_data = 1;
+				if (_len >= sizeof(msg_ss_data_t)) relay_data_store[idx].cfg_ver = data_msg->cfg_ver;
+					// printf("[RELAY] Data saved to Slot %d\r\n", idx); // Debug
+			} else {
+				printf("[RELAY] Error: Sensor ID 0x%02X managed but not found in store!\r\n", data_msg->sensor_id);
+			}
+        }
+    }
+
+    // --- CASE 2b: DỮ LIỆU GỬI GỘP (nhiều mẫu, cũ nhất trước) ---
+    else if (func_code == FUNC_CODE_SS_BATCH) {
+        if (_len < SS_BATCH_HEADER_LEN || _rxBuf[2] != _myRelayID) return;
+
+        int idx = GetSensorIndex(_rxBuf[1]);
+        if (idx < 0) return;	// Không có trong registry
+
+        Relay_RegTouch(idx, _lora);
+        if (relay_data_store[idx].has_data) {		// Bản sao
+            Relay_SatInc(&relay_data_store[idx].dups);
+            return;
+        }
+
+        uint8_t n = _rxBuf[5];
+        uint8_t ptr = SS_BATCH_HEADER_LEN;
+        Relay_Record_t rec;
+
+        Relay_MarkSlotUsed(idx);
+        relay_data_store[idx].upload_period = _rxBuf[3];
+        relay_data_store[idx].cfg_ver = _rxBuf[4];
+        relay_data_store[idx].next_cycle = relay_cycle_count + _rxBuf[3];
+
+        printf("[RELAY] Received BATCH from 0x%02X: %d samples (period %d)\r\n", _rxBuf[1], n, _rxBuf[3]);
+
+        for (int k = 0; k < n && ptr + SS_BATCH_SAMPLE_LEN <= _len; k++, ptr += SS_BATCH_SAMPLE_LEN) {
+            rec.sensor_id = _rxBuf[1];
+            rec.temp = (int16_t)((_rxBuf[ptr+1] << 8) | _rxBuf[ptr+2]);
+            rec.hum  = (uint16_t)((_rxBuf[ptr+3] << 8) | _rxBuf[ptr+4]);
+            rec.soil = _rxBuf[ptr+5];
+
+            // Mẫu mới nhất -> dữ liệu chu kỳ này, các mẫu cũ hơn -> backlog đúng chu kỳ đo
+            if (k == n - 1 || ptr + 2 * SS_BATCH_SAMPLE_LEN > _len) {
+                relay_data_store[idx].temp = rec.temp;
+                relay_data_store[idx].hum  = rec.hum;
+                relay_data_store[idx].soil = rec.soil;
+                relay_data_store[idx].has_data = 1;
+            } else {
+                Relay_BacklogAddRecord(_myRelayID, relay_cycle_count - _rxBuf[ptr], &rec);
+            }
+        }
+    }
+
+    // --- CASE 3: RELAY NGOÀI TẦM GW XIN LÀM RELAY CON ---
+    else if (func_code == FUNC_CODE_RL_REG_ADV) {
+        msg_rl_reg_adv_t* adv = (msg_rl_reg_adv_t*)_rxBuf;
+
+        // Không nhận Relay cha của chính mình (tránh vòng lặp), không vượt số chặng tối đa
+        if (relay_hop >= RELAY_MAX_HOPS || adv->relay_id == relay_parent_id) return;
+
+        for (int i = 0; i < relay_child_queue.count; i++) {
+            if (relay_child_queue.pending_sensors[i] == adv->relay_id) return;
+        }
+        if (relay_child_queue.count < MAX_PENDING_ACK) {
+            relay_child_queue.pending_sensors[relay_child_queue.count++] = adv->relay_id;
+            printf("[RELAY] Received ADV from Relay 0x%02X --> queued as child\r\n", adv->relay_id);
+        }
+    }
+
+    // --- CASE 4: DỮ LIỆU TỪ RELAY CON (chuyển tiếp lên GW) ---
+    else if (func_code == FUNC_CODE_RL_BACKLOG) {
+        if (_len < RL_BACKLOG_HEADER_LEN || _rxBuf[2] != _myRelayID) return;
+
+        int child = Relay_FindChild(_rxBuf[1]);
+        if (child < 0) return;
+
+        Relay_StoreChildUplink(_rxBuf, _len);
+        relay_children[child].has_data = 1;
+
+        // ACK ngay trong slot của Relay con (cùng định dạng ACK của GW)
+        uint8_t ack[GW_ACK_HEADER_LEN + 1] = { FUNC_CODE_GW_ACK, 1, _rxBuf[1] };
+        LoRa_setMode(_lora, STNBY_MODE);
+        LoRaApp_Transmit(_lora, ack, sizeof(ack), 200, AIR_PRIO_CRITICAL);
+        LoRa_setMode(_lora, RXCONTIN_MODE);
+    }
+
+    // --- CASE 5: BEACON CỦA RELAY CHA (đồng bộ slot chuyển tiếp) ---
+    else if (func_code == FUNC_CODE_RL_BEACON) {
+        if (relay_hop > 1 && _len >= sizeof(msg_rl_beacon_t) && _rxBuf[1] == relay_parent_id) {
+            Relay_HandleParentBeacon(_rxBuf, _len);
+        }
+    }
+
+    // --- CASE 6: CẢNH BÁO NHANH (Sensor / Relay con gửi trùng phiên hoạt động chính) ---
+    else if (func_code == FUNC_CODE_SS_ALARM || func_code == FUNC_CODE_RL_ALARM) {
+        Relay_HandleAlarm(_lora, _rxBuf, _len, _myRelayID);
+    }
+}
+
+
+/*
+ * @brief:  Broadcast Beacon đầu chu kỳ, mốc thời gian cho TDMA của các Sensor
+ * 			[Func | RelayID | Cycle_count | RTC_time | total_cycle | Bitmap_len | Bitmap... | TxPower...]
+ * 			Bitmap: ACK data của chu kỳ trước (chỉ gửi khi đã qua ít nhất 1 phiên lắng nghe)
+ * 			TxPower: bước công suất khuyến nghị cho từng slot (đi kèm Bitmap)
+ * 			Sau bitmap: [Cfg_Ver | Cfg_Len | TLV...] khi còn Sensor chưa xác nhận cấu hình (hoặc vừa đổi phiên bản)
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myRelayID: ID Relay node
+ */
+void LoRaApp_Relay_Task_SendBeacon(LoRa* _lora, uint8_t _myRelayID) {
+    uint8_t tx_buf[sizeof(msg_rl_beacon_t) + RELAY_DATA_ACK_BYTES + RL_TXP_BYTES(RELAY_DATA_ACK_BYTES) + 2 + SCFG_MAX_LEN];
+    msg_rl_beacon_t* beacon = (msg_rl_beacon_t*)tx_buf;
+    uint8_t send_cfg = 0;
+
+    relay_cycle_wake_tick = HAL_GetTick();
+    relay_stretch_ms = 0;
+    if (relay_realign_pending) Relay_ApplyRealign();
+
+    Relay_UpdateSchedule(_lora);
+
+    beacon->func_code = FUNC_CODE_RL_BEACON;
+    beacon->relay_id = _myRelayID;
+    beacon->cycle_count = ++relay_cycle_count;
+    beacon->rtc_time = RTC_GetSeconds();
+    beacon->total_cycle = TOTAL_CYCLE_SEC;
+    beacon->slot_ms = relay_slot_ms;
+    beacon->stretch = (uint16_t)(relay_stretch_ms / GW_SCHED_UNIT_MS);
+    beacon->bitmap_len = relay_data_ack_valid ? RELAY_DATA_ACK_BYTES : 0;
+    memcpy(&tx_buf[sizeof(msg_rl_beacon_t)], relay_data_ack_bitmap, RELAY_DATA_ACK_BYTES);
+    uint8_t tx_len = sizeof(msg_rl_beacon_t) + beacon->bitmap_len;
+    if (beacon->bitmap_len > 0) {
+        Relay_PackTxPower(&tx_buf[tx_len]);
+        tx_len += RL_TXP_BYTES(beacon->bitmap_len);
+    }
+
+    // Cấu hình Sensor: Sensor đã đăng ký nhưng chưa xác nhận phiên bản hiện tại -> gắn sau bitmap
+    if (relay_scfg_ver != 0) {
+        send_cfg = (relay_scfg_repeat > 0);
+        for (int i = 0; i < RELAY_MAX_SENSORS && !send_cfg; i++) {
+            send_cfg = (relay_slot_registered[i / 8] & (1 << (i % 8))) && relay_data_store[i].cfg_ver != relay_scfg_ver;
+        }
+    }
+    if (send_cfg) {
+        tx_buf[tx_len++] = relay_scfg_ver;
+        tx_buf[tx_len++] = relay_scfg_len;
+        memcpy(&tx_buf[tx_len], relay_scfg, relay_scfg_len);
+        tx_len += relay_scfg_len;
+        if (relay_scfg_repeat > 0) relay_scfg_repeat--;
+    }
+
+    LoRa_setMode(_lora, STNBY_MODE);
+    LoRaApp_Channel_Set(_lora, relay_channel);
+    int result = LoRaApp_Transmit(_lora, tx_buf, tx_len, 200, AIR_PRIO_CRITICAL);
+
+    // Mốc chu kỳ: lúc phát xong (Sensor lấy mốc lúc nhận xong -> cùng 1 thời điểm)
+    relay_cycle_start_tick = HAL_GetTick();
+
+    // Relay con: dự đoán Beacon Relay cha (ghi đè khi nghe được trong chu kỳ)
+    if (relay_hop > 1) {
+        relay_parent_beacon_tick = relay_cycle_start_tick + RELAY_HOP_LEAD_MS - relay_child_offset_ms;
+        relay_parent_heard = 0;
+        relay_parent_stretch_ms = 0;
+    }
+
+    if (!result) {
+        printf("[RELAY] Sending Beacon #%u -> FAILED\r\n", relay_cycle_count);
+    }
+
+    LoRa_setMode(_lora, RXCONTIN_MODE); // Chuyển sang nghe ngay
+}
+
+
+/*
+ * @brief:  Nhận các Relay con đang chờ: cấp slot sau các slot Sensor và gửi RL_PARENT_ACK (x3)
+ * 			[Func | ParentID | ChildID | Hop | total_cycle | cycle_offset_ms | child_offset_ms | child_slot]
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myRelayID: ID Relay node
+ */
+static void Relay_SendChildACKs(LoRa* _lora, uint8_t _myRelayID) {
+    msg_rl_parent_ack_t ack_msg;
+
+    LoRa_setMode(_lora, STNBY_MODE);
+
+    for (int i = 0; i < relay_child_queue.count; i++) {
+        uint8_t child_id = relay_child_queue.pending_sensors[i];
+
+        // Relay con khởi động lại -> giữ slot cũ, nếu không lấy slot trống đầu tiên
+        int slot = Relay_FindChild(child_id);
+        if (slot < 0) slot = Relay_FindChild(0);
+        if (slot < 0) {
+            printf("[RELAY] No free child slot for Relay 0x%02X\r\n", child_id);
+            continue;
+        }
+        relay_children[slot].relay_id = child_id;
+        relay_children[slot].has_data = 0;
+        relay_children[slot].silent = 0;
+
+        // Slot mới kéo dài phiên nghe của chu kỳ sau
+        Relay_UpdateSchedule(_lora);
+
+        ack_msg.func_code = FUNC_CODE_RL_PARENT_ACK;
+        ack_msg.parent_id = _myRelayID;
+        ack_msg.child_id = child_id;
+        ack_msg.hop = relay_hop + 1;
+        ack_msg.total_cycle = TOTAL_CYCLE_SEC;
+        ack_msg.child_offset_ms = (uint16_t)Relay_ChildOffsetMs(slot);
+        ack_msg.child_slot = (uint8_t)slot;
+
+        for (int k = 0; k < 3; k++) {
+            ack_msg.cycle_offset_ms = (uint16_t)(HAL_GetTick() - relay_cycle_start_tick);
+            LoRaApp_Transmit(_lora, (uint8_t*)&ack_msg, sizeof(msg_rl_parent_ack_t), 200, k == 0 ? AIR_PRIO_NORMAL : AIR_PRIO_LOW);
+            HAL_Delay(20);
+        }
+        printf("[RELAY] Child Relay 0x%02X accepted: slot %d (+%u ms), hop %d\r\n",
+               child_id, slot, ack_msg.child_offset_ms, ack_msg.hop);
+    }
+    relay_child_queue.count = 0;
+}
+
+
+/*
+ * @brief:  Cấp slot và gửi REG_ACK cho 1 Sensor, mỗi bản sao đóng dấu lại vị trí trong chu kỳ
+ * 			[Func | RelayID | Sensor_ID | TDMA slot | total_cycle | cycle_offset_ms | slot_ms]
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myRelayID: ID Relay node
+ * 			_sensorID: ID Sensor được ACK (đã có slot: quản lý hoặc dự phòng)
+ * 			_copies: Số bản sao
+ * @return: 1 nếu phát thành công, 0 nếu lỗi hoặc Sensor không có slot
+ */
+static int Relay_SendRegAck(LoRa* _lora, uint8_t _myRelayID, uint8_t _sensorID, uint8_t _copies) {
+    uint8_t tx_buf[10];
+    msg_ss_reg_ack_t ack_msg;
+    int result = 0;
+
+    // Cấp time slot cho sensor node
+    int slot_idx = GetSensorIndex(_sensorID);
+    if (slot_idx == -1) return 0;
+    Relay_MarkSlotUsed(slot_idx);
+    relay_data_store[slot_idx].upload_period = 0;	// Sensor đăng ký lại: chu kỳ gửi đầu tiên ngay sau ACK
+    relay_data_store[slot_idx].silent = 0;
+
+    ack_msg.func_code = FUNC_CODE_REG_ACK;
+    ack_msg.relay_id = _myRelayID;
+    ack_msg.target_sensor_id = _sensorID;
+    ack_msg.time_slot = (uint8_t)slot_idx;
+    ack_msg.total_cycle = TOTAL_CYCLE_SEC;
+
+    // Slot mới có thể làm tăng độ rộng phiên nghe -> tính lại ngay để lịch trong ACK khớp Beacon sau
+    Relay_UpdateSchedule(_lora);
+    ack_msg.slot_ms = relay_slot_ms;
+
+    for (int i = 0; i < _copies; i++){
+    	ack_msg.cycle_offset_ms = (uint16_t)(HAL_GetTick() - relay_cycle_start_tick);
+    	memcpy(tx_buf, &ack_msg, sizeof(msg_ss_reg_ack_t));
+    	result |= LoRaApp_Transmit(_lora, tx_buf, sizeof(msg_ss_reg_ack_t), 200, i == 0 ? AIR_PRIO_NORMAL : AIR_PRIO_LOW);
+    	if (i < _copies - 1) HAL_Delay(20);
+    }
+    return result;
+}
+
+
+/*
+ * @brief:  Gửi (Broadcast) ACK cho các Sensor đang nằm trong hàng đợi (Timeout: RELAY_ACK_WINDOW_MS)
+ * 			Bao gồm cấp phát timeslot cho TDMA, Cycle tổng (total_cycle) và vị trí hiện tại trong chu kỳ
+ * 			[Func | RelayID | Sensor_ID | TDMA slot | total_cycle | cycle_offset_ms]
+ * 			Relay con chờ nhận (RL_REG_ADV nghe được trong phiên nghe) được ACK trong cùng cửa sổ
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myRelayID: ID Relay node
+ * 			_queue: Hàng chờ yêu cầu Đăng ký của Sensor node
+ */
+
+// --- TASK 2: GỬI ACK (Fixed Time: RELAY_ACK_WINDOW_MS) ---
+void LoRaApp_Relay_Task_SendACKs(LoRa* _lora, uint8_t _myRelayID, Relay_Reg_Queue_t* _queue) {
+    uint32_t start_task = HAL_GetTick();
+
+    // Không có Sensor/Relay con chờ ACK -> bỏ qua cửa sổ, chuyển ngay sang Forward Gateway
+    if (_queue->count == 0 && relay_child_queue.count == 0) {
+        relay_data_ack_valid = 1;
+        return;
+    }
+
+    // Logic gửi ACK
+    if (_queue->count > 0) {
+        LoRa_setMode(_lora, STNBY_MODE);
+//        printf("[RELAY] Sending %d ACKs...\r\n", _queue->count);
 
-                    // Quét danh sách để tìm ID của mình
-                    for(int i=0; i<count; i++) {
-                        uint8_t id = _rxBuf[ptr];
-                        uint16_t delta = (_rxBuf[ptr+1] << 8) | _rxBuf[ptr+2];
+        for (int i = 0; i < _queue->count; i++) {
+            // Broadcast + nhắc lại 2 lần
+            int result = Relay_SendRegAck(_lora, _myRelayID, _queue->pending_sensors[i], 3);
+            if (result){
+            	printf("[RELAY] Sending %d ACKs... -> OK\r\n", _queue->count);
+            } else {
+            	printf("[RELAY] Sending %d ACKs... -> FAILED\r\n", _queue->count);
+            }
+        }
+        _queue->count = 0;
+    }
 
-                        //Nếu có chứa ID bản thân
-                        if(id == _myRelayID) {
+    if (relay_child_queue.count > 0) {
+        Relay_SendChildACKs(_lora, _myRelayID);
+    }
 
-                            TOTAL_CYCLE_SEC = total_cycle;
-                            my_wakeup_offset = delta; // Đơn vị s
-                            configured = 1;
+    // Bù giờ cho đủ  Timeout RELAY_ACK_WINDOW_MS
+    Pad_Execution_Time(start_task, RELAY_ACK_WINDOW_MS);
 
-                            printf("[RELAY] System configuration set! Cycle: %ds, Wakeup Offset: %ds\r\n", total_cycle, my_wakeup_offset);
-                            break;
+    // Phiên lắng nghe đầy đủ đã diễn ra trước pha ACK -> bitmap chu kỳ sau có nghĩa
+    relay_data_ack_valid = 1;
+}
+
+
+/*
+ * @brief:  Đóng gói [Count | Record_1 | ... | Record_n] của 1 aggregate vào buffer gửi
+ * @param:
+ * 			_buf: Con trỏ vị trí ghi
+ * 			_agg: Aggregate cần đóng gói
+ * @return: Số byte đã ghi
+ */
+static uint8_t Relay_PackRecords(uint8_t* _buf, const Relay_Aggregate_t* _agg) {
+    uint8_t idx = 0;
+
+    _buf[idx++] = _agg->count;
+    for (int i = 0; i < _agg->count; i++) {
+        const Relay_Record_t* rec = &_agg->records[i];
+        _buf[idx++] = rec->sensor_id;
+        _buf[idx++] = (rec->temp >> 8) & 0xFF;
+        _buf[idx++] = (rec->temp) & 0xFF;
+        _buf[idx++] = (rec->hum >> 8) & 0xFF;
+        _buf[idx++] = (rec->hum) & 0xFF;
+        _buf[idx++] = rec->soil;
+    }
+    return idx;
+}
+
+
+/*
+ * @brief:  Ghi nhận bản ghi của bản tin đang gửi làm tham chiếu delta kế tiếp (áp dụng khi được ACK)
+ * @param:
+ * 			_rec: Bản ghi (đúng thứ tự GW giải mã)
+ */
+static void Relay_DeltaNext(const Relay_Record_t* _rec) {
+    Relay_Record_t* next = &relay_delta_next[relay_delta_next_count++];
+
+    *next = *_rec;
+    next->soil &= ~RL_RECORD_CARRIED;
+}
+
+
+/*
+ * @brief:  Đóng gói phần sau RelayID của RL_DELTA:
+ * 			[RefCheck | Bitmap | N_new | Delta_1 | ... | Delta_k | Record_1 | ... | Record_n]
+ * 			Sensor có trong tham chiếu -> delta zigzag varint (thường 1 byte/đại lượng), Sensor mới -> bản ghi đầy đủ
+ * @param:
+ * 			_buf: Con trỏ vị trí ghi
+ * 			_agg: Aggregate chu kỳ này
+ * @return: Số byte đã ghi
+ */
+static uint8_t Relay_PackDelta(uint8_t* _buf, const Relay_Aggregate_t* _agg) {
+    uint8_t used[RELAY_AGG_MAX_RECORDS] = { 0 };
+    uint8_t bm_len = (relay_delta_ref_count + 7) / 8;
+    uint8_t idx = 0;
+    uint8_t n_new = 0;
+
+    _buf[idx++] = LoRaApp_Delta_RefCheck(relay_delta_ref, relay_delta_ref_count);
+    uint8_t bm_idx = idx;
+    memset(&_buf[bm_idx], 0, bm_len);
+    idx += bm_len;
+    uint8_t n_idx = idx++;
+    relay_delta_next_count = 0;
+
+    for (int r = 0; r < relay_delta_ref_count; r++) {
+        const Relay_Record_t* ref = &relay_delta_ref[r];
+
+        for (int i = 0; i < _agg->count; i++) {
+            const Relay_Record_t* rec = &_agg->records[i];
+            if (used[i] || rec->sensor_id != ref->sensor_id) continue;
+
+            uint8_t soil = rec->soil & ~RL_RECORD_CARRIED;
+            _buf[bm_idx + r / 8] |= 1 << (r % 8);
+            idx += LoRaApp_Varint_Put(&_buf[idx], (ZIGZAG_ENC((int32_t)soil - ref->soil) << 1)
+                                                  | ((rec->soil & RL_RECORD_CARRIED) ? 1 : 0));
+            idx += LoRaApp_Varint_Put(&_buf[idx], ZIGZAG_ENC((int32_t)rec->temp - ref->temp));
+            idx += LoRaApp_Varint_Put(&_buf[idx], ZIGZAG_ENC((int32_t)rec->hum - ref->hum));
+            used[i] = 1;
+            Relay_DeltaNext(rec);
+            break;
+        }
+    }
+
+    // Sensor không có trong tham chiếu (mới / im lặng ở bản tin trước): bản ghi đầy đủ
+    for (int i = 0; i < _agg->count; i++) {
+        const Relay_Record_t* rec = &_agg->records[i];
+        if (used[i]) continue;
+
+        _buf[idx++] = rec->sensor_id;
+        _buf[idx++] = (rec->temp >> 8) & 0xFF;
+        _buf[idx++] = (rec->temp) & 0xFF;
+        _buf[idx++] = (rec->hum >> 8) & 0xFF;
+        _buf[idx++] = (rec->hum) & 0xFF;
+        _buf[idx++] = rec->soil;
+        n_new++;
+        Relay_DeltaNext(rec);
+    }
+    _buf[n_idx] = n_new;
+    return idx;
+}
+
+
+/*
+ * @brief:  Chờ ACK gộp của GW có chứa ID của mình
+ * 			Relay hop 1: xử lý phần downlink gắn sau danh sách ID (nếu có)
+ * 			Lỡ RELAY_SEC_EPOCH_MISSES lần liên tiếp -> LoRaSec_NewEpoch()
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myRelayID: ID Relay node
+ * 			_start_tick: Mốc bắt đầu cửa sổ (HAL tick)
+ * @return: 1 nếu nhận được ACK trong RELAY_GW_WINDOW_MS, 0 nếu hết giờ
+ */
+static uint8_t Relay_WaitGatewayAck(LoRa* _lora, uint8_t _myRelayID, uint32_t _start_tick) {
+    uint8_t rx_gw[255];
+    extern volatile uint8_t loraRxDoneFlag;
+
+    LoRa_setMode(_lora, RXCONTIN_MODE);
+
+    while (HAL_GetTick() - _start_tick < RELAY_GW_WINDOW_MS) {
+        if (loraRxDoneFlag) {
+            loraRxDoneFlag = 0;
+            uint32_t rx_tick = HAL_GetTick();
+            int len = LoRaApp_Receive(_lora, rx_gw, sizeof(rx_gw));
+            if (len >= GW_ACK_HEADER_LEN && rx_gw[0] == FUNC_CODE_GW_ACK) {
+                // Tìm ID của mình trong danh sách ACK gộp
+                for (int k = 0; k < rx_gw[1] && GW_ACK_HEADER_LEN + k < len; k++) {
+                    if (rx_gw[GW_ACK_HEADER_LEN + k] == _myRelayID) {
+                        int dl = GW_ACK_HEADER_LEN + rx_gw[1];
+                        if (relay_hop == 1 && dl < len) {
+                            Relay_HandleDownlink(&rx_gw[dl], len - dl, _myRelayID, rx_tick);
                         }
-                        ptr += 3; // Nhảy sang cặp tiếp theo
+                        relay_ack_misses = 0;
+                        return 1;
                     }
-                    if(configured) break;
                 }
             }
         }
+    }
+#if LORA_SEC_ENABLE
+    // GW / Relay cha reset thì chặn epoch đang dùng mà không phát gì báo -> sang epoch mới
+    if (++relay_ack_misses >= RELAY_SEC_EPOCH_MISSES) {
+        relay_ack_misses = 0;
+        LoRaSec_NewEpoch();
+    }
+#endif
+    return 0;
+}
+
+
+/*
+ * @brief:  Gửi các aggregate trong backlog (cũ nhất trước) gộp trong 1 bản tin và chờ ACK
+ * 			[Func | RelayID | DestID | Cycle_H | Cycle_L | N_agg | Agg_1 | ... | Agg_n]
+ * 			Số aggregate giới hạn bởi payload 255 byte và RELAY_BACKLOG_MAX_TOA_MS, phần còn lại gửi ở lần sau
+ * 			Backlog rỗng vẫn gửi header (Relay con báo còn sống cho Relay cha)
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myRelayID: ID Relay node
+ * 			_destID: Relay cha hoặc RELAY_PARENT_GATEWAY
+ * @return: 1 nếu được ACK (đã xóa các aggregate vừa gửi khỏi backlog)
+ */
+static uint8_t Relay_SendBacklog(LoRa* _lora, uint8_t _myRelayID, uint8_t _destID) {
+    uint8_t tx_buf[255];
+    uint8_t idx = 0;
+    uint8_t n_agg = 0;
+    uint8_t acked;
+
+    tx_buf[idx++] = FUNC_CODE_RL_BACKLOG;
+    tx_buf[idx++] = _myRelayID;
+    tx_buf[idx++] = _destID;
+    tx_buf[idx++] = (relay_cycle_count >> 8) & 0xFF;
+    tx_buf[idx++] = (relay_cycle_count) & 0xFF;
+    uint8_t n_idx = idx++;
+
+    while (n_agg < relay_backlog_len) {
+        const Relay_Aggregate_t* agg = &relay_backlog[(relay_backlog_head + n_agg) % RELAY_BACKLOG_DEPTH];
+        uint16_t agg_len = RL_BACKLOG_AGG_HEADER_LEN + agg->count * RL_RECORD_LEN;
+
+        if (idx + agg_len > LORA_MAX_PAYLOAD) break;
+        if (n_agg > 0 && LoRa_getTimeOnAir(_lora, LORA_AIR_LEN(idx + agg_len)) > RELAY_BACKLOG_MAX_TOA_MS) break;
+
+        tx_buf[idx++] = agg->relay_id;
+        tx_buf[idx++] = (agg->cycle >> 8) & 0xFF;
+        tx_buf[idx++] = (agg->cycle) & 0xFF;
+        idx += Relay_PackRecords(&tx_buf[idx], agg);
+        n_agg++;
+    }
+    tx_buf[n_idx] = n_agg;
+
+    printf("[RELAY] Uplink to 0x%02X: %u/%u aggregates (%d bytes)...\r\n", _destID, n_agg, relay_backlog_len, idx);
+
+    uint32_t start_task = HAL_GetTick();
+    LoRa_setMode(_lora, STNBY_MODE);
+    // Relay con: đây là đường gửi dữ liệu chính. Hết ngân sách -> giữ backlog, gửi chu kỳ sau
+    if (!LoRaApp_Transmit(_lora, tx_buf, idx, 1000, relay_hop > 1 ? AIR_PRIO_NORMAL : AIR_PRIO_LOW)) return 0;
+
+    acked = Relay_WaitGatewayAck(_lora, _myRelayID, start_task);
+    if (acked) {
+        relay_backlog_head = (relay_backlog_head + n_agg) % RELAY_BACKLOG_DEPTH;
+        relay_backlog_len -= n_agg;
+        printf("[RELAY] Uplink ACK OK (%u pending).\r\n", relay_backlog_len);
+    } else {
+        printf("[RELAY] Uplink ACK timeout.\r\n");
+    }
+    LoRa_setMode(_lora, STNBY_MODE);
+    return acked;
+}
+
+
+/*
+ * @brief:  Relay con: nghe (RX) tới slot của mình trong chu kỳ Relay cha
+ * 			Nghe được Beacon Relay cha trong lúc chờ -> căn lại slot theo Beacon thật
+ * @param:	_lora: Con trỏ struct LoRa quản lý
+ */
+static void Relay_WaitParentSlot(LoRa* _lora) {
+    uint8_t rx_buf[RL_BEACON_MAX_LEN];
+    extern volatile uint8_t loraRxDoneFlag;
+
+    LoRa_setMode(_lora, RXCONTIN_MODE);
+
+    while ((int32_t)(relay_parent_beacon_tick + relay_child_offset_ms - HAL_GetTick()) > 0) {
+        if (loraRxDoneFlag) {
+            loraRxDoneFlag = 0;
+            int len = LoRaApp_Receive(_lora, rx_buf, sizeof(rx_buf));
+            if (len >= (int)sizeof(msg_rl_beacon_t) && rx_buf[0] == FUNC_CODE_RL_BEACON && rx_buf[1] == relay_parent_id) {
+                Relay_HandleParentBeacon(rx_buf, len);
+            }
+        }
+    }
+
+    if (!relay_parent_heard) {
+        printf("[RELAY] Parent Beacon missed, using predicted slot.\r\n");
+    }
+}
+
+
+/*
+ * @brief:  Gom/tạo bản tin tổng hợp dữ liệu cac Sensor node quản lý và forward tới GW (Timeout: RELAY_GW_WINDOW_MS)
+ * 			[Func | RelayID | Count | SensorID_1 | Temp_1 | Humid_1 | Soil_1 | ... | SensorID_n | Temp_n | Humid_n | Soil_n |]
+ * 			GW đã ACK bản tin trước -> RL_DELTA (delta so với bản tin đó), keyframe RL_DATA mỗi RELAY_DELTA_KEYFRAME_CYCLES
+ * 			Dừng nghe ngay khi nhận ACK gộp của GW có chứa ID của mình
+ * 			Không được ACK -> aggregate vào backlog. Được ACK (hoặc chu kỳ không có data) -> gửi backlog
+ * 			(gồm cả dữ liệu Relay con chuyển lên), tối đa RELAY_UPLINK_MAX_FRAMES bản tin
+ * 			Relay con (hop > 1): đưa aggregate vào backlog, gửi 1 bản tin RL_BACKLOG tới Relay cha đúng slot
+ * 			Nhiều kênh (hop 1): chờ tới cửa sổ đường lên (mốc chu kỳ + relay_uplink_lead_ms), gửi trên kênh GW
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myRelayID: ID Relay node
+ * @return:
+ * 			1 nếu GW (Relay cha) đã ACK, 0 nếu không (hoặc không có dữ liệu)
+ */
 
-        if(!configured) {
-            HAL_Delay(1000 + (HAL_GetTick() % 1000));
+// --- TASK 3: FORWARD GATEWAY (Timeout: RELAY_GW_WINDOW_MS) ---
+uint8_t LoRaApp_Relay_Task_ForwardToGateway(LoRa* _lora, uint8_t _myRelayID) {
+    uint32_t start_task = HAL_GetTick();
+    uint8_t tx_buf[256];
+    uint8_t idx = 0;
+    uint8_t acked = 0;
+    Relay_Aggregate_t agg;
+
+    // Gom dữ liệu chu kỳ này
+    agg.relay_id = _myRelayID;
+    agg.cycle = relay_cycle_count;
+    agg.count = 0;
+    for(int i=0; i<RELAY_MAX_SENSORS; i++) {
+        // Sensor im lặng trong dead-band (gửi mỗi chu kỳ) -> giá trị cuối, đánh dấu RL_RECORD_CARRIED
+        uint8_t carried = !relay_data_store[i].has_data && SENSOR_DEADBAND_ENABLE
+                          && relay_data_store[i].upload_period <= 1 && relay_data_store[i].carry_left > 0;
+
+        if((relay_data_store[i].has_data || carried) && agg.count < RELAY_AGG_MAX_RECORDS) {
+            agg.records[agg.count].sensor_id = relay_data_store[i].sensor_id;
+            agg.records[agg.count].temp = relay_data_store[i].temp;
+            agg.records[agg.count].hum  = relay_data_store[i].hum;
+            agg.records[agg.count].soil = relay_data_store[i].soil | (carried ? RL_RECORD_CARRIED : 0);
+            agg.count++;
         }
     }
 
-    // Ngủ chờ đến thời điểm Δt (Wakeup Offset) để bắt đầu chu kỳ
-    if(my_wakeup_offset > 0) {
-        printf("[RELAY] Waiting %d ms to sync start time...\r\n", my_wakeup_offset);
-        uint32_t sleep_sec = my_wakeup_offset;
-
-        //Nếu > 1s -> vào STOP mode; < 1s -> HAL_Delay
-        if(sleep_sec > 0) {
-            RTC_SetAlarm_In_Seconds(sleep_sec);
-            Enter_Stop_Mode();
+    // Relay con: chuyển toàn bộ lên Relay cha trong slot của mình
+    if (relay_hop > 1) {
+        if (agg.count > 0) Relay_BacklogPush(&agg);
+        Relay_WaitParentSlot(_lora);
+        return Relay_SendBacklog(_lora, _myRelayID, relay_parent_id);
+    }
+
+    // Nhiều kênh: ngủ tới cửa sổ đường lên GW xếp cho Relay này, lên kênh GW (về kênh con ở cuối hàm)
+    LoRa_setMode(_lora, STNBY_MODE);
+    if (relay_uplink_lead_ms > 0) {
+        int32_t wait = (int32_t)(relay_cycle_wake_tick + relay_uplink_lead_ms - HAL_GetTick());
+        if (wait > 0) Sleep_Precise_Ms((uint32_t)wait);
+        start_task = HAL_GetTick();
+    }
+    LoRaApp_Channel_Set(_lora, LORA_CH_GATEWAY);
+
+    // Gửi & Chờ ACK (Nếu có dữ liệu)
+    if (agg.count > 0) {
+        uint8_t with_link = relay_link_due;
+        // GW đã ACK bản tin trước -> delta so với bản tin đó, mỗi RELAY_DELTA_KEYFRAME_CYCLES gửi RL_DATA đầy đủ
+        uint8_t delta = RELAY_DELTA_ENABLE && relay_delta_ref_valid && relay_delta_run < RELAY_DELTA_KEYFRAME_CYCLES;
+
+        tx_buf[idx++] = delta ? FUNC_CODE_RL_DELTA : FUNC_CODE_RL_DATA;
+        tx_buf[idx++] = _myRelayID;
+        if (delta) {
+            idx += Relay_PackDelta(&tx_buf[idx], &agg);
+        } else {
+            idx += Relay_PackRecords(&tx_buf[idx], &agg);
+            relay_delta_next_count = 0;
+            for (int i = 0; i < agg.count; i++) Relay_DeltaNext(&agg.records[i]);
+        }
+        // Tới kỳ: kèm khối chất lượng liên kết sau Record cuối
+        if (with_link) idx += Relay_PackLinkStats(&tx_buf[idx]);
+
+        printf("[RELAY] Forwarding to GW (%d bytes, %s)...\r\n", idx, delta ? "delta" : "keyframe");
+
+//        // Debug bản tin HEX
+//        printf("HEX: ");
+//        for(int k=0; k<idx; k++) printf("%02X ", tx_buf[k]);
+//        printf("\r\n");
+
+        LoRa_setMode(_lora, STNBY_MODE);
+        // Chờ ACK (Thời gian còn lại trong window). Hết ngân sách phát -> vào backlog như mất ACK
+        acked = LoRaApp_Transmit(_lora, tx_buf, idx, 500, AIR_PRIO_NORMAL) // Timeout gửi 500ms
+                && Relay_WaitGatewayAck(_lora, _myRelayID, start_task);
+
+        if (acked) {
+            printf("[RELAY] GW ACK OK (%lu ms).\r\n", HAL_GetTick() - start_task);
+            // GW đã giải mã bản tin này -> tham chiếu delta của chu kỳ sau
+            memcpy(relay_delta_ref, relay_delta_next, sizeof(relay_delta_ref));
+            relay_delta_ref_count = relay_delta_next_count;
+            relay_delta_ref_valid = 1;
+            relay_delta_run = delta ? relay_delta_run + 1 : 0;
+            // Khối liên kết đã tới GW -> bắt đầu kỳ đếm mới (EWMA giữ nguyên)
+            if (with_link) {
+                relay_link_due = 0;
+                for (int i = 0; i < RELAY_MAX_SENSORS; i++) {
+                    relay_data_store[i].heard = 0;
+                    relay_data_store[i].expected = 0;
+                    relay_data_store[i].dups = 0;
+                }
+            }
         } else {
-            HAL_Delay(my_wakeup_offset);
+            printf("[RELAY] GW ACK timeout.\r\n");
+            Relay_BacklogPush(&agg);
+            // Không biết GW đã nhận hay chưa (có thể chỉ mất ACK) -> bản tin sau là keyframe
+            relay_delta_ref_valid = 0;
+        }
+        LoRa_setMode(_lora, STNBY_MODE);
+    } else if (relay_backlog_len == 0) {
+        // Không có gì để gửi: header RL_BACKLOG rỗng báo còn sống (GW giữ cửa sổ Δt của Relay này)
+        printf("[RELAY] No Data to Forward. Keep-alive.\r\n");
+        Relay_SendBacklog(_lora, _myRelayID, RELAY_PARENT_GATEWAY);
+    }
+
+    // Đường lên GW vừa thông (hoặc chưa thử) -> gửi backlog: chu kỳ bị lỡ + dữ liệu Relay con
+    if (acked || agg.count == 0) {
+        for (int f = 0; f < RELAY_UPLINK_MAX_FRAMES && relay_backlog_len > 0; f++) {
+            if (!Relay_SendBacklog(_lora, _myRelayID, RELAY_PARENT_GATEWAY)) break;
         }
     }
+    LoRa_setMode(_lora, STNBY_MODE);
+    LoRaApp_Channel_Set(_lora, relay_channel);
 
-    printf("[RELAY] Synced! Entering Main Loop.\r\n");
+    // Không bù giờ: thời gian ngủ tính từ mốc Beacon nên kết thúc sớm = ngủ sớm
+    return acked;
+}
+
+
+/*
+ * @brief:  Mốc bắt đầu chu kỳ kế tiếp (tính từ lúc bắt đầu chu kỳ này, cộng stretch khi dời lịch)
+ * 			Relay con nghe được Beacon Relay cha -> neo lại chu kỳ theo Relay cha (bù trôi đồng hồ)
+ * @return: HAL tick
+ */
+static uint32_t Relay_NextCycleTick(void) {
+    uint32_t cycle_ms = (uint32_t)TOTAL_CYCLE_SEC * 1000;
+
+    if (relay_hop > 1 && relay_parent_heard) {
+        return relay_parent_beacon_tick + relay_child_offset_ms - RELAY_HOP_LEAD_MS + cycle_ms + relay_parent_stretch_ms;
+    }
+    return relay_cycle_wake_tick + cycle_ms + relay_stretch_ms;
+}
+
+
+/*
+ * @brief:  Relay con: ngủ tới slot cảnh báo kế tiếp của Relay cha (mốc từ Beacon Relay cha)
+ * @param:	_window: Độ dài slot cảnh báo (ms)
+ * @return: 1 nếu đã tới slot, 0 nếu không còn slot nào trước chu kỳ sau
+ */
+static uint8_t Relay_WaitParentAlarmSlot(uint32_t _window) {
+    int32_t since = (int32_t)(HAL_GetTick() - relay_parent_beacon_tick);
+    uint32_t k = (since < 0) ? 1 : (uint32_t)since / RELAY_ALARM_PERIOD_MS + 1;
+    uint32_t slot_tick = relay_parent_beacon_tick + k * RELAY_ALARM_PERIOD_MS;
+
+    if ((int32_t)(Relay_NextCycleTick() - (slot_tick + _window)) < 0) return 0;
+
+    int32_t wait = (int32_t)(slot_tick + RELAY_ALARM_GUARD_MS - HAL_GetTick());
+    if (wait > 0) Sleep_Precise_Ms((uint32_t)wait);
     return 1;
 }
 
 
 /*
- * @brief:  Xử lý dữ liệu nhận được khi Relay đang ở Pha Lắng nghe
- * 			Hàm sẽ phân loại và xử lý bản tin nhận được theo function code
- * @param:
- * 			_lora: Con trỏ struct LoRa quản lý
- * 			_rxBuf: Con trỏ buffer nhận
- * 			_myRelayID: ID Relay node
- * 			_queue: Hàng chờ yêu cầu Đăng ký của Sensor node (xử lý gửi ACK đầu chu kỳ sau)
- *
+ * @brief:  Chuyển tiếp các cảnh báo đang chờ (cũ nhất trước), mỗi bản tin chờ ACK
+ * 			[Func | RelayID | DestID | OriginRelayID | SensorID | Flags | Temp_H | Temp_L | Hum_H | Hum_L | Soil]
+ * 			Hop 1: gửi GW ngay trên kênh GW (GW luôn nghe). Relay con: gửi trong slot cảnh báo của Relay cha (kênh con)
+ * 			Không được ACK -> dừng, thử lại ở lần sau (tối đa ALARM_RETRIES lần mỗi cảnh báo)
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myRelayID: ID Relay node
+ */
+static void Relay_ForwardAlarms(LoRa* _lora, uint8_t _myRelayID) {
+    uint8_t tx_buf[RL_ALARM_LEN];
+    uint32_t window = LoRaApp_Alarm_WindowMs(_lora);
+
+    while (relay_alarm_count > 0) {
+        if (relay_hop > 1 && !Relay_WaitParentAlarmSlot(window)) return;
+
+        tx_buf[0] = FUNC_CODE_RL_ALARM;
+        tx_buf[1] = _myRelayID;
+        tx_buf[2] = relay_parent_id;
+        memcpy(&tx_buf[RL_ALARM_HEADER_LEN], relay_alarm_queue[0], sizeof(relay_alarm_queue[0]));
+
+        uint32_t start_task = HAL_GetTick();
+        uint8_t acked = 0;
+        LoRa_setMode(_lora, STNBY_MODE);
+        LoRaApp_Channel_Set(_lora, relay_hop > 1 ? relay_channel : LORA_CH_GATEWAY);
+        if (LoRaApp_Alarm_WaitChannel(_lora, _myRelayID)) {
+            LoRaApp_Transmit(_lora, tx_buf, RL_ALARM_LEN, 200, AIR_PRIO_CRITICAL);
+            acked = Relay_WaitGatewayAck(_lora, _myRelayID, start_task);
+        }
+        LoRa_setMode(_lora, STNBY_MODE);
+        LoRaApp_Channel_Set(_lora, relay_channel);
+
+        if (!acked && --relay_alarm_tries[0] > 0) {
+            printf("[RELAY] Alarm uplink failed, retry later.\r\n");
+            return;
+        }
+        printf("[RELAY] Alarm 0x%02X/0x%02X to 0x%02X -> %s\r\n", relay_alarm_queue[0][0], relay_alarm_queue[0][1],
+                relay_parent_id, acked ? "ACK OK" : "DROPPED");
+
+        relay_alarm_count--;
+        memmove(relay_alarm_queue[0], relay_alarm_queue[1], relay_alarm_count * sizeof(relay_alarm_queue[0]));
+        memmove(&relay_alarm_tries[0], &relay_alarm_tries[1], relay_alarm_count);
+    }
+}
+
+
+/*
+ * @brief:  Nghe 1 slot cảnh báo (kèm ADV của Sensor failover đã đồng bộ theo Beacon)
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myRelayID: ID Relay node
+ * 			_start_tick: Mốc bắt đầu nghe (HAL tick)
+ * 			_window: Thời gian nghe (ms)
+ */
+static void Relay_ListenAlarmSlot(LoRa* _lora, uint8_t _myRelayID, uint32_t _start_tick, uint32_t _window) {
+    uint8_t rx_buf[32];
+    extern volatile uint8_t loraRxDoneFlag;
+
+    LoRa_setMode(_lora, RXCONTIN_MODE);
+
+    while (HAL_GetTick() - _start_tick < _window) {
+        if (loraRxDoneFlag) {
+            loraRxDoneFlag = 0;
+            int len = LoRaApp_Receive(_lora, rx_buf, sizeof(rx_buf));
+            if (len > 0 && (rx_buf[0] == FUNC_CODE_SS_ALARM || rx_buf[0] == FUNC_CODE_RL_ALARM)) {
+                Relay_HandleAlarm(_lora, rx_buf, (uint8_t)len, _myRelayID);
+            }
+            // Sensor failover (đã đồng bộ theo Beacon của Relay này): ACK ngay trong slot, không chờ chu kỳ sau
+            else if (len >= (int)sizeof(msg_ss_reg_adv_t) && rx_buf[0] == FUNC_CODE_REG_ADV && rx_buf[2] == _myRelayID
+                     && Relay_AcceptSensor(rx_buf[1]) >= 0) {
+                LoRa_setMode(_lora, STNBY_MODE);
+                Relay_SendRegAck(_lora, _myRelayID, rx_buf[1], 1);
+                LoRa_setMode(_lora, RXCONTIN_MODE);
+                printf("[RELAY] ADV from Sensor 0x%02X in alarm slot -> ACK sent.\r\n", rx_buf[1]);
+            }
+        }
+    }
+    LoRa_setMode(_lora, STNBY_MODE);
+}
+
+
+/*
+ * @brief:  Slot cảnh báo: sau phiên hoạt động chính, thức nghe mỗi RELAY_ALARM_PERIOD_MS (tính từ Beacon)
+ * 			tới hết chu kỳ, cảnh báo nhận được chuyển tiếp ngay sau slot
+ * @param:
+ * 			_lora: Con trỏ struct LoRa quản lý
+ * 			_myRelayID: ID Relay node
+ */
+void LoRaApp_Relay_Task_AlarmSlots(LoRa* _lora, uint8_t _myRelayID) {
+    if (!ALARM_ENABLE) return;
+
+    uint32_t window = LoRaApp_Alarm_WindowMs(_lora);
+    uint8_t slots = 0;
+
+    // Cảnh báo nhận trong phiên hoạt động chính
+    Relay_ForwardAlarms(_lora, _myRelayID);
+
+    for (;;) {
+        uint32_t k = (HAL_GetTick() + RELAY_ALARM_GUARD_MS - relay_cycle_start_tick) / RELAY_ALARM_PERIOD_MS + 1;
+        uint32_t slot_tick = relay_cycle_start_tick + k * RELAY_ALARM_PERIOD_MS;
+        if ((int32_t)(Relay_NextCycleTick() - (slot_tick + window)) < 0) break;
+
+        int32_t wait = (int32_t)(slot_tick - RELAY_ALARM_GUARD_MS - HAL_GetTick());
+        if (wait > 0) Sleep_Precise_Ms((uint32_t)wait);
+
+        Relay_ListenAlarmSlot(_lora, _myRelayID, slot_tick - RELAY_ALARM_GUARD_MS, window);
+        Relay_ForwardAlarms(_lora, _myRelayID);
+        slots++;
+    }
+    printf("[RELAY] Alarm slots: %u (window %lu ms).\r\n", slots, window);
+}
+
+
+/*
+ * @brief:  Ngủ STOP tới đầu chu kỳ kế tiếp (Relay_NextCycleTick)
+ */
+void LoRaApp_Relay_SleepUntilNextCycle(void) {
+    uint32_t next = Relay_NextCycleTick();
+
+    uint32_t elapsed = HAL_GetTick() - relay_cycle_start_tick;
+    int32_t remain = (int32_t)(next - HAL_GetTick());
+    uint32_t sleep_ms = (remain > 0) ? (uint32_t)remain : 0;
+
+    printf("[RELAY] Active: %lu ms. Sleep time: %lu ms.\r\n", elapsed, sleep_ms);
+
+    Sleep_Precise_Ms(sleep_ms);
+}
+
+#endif
+
+
+#if (CURRENT_NODE_TYPE == NODE_TYPE_GATEWAY)
+// ==============================
+// --- HÀM PHÍA GATEWAY ---
+// ==============================
+
+static Gateway_Relay_List_t gw_relay_list;
+
+// Hàng chờ ACK gộp cho Relay đã gửi Data
+static uint8_t gw_ack_pending[GW_ACK_MAX_BATCH];
+static uint8_t gw_ack_count = 0;
+static uint32_t gw_ack_first_tick = 0;
+
+// Lịch Δt: cửa sổ Relay i bắt đầu tại gw_sched_epoch_tick + offset_ms (mod chu kỳ)
+static uint8_t gw_sched_active = 0;			// Đã có lệnh cấu hình (chu kỳ) từ Server
+static uint16_t gw_sched_total_cycle = DEFAULT_TOTAL_CYCLE;
+static uint32_t gw_sched_epoch_tick = 0;
+
+// Hàng chờ downlink: gửi kèm GW_ACK, lúc Relay đích chắc chắn đang nghe
+static Gateway_Downlink_t gw_dl_queue[GW_DL_QUEUE_SIZE];
+static uint8_t gw_dl_count = 0;
+
+/*
+ * @brief: 	Init/Reset danh sách Relay đang quản lý
+ */
+void LoRaApp_Gateway_Init(void) {
+    gw_relay_list.count = 0;
+    gw_sched_active = 0;
+    gw_dl_count = 0;
+//    printf("[GW] Gateway Initialized. Start listening ...\r\n");
+}
+
+
+/*
+ * @brief: 	Tìm Relay trong danh sách quản lý
+ * @param:	relay_id: ID Relay
+ * @return: Con trỏ tới mục của Relay, NULL nếu chưa có
+ */
+static Relay_Info_t* Gateway_FindRelay(uint8_t relay_id) {
+	for (int i = 0; i < gw_relay_list.count; i++) {
+		if (gw_relay_list.relays[i].relay_id == relay_id) return &gw_relay_list.relays[i];
+	}
+	return NULL;
+}
+
+
+/*
+ * @brief: 	Tìm vị trí sớm nhất trong chu kỳ còn trống đủ cho 1 cửa sổ (first-fit giữa các Relay đã xếp)
+ * 			Các Relay đang chạy giữ nguyên vị trí (dời lịch sẽ làm Sensor của chúng mất đồng bộ Beacon)
+ * 			Cửa sổ đường lên (kênh GW) không chồng lấn nhau. Relay cùng kênh con: cả phiên cluster
+ * 			[offset - lead, offset + window) cũng không chồng lấn; khác kênh con -> phiên cluster chạy song song
+ * @param:	_relay: Relay cần xếp (chưa được đánh dấu scheduled)
+ * @return: Vị trí cửa sổ (ms tính từ mốc lịch)
+ */
+static uint32_t Gateway_FindGap(const Relay_Info_t* _relay) {
+	uint32_t cycle_ms = (uint32_t)gw_sched_total_cycle * 1000;
+	uint32_t need = (uint32_t)_relay->window_ms + GW_SCHED_GUARD_MS;
+	uint32_t candidate = _relay->lead_ms;	// Phiên cluster bắt đầu sau mốc lịch (không vắt qua chu kỳ trước)
+	uint8_t moved = 1;
+
+	// Đẩy candidate qua mọi cửa sổ chồng lấn tới khi không còn va chạm (danh sách không sắp xếp, N nhỏ)
+	while (moved) {
+		moved = 0;
+		for (int i = 0; i < gw_relay_list.count; i++) {
+			const Relay_Info_t* r = &gw_relay_list.relays[i];
+			if (!r->scheduled) continue;
+
+			uint8_t same_ch = (r->channel == _relay->channel);
+			uint32_t end = r->offset_ms + r->window_ms + GW_SCHED_GUARD_MS;
+			uint32_t my_lead = same_ch ? _relay->lead_ms : 0;
+			uint32_t r_lead = same_ch ? r->lead_ms : 0;
+
+			if (candidate < end + my_lead && r->offset_ms < candidate + need + r_lead) {
+				candidate = end + my_lead;
+				moved = 1;
+			}
+		}
+	}
+
+	if (candidate + need > cycle_ms) {
+		printf("[GW] Schedule overflow: Relay 0x%02X needs %lu ms, cycle %u s is too short!\r\n",
+				_relay->relay_id, need, gw_sched_total_cycle);
+		candidate %= cycle_ms;
+	}
+	return candidate;
+}
+
+
+/*
+ * @brief: 	In lịch hiện tại và chu kỳ tối thiểu (kết thúc cửa sổ cuối + khoảng bảo vệ)
+ */
+static void Gateway_PrintSchedule(void) {
+	uint32_t min_cycle_ms = 0;
+
+	printf("[GW] Schedule (cycle %u s):", gw_sched_total_cycle);
+	for (int i = 0; i < gw_relay_list.count; i++) {
+		const Relay_Info_t* r = &gw_relay_list.relays[i];
+		if (!r->scheduled) continue;
+
+		uint32_t end = r->offset_ms + r->window_ms + GW_SCHED_GUARD_MS;
+		if (end > min_cycle_ms) min_cycle_ms = end;
+		printf(" 0x%02X@%lu+%u/ch%d", r->relay_id, r->offset_ms, r->window_ms, r->channel);
+	}
+	printf(" -> min cycle %lu s\r\n", (min_cycle_ms + 999) / 1000);
+}
+
+
+/*
+ * @brief: 	Thời gian từ lúc này tới đầu cửa sổ kế tiếp của Relay theo lịch hiện tại
+ * @param:	_relay: Relay đã được xếp lịch
+ * @return: Δt (đơn vị GW_SCHED_UNIT_MS)
  */
-void LoRaApp_Relay_RxProcessing(
-		LoRa* _lora, uint8_t* _rxBuf, uint8_t _myRelayID, Relay_Reg_Queue_t* _queue) {
-
-    uint8_t func_code = _rxBuf[0];
+static uint16_t Gateway_WindowDelay(const Relay_Info_t* _relay) {
+	uint32_t cycle_ms = (uint32_t)gw_sched_total_cycle * 1000;
+	uint32_t elapsed = (HAL_GetTick() - gw_sched_epoch_tick) % cycle_ms;
 
-    // --- CASE 1: PHA ĐĂNG KÝ (ADV) ---
-    if (func_code == FUNC_CODE_REG_ADV) {
-        msg_ss_reg_adv_t* adv_msg = (msg_ss_reg_adv_t*)_rxBuf;
+	return (uint16_t)(((_relay->offset_ms + cycle_ms - elapsed) % cycle_ms) / GW_SCHED_UNIT_MS);
+}
 
-//        printf("[RELAY] Received ADV from Sensor 0x%02X for Relay 0x%02X\r\n",
-//                           adv_msg->sensor_id, adv_msg->target_relay_id);
 
-        // Kiểm tra Target Relay ID
-        if (adv_msg->target_relay_id != _myRelayID) {
-            return;
-        }
+/*
+ * @brief: 	Broadcast lịch (GW_REG_ACK) cho các Relay đã xếp (tất cả hoặc chỉ mục thay đổi), lặp 5 lần
+ * 			Δt của mỗi lần phát tính lại theo thời điểm phát: Relay nhận bản nào cũng bắt đầu đúng vị trí
+ * 			[Func | Cycle_H | Cycle_L | Count | RelayID | Dt_H | Dt_L | ... | Ch_1 | ... | Ch_n], Δt đơn vị GW_SCHED_UNIT_MS
+ * 			Δt: tới đầu cửa sổ đường lên. Ch: kênh con của cluster, theo thứ tự cặp (Relay cũ bỏ qua khối kênh)
+ * @param:
+ * 			_lora:	Con trỏ struct LoRa quản lý
+ * 			only_dirty: 1 chỉ gửi mục mới/đổi, 0 gửi toàn bộ lịch
+ */
+static void Gateway_BroadcastSchedule(LoRa* _lora, uint8_t only_dirty) {
+	uint8_t tx_buf[4 + 4 * MAX_RELAY_QUEUE];
+	uint8_t channels[MAX_RELAY_QUEUE];
+	int result = 0;
+	uint8_t pair_count = 0;
 
-        // Kiểm tra xem thuộc danh sách quản lý không?
-        if (IsSensorManaged(adv_msg->sensor_id)) {
+	for (int k = 0; k < 5; k++) {
+		uint8_t idx = 0;
 
-            printf("[RELAY] Received ADV form Managed Sensor: 0x%02X --> ACCEPTED\r\n", adv_msg->sensor_id);
+		tx_buf[idx++] = FUNC_CODE_GW_REG_ACK;
+		tx_buf[idx++] = (gw_sched_total_cycle >> 8) & 0xFF;
+		tx_buf[idx++] = (gw_sched_total_cycle) & 0xFF;
+		uint8_t count_idx = idx++;
+		pair_count = 0;
 
-            // Logic thêm vào hàng đợi (Queue logic)
-            if (_queue->count < MAX_PENDING_ACK) {
-                uint8_t exists = 0;
-                for(int i=0; i < _queue->count; i++) {
-                    if(_queue->pending_sensors[i] == adv_msg->sensor_id) {
-                        exists = 1; break;
-                    }
-                }
+		for (int i = 0; i < gw_relay_list.count; i++) {
+			const Relay_Info_t* r = &gw_relay_list.relays[i];
+			if (!r->scheduled || (only_dirty && !r->dirty)) continue;
 
-                if (!exists) {
-                    _queue->pending_sensors[_queue->count] = adv_msg->sensor_id;
-                    _queue->count++;
-                    printf("[RELAY] Added Sensor 0x%02X to ACK Queue. Count: %d\r\n", adv_msg->sensor_id, _queue->count);
-                }
-            }
-        }
-    }
+			uint16_t dt = Gateway_WindowDelay(r);
+			tx_buf[idx++] = r->relay_id;
+			tx_buf[idx++] = (dt >> 8) & 0xFF;
+			tx_buf[idx++] = (dt) & 0xFF;
+			channels[pair_count++] = r->channel;
+		}
+		tx_buf[count_idx] = pair_count;
+		if (pair_count == 0) return;
+		memcpy(&tx_buf[idx], channels, pair_count);
+		idx += pair_count;
 
-    // --- CASE 2: PHA BÁO CÁO (HANDLE LƯU DATA) ---
-    else if (func_code == FUNC_CODE_SS_DATA) {
-        msg_ss_data_t* data_msg = (msg_ss_data_t*)_rxBuf;
+		LoRa_setMode(_lora, STNBY_MODE);
+		result |= LoRaApp_Transmit(_lora, tx_buf, idx, 2000, k == 0 ? AIR_PRIO_NORMAL : AIR_PRIO_LOW);
+		HAL_Delay(100);
+	}
 
-        // Kiểm tra Target Relay ID
-        if (data_msg->target_relay_id != _myRelayID) {
-            return;
-        }
+	for (int i = 0; i < gw_relay_list.count; i++) gw_relay_list.relays[i].dirty = 0;
 
-        // Kiểm tra xem có thuộc danh sách quản lý?
-        if (IsSensorManaged(data_msg->sensor_id)) {
-        	printf("[RELAY] Received DATA from 0x%02X: T=%d, H=%d, S=%d\r\n",
-        	                   data_msg->sensor_id, data_msg->temp_val, data_msg->hum_val, data_msg->soil_val);
+	printf("[GW] Broadcasting Schedule (Cycle: %ds, Nodes: %d) -> %s\r\n",
+			gw_sched_total_cycle, pair_count, result ? "OK" : "FAILED");
+	LoRa_setMode(_lora, RXCONTIN_MODE);
+}
 
-        	int idx = GetSensorIndex(data_msg->sensor_id);
+/*
+ * @brief: 	Đưa Relay vào hàng chờ ACK gộp (bỏ qua nếu đã có - bản gửi lại)
+ * @param:	relay_id: ID Relay cần ACK
+ */
+static void Gateway_QueueAck(uint8_t relay_id) {
+	for (int i = 0; i < gw_ack_count; i++) {
+		if (gw_ack_pending[i] == relay_id) return;
+	}
+	if (gw_ack_count < GW_ACK_MAX_BATCH) {
+		if (gw_ack_count == 0) gw_ack_first_tick = HAL_GetTick();
+		gw_ack_pending[gw_ack_count++] = relay_id;
+	}
+}
 
-        	// Trả về nếu đã có dữ liệu ở chu kỳ này rồi
-        	if (relay_data_store[idx].has_data == 1) return;
 
-        	if (idx >= 0 && idx < MANAGED_SENSOR_COUNT) {
-				relay_data_store[idx].temp = data_msg->temp_val;
-				relay_data_store[idx].hum  = data_msg->hum_val;
-				relay_data_store[idx].soil = data_msg->soil_val;
-				relay_data_store[idx].has_data = 1;
-					// printf("[RELAY] Data saved to Slot %d\r\n", idx); // Debug
-			} else {
-				printf("[RELAY] Error: Sensor ID 0x%02X managed but not found in store!\r\n", data_msg->sensor_id);
-			}
-        }
-    }
+/*
+ * @brief: 	Xóa 1 bản tin khỏi hàng chờ downlink (giữ thứ tự)
+ * @param:	i: Vị trí bản tin
+ */
+static void Gateway_DownlinkRemove(int i) {
+	for (int k = i; k < gw_dl_count - 1; k++) gw_dl_queue[k] = gw_dl_queue[k + 1];
+	gw_dl_count--;
 }
 
 
 /*
- * @brief:  Gửi (Broadcast) ACK cho các Sensor đang nằm trong hàng đợi (Timeout: RELAY_ACK_WINDOW_MS)
- * 			Bao gồm cấp phát timeslot cho TDMA và Cycle tổng (total_cycle) cho từng Sensor
- * 			[Func | RelayID | Sensor_ID | TDMA slot | total_cycle]
+ * @brief: 	Đưa 1 bản tin vào hàng chờ downlink, gửi kèm GW_ACK kế tiếp của Relay đích
+ * 			Bản tin riêng gửi GW_DL_REPEAT lần, bản tin broadcast gửi trong mọi GW_ACK tới khi hết hạn
+ * 			Đã có bản tin cùng target và type -> thay thế (cấu hình mới nhất). Hàng chờ đầy -> bỏ bản tin cũ nhất
+ * 			DL_TYPE_SCHED không cần data: Dt tính theo lịch lúc gửi
  * @param:
- * 			_lora: Con trỏ struct LoRa quản lý
- * 			_myRelayID: ID Relay node
- * 			_queue: Hàng chờ yêu cầu Đăng ký của Sensor node
+ * 			target: RelayID hoặc GW_DL_BROADCAST
+ * 			type: DL_TYPE_x
+ * 			data: Dữ liệu (NULL nếu len = 0)
+ * 			len: Độ dài dữ liệu (tối đa GW_DL_MAX_DATA)
+ * 			ttl_ms: Thời gian tồn tại trong hàng chờ
  */
+void LoRaApp_Gateway_QueueDownlink(uint8_t target, uint8_t type, const uint8_t* data, uint8_t len, uint32_t ttl_ms) {
+	if (len > GW_DL_MAX_DATA) return;
 
-// --- TASK 1: GỬI ACK (Fixed Time: RELAY_ACK_WINDOW_MS) ---
-void LoRaApp_Relay_Task_SendACKs(LoRa* _lora, uint8_t _myRelayID, Relay_Reg_Queue_t* _queue) {
-    uint32_t start_task = HAL_GetTick();
+	for (int i = 0; i < gw_dl_count; i++) {
+		if (gw_dl_queue[i].target == target && gw_dl_queue[i].type == type) {
+			Gateway_DownlinkRemove(i);
+			break;
+		}
+	}
+	if (gw_dl_count >= GW_DL_QUEUE_SIZE) {
+		printf("[GW] Downlink queue full, dropping 0x%02X/0x%02X\r\n", gw_dl_queue[0].target, gw_dl_queue[0].type);
+		Gateway_DownlinkRemove(0);
+	}
 
-    // Logic gửi ACK
-    if (_queue->count > 0) {
-        uint8_t tx_buf[10];
-        msg_ss_reg_ack_t ack_msg;
-//        printf("[RELAY] Sending %d ACKs...\r\n", _queue->count);
+	Gateway_Downlink_t* dl = &gw_dl_queue[gw_dl_count++];
+	dl->target = target;
+	dl->type = type;
+	dl->len = len;
+	dl->tries = GW_DL_REPEAT;
+	dl->expire_tick = HAL_GetTick() + ttl_ms;
+	if (len > 0) memcpy(dl->data, data, len);
+}
 
-        for (int i = 0; i < _queue->count; i++) {
-            uint8_t sensor_id = _queue->pending_sensors[i];
-            // Cấp time slot cho sensor node
-            int slot_idx = GetSensorIndex(sensor_id);
-            if (slot_idx == -1) slot_idx = 0;
 
-            ack_msg.func_code = FUNC_CODE_REG_ACK;
-            ack_msg.relay_id = _myRelayID;
-            ack_msg.target_sensor_id = sensor_id;
-            ack_msg.time_slot = (uint8_t)slot_idx;
+/*
+ * @brief: 	Gắn các bản tin downlink cho Relay trong ACK gộp (hoặc broadcast) vào sau danh sách ID
+ * 			[N_dl | Target | Type | Len | Data... | ...], không có bản tin nào -> không thêm byte
+ * @param:
+ * 			_buf: Buffer bản tin ACK
+ * 			_idx: Vị trí ghi (ngay sau RelayID cuối)
+ * 			_size: Kích thước buffer
+ * @return: Độ dài bản tin sau khi gắn
+ */
+static uint8_t Gateway_AppendDownlinks(uint8_t* _buf, uint8_t _idx, uint8_t _size) {
+	uint8_t n_idx = _idx++;
+	uint8_t n_dl = 0;
+
+	for (int i = 0; i < gw_dl_count; ) {
+		Gateway_Downlink_t* dl = &gw_dl_queue[i];
+		uint8_t match = (dl->target == GW_DL_BROADCAST);
+
+		if ((int32_t)(HAL_GetTick() - dl->expire_tick) >= 0) {
+			printf("[GW] Downlink 0x%02X/0x%02X expired\r\n", dl->target, dl->type);
+			Gateway_DownlinkRemove(i);
+			continue;
+		}
+		for (int k = 0; k < gw_ack_count && !match; k++) match = (gw_ack_pending[k] == dl->target);
+		if (!match || _idx + GW_DL_HEADER_LEN + GW_DL_MAX_DATA > _size) {
+			i++;
+			continue;
+		}
 
-            ack_msg.total_cycle = (uint8_t)TOTAL_CYCLE_SEC;
+		// Lịch: Dt tính tại lúc gửi theo vị trí cửa sổ hiện tại của Relay
+		if (dl->type == DL_TYPE_SCHED) {
+			Relay_Info_t* r = Gateway_FindRelay(dl->target);
+			if (!r || !r->scheduled) {
+				Gateway_DownlinkRemove(i);
+				continue;
+			}
+			uint16_t dt = Gateway_WindowDelay(r);
+			dl->len = 4;
+			dl->data[0] = (gw_sched_total_cycle >> 8) & 0xFF;
+			dl->data[1] = (gw_sched_total_cycle) & 0xFF;
+			dl->data[2] = (dt >> 8) & 0xFF;
+			dl->data[3] = (dt) & 0xFF;
+		}
 
-            memcpy(tx_buf, &ack_msg, sizeof(msg_ss_reg_ack_t));
+		_buf[_idx++] = dl->target;
+		_buf[_idx++] = dl->type;
+		_buf[_idx++] = dl->len;
+		memcpy(&_buf[_idx], dl->data, dl->len);
+		_idx += dl->len;
+		n_dl++;
 
-            LoRa_transmit(_lora, tx_buf, sizeof(msg_ss_reg_ack_t), 200);
+		if (dl->target != GW_DL_BROADCAST && --dl->tries == 0) {
+			Gateway_DownlinkRemove(i);
+			continue;
+		}
+		i++;
+	}
 
-            int result;
+	if (n_dl == 0) return n_idx;
+	_buf[n_idx] = n_dl;
+	return _idx;
+}
 
-            // Broadcast + nhắc lại 2 lần
-            for (int i = 0; i < 2; i++){
-            	result = LoRa_transmit(_lora, tx_buf, sizeof(msg_ss_reg_ack_t), 100);
-            	HAL_Delay(20);
-            }
-            if (result){
-            	printf("[RELAY] Sending %d ACKs... -> OK\r\n", _queue->count);
-            } else {
-            	printf("[RELAY] Sending %d ACKs... -> FAILED\r\n", _queue->count);
-            }
-        }
-        _queue->count = 0;
-    }
 
-    // Bù giờ cho đủ  Timeout RELAY_ACK_WINDOW_MS
-    Pad_Execution_Time(start_task, RELAY_ACK_WINDOW_MS);
-    LoRa_setMode(_lora, RXCONTIN_MODE); // Chuyển sang nghe
+/*
+ * @brief: 	In 1 bản ghi ra UART theo định dạng CSV: ,RelayID,SensorID,Temp,Hum,Soil
+ * 			Giá trị giữ lại (dead-band) -> hậu tố '*' sau Soil để Server không ghi thành mẫu đo mới
+ * @param:
+ * 			relay_id: ID Relay gửi dữ liệu
+ * 			_rec: Bản ghi (Soil có thể mang bit RL_RECORD_CARRIED)
+ */
+static void Gateway_PrintRecord(uint8_t relay_id, const Relay_Record_t* _rec) {
+	printf(",0x%02X,0x%02X,%.1f,%.1f,%d%s", relay_id, _rec->sensor_id, _rec->temp/10.0, _rec->hum/10.0,
+			_rec->soil & ~RL_RECORD_CARRIED, (_rec->soil & RL_RECORD_CARRIED) ? "*" : "");
 }
 
 
 /*
- * @brief:  Gom/tạo bản tin tổng hợp dữ liệu cac Sensor node quản lý và forward tới GW (Timeout: RELAY_GW_WINDOW_MS)
- * 			[Func | RelayID | SensorID_1 | Temp_1 | Humid_1 | Soil_1 | ... | SensorID_n | Temp_n | Humid_n | Soil_n |]
+ * @brief: 	Đọc 1 bản ghi đầy đủ [SensorID | Temp_H | Temp_L | Hum_H | Hum_L | Soil]
  * @param:
- * 			_lora: Con trỏ struct LoRa quản lý
- * 			_myRelayID: ID Relay node
- * 			_queue: Hàng chờ yêu cầu Đăng ký của Sensor node
+ * 			_p: Vị trí bản ghi trong buffer nhận
+ * 			_rec: Nơi ghi bản ghi
  */
+static void Gateway_ReadRecord(const uint8_t* _p, Relay_Record_t* _rec) {
+	_rec->sensor_id = _p[0];
+	_rec->temp = (int16_t)((_p[1] << 8) | _p[2]);
+	_rec->hum = (uint16_t)((_p[3] << 8) | _p[4]);
+	_rec->soil = _p[5];
+}
 
-// --- TASK 3: FORWARD GATEWAY (Fixed Time: RELAY_GW_WINDOW_MS) ---
-void LoRaApp_Relay_Task_ForwardToGateway(LoRa* _lora, uint8_t _myRelayID) {
-    uint32_t start_task = HAL_GetTick();
-    uint8_t tx_buf[256];
-    uint8_t idx = 0;
-
-    // Gom bản tin
-    tx_buf[idx++] = FUNC_CODE_RL_DATA;
-    tx_buf[idx++] = _myRelayID;
 
-    uint8_t has_data = 0;
-    for(int i=0; i<MANAGED_SENSOR_COUNT; i++) {
-        if(relay_data_store[i].has_data) {
-            tx_buf[idx++] = relay_data_store[i].sensor_id;
-            tx_buf[idx++] = (relay_data_store[i].temp >> 8) & 0xFF;
-            tx_buf[idx++] = (relay_data_store[i].temp) & 0xFF;
-            tx_buf[idx++] = (relay_data_store[i].hum >> 8) & 0xFF;
-            tx_buf[idx++] = (relay_data_store[i].hum) & 0xFF;
-            tx_buf[idx++] = relay_data_store[i].soil;
-            has_data = 1;
-        }
-    }
+/*
+ * @brief: 	Lưu các bản ghi vừa giải mã làm tham chiếu RL_DELTA của Relay (Soil bỏ bit RL_RECORD_CARRIED)
+ * @param:
+ * 			_relay: Relay gửi (NULL: Relay chưa đăng ký, không lưu)
+ * 			_rec: Bản ghi theo thứ tự trong bản tin
+ * 			_count: Số bản ghi
+ */
+static void Gateway_SetDeltaRef(Relay_Info_t* _relay, const Relay_Record_t* _rec, uint8_t _count) {
+	if (!_relay) return;
 
-    // Gửi & Chờ ACK (Nếu có dữ liệu)
-    if (has_data) {
-        printf("[RELAY] Forwarding to GW (%d bytes)...\r\n", idx);
+	for (int i = 0; i < _count; i++) {
+		_relay->ref[i] = _rec[i];
+		_relay->ref[i].soil &= ~RL_RECORD_CARRIED;
+	}
+	_relay->ref_count = _count;
+	_relay->ref_valid = 1;
+}
 
-//        // Debug bản tin HEX
-//        printf("HEX: ");
-//        for(int k=0; k<idx; k++) printf("%02X ", tx_buf[k]);
-//        printf("\r\n");
 
-        LoRa_setMode(_lora, STNBY_MODE);
-        LoRa_transmit(_lora, tx_buf, idx, 500); // Timeout gửi 500ms
+/*
+ * @brief: 	In các bản ghi [Count | Record_1 | ... | Record_n] ra UART theo định dạng CSV
+ * 			Format: ,RelayID,SensorID,Temp,Hum,Soil (lặp lại cho mỗi Sensor)
+ * @param:
+ * 			relay_id: ID Relay gửi dữ liệu
+ * 			_rxBuf:	Con trỏ buffer nhận
+ * 			ptr: Vị trí byte Count
+ * 			len: Độ dài buffer nhận
+ * 			_ref: RL_DATA (keyframe): Relay lưu tham chiếu RL_DELTA, NULL: không lưu (RL_BACKLOG)
+ * @return: Vị trí byte ngay sau bản ghi cuối
+ */
+static uint8_t Gateway_PrintRecords(uint8_t relay_id, uint8_t* _rxBuf, uint8_t ptr, uint8_t len, Relay_Info_t* _ref) {
+	Relay_Record_t recs[RELAY_AGG_MAX_RECORDS];
+	uint8_t n = 0;
 
-        // Chờ ACK (Thời gian còn lại trong window)
-        LoRa_setMode(_lora, RXCONTIN_MODE);
+	if (ptr >= len) return len;
 
-        // Tính thời gian còn lại để chờ ACK
-        uint32_t elapsed = HAL_GetTick() - start_task;
-        uint32_t remaining = (RELAY_GW_WINDOW_MS > elapsed) ? (RELAY_GW_WINDOW_MS - elapsed) : 0;
+	uint8_t sensor_count = _rxBuf[ptr++];
 
-        uint32_t wait_start = HAL_GetTick();
-        uint8_t rx_gw[10];
-        extern volatile uint8_t loraRxDoneFlag;
+	// Duyệt qua từng sensor trong gói tin này
+	for(int i=0; i<sensor_count; i++) {
+		// Kiểm tra bounds
+		if(ptr + RL_RECORD_LEN > len) return len;
 
-        while(HAL_GetTick() - wait_start < remaining) {
-            if(loraRxDoneFlag) {
-                loraRxDoneFlag = 0;
-                if(LoRa_receive(_lora, rx_gw, sizeof(rx_gw)) > 0) {
-                    if(rx_gw[0] == FUNC_CODE_GW_ACK) {
-                        printf("[RELAY] GW ACK OK.\r\n");
-                        break;
-                    }
-                }
-            }
-        }
-    } else {
-        printf("[RELAY] No Data to Forward.\r\n");
-    }
+		Relay_Record_t rec;
+		Gateway_ReadRecord(&_rxBuf[ptr], &rec);
+		Gateway_PrintRecord(relay_id, &rec);
+		if (n < RELAY_AGG_MAX_RECORDS) recs[n++] = rec;
+		ptr += RL_RECORD_LEN; // Nhảy 6 byte (1 ID + 2 Temp + 2 Hum + 1 Soil)
+	}
 
-    // Bù giờ cho đủ timeout RELAY_GW_WINDOW_MS
-    Pad_Execution_Time(start_task, RELAY_GW_WINDOW_MS);
+	Gateway_SetDeltaRef(_ref, recs, n);
+	return ptr;
 }
 
-#endif
 
+/*
+ * @brief: 	Giải mã phần sau RelayID của RL_DELTA theo tham chiếu của Relay
+ * 			[RefCheck | Bitmap | N_new | Delta_1 | ... | Delta_k | Record_1 | ... | Record_n]
+ * @param:
+ * 			_relay: Relay gửi
+ * 			_rxBuf: Buffer nhận
+ * 			len: Độ dài bản tin
+ * 			_out: Nơi ghi bản ghi giá trị tuyệt đối (thứ tự = tham chiếu mới)
+ * 			_count: Nơi ghi số bản ghi
+ * @return: Vị trí byte ngay sau bản ghi cuối, 0 nếu không có / lệch tham chiếu hoặc bản tin hỏng
+ */
+static uint8_t Gateway_DecodeDelta(Relay_Info_t* _relay, uint8_t* _rxBuf, uint8_t len,
+								   Relay_Record_t* _out, uint8_t* _count) {
+	uint8_t ptr = 2;
+	uint8_t n = 0;
+
+	if (!_relay || !_relay->ref_valid || ptr >= len) return 0;
+	if (_rxBuf[ptr++] != LoRaApp_Delta_RefCheck(_relay->ref, _relay->ref_count)) return 0;
+
+	uint8_t bm_idx = ptr;
+	ptr += (_relay->ref_count + 7) / 8;
+	if (ptr >= len) return 0;
+	uint8_t n_new = _rxBuf[ptr++];
+
+	for (int r = 0; r < _relay->ref_count; r++) {
+		if (!(_rxBuf[bm_idx + r / 8] & (1 << (r % 8)))) continue;
+
+		uint32_t v[3];
+		for (int f = 0; f < 3; f++) {
+			uint8_t used = LoRaApp_Varint_Get(&_rxBuf[ptr], len - ptr, &v[f]);
+			if (!used) return 0;
+			ptr += used;
+		}
 
+		Relay_Record_t* rec = &_out[n++];
+		const Relay_Record_t* ref = &_relay->ref[r];
+		rec->sensor_id = ref->sensor_id;
+		rec->soil = (uint8_t)(ref->soil + ZIGZAG_DEC(v[0] >> 1)) | ((v[0] & 1) ? RL_RECORD_CARRIED : 0);
+		rec->temp = (int16_t)(ref->temp + ZIGZAG_DEC(v[1]));
+		rec->hum = (uint16_t)(ref->hum + ZIGZAG_DEC(v[2]));
+	}
 
-#if (CURRENT_NODE_TYPE == NODE_TYPE_GATEWAY)
-// ==============================
-// --- HÀM PHÍA GATEWAY ---
-// ==============================
+	for (int i = 0; i < n_new; i++) {
+		if (ptr + RL_RECORD_LEN > len || n >= RELAY_AGG_MAX_RECORDS) return 0;
+		Gateway_ReadRecord(&_rxBuf[ptr], &_out[n++]);
+		ptr += RL_RECORD_LEN;
+	}
 
-static Gateway_Relay_List_t gw_relay_list;
+	*_count = n;
+	return ptr;
+}
 
-void LoRaApp_Gateway_Init(void) {
-    gw_relay_list.count = 0;
-//    printf("[GW] Gateway Initialized. Start listening ...\r\n");
+
+/*
+ * @brief: 	In khối chất lượng liên kết của Relay ra UART trên 1 dòng riêng
+ * 			Format: LINK,RelayID,SensorID,RSSI,SNR,Heard,Expected,Dups,... (RSSI dBm, SNR dB: trung bình trượt)
+ * @param:
+ * 			relay_id: ID Relay gửi khối
+ * 			_rxBuf: Buffer nhận
+ * 			ptr: Vị trí byte RL_LINK_MARK
+ * 			len: Độ dài bản tin
+ */
+static void Gateway_PrintLinkStats(uint8_t relay_id, uint8_t* _rxBuf, uint8_t ptr, uint8_t len) {
+	uint8_t n = _rxBuf[ptr + 1];
+	ptr += 2;
+
+	printf("LINK");
+	for (int i = 0; i < n && ptr + RL_LINK_LEN <= len; i++, ptr += RL_LINK_LEN) {
+		printf(",0x%02X,0x%02X,%d,%.2f,%u,%u,%u", relay_id, _rxBuf[ptr], -(int)_rxBuf[ptr+1],
+				(int8_t)_rxBuf[ptr+2] / 4.0, _rxBuf[ptr+3], _rxBuf[ptr+4], _rxBuf[ptr+5]);
+	}
+	printf("\r\n");
 }
 
+
 /*
  * @brief: 	Xử lý bản tin nhận được tại Gateway (Đăng ký và Báo cáo từ Relay)
  * @param:
@@ -704,73 +4104,269 @@ void LoRaApp_Gateway_RxProcessing(LoRa* _lora, uint8_t* _rxBuf, uint8_t len) {
     // --- XỬ LÝ RELAY ĐĂNG KÝ (0x06) ---
     if (func_code == FUNC_CODE_RL_REG_ADV) {
         msg_rl_reg_adv_t* adv = (msg_rl_reg_adv_t*)_rxBuf;
+        uint16_t window_ms = adv->window ? (uint16_t)adv->window * RL_WINDOW_UNIT_MS : GW_SCHED_DEFAULT_WINDOW_MS;
+        // Relay cũ (3 byte) không báo lead: cả phiên hoạt động nằm trong cửa sổ
+        uint16_t lead_ms = (len >= sizeof(msg_rl_reg_adv_t)) ? (uint16_t)adv->lead * RL_WINDOW_UNIT_MS : 0;
 
         // Kiểm tra xem ID đã có trong danh sách chưa
-        uint8_t known = 0;
-        for(int i=0; i<gw_relay_list.count; i++) {
-            if(gw_relay_list.relays[i].relay_id == adv->relay_id) {
-                gw_relay_list.relays[i].last_seen = HAL_GetTick(); // Update timestamp
-                known = 1;
-                break;
+        Relay_Info_t* relay = Gateway_FindRelay(adv->relay_id);
+        if (relay) {
+            relay->last_seen = HAL_GetTick(); // Update timestamp
+            // Relay đã xếp lịch vẫn gửi ADV: lỡ broadcast hoặc khởi động lại -> gửi lại mục của nó
+            if (relay->scheduled) {
+                // Cửa sổ / phiên cluster lớn hơn -> xếp lại
+                if (window_ms > relay->window_ms || lead_ms > relay->lead_ms) relay->scheduled = 0;
+                relay->dirty = 1;
             }
+            relay->window_ms = window_ms;
+            relay->lead_ms = lead_ms;
         }
-
-        if(!known && gw_relay_list.count < MAX_RELAY_QUEUE) {
-            gw_relay_list.relays[gw_relay_list.count].relay_id = adv->relay_id;
-            gw_relay_list.relays[gw_relay_list.count].last_seen = HAL_GetTick();
-            gw_relay_list.count++;
-            printf("[GW] New Relay Registered: 0x%02X\r\n", adv->relay_id);
+        else if(gw_relay_list.count < MAX_RELAY_QUEUE) {
+            relay = &gw_relay_list.relays[gw_relay_list.count++];
+            memset(relay, 0, sizeof(Relay_Info_t));
+            relay->relay_id = adv->relay_id;
+            relay->last_seen = HAL_GetTick();
+            relay->window_ms = window_ms;
+            relay->lead_ms = lead_ms;
+            relay->channel = LoRaApp_Channel_ForRelay(adv->relay_id);
+            printf("[GW] New Relay Registered: 0x%02X (window %u ms, lead %u ms, channel %d)\r\n",
+                    adv->relay_id, window_ms, lead_ms, relay->channel);
         }
     }
     // --- XỬ LÝ DỮ LIỆU BÁO CÁO TỪ RELAY (0x04) ---
     else if (func_code == FUNC_CODE_RL_DATA) {
-    	uint8_t relay_id = _rxBuf[1];
-		uint8_t sensor_count = _rxBuf[2];
-		uint8_t ptr = 3;
+		if (len < 3) return;
+
+		uint8_t relay_id = _rxBuf[1];
+		Relay_Info_t* relay = Gateway_FindRelay(relay_id);
+		if (relay) relay->last_seen = HAL_GetTick();
 
-		printf("DATA,0x%02X", relay_id);
+		Gateway_QueueAck(relay_id);
 
-		// Duyệt qua từng sensor trong gói tin này
-		for(int i=0; i<sensor_count; i++) {
-			// Kiểm tra bounds
-			if(ptr + 6 > len) break;
+		printf("DATA");
+		uint8_t ptr = Gateway_PrintRecords(relay_id, _rxBuf, 2, len, relay);
 
-			uint8_t s_id = _rxBuf[ptr];
-			int16_t temp = (_rxBuf[ptr+1] << 8) | _rxBuf[ptr+2];
-			uint16_t hum = (_rxBuf[ptr+3] << 8) | _rxBuf[ptr+4];
-			uint8_t soil = _rxBuf[ptr+5];
+		//Đánh dấu kết thúc
+		printf("\r\n");
 
-			// In ra UART theo định dạng CSV
-			// Format:SensorID,Temp,Hum,Soil,..
-			printf(",0x%02X,%.1f,%.1f,%d", s_id, temp/10.0, hum/10.0, soil);
-			ptr += 6; // Nhảy 6 byte (1 ID + 2 Temp + 2 Hum + 1 Soil)
+		// Khối chất lượng liên kết (mỗi RELAY_LINK_REPORT_CYCLES chu kỳ) -> dòng LINK riêng
+		if (ptr + 2 <= len && _rxBuf[ptr] == RL_LINK_MARK) {
+			Gateway_PrintLinkStats(relay_id, _rxBuf, ptr, len);
 		}
+    }
+    // --- XỬ LÝ DỮ LIỆU MÃ HOÁ DELTA TỪ RELAY (0x0F) ---
+    else if (func_code == FUNC_CODE_RL_DELTA) {
+		Relay_Record_t recs[RELAY_AGG_MAX_RECORDS];
+		uint8_t count = 0;
+
+		if (len < 3) return;
+
+		uint8_t relay_id = _rxBuf[1];
+		Relay_Info_t* relay = Gateway_FindRelay(relay_id);
+		uint8_t ptr = Gateway_DecodeDelta(relay, _rxBuf, len, recs, &count);
+
+		// Lệch tham chiếu (GW khởi động lại / mất ACK) -> không ACK: Relay đưa aggregate vào backlog, gửi keyframe
+		if (ptr == 0) {
+			if (relay) relay->ref_valid = 0;
+			printf("[GW] Delta from 0x%02X does not match reference, waiting for keyframe.\r\n", relay_id);
+			return;
+		}
+		relay->last_seen = HAL_GetTick();
 
-		//Đánh dấu kết thúc
+		Gateway_QueueAck(relay_id);
+		Gateway_SetDeltaRef(relay, recs, count);
+
+		// Giá trị tuyệt đối đã dựng lại: cùng định dạng DATA như RL_DATA
+		printf("DATA");
+		for (int i = 0; i < count; i++) Gateway_PrintRecord(relay_id, &recs[i]);
 		printf("\r\n");
+
+		if (ptr + 2 <= len && _rxBuf[ptr] == RL_LINK_MARK) {
+			Gateway_PrintLinkStats(relay_id, _rxBuf, ptr, len);
+		}
+    }
+    // --- XỬ LÝ DỮ LIỆU GỬI BÙ / CHUYỂN TIẾP TỪ RELAY (0x09) ---
+    else if (func_code == FUNC_CODE_RL_BACKLOG) {
+		// Bản tin Relay con gửi Relay cha (DestID khác GW) -> bỏ qua
+		if (len < RL_BACKLOG_HEADER_LEN || _rxBuf[2] != MY_GATEWAY_ID) return;
+
+		uint8_t relay_id = _rxBuf[1];
+		uint16_t cur_cycle = (_rxBuf[3] << 8) | _rxBuf[4];
+		uint8_t n_agg = _rxBuf[5];
+		uint8_t ptr = RL_BACKLOG_HEADER_LEN;
+		Relay_Info_t* relay = Gateway_FindRelay(relay_id);
+		if (relay) relay->last_seen = HAL_GetTick();
+
+		Gateway_QueueAck(relay_id);
+
+		// Mỗi aggregate 1 dòng (RelayID gốc: Relay con ở xa được chuyển tiếp qua relay_id)
+		// Chu kỳ hiện tại -> DATA, chu kỳ cũ -> BACKLOG kèm số chu kỳ đã trôi qua để server đặt lại mốc thời gian
+		// Format: BACKLOG,CyclesAgo,RelayID,SensorID,Temp,Hum,Soil,...
+		for (int i = 0; i < n_agg; i++) {
+			if (ptr + RL_BACKLOG_AGG_HEADER_LEN > len) break;
+
+			uint8_t origin_id = _rxBuf[ptr];
+			uint16_t cycles_ago = (uint16_t)(cur_cycle - ((_rxBuf[ptr+1] << 8) | _rxBuf[ptr+2]));
+			if (cycles_ago == 0) {
+				printf("DATA");
+			} else {
+				printf("BACKLOG,%u", cycles_ago);
+			}
+			ptr = Gateway_PrintRecords(origin_id, _rxBuf, ptr + 3, len, NULL);
+			printf("\r\n");
+		}
+    }
+    // --- XỬ LÝ CẢNH BÁO NHANH TỪ RELAY (0x0D) ---
+    else if (func_code == FUNC_CODE_RL_ALARM) {
+		if (len < RL_ALARM_LEN || _rxBuf[2] != MY_GATEWAY_ID) return;
+
+		Relay_Info_t* relay = Gateway_FindRelay(_rxBuf[1]);
+		if (relay) relay->last_seen = HAL_GetTick();
+
+		Gateway_QueueAck(_rxBuf[1]);
+
+		// Format: ALARM,RelayID,SensorID,Temp,Hum,Soil,Flags (RelayID gốc của Sensor)
+		int16_t temp = (_rxBuf[6] << 8) | _rxBuf[7];
+		uint16_t hum = (_rxBuf[8] << 8) | _rxBuf[9];
+		printf("ALARM,0x%02X,0x%02X,%.1f,%.1f,%d,0x%02X\r\n", _rxBuf[3], _rxBuf[4],
+				temp/10.0, hum/10.0, _rxBuf[10], _rxBuf[5]);
     }
 }
 
 
 /*
- * @brief: 	Gửi danh sách hàng chờ Relay đăng ký định kỳ qua UART
+ * @brief: 	Gửi ACK gộp cho các Relay đã nhận Data
+ * 			Giữ GW_ACK_HOLD_MS kể từ Relay đầu tiên để gộp các Relay có cửa sổ liền kề
+ * 			[Func | Count | RelayID_1 | ... | RelayID_n | Downlink...]
+ * 			Relay vừa gửi còn nghe ACK -> kèm các bản tin downlink chờ gửi cho chúng
+ * @param:
+ * 			_lora:	Con trỏ struct LoRa quản lý
+ */
+void LoRaApp_Gateway_Task_FlushACKs(LoRa* _lora) {
+	if (gw_ack_count == 0) return;
+	if (gw_ack_count < GW_ACK_MAX_BATCH && HAL_GetTick() - gw_ack_first_tick < GW_ACK_HOLD_MS) return;
+
+	uint8_t tx_buf[255];
+	tx_buf[0] = FUNC_CODE_GW_ACK;
+	tx_buf[1] = gw_ack_count;
+	memcpy(&tx_buf[GW_ACK_HEADER_LEN], gw_ack_pending, gw_ack_count);
+	uint8_t len = Gateway_AppendDownlinks(tx_buf, GW_ACK_HEADER_LEN + gw_ack_count, LORA_MAX_PAYLOAD);
+
+	LoRa_setMode(_lora, STNBY_MODE);
+	LoRaApp_Transmit(_lora, tx_buf, len, 500, AIR_PRIO_CRITICAL);
+	LoRa_setMode(_lora, RXCONTIN_MODE);
+
+	gw_ack_count = 0;
+}
+
+
+/*
+ * @brief: 	Gửi danh sách hàng chờ Relay đăng ký (chưa được xếp lịch) định kỳ qua UART
  * 			[ADV,RelayID_1,RelayID_2,...,RelayID_n]
  */
 void LoRaApp_Gateway_Send_RL_Queue(void) {
-    if(gw_relay_list.count == 0) return;
-//    printf("[GW-DEBUG] Registered Relays: ");
-    printf("ADV,");
+    uint8_t printed = 0;
+
     for(int i=0; i<gw_relay_list.count; i++) {
-        printf("0x%02X", gw_relay_list.relays[i].relay_id);
-        if(i < gw_relay_list.count - 1) printf(", ");
+        if (gw_relay_list.relays[i].scheduled) continue;
+        printf(printed ? ", 0x%02X" : "ADV,0x%02X", gw_relay_list.relays[i].relay_id);
+        printed = 1;
     }
-    printf("\r\n");
+    if (printed) printf("\r\n");
+}
+
+
+/*
+ * @brief: 	Duy trì lịch Δt (gọi trong vòng lặp chính)
+ * 			Relay im lặng quá GW_RELAY_TIMEOUT_CYCLES chu kỳ -> xóa, giải phóng cửa sổ
+ * 			Relay mới (ADV sau khi đã có lịch) -> xếp vào khoảng trống đầu tiên
+ * 			Chỉ broadcast các mục mới/đổi
+ * @param:	_lora: Con trỏ struct LoRa quản lý
+ */
+void LoRaApp_Gateway_Task_Schedule(LoRa* _lora) {
+	uint32_t timeout_ms = (uint32_t)gw_sched_total_cycle * 1000 * GW_RELAY_TIMEOUT_CYCLES;
+	uint8_t changed = 0;
+
+	for (int i = 0; i < gw_relay_list.count; ) {
+		Relay_Info_t* r = &gw_relay_list.relays[i];
+		if (HAL_GetTick() - r->last_seen > timeout_ms) {
+			printf("[GW] Relay 0x%02X silent. %s\r\n", r->relay_id, r->scheduled ? "Window released." : "Removed.");
+			*r = gw_relay_list.relays[--gw_relay_list.count];
+			continue;
+		}
+		i++;
+	}
+
+	if (!GW_SCHED_AUTO || !gw_sched_active) return;
+
+	for (int i = 0; i < gw_relay_list.count; i++) {
+		Relay_Info_t* r = &gw_relay_list.relays[i];
+		if (r->scheduled) {
+			changed |= r->dirty;
+			continue;
+		}
+		r->offset_ms = Gateway_FindGap(r);
+		r->scheduled = 1;
+		r->dirty = 1;
+		changed = 1;
+		printf("[GW] Relay 0x%02X joined at +%lu ms\r\n", r->relay_id, r->offset_ms);
+	}
+
+	if (changed) {
+		Gateway_PrintSchedule();
+		Gateway_BroadcastSchedule(_lora, 1);
+	}
+}
+
+
+/*
+ * @brief: 	Lệnh cấu hình Sensor: đóng gói TLV, broadcast tới mọi Relay qua downlink (kèm GW_ACK)
+ * 			Input format: "Ver,MeasureCycle,TMin,TMax,HMin,HMax,SMin,SMax" (nhiệt độ, độ ẩm x10)
+ * 			Relay phát lại trong Beacon tới khi Sensor xác nhận Ver
+ * @param:	cmd_str: Lệnh (sau tiền tố "SCFG,")
+ */
+static void Gateway_ProcessSensorConfig(char* cmd_str) {
+	int32_t val[8];
+	uint8_t data[GW_DL_MAX_DATA];
+	uint8_t idx = 0;
+	char* token = strtok(cmd_str, ",");
+
+	for (int i = 0; i < 8; i++) {
+		if (token == NULL) {
+			printf("[GW] SCFG: expected 8 fields.\r\n");
+			return;
+		}
+		val[i] = strtol(token, NULL, 0);
+		token = strtok(NULL, ",");
+	}
+
+	data[idx++] = (uint8_t)val[0];
+	data[idx++] = SCFG_TLV_MEASURE_CYCLE;
+	data[idx++] = 1;
+	data[idx++] = (uint8_t)val[1];
+	data[idx++] = SCFG_TLV_THRESHOLDS;
+	data[idx++] = SCFG_THRESHOLDS_LEN;
+	for (int i = 2; i < 6; i++) {
+		data[idx++] = (val[i] >> 8) & 0xFF;
+		data[idx++] = (val[i]) & 0xFF;
+	}
+	data[idx++] = (uint8_t)val[6];
+	data[idx++] = (uint8_t)val[7];
+
+	LoRaApp_Gateway_QueueDownlink(GW_DL_BROADCAST, DL_TYPE_SENSOR_CFG, data, idx,
+			(uint32_t)gw_sched_total_cycle * 1000 * GW_DL_TTL_CYCLES);
+	printf("[GW] Sensor config v%u queued (measure every %u cycles)\r\n", data[0], data[3]);
 }
 
 
 /*
- * @brief: 	Parse lệnh UART và Broadcast cấu hình xuống Relay
+ * @brief: 	Parse lệnh UART, lập lịch mới và gửi xuống Relay
  * 			Input format: "total_cycle,ID1,dt1,ID2,dt2..."
+ * 			Lệnh bắt đầu bằng "SCFG," -> cấu hình Sensor (Gateway_ProcessSensorConfig)
+ * 			GW_SCHED_AUTO: bỏ qua dt, xếp lại mọi Relay đã đăng ký (và Relay trong lệnh) bằng Gateway_FindGap
+ * 			theo độ dài cửa sổ / lead Relay báo và kênh con. Ngược lại: dt (s) là vị trí cửa sổ
+ * 			Relay đang đăng ký nhận lịch qua broadcast GW_REG_ACK, Relay đang chạy (ngủ STOP, không nghe
+ * 			broadcast) nhận qua downlink DL_TYPE_SCHED kèm GW_ACK kế tiếp -> áp dụng sau 1 chu kỳ
  *
  * @param:
  * 			_lora: Con trỏ struct LoRa quản lý
@@ -778,66 +4374,103 @@ void LoRaApp_Gateway_Send_RL_Queue(void) {
  */
 
 void LoRaApp_Gateway_ProcessConfigCommand(LoRa* _lora, char* cmd_str){
-	uint8_t tx_buf[255];
-	uint8_t idx = 0;
-
-	// Xóa queue cũ
-	gw_relay_list.count = 0;
-	memset(gw_relay_list.relays, 0, sizeof(gw_relay_list.relays));
-
 	printf(">> \"%s\"\r\n", cmd_str);
 
+	if (strncmp(cmd_str, "SCFG,", 5) == 0) {
+		Gateway_ProcessSensorConfig(cmd_str + 5);
+		return;
+	}
+
 	// Tách chuỗi lấy total_cycle
 	char* token = strtok(cmd_str, ",");
-	uint16_t total_cycle = (uint16_t)atoi(token);
-
-	// Đóng gói bản tin ACK (GW->RL)
-	// Header: [Func (1) | Cycle_H (1) | Cycle_L (1) | Count (1)]
-	tx_buf[idx++] = FUNC_CODE_GW_REG_ACK;
-	tx_buf[idx++] = (total_cycle >> 8) & 0xFF;
-	tx_buf[idx++] = (total_cycle) & 0xFF;
-
-	uint8_t count_idx = idx++;
-	uint8_t pair_count = 0;
-
-	// Lấy các cặp (RelayID, Delta_t)
-	while(token != NULL) {
-	        token = strtok(NULL, ","); // ID
-	        if(token == NULL) break;
-	        uint8_t r_id = (uint8_t)strtol(token, NULL, 0);
+	if (token == NULL) return;
+	long cycle_arg = strtol(token, NULL, 0);
+	if (cycle_arg <= 0) return;
+	if (cycle_arg > (long)GW_SCHED_MAX_CYCLE_S) {
+		// Δt / stretch gửi Relay là uint16_t đơn vị GW_SCHED_UNIT_MS: chu kỳ dài hơn sẽ tràn -> Relay thức sai lệch
+		printf("[GW] Cycle %ld s rejected: max %lu s (Dt unit %d ms)\r\n", cycle_arg, GW_SCHED_MAX_CYCLE_S, GW_SCHED_UNIT_MS);
+		return;
+	}
+	uint16_t total_cycle = (uint16_t)cycle_arg;
+
+	// Downlink phải chờ tới cửa sổ kế tiếp của Relay (theo chu kỳ cũ hoặc mới, lấy cái dài hơn)
+	uint16_t longest = (total_cycle > gw_sched_total_cycle) ? total_cycle : gw_sched_total_cycle;
+	uint32_t ttl_ms = (uint32_t)longest * 1000 * GW_DL_TTL_CYCLES;
+
+	gw_sched_total_cycle = total_cycle;
+	gw_sched_epoch_tick = HAL_GetTick();
+	gw_sched_active = 1;
+
+	if (GW_SCHED_AUTO) {
+		// Relay trong lệnh chưa từng gửi ADV tới GW -> thêm với cửa sổ mặc định
+		while ((token = strtok(NULL, ",")) != NULL) {
+			uint8_t r_id = (uint8_t)strtol(token, NULL, 0);
+			strtok(NULL, ",");	// Bỏ qua dt của Server
+
+			if (!Gateway_FindRelay(r_id) && gw_relay_list.count < MAX_RELAY_QUEUE) {
+				Relay_Info_t* r = &gw_relay_list.relays[gw_relay_list.count++];
+				memset(r, 0, sizeof(Relay_Info_t));
+				r->relay_id = r_id;
+				r->window_ms = GW_SCHED_DEFAULT_WINDOW_MS;
+				r->channel = LoRaApp_Channel_ForRelay(r_id);
+			}
+		}
 
-	        token = strtok(NULL, ","); // Delta_t
-	        if(token == NULL) break;
-	        uint16_t r_delta_t = (uint16_t)strtol(token, NULL, 0);
+		// Lịch mới: xếp lại toàn bộ từ mốc hiện tại, cùng luật với Relay đăng ký lúc chạy
+		// (cửa sổ đường lên không chồng lấn, Relay cùng kênh con tách cả phiên cluster)
+		for (int i = 0; i < gw_relay_list.count; i++) {
+			gw_relay_list.relays[i].scheduled = 0;
+		}
+		for (int i = 0; i < gw_relay_list.count; i++) {
+			Relay_Info_t* r = &gw_relay_list.relays[i];
+			r->last_seen = gw_sched_epoch_tick;
+			r->offset_ms = Gateway_FindGap(r);
+			r->scheduled = 1;
+			r->dirty = 0;
+		}
+	} else {
+		// Lịch của Server thay lịch cũ: Relay có trong lệnh giữ thông tin đã biết (cửa sổ, lead, tham chiếu delta),
+		// Relay không có trong lệnh bị bỏ khỏi danh sách
+		for (int i = 0; i < gw_relay_list.count; i++) {
+			gw_relay_list.relays[i].scheduled = 0;
+		}
 
-	        tx_buf[idx++] = r_id;
-	        tx_buf[idx++] = (r_delta_t >> 8) & 0xFF;
-	        tx_buf[idx++] = (r_delta_t) & 0xFF;
-	        pair_count++;
-	    }
+		while ((token = strtok(NULL, ",")) != NULL) {
+			uint8_t r_id = (uint8_t)strtol(token, NULL, 0);
 
-	// Cập nhật số lượng Relay vào byte Count
-	tx_buf[count_idx] = pair_count;
+			token = strtok(NULL, ","); // Delta_t
+			if (token == NULL) break;
 
-	// Broadcast qua LoRa
-	printf("[GW] Broadcasting Config (Cycle: %ds, Nodes: %d)...\r\n", total_cycle, pair_count);
+			Relay_Info_t* r = Gateway_FindRelay(r_id);
+			if (r == NULL) {
+				if (gw_relay_list.count >= MAX_RELAY_QUEUE) continue;
+				r = &gw_relay_list.relays[gw_relay_list.count++];
+				memset(r, 0, sizeof(Relay_Info_t));
+				r->relay_id = r_id;
+				r->window_ms = GW_SCHED_DEFAULT_WINDOW_MS;
+			}
+			r->channel = LoRaApp_Channel_ForRelay(r_id);
+			r->last_seen = gw_sched_epoch_tick;
+			r->offset_ms = ((uint32_t)strtol(token, NULL, 0) * 1000) % ((uint32_t)total_cycle * 1000);
+			r->scheduled = 1;
+			r->dirty = 0;
+		}
 
-	int result;
-	for (int i = 0; i < 5; i++) {
-		// Chuyển sang Standby để nạp FIFO
-		LoRa_setMode(_lora, STNBY_MODE);
-		// Gửi gói tin
-		result = LoRa_transmit(_lora, tx_buf, idx, 2000);
-		HAL_Delay(100);
+		uint8_t kept = 0;
+		for (int i = 0; i < gw_relay_list.count; i++) {
+			if (!gw_relay_list.relays[i].scheduled) continue;
+			if (kept != i) gw_relay_list.relays[kept] = gw_relay_list.relays[i];
+			kept++;
+		}
+		gw_relay_list.count = kept;
 	}
 
-	if (result) {
-		printf("Broadcast -> OK\r\n");
-	} else {
-		printf("Broadcast -> FAILED\r\n");
-	}
+	Gateway_PrintSchedule();
+	Gateway_BroadcastSchedule(_lora, 0);
 
-	LoRa_setMode(_lora, RXCONTIN_MODE);
+	for (int i = 0; i < gw_relay_list.count; i++) {
+		LoRaApp_Gateway_QueueDownlink(gw_relay_list.relays[i].relay_id, DL_TYPE_SCHED, NULL, 0, ttl_ms);
+	}
 }
 
 #endif
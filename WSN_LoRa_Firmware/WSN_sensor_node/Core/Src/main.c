@@ -106,6 +106,14 @@ uint8_t initialize_lora() {
     if (init_result != LORA_OK) {
         return 0;
     }
+
+#if LORA_SEC_ENABLE
+    // --- Lớp bảo mật: khoá riêng của node, epoch bộ đếm (nhiễu máy thu làm epoch khi mất backup) ---
+    LoRaSec_Init(MY_SENSOR_ID, LoRa_getRandom(&myLoRa));
+#if LORA_SEC_BENCHMARK
+    LoRaApp_Security_Benchmark(&myLoRa);
+#endif
+#endif
     printf("LoRa Init OK. Node ID: %s\r\n", MY_SENSOR_ID);
     HAL_GPIO_WritePin(LED_PORT, LED_PIN, 1);
     return 1;
@@ -171,7 +179,7 @@ int main(void)
 
   // --- PHA ĐĂNG KÝ (REGISTRATION PHASE) ---
   mySlot = LoRaApp_Sensor_RegistrationPhase(&myLoRa, rxBuffer, sizeof(rxBuffer),
-                                              &loraRxDoneFlag, MY_SENSOR_ID, TARGET_RELAY_ID);
+                                              &loraRxDoneFlag, MY_SENSOR_ID);
 
   /* USER CODE END 2 */
 
@@ -183,32 +191,36 @@ int main(void)
 	  // --- PHA BÁO CÁO (REPORT PHASE) ---
 	  printf("\r\n[SENSOR] >>> NEW CYCLE STARTED <<<\r\n");
 
-	  // TASK 1: GỬI DỮ LIỆU (Timeout: SENSOR_TX_WINDOW_MS)
-	  LoRaApp_Sensor_Task_SendData(&myLoRa, MY_SENSOR_ID, TARGET_RELAY_ID, mySlot);
+	  // TASK 1: CHỜ BEACON + GỬI DỮ LIỆU THEO SLOT
+	  LoRaApp_Sensor_Task_SendData(&myLoRa, MY_SENSOR_ID, LoRaApp_Sensor_GetRelayID(), mySlot);
 
+	  // Mất Relay (nghe lại nhiều chu kỳ không thấy Beacon) -> đăng ký lại từ đầu, sang chu kỳ mới
+	  if (LoRaApp_Sensor_IsLost()) {
+		  mySlot = LoRaApp_Sensor_RegistrationPhase(&myLoRa, rxBuffer, sizeof(rxBuffer),
+		                                              &loraRxDoneFlag, MY_SENSOR_ID);
+		  continue;
+	  }
 
-	  // TASK 2: ĐO CẢM BIẾN (Timeout: SENSOR_MEASURE_WINDOW_MS)
-	  uint32_t active_time_ms = SENSOR_TX_WINDOW_MS;
 
-	  // Chỉ đo mỗi SENSOR_MEASURE_CYCLE cố định
-	  if ((sensor_cycle_count % SENSOR_MEASURE_CYCLE) == 0) {
+	  // TASK 2: ĐO CẢM BIẾN (Timeout: SENSOR_MEASURE_WINDOW_MS)
+	  // Chỉ đo mỗi SENSOR_MEASURE_CYCLE chu kỳ (Server đổi được qua cấu hình Sensor)
+	  if ((sensor_cycle_count % LoRaApp_Sensor_GetMeasureCycle()) == 0) {
 	            // Thực hiện đo (Mất thêm 3s)
 	            LoRaApp_Sensor_Task_Measure(&mySensors);
-	            active_time_ms += SENSOR_MEASURE_WINDOW_MS;
 		} else {
 			printf("[SENSOR] Skip Measure phase.\r\n");
 		}
 
 
-	  //--- CÀI ĐẶT RTC + VÀO CHẾ ĐỘ STOP MODE ---
-	  uint32_t sleep_sec = TOTAL_CYCLE_SEC - (active_time_ms / 1000);
+	  // TASK 3: CẢNH BÁO NHANH (chỉ khi vừa vượt ngưỡng): gửi trong slot cảnh báo kế tiếp của Relay
+	  LoRaApp_Sensor_Task_Alarm(&myLoRa, MY_SENSOR_ID, LoRaApp_Sensor_GetRelayID());
 
-	  printf("[SENSOR] Active: %lu ms. Enter STOP mode: %lu s.\r\n", active_time_ms, sleep_sec);
 
+	  //--- CÀI ĐẶT RTC + VÀO CHẾ ĐỘ STOP MODE (dậy ngay trước Beacon chu kỳ sau) ---
 	  sensor_cycle_count++;
+	  if ((sensor_cycle_count % SENSOR_HEARTBEAT_CYCLES) == 0) LoRaApp_Airtime_Print();	// Chẩn đoán duty cycle
 
-	  RTC_SetAlarm_In_Seconds(sleep_sec);
-	  Enter_Stop_Mode();
+	  LoRaApp_Sensor_SleepUntilNextCycle();
 
     /* USER CODE END WHILE */
 
@@ -21,6 +21,8 @@
 #include "rtc.h"
 
 /* USER CODE BEGIN 0 */
+// DR1: RTC đã được khởi tạo -> reset không đặt lại bộ đếm (mốc pha chu kỳ của Sensor trong backup vẫn đúng)
+#define RTC_BKP_INIT_MARK	0x32F2
 
 /* USER CODE END 0 */
 
@@ -44,7 +46,7 @@ void MX_RTC_Init(void)
   /** Initialize RTC Only
   */
   hrtc.Instance = RTC;
-  hrtc.Init.AsynchPrediv = RTC_AUTO_1_SECOND;
+  hrtc.Init.AsynchPrediv = 31;
   hrtc.Init.OutPut = RTC_OUTPUTSOURCE_ALARM;
   if (HAL_RTC_Init(&hrtc) != HAL_OK)
   {
@@ -52,6 +54,10 @@ void MX_RTC_Init(void)
   }
 
   /* USER CODE BEGIN Check_RTC_BKUP */
+  if (HAL_RTCEx_BKUPRead(&hrtc, RTC_BKP_DR1) == RTC_BKP_INIT_MARK)
+  {
+    return;
+  }
 
   /* USER CODE END Check_RTC_BKUP */
 
@@ -75,6 +81,7 @@ void MX_RTC_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN RTC_Init 2 */
+  HAL_RTCEx_BKUPWrite(&hrtc, RTC_BKP_DR1, RTC_BKP_INIT_MARK);
 
   /* USER CODE END RTC_Init 2 */
 
@@ -166,6 +166,9 @@ void LoRa_setMode(LoRa* _LoRa, int mode){
 	}else if (mode == RXSINGLE_MODE){
 		data = (read & 0xF8) | 0x06;
 		_LoRa->current_mode = RXSINGLE_MODE;
+	}else if (mode == CAD_MODE){
+		data = (read & 0xF8) | 0x07;
+		_LoRa->current_mode = CAD_MODE;
 	}
 	// Change RegOpMode register value
 	LoRa_write(_LoRa, RegOpMode, data);
@@ -219,6 +222,25 @@ void LoRa_setFrequency(LoRa* _LoRa, int freq){
 }
 
 
+/* ===================================================================================================
+ * @brief:	Set carrier frequency with kHz resolution (channel hopping between sub-channels)
+ * 			Frf = f(Hz) * 2^19 / 32 MHz = f(kHz) * 16384 / 1000 - datasheet 4.1.4, RegFrMsb/Mid/Lsb
+ * 			Call in SLEEP or STANDBY mode. No settling delay: the PLL locks on the next FSTX/FSRX
+ *
+ * @param:	_LoRa: pointer to LoRa data struct
+ * @param:	khz: carrier frequency (kHz)
+ *
+ * @return: none
+ ======================================================================================================*/
+void LoRa_setFrequencyKHz(LoRa* _LoRa, uint32_t khz){
+	uint32_t F = (uint32_t)(((uint64_t)khz * 16384) / 1000);
+
+	LoRa_write(_LoRa, RegFrMsb, (uint8_t)(F >> 16));
+	LoRa_write(_LoRa, RegFrMid, (uint8_t)(F >> 8));
+	LoRa_write(_LoRa, RegFrLsb, (uint8_t)(F >> 0));
+}
+
+
 /* ===================================================================================================
  * @brief:	Set the LowDataRateOptimization flag, HIGH whenever symbol duration (Tsymbol) execeeds 16ms
  * 																					- datasheet 31, 28
@@ -449,6 +471,75 @@ int LoRa_getRSSI(LoRa* _LoRa){
 }
 
 
+/* ===================================================================================================
+ * @brief:	Return the SNR estimate of last received packet
+ *
+ * @param:	_LoRa: pointer to LoRa data struct
+ *
+ * @return:	SNR of last received packet in 0.25 dB steps (signed, e.g. 30 = 7.5 dB)
+ ======================================================================================================*/
+int LoRa_getSNR(LoRa* _LoRa){
+	return (int8_t)LoRa_read(_LoRa, RegPktSnrValue);
+}
+
+
+/* ===================================================================================================
+ * @brief:	Collect 32 random bits from the LSB of the wideband RSSI (Semtech AN1200.24)
+ * 			The radio is left in STANDBY mode
+ *
+ * @param:	_LoRa: pointer to LoRa data struct
+ *
+ * @return:	Random word (thermal noise of the receiver, differs between nodes powered up together)
+ ======================================================================================================*/
+uint32_t LoRa_getRandom(LoRa* _LoRa){
+	uint32_t rnd = 0;
+
+	LoRa_setMode(_LoRa, RXCONTIN_MODE);
+	for (int i = 0; i < 32; i++) {
+		HAL_Delay(1);
+		rnd = (rnd << 1) | (LoRa_read(_LoRa, RegRssiWideband) & 0x01);
+	}
+	LoRa_setMode(_LoRa, STNBY_MODE);
+
+	return rnd;
+}
+
+
+/* ===================================================================================================
+ * @brief:	Calculate time on air of a packet with current setting (SX1276/77/78 datasheet 4.1.1.7)
+ * 			Explicit header, CRC on (as configured in LoRa_init)
+ *
+ * @param:	_LoRa: pointer to LoRa data struct
+ * @param:	length: payload length (bytes)
+ *
+ * @return:	Time on air in ms (rounded up)
+ ======================================================================================================*/
+uint32_t LoRa_getTimeOnAir(LoRa* _LoRa, uint8_t length){
+	//Possible bandwidth (kHz)
+	double BW[] = {7.8, 10.4, 15.6, 20.8, 31.25, 41.7, 62.5, 125.0, 250.0, 500.0};
+	int SF = _LoRa->spredingFactor;
+
+	// T_symbol (ms) = 2^SF / BW
+	double T_symbol = (1 << SF) / BW[_LoRa->bandWidth];
+
+	// Low Data Rate Optimize: same rule as LoRa_setAutoLDO
+	int DE = ((long)T_symbol > 16) ? 1 : 0;
+
+	// Preamble: (n_preamble + 4.25) symbols
+	double T_preamble = (_LoRa->preamble + 4.25) * T_symbol;
+
+	// Payload: 8 + max(ceil((8PL - 4SF + 28 + 16CRC - 20IH) / (4(SF - 2DE))) * (CR + 4), 0)
+	int numerator = 8 * length - 4 * SF + 28 + 16;
+	int denominator = 4 * (SF - 2 * DE);
+	int n_payload = 8;
+	if (numerator > 0) {
+		n_payload += ((numerator + denominator - 1) / denominator) * (_LoRa->crcRate + 4);
+	}
+
+	return (uint32_t)(T_preamble + n_payload * T_symbol + 0.999);
+}
+
+
 /* ===================================================================================================
  * @brief:	Transmit data packet
  *
@@ -547,3 +638,37 @@ uint8_t LoRa_receive(LoRa* _LoRa, uint8_t* data, uint8_t length){
 	LoRa_setMode(_LoRa, RXCONTIN_MODE);
     return min;
 }
+
+
+/* ===================================================================================================
+ * @brief:	Channel Activity Detection (CAD): look for a LoRa preamble on the channel
+ * 			Polls CadDone instead of using DIO0 (DIO0 stays mapped to RxDone/TxDone)
+ *
+ * @param:	_LoRa: pointer to LoRa data struct
+ *
+ * @return:	1 if a preamble was detected (channel busy), 0 if the channel is free
+ ======================================================================================================*/
+uint8_t LoRa_channelActivity(LoRa* _LoRa){
+	uint8_t read;
+	uint16_t timeout = 200;
+
+	//Clear flags, then STANDBY -> CAD (the chip returns to STANDBY by itself after CadDone)
+	LoRa_setMode(_LoRa, STNBY_MODE);
+	LoRa_write(_LoRa, RegIrqFlags, 0xFF);
+	LoRa_setMode(_LoRa, CAD_MODE);
+
+	while(1){
+		read = LoRa_read(_LoRa, RegIrqFlags);
+		//0x04 = 0000 0100 -> CadDone, 0x01 = 0000 0001 -> CadDetected
+		if((read & 0x04) != 0){
+			LoRa_write(_LoRa, RegIrqFlags, 0xFF);
+			LoRa_setMode(_LoRa, STNBY_MODE);
+			return (read & 0x01) ? 1 : 0;
+		}
+		if(--timeout == 0){
+			LoRa_setMode(_LoRa, STNBY_MODE);
+			return 0;
+		}
+		HAL_Delay(1);
+	}
+}
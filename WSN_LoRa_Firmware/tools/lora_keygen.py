@@ -0,0 +1,128 @@
+# -*- coding: utf-8 -*-
+"""
+Sinh Core/Inc/lora_key.h cho từng node (khoá bảo mật bản tin LoRa, xem lora_sec.h)
+
+Khoá riêng mỗi node: K_id = AES-128(Khoá chủ, [0x57 0x4B 0 ... 0 id]) (giống Sec_DeriveKey trong lora_sec.c)
+  - Gateway: giữ khoá chủ (--master-node), dẫn xuất được khoá của mọi node
+  - Sensor / Relay: chỉ giữ bảng khoá đã dẫn xuất: khoá của chính node + khoá các node nó cần mở bản tin
+
+Ví dụ:
+  python lora_keygen.py --new-master
+  python lora_keygen.py --master <hex> --node 0x00 --master-node        > ../WSN_gateway_node/Core/Inc/lora_key.h
+  python lora_keygen.py --master <hex> --node 0x03 --peers 0x00,0x01,0xFA,0xFE,0xFD,0xFC > ../WSN_relay_node/Core/Inc/lora_key.h
+  python lora_keygen.py --master <hex> --node 0xFA --peers 0x03,0x01   > ../WSN_sensor_node/Core/Inc/lora_key.h
+"""
+
+import argparse
+import os
+import sys
+
+KDF_LABEL = 0x574B  # LORA_SEC_KDF_LABEL
+
+SBOX = [
+    0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+    0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+    0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+    0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+    0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+    0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+    0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+    0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+    0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+    0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+    0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+    0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+    0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+    0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+    0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+    0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16,
+]
+
+
+def xtime(b):
+    b <<= 1
+    return (b ^ 0x1B) & 0xFF if b & 0x100 else b
+
+
+def aes128_encrypt(key, block):
+    """Mã hoá 1 khối AES-128 (chỉ dùng để dẫn xuất khoá, không cần tốc độ)"""
+    rk = list(key)
+    rcon = 1
+    for i in range(4, 44):
+        t = rk[(i - 1) * 4:i * 4]
+        if i % 4 == 0:
+            t = [SBOX[t[1]] ^ rcon, SBOX[t[2]], SBOX[t[3]], SBOX[t[0]]]
+            rcon = xtime(rcon)
+        rk += [rk[(i - 4) * 4 + j] ^ t[j] for j in range(4)]
+
+    s = [block[j] ^ rk[j] for j in range(16)]
+    for rnd in range(1, 11):
+        s = [SBOX[b] for b in s]
+        s = [s[(j + 4 * (j % 4)) % 16] for j in range(16)]  # ShiftRows (cột chính)
+        if rnd < 10:
+            m = []
+            for c in range(4):
+                a = s[c * 4:c * 4 + 4]
+                x = a[0] ^ a[1] ^ a[2] ^ a[3]
+                m += [a[j] ^ x ^ xtime(a[j] ^ a[(j + 1) % 4]) for j in range(4)]
+            s = m
+        s = [s[j] ^ rk[rnd * 16 + j] for j in range(16)]
+    return bytes(s)
+
+
+def derive_key(master, node_id):
+    blk = bytearray(16)
+    blk[0] = KDF_LABEL >> 8
+    blk[1] = KDF_LABEL & 0xFF
+    blk[15] = node_id
+    return aes128_encrypt(master, bytes(blk))
+
+
+def c_bytes(key):
+    return "{ " + ", ".join("0x%02X" % b for b in key) + " }"
+
+
+def parse_id(text):
+    v = int(text, 0)
+    if not 0 <= v <= 0xFF:
+        raise argparse.ArgumentTypeError("ID phải nằm trong 0x00 ... 0xFF")
+    return v
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Sinh lora_key.h cho 1 node")
+    ap.add_argument("--new-master", action="store_true", help="In khoá chủ ngẫu nhiên mới rồi thoát")
+    ap.add_argument("--master", help="Khoá chủ (32 ký tự hex)")
+    ap.add_argument("--node", type=parse_id, help="ID node sẽ nạp file này")
+    ap.add_argument("--master-node", action="store_true", help="Node giữ khoá chủ (Gateway)")
+    ap.add_argument("--peers", default="", help="ID các node cần mở bản tin, cách nhau dấu phẩy")
+    args = ap.parse_args()
+
+    if args.new_master:
+        print(os.urandom(16).hex().upper())
+        return 0
+    if args.master is None or args.node is None:
+        ap.error("cần --master và --node")
+
+    master = bytes.fromhex(args.master)
+    if len(master) != 16:
+        ap.error("khoá chủ phải dài 16 byte")
+
+    out = ["/*", " * lora_key.h (sinh bởi tools/lora_keygen.py, KHÔNG commit)", " */", "",
+           "#ifndef INC_LORA_KEY_H_", "#define INC_LORA_KEY_H_", ""]
+    if args.master_node:
+        out.append("#define LORA_SEC_MASTER_KEY\t\t\t%s" % c_bytes(master))
+    else:
+        ids = [args.node] + [i for i in (parse_id(p) for p in args.peers.split(",") if p.strip()) if i != args.node]
+        out.append("// Khoá đã dẫn xuất: [0] là khoá của chính node 0x%02X" % args.node)
+        out.append("#define LORA_SEC_KEY_TABLE\t\t\t{ \\")
+        for i in ids:
+            out.append("\t{ 0x%02X, %s }, \\" % (i, c_bytes(derive_key(master, i))))
+        out.append("}")
+    out += ["", "#endif /* INC_LORA_KEY_H_ */", ""]
+    sys.stdout.write("\n".join(out))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())